@@ -276,6 +276,43 @@ void init_build_config(build_config_t *config) {
     
     // Image settings
     strcpy(config->image_size, "8192");
+    config->image_headroom_percent = 20;
+    config->expand_rootfs_on_boot = 1;
+    config->rootfs_format = ROOTFS_FORMAT_EXT4;
+    strcpy(config->rootfs_compression, "lz4");
+    config->overlay_type = OVERLAY_PARTITION;
+    config->overlay_size_mb = 512;
+    strcpy(config->target_medium, "sd");
+    config->erase_block_kb = 0;
+    config->fs_profile[0] = '\0';
+    config->incremental_image = 0;
+    config->chunk_store = 0;
+    config->delta_from[0] = '\0';
+    config->dm_verity = 0;
+    config->output_targets[0] = '\0';
+    config->slim_rootfs = 1;
+    config->slim_purge_dev = 0;
+    strcpy(config->slim_locales, "en,en_US");
+    config->reproducible = 0;
+    config->verify_reproducible = 0;
+    config->apt_snapshot[0] = '\0';
+    config->source_date_epoch = 0;
+    config->finalize_rootfs = 1;
+    config->tmpfs_build_mb = 0;
+    config->persist_dir[0] = '\0';
+    config->force_emulation = 0;
+    config->host_exec = HOST_EXEC_QEMU;
+    config->build_workers[0] = '\0';
+    config->distcc_hosts[0] = '\0';
+    config->distcc_pump = 0;
+    config->compile_jobs = 0;
+    config->remote_cache_url[0] = '\0';
+    config->remote_cache_readonly = 0;
+    config->use_ccache = 0;
+    config->cache_quotas[0] = '\0';
+    config->pin_artifacts = 0;
+    config->offline_bundle[0] = '\0';
+    cache_session_begin();
     strcpy(config->hostname, "orangepi");
     strcpy(config->username, "orangepi");
     strcpy(config->password, "orangepi");
@@ -324,6 +361,7 @@ void process_args(int argc, char *argv[], build_config_t *config) {
     for (i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             printf("Usage: %s [OPTIONS]\n", argv[0]);
+            printf("       %s COMMAND [ARGS]   (run '%s help' for image tools)\n", argv[0], argv[0]);
             printf("Options:\n");
             printf("  --kernel-version VERSION   Kernel version (default: %s)\n", config->kernel_version);
             printf("  --build-dir DIR           Build directory (default: %s)\n", config->build_dir);
@@ -337,6 +375,38 @@ void process_args(int argc, char *argv[], build_config_t *config) {
             printf("  --no-rootfs               Skip rootfs building\n");
             printf("  --no-uboot                Skip U-Boot building\n");
             printf("  --no-image                Skip image creation\n");
+            printf("  --image-size MB|auto      Image size in MB, or auto to fit the rootfs (default: %s)\n", config->image_size);
+            printf("  --image-headroom PCT      Free space added in auto size mode (default: %d%%)\n", config->image_headroom_percent);
+            printf("  --no-expand-rootfs        Do not grow the root filesystem on first boot\n");
+            printf("  --rootfs-format FMT       Root filesystem: ext4, btrfs, f2fs, erofs or squashfs (default: %s)\n", rootfs_format_name(config->rootfs_format));
+            printf("  --rootfs-compression ALG  Read-only root compression: lz4 or zstd, EROFS zstd needs Linux 6.10+ (default: %s)\n", config->rootfs_compression);
+            printf("  --overlay TYPE            Read-only root overlay: partition or tmpfs\n");
+            printf("  --overlay-size MB         Overlay partition size in auto size mode (default: %d)\n", config->overlay_size_mb);
+            printf("  --medium sd|emmc|nvme     Target medium partition layout (default: %s)\n", config->target_medium);
+            printf("  --erase-block KB          Align partitions to this erase block size (default: medium)\n");
+            printf("  --fs-profile NAME         Filesystem tuning: sd, emmc, nvme or kiosk (default: medium)\n");
+            printf("  --incremental             Refresh the previous image, copying only changed files\n");
+            printf("  --chunk-store             Add the image to the chunk store for delta downloads\n");
+            printf("  --delta-from IMAGE        Also build a delta update package from a previous image or manifest\n");
+            printf("  --verity                  Protect a read-only root with dm-verity\n");
+            printf("  --targets LIST            Also produce: sd,emmc,nvme,compressed,tarball,bootfiles,spi\n");
+            printf("  --no-slim                 Keep docs, man pages, all locales and apt lists in the image\n");
+            printf("  --purge-dev               Purge -dev and -dbg packages before imaging\n");
+            printf("  --keep-locales LIST       Translations kept when slimming (default: %s)\n", config->slim_locales);
+            printf("  --reproducible            Bit-identical output for the same inputs (honours SOURCE_DATE_EPOCH)\n");
+            printf("  --snapshot TIMESTAMP      Install from the Ubuntu snapshot archive at YYYYMMDDTHHMMSSZ\n");
+            printf("  --verify-reproducible     Assemble the image twice and fail if the results differ\n");
+            printf("  --tmpfs SIZE|auto         Stage rootfs and images in a tmpfs of SIZE MB (spills to disk if short)\n");
+            printf("  --no-finalize             Leave cache generation (ldconfig, fc-cache, ...) to first boot\n");
+            printf("  --force-emulation         Run chroots under qemu-aarch64-static even if native or binfmt_misc works\n");
+            printf("  --worker [USER@]HOST      Offload kernel builds and compression over SSH (repeatable)\n");
+            printf("  --distcc HOSTS            Distribute compiles (DISTCC_HOSTS syntax, e.g. 'a/16,cpp,lzo b/32,cpp,lzo')\n");
+            printf("  --remote-cache URL        Share kernel, bootloader, base rootfs and ccache objects over HTTP\n");
+            printf("  --remote-cache-readonly   Use the remote cache without uploading to it\n");
+            printf("  --cache-quota NAME=MB     Size limit of a cache (artifacts, sources, apt-indexes, ccache; 0 = none)\n");
+            printf("  --pin-artifacts           Keep every artifact this build uses out of cache eviction\n");
+            printf("  --offline DIR             Fetch nothing from the network; serve sources, blobs and packages from\n"
+                   "                            a bundle written by '%s export-bundle DIR [OPTIONS]'\n", argv[0]);
             printf("  --clean                   Clean previous build\n");
             printf("  --verbose                 Verbose output\n");
             printf("  --help                    Show this help\n");
@@ -389,6 +459,144 @@ void process_args(int argc, char *argv[], build_config_t *config) {
             config->build_uboot = 0;
         } else if (strcmp(argv[i], "--no-image") == 0) {
             config->create_image = 0;
+        } else if (strcmp(argv[i], "--image-size") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->image_size, argv[i + 1], sizeof(config->image_size) - 1);
+                config->image_size[sizeof(config->image_size) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--image-headroom") == 0) {
+            if (i + 1 < argc) {
+                config->image_headroom_percent = atoi(argv[i + 1]);
+                i++;
+            }
+        } else if (strcmp(argv[i], "--no-expand-rootfs") == 0) {
+            config->expand_rootfs_on_boot = 0;
+        } else if (strcmp(argv[i], "--rootfs-format") == 0) {
+            if (i + 1 < argc) {
+                if (parse_rootfs_format(argv[i + 1], &config->rootfs_format) != 0) {
+                    printf("Unknown root filesystem format: %s\n", argv[i + 1]);
+                }
+                i++;
+            }
+        } else if (strcmp(argv[i], "--rootfs-compression") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->rootfs_compression, argv[i + 1], sizeof(config->rootfs_compression) - 1);
+                config->rootfs_compression[sizeof(config->rootfs_compression) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--overlay") == 0) {
+            if (i + 1 < argc) {
+                config->overlay_type = strcmp(argv[i + 1], "tmpfs") == 0 ? OVERLAY_TMPFS : OVERLAY_PARTITION;
+                i++;
+            }
+        } else if (strcmp(argv[i], "--overlay-size") == 0) {
+            if (i + 1 < argc) {
+                config->overlay_size_mb = atoi(argv[i + 1]);
+                i++;
+            }
+        } else if (strcmp(argv[i], "--medium") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->target_medium, argv[i + 1], sizeof(config->target_medium) - 1);
+                config->target_medium[sizeof(config->target_medium) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--erase-block") == 0) {
+            if (i + 1 < argc) {
+                config->erase_block_kb = atoi(argv[i + 1]);
+                i++;
+            }
+        } else if (strcmp(argv[i], "--fs-profile") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->fs_profile, argv[i + 1], sizeof(config->fs_profile) - 1);
+                config->fs_profile[sizeof(config->fs_profile) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            config->incremental_image = 1;
+        } else if (strcmp(argv[i], "--chunk-store") == 0) {
+            config->chunk_store = 1;
+        } else if (strcmp(argv[i], "--verity") == 0) {
+            config->dm_verity = 1;
+        } else if (strcmp(argv[i], "--targets") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->output_targets, argv[i + 1], sizeof(config->output_targets) - 1);
+                config->output_targets[sizeof(config->output_targets) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--no-slim") == 0) {
+            config->slim_rootfs = 0;
+        } else if (strcmp(argv[i], "--purge-dev") == 0) {
+            config->slim_purge_dev = 1;
+        } else if (strcmp(argv[i], "--keep-locales") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->slim_locales, argv[i + 1], sizeof(config->slim_locales) - 1);
+                config->slim_locales[sizeof(config->slim_locales) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--tmpfs") == 0) {
+            if (i + 1 < argc) {
+                config->tmpfs_build_mb = strcmp(argv[i + 1], "auto") == 0 ? -1 : atol(argv[i + 1]);
+                i++;
+            }
+        } else if (strcmp(argv[i], "--no-finalize") == 0) {
+            config->finalize_rootfs = 0;
+        } else if (strcmp(argv[i], "--force-emulation") == 0) {
+            config->force_emulation = 1;
+        } else if (strcmp(argv[i], "--worker") == 0) {
+            if (i + 1 < argc) {
+                size_t len = strlen(config->build_workers);
+                snprintf(config->build_workers + len, sizeof(config->build_workers) - len,
+                         "%s%s", len ? "," : "", argv[i + 1]);
+                i++;
+            }
+        } else if (strcmp(argv[i], "--distcc") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->distcc_hosts, argv[i + 1], sizeof(config->distcc_hosts) - 1);
+                config->distcc_hosts[sizeof(config->distcc_hosts) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--remote-cache") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->remote_cache_url, argv[i + 1], sizeof(config->remote_cache_url) - 1);
+                config->remote_cache_url[sizeof(config->remote_cache_url) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--remote-cache-readonly") == 0) {
+            config->remote_cache_readonly = 1;
+        } else if (strcmp(argv[i], "--cache-quota") == 0) {
+            if (i + 1 < argc) {
+                size_t len = strlen(config->cache_quotas);
+                snprintf(config->cache_quotas + len, sizeof(config->cache_quotas) - len,
+                         "%s%s", len ? "," : "", argv[i + 1]);
+                i++;
+            }
+        } else if (strcmp(argv[i], "--pin-artifacts") == 0) {
+            config->pin_artifacts = 1;
+        } else if (strcmp(argv[i], "--offline") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->offline_bundle, argv[i + 1], sizeof(config->offline_bundle) - 1);
+                config->offline_bundle[sizeof(config->offline_bundle) - 1] = '\0';
+                i++;
+            }
+        } else if (strcmp(argv[i], "--reproducible") == 0) {
+            config->reproducible = 1;
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->apt_snapshot, argv[i + 1], sizeof(config->apt_snapshot) - 1);
+                config->apt_snapshot[sizeof(config->apt_snapshot) - 1] = '\0';
+                config->reproducible = 1;
+                i++;
+            }
+        } else if (strcmp(argv[i], "--verify-reproducible") == 0) {
+            config->reproducible = 1;
+            config->verify_reproducible = 1;
+        } else if (strcmp(argv[i], "--delta-from") == 0) {
+            if (i + 1 < argc) {
+                strncpy(config->delta_from, argv[i + 1], sizeof(config->delta_from) - 1);
+                config->delta_from[sizeof(config->delta_from) - 1] = '\0';
+                i++;
+            }
         } else if (strcmp(argv[i], "--clean") == 0) {
             config->clean_build = 1;
         } else if (strcmp(argv[i], "--verbose") == 0) {
@@ -482,11 +690,8 @@ int start_interactive_build(build_config_t *config) {
     return ERROR_SUCCESS;
 }
 
-// Perform quick setup - FIXED VERSION
-int perform_quick_setup(build_config_t *config) {
-    int result;
-    
-    // Set default quick setup options
+// What every build runs with; an offline bundle is exported for the same settings
+void apply_quick_setup_defaults(build_config_t *config) {
     config->distro_type = DISTRO_DESKTOP;
     config->emu_platform = EMU_NONE;
     strcpy(config->ubuntu_release, "24.04");  // Use stable Noble instead of development version
@@ -498,6 +703,14 @@ int perform_quick_setup(build_config_t *config) {
     config->build_rootfs = 1;
     config->build_uboot = 1;
     config->create_image = 1;
+}
+
+// Perform quick setup - FIXED VERSION
+int perform_quick_setup(build_config_t *config) {
+    int result;
+    
+    // Set default quick setup options
+    apply_quick_setup_defaults(config);
     
     clear_screen();
     print_header();
@@ -509,6 +722,22 @@ int perform_quick_setup(build_config_t *config) {
     
     LOG_INFO("Starting quick setup build...");
     
+    // Native compilers and no qemu on aarch64 hosts
+    detect_host_exec(config);
+    
+    // Every fetch below is served from the bundle; a bundle for other settings is refused
+    if (config->offline_bundle[0]) {
+        result = offline_setup(config);
+        if (result != ERROR_SUCCESS) {
+            return result;
+        }
+    }
+    
+    // Stage rootfs and images in RAM; if that is not possible the build runs on disk
+    if (config->tmpfs_build_mb) {
+        tmpfs_stage_begin(config);
+    }
+    
     // Ensure output directories exist
     result = ensure_directories_exist(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
@@ -522,12 +751,18 @@ int perform_quick_setup(build_config_t *config) {
     }
     
     // Install prerequisites
+    stage_timer_begin("Prerequisites", STAGE_HOST);
     result = install_prerequisites();
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
     }
     
+    // Compile jobs follow the distcc slots; without distcc they stay at --jobs
+    distcc_setup(config);
+    ccache_setup(config);
+    
     // Download kernel source
+    stage_timer_begin("Kernel source", STAGE_HOST);
     result = download_kernel_source(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
@@ -540,6 +775,7 @@ int perform_quick_setup(build_config_t *config) {
     }
     
     // Build kernel
+    stage_timer_begin("Kernel build", STAGE_COMPILE);
     result = build_kernel(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
@@ -547,6 +783,7 @@ int perform_quick_setup(build_config_t *config) {
     
     // Download Mali blobs
     if (config->install_gpu_blobs) {
+        stage_timer_begin("Mali blobs", STAGE_HOST);
         result = download_mali_blobs(config);
         if (result != ERROR_SUCCESS && !config->continue_on_error) {
             return result;
@@ -555,6 +792,7 @@ int perform_quick_setup(build_config_t *config) {
     
     // Build rootfs
     if (config->build_rootfs) {
+        stage_timer_begin("Root filesystem", STAGE_CHROOT);
         result = build_ubuntu_rootfs(config);
         if (result != ERROR_SUCCESS && !config->continue_on_error) {
             return result;
@@ -562,6 +800,7 @@ int perform_quick_setup(build_config_t *config) {
     }
     
     // Install kernel
+    stage_timer_begin("Kernel and GPU install", STAGE_HOST);
     result = install_kernel(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
@@ -590,12 +829,18 @@ int perform_quick_setup(build_config_t *config) {
     }
     
     // Install system packages
+    stage_timer_begin("System packages", STAGE_CHROOT);
+    result = tmpfs_stage_check(config, TMPFS_PACKAGES_MB);
+    if (result != ERROR_SUCCESS && !config->continue_on_error) {
+        return result;
+    }
     result = install_system_packages(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
     }
     
     // Configure system services
+    stage_timer_begin("System services", STAGE_CHROOT);
     result = configure_system_services(config);
     if (result != ERROR_SUCCESS && !config->continue_on_error) {
         return result;
@@ -603,6 +848,7 @@ int perform_quick_setup(build_config_t *config) {
     
     // Build U-Boot if requested
     if (config->build_uboot) {
+        stage_timer_begin("U-Boot", STAGE_COMPILE);
         result = download_uboot_source(config);
         if (result != ERROR_SUCCESS && !config->continue_on_error) {
             return result;
@@ -616,12 +862,30 @@ int perform_quick_setup(build_config_t *config) {
     
     // Create system image if requested
     if (config->create_image) {
+        stage_timer_begin("System image", STAGE_CHROOT);
+        result = tmpfs_stage_check(config, -1);
+        if (result != ERROR_SUCCESS && !config->continue_on_error) {
+            return result;
+        }
         result = create_system_image(config);
         if (result != ERROR_SUCCESS && !config->continue_on_error) {
             return result;
         }
     }
     
+    // Artifacts reach the output directory once, at the end
+    stage_timer_begin("Artifact copy", STAGE_HOST);
+    result = tmpfs_stage_end(config);
+    if (result != ERROR_SUCCESS) {
+        return result;
+    }
+    
+    // Other hosts can use what this build produced once it is uploaded
+    remote_cache_wait();
+    
+    // Trim caches to their quotas, keeping everything this build used
+    cache_gc(config, NULL);
+    
     LOG_INFO("Quick setup build completed successfully!");
     
     // Show completion message
@@ -640,6 +904,7 @@ int perform_quick_setup(build_config_t *config) {
         printf("sudo dd if=%s/orangepi5plus-%s.img of=/dev/sdX bs=4M status=progress\n", 
                config->output_dir, config->ubuntu_codename);
     }
+    print_stage_report(config);
     printf("\n");
     pause_screen();
     
@@ -768,11 +1033,13 @@ int main(int argc, char *argv[]) {
     // Setup signal handlers
     setup_signal_handlers();
     
-    // Process command line arguments
-    process_args(argc, argv, &config);
-    
-    // Check if we have command line arguments that indicate non-interactive mode
-    if (argc > 1) {
+    if (argc > 1 && argv[1][0] != '-') {
+        // Image tools (chunk-sync, ...) take their own arguments
+        result = run_subcommand(&config, argc - 1, argv + 1);
+    } else if (argc > 1) {
+        // Process command line arguments
+        process_args(argc, argv, &config);
+        
         // Non-interactive mode - validate and run
         result = validate_config(&config);
         if (result != ERROR_SUCCESS) {
@@ -787,6 +1054,10 @@ int main(int argc, char *argv[]) {
         result = start_interactive_build(&config);
     }
     
+    // Keep what a failed build staged in RAM
+    tmpfs_stage_end(&config);
+    remote_cache_wait();
+    
     // Cleanup
     if (log_fp) {
         fclose(log_fp);
@@ -48,6 +48,13 @@
 #include <ctype.h>
 #include <stdarg.h>
 
+#include "src/partition_layout.h"
+#include "src/sha256.h"
+#include "src/gpt.h"
+#include "src/merkle.h"
+#include "src/sparsify.h"
+#include "src/package_profiles.h"
+
 // Version and paths
 #define VERSION "0.1.0a"
 #define BUILD_DIR "/tmp/opi5plus_build"
@@ -56,6 +63,13 @@
 #define MAX_CMD_LEN 2048
 #define MAX_PATH_LEN 512
 #define MAX_ERROR_MSG 1024
+#define TMPFS_PACKAGES_MB 8192  // Rootfs growth while packages install, checked in a tmpfs stage
+
+// Kernel build outputs install_kernel needs, listed from the top of the tree
+#define KERNEL_OUTPUT_LIST \
+    "{ find . -name \\*.ko; ls -d arch/arm64/boot/Image arch/arm64/boot/dts/rockchip/*.dtb " \
+    "modules.order modules.builtin modules.builtin.modinfo Module.symvers System.map " \
+    "include/config/kernel.release 2>/dev/null; }"
 
 // GitHub token and environment constants
 #define GITHUB_TOKEN_MAX_LEN 255
@@ -141,6 +155,124 @@ typedef enum {
     EMU_ALL = 99
 } emulation_platform_t;
 
+// Root filesystem formats
+typedef enum {
+    ROOTFS_FORMAT_EXT4 = 0,
+    ROOTFS_FORMAT_EROFS = 1,
+    ROOTFS_FORMAT_SQUASHFS = 2,
+    ROOTFS_FORMAT_BTRFS = 3,
+    ROOTFS_FORMAT_F2FS = 4
+} rootfs_format_t;
+
+// Writable overlay for read-only root formats
+typedef enum {
+    OVERLAY_PARTITION = 0,
+    OVERLAY_TMPFS = 1
+} overlay_type_t;
+
+// How aarch64 binaries run inside the rootfs chroot
+typedef enum {
+    HOST_EXEC_QEMU = 0,         // qemu-aarch64-static copied into the chroot
+    HOST_EXEC_BINFMT = 1,       // Preloaded binfmt_misc interpreter, nothing to copy
+    HOST_EXEC_NATIVE = 2        // aarch64 host, no emulation at all
+} host_exec_t;
+
+// What a timed build stage spends its time on
+typedef enum {
+    STAGE_HOST = 0,             // Host tools only
+    STAGE_COMPILE = 1,          // Cross or native compiler
+    STAGE_CHROOT = 2            // aarch64 binaries in the rootfs
+} stage_kind_t;
+
+// Root filesystem format information
+typedef struct {
+    rootfs_format_t format;
+    const char *name;
+    const char *fstype;
+    int readonly;
+    const char *host_tool;
+    const char *mkfs_command;       // printf format taking geometry options and the device
+    const char *mount_options;      // Format-specific mount options, the tuning profile adds the rest
+    int fsck_pass;
+    const char *target_package;     // Userspace tools needed on the device
+    const char *kernel_options[8];
+} rootfs_format_info_t;
+
+// Filesystem tuning profile per target medium
+typedef struct {
+    const char *name;
+    const char *description;
+    int journal_size_mb;            // ext4 journal size
+    int reserved_percent;           // ext4 reserved blocks
+    int commit_interval;            // Seconds between journal commits (ext4, btrfs)
+    const char *journal_mode;       // ext4 data= mode
+    const char *atime_options;
+    const char *boot_mount_options; // /boot (vfat) fstab options
+} fs_tuning_profile_t;
+
+// Rootfs manifest entry
+typedef struct {
+    char *path;                     // Relative to the rootfs root
+    char type;                      // f, d, l, c, b, p or s
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    long long size;
+    long long mtime;
+    char hash[SHA256_HEX_SIZE];     // Contents (files) or target (symlinks), "-" otherwise
+    unsigned long long rdev;        // Device number of c and b entries, 0 otherwise
+    char link[SHA256_HEX_SIZE];     // Hardlink group: hash of the group's first path, "-" if none
+} manifest_entry_t;
+
+// Rootfs manifest, sorted by path
+typedef struct {
+    manifest_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} manifest_t;
+
+// Manifest comparison totals
+typedef struct {
+    size_t added;
+    size_t changed;
+    size_t removed;
+    size_t unchanged;
+    long long update_bytes;
+} manifest_diff_stats_t;
+
+// Chunk index entry: one content-defined chunk of an image
+typedef struct {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint64_t offset;
+    uint32_t length;
+} chunk_index_entry_t;
+
+// Chunk index of an image, in image order
+typedef struct {
+    chunk_index_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    uint64_t size;                  // Image size in bytes
+} chunk_index_t;
+
+// Chunk store insertion totals
+typedef struct {
+    size_t chunks;
+    size_t new_chunks;
+    uint64_t bytes;
+    uint64_t new_bytes;
+} chunk_store_stats_t;
+
+// Chunk sync totals by where each chunk came from
+typedef struct {
+    size_t chunks;
+    size_t reused_in_place;
+    size_t from_seed;
+    size_t from_cache;
+    size_t downloaded;
+    uint64_t downloaded_bytes;
+} chunk_sync_stats_t;
+
 // Ubuntu release information
 typedef struct {
     char version[16];
@@ -197,7 +329,43 @@ typedef struct {
     int create_image;
     
     // Image settings
-    char image_size[32];
+    char image_size[32];            // Size in MB, or "auto" to fit the staged rootfs
+    int image_headroom_percent;     // Free space added on top of the rootfs in auto mode
+    int expand_rootfs_on_boot;      // Grow root to fill the medium on first boot
+    rootfs_format_t rootfs_format;  // ext4, btrfs, f2fs, or a compressed read-only image
+    char rootfs_compression[16];    // lz4 or zstd for read-only root images
+    overlay_type_t overlay_type;    // Where writes go on a read-only root
+    int overlay_size_mb;            // Overlay partition size in auto size mode
+    char target_medium[16];         // sd, emmc or nvme partition layout
+    int erase_block_kb;             // Partition alignment, 0 = medium default
+    char fs_profile[16];            // sd, emmc, nvme or kiosk; empty = match target medium
+    int incremental_image;          // Refresh the previous image instead of assembling from scratch
+    int chunk_store;                // Add finished images to the chunk store in <output_dir>/chunks
+    char delta_from[MAX_PATH_LEN];  // Previous image or rootfs manifest to build a delta package against
+    int dm_verity;                  // Protect a read-only root with dm-verity
+    char output_targets[128];       // Extra outputs: other media, compressed, tarball, bootfiles
+    int slim_rootfs;                // Drop docs, unused locales and apt caches before imaging
+    int slim_purge_dev;             // Also purge -dev and -dbg packages left by source builds
+    char slim_locales[128];         // Comma-separated translations kept by slimming
+    int reproducible;               // Bit-identical output from identical inputs
+    int verify_reproducible;        // Assemble the image twice and compare
+    char apt_snapshot[32];          // snapshot.ubuntu.com timestamp, e.g. 20240601T000000Z
+    long long source_date_epoch;    // Pinned build time, resolved from SOURCE_DATE_EPOCH or the snapshot
+    int finalize_rootfs;            // Build first-boot caches into the image
+    long tmpfs_build_mb;            // Stage rootfs and images in a tmpfs of this size (-1 auto, 0 off)
+    char persist_dir[MAX_PATH_LEN]; // Real output directory while output_dir is a tmpfs stage
+    int force_emulation;            // Always copy qemu-aarch64-static into chroots; aarch64 hosts also cross compile
+    host_exec_t host_exec;          // Detected at build start
+    char build_workers[512];        // Comma-separated [user@]host SSH workers for offloaded stages
+    char distcc_hosts[512];         // DISTCC_HOSTS list; empty compiles locally
+    int distcc_pump;                // Every distcc host preprocesses remotely (set by distcc_setup)
+    int compile_jobs;               // make -j for compiles, raised to the distcc slot count
+    char remote_cache_url[512];     // HTTP GET/PUT cache shared by build hosts; empty for none
+    int remote_cache_readonly;      // Never upload (untrusted runners)
+    int use_ccache;                 // Compiles go through ccache (set by ccache_setup)
+    char cache_quotas[256];         // Comma-separated cache=MB overrides of the default quotas
+    int pin_artifacts;              // Pin every artifact this build uses (release builds)
+    char offline_bundle[MAX_PATH_LEN]; // Serve every fetch from this bundle; empty builds online
     char hostname[64];
     char username[32];
     char password[32];
@@ -211,6 +379,14 @@ typedef struct {
     int menu_stack[10];
 } menu_state_t;
 
+// Output targets running alongside the primary image
+#define MAX_OUTPUT_JOBS 8
+typedef struct {
+    int count;
+    pid_t pids[MAX_OUTPUT_JOBS];
+    char names[MAX_OUTPUT_JOBS][32];
+} output_jobs_t;
+
 // Error context
 typedef struct {
     error_code_t code;
@@ -272,6 +448,7 @@ void show_emulation_menu(void);
 void show_ubuntu_selection_menu(void);
 void show_gpu_options_menu(build_config_t *config);
 void show_build_options_menu(void);
+void show_image_settings_menu(build_config_t *config);
 void show_advanced_menu(void);
 void show_help_menu(void);
 void show_build_progress(const char *stage, int percent);
@@ -286,8 +463,12 @@ int build_kernel(build_config_t *config);
 int install_kernel(build_config_t *config);
 int download_uboot_source(build_config_t *config);
 int build_uboot(build_config_t *config);
+const char *get_distro_base_packages(build_config_t *config);
 int build_ubuntu_rootfs(build_config_t *config);
 int create_system_image(build_config_t *config);
+int assemble_system_image(build_config_t *config, const char *image_path, long image_mb,
+                          long root_mb, int incremental, int primary);
+int write_boot_config(build_config_t *config, const char *boot_dir);
 int install_system_packages(build_config_t *config);
 int configure_system_services(build_config_t *config);
 int install_emulation_packages(build_config_t *config);
@@ -303,9 +484,177 @@ int setup_vulkan_support(build_config_t *config);
 int verify_gpu_installation(void);
 int integrate_mali_into_kernel(build_config_t *config);
 
+// Function prototypes from image_size.c
+long measure_rootfs_mb(const char *rootfs_dir);
+long count_rootfs_inodes(const char *rootfs_dir);
+int image_size_is_auto(build_config_t *config);
+int init_image_layout(build_config_t *config, partition_layout_t *layout);
+int resolve_image_size(build_config_t *config, long *image_mb);
+int install_rootfs_expand_service(build_config_t *config, const char *rootfs_dir);
+
+// Function prototypes from filesystem.c
+const rootfs_format_info_t* get_rootfs_format_info(rootfs_format_t format);
+int parse_rootfs_format(const char *name, rootfs_format_t *format);
+const char* rootfs_format_name(rootfs_format_t format);
+int rootfs_format_is_readonly(build_config_t *config);
+int overlay_uses_partition(build_config_t *config);
+void get_readonly_root_image_path(build_config_t *config, char *path, size_t size);
+int append_rootfs_kernel_options(build_config_t *config, FILE *kconfig);
+int check_rootfs_kernel_options(build_config_t *config, const char *config_path);
+void build_root_cmdline(build_config_t *config, char *cmdline, size_t size);
+int write_fstab(build_config_t *config, const char *rootfs_dir);
+int build_readonly_root_image(build_config_t *config, const char *rootfs_dir, long *image_mb);
+int install_overlay_root_support(build_config_t *config, const char *rootfs_dir);
+int install_rootfs_format_support(build_config_t *config, const char *rootfs_dir);
+int format_root_partition(build_config_t *config, const char *device);
+int mount_root_partition(build_config_t *config, const char *device, const char *mount_point);
+int regenerate_initramfs(build_config_t *config, const char *rootfs_dir);
+void get_root_device(build_config_t *config, int partition, char *device, size_t size);
+int read_verity_params(build_config_t *config, char *root_hash, size_t size,
+                       unsigned long long *data_blocks, unsigned long long *hash_offset);
+const fs_tuning_profile_t* get_fs_tuning_profile(build_config_t *config);
+int fs_tuning_profile_exists(const char *name);
+void get_root_fs_options(build_config_t *config, char *options, size_t size);
+void get_root_mount_options(build_config_t *config, char *options, size_t size);
+void build_ext4_mkfs_options(build_config_t *config, const char *label, char *options, size_t size);
+
+// Function prototypes from image_metadata.c
+int write_image_metadata(build_config_t *config, const char *path, long image_mb);
+int write_image_hash_tree(build_config_t *config, const char *image_path);
+
+// Function prototypes from manifest.c
+int manifest_build(const char *root_dir, const manifest_t *previous, manifest_t *manifest);
+int manifest_save(const manifest_t *manifest, const char *path);
+int manifest_load(const char *path, manifest_t *manifest);
+void manifest_free(manifest_t *manifest);
+const manifest_entry_t* manifest_find(const manifest_t *manifest, const char *path);
+int manifest_entry_changed(const manifest_entry_t *old, const manifest_entry_t *new);
+int manifest_diff(const manifest_t *old, const manifest_t *new,
+                  FILE *update_list, FILE *remove_list, manifest_diff_stats_t *stats);
+
+// Function prototypes from incremental.c
+int prepare_incremental_image(build_config_t *config, const char *image_path, long *image_mb);
+int apply_incremental_update(build_config_t *config, const char *rootfs_dir, const char *mount_point);
+int save_incremental_base(build_config_t *config, const char *image_path);
+
+// Function prototypes from chunk_store.c
+int chunk_store_add_image(const char *store_dir, const char *image_path, const char *index_path,
+                          chunk_store_stats_t *stats);
+int chunk_index_load(const char *path, chunk_index_t *index);
+void chunk_index_free(chunk_index_t *index);
+int chunk_sync(const char *index_path, const char *store, const char *seed_path,
+               const char *output_path, const char *cache_dir, chunk_sync_stats_t *stats);
+int publish_image_chunks(build_config_t *config, const char *image_path);
+
+// Function prototypes from delta.c
+int build_delta_package(build_config_t *config, const char *image_path);
+
+// Function prototypes from inspect.c
+int inspect_partition_usage(const char *image);
+int inspect_list(const char *image, const char *partition, const char *path);
+int inspect_cat(const char *image, const char *partition, const char *path);
+int inspect_extract(const char *image, const char *partition, const char *path, const char *dest_dir);
+int inspect_diff(const char *image, const char *rootfs_dir);
+
+// Function prototypes from image_diff.c
+int write_image_contents(build_config_t *config, const char *image_path);
+int image_diff(const char *old_path, const char *new_path, int limit);
+
+// Function prototypes from output_targets.c
+void get_system_image_path(build_config_t *config, const char *medium, char *path, size_t size);
+int validate_output_targets(const char *targets);
+int output_target_enabled(build_config_t *config, const char *name);
+int compress_release_image(build_config_t *config, const char *image_path);
+void start_output_targets(build_config_t *config, long root_mb, output_jobs_t *jobs);
+int wait_output_targets(output_jobs_t *jobs);
+
+// Function prototypes from slim.c
+int slim_rootfs(build_config_t *config, const char *rootfs_dir);
+
+// Function prototypes from reproducible.c
+int resolve_reproducible_build(build_config_t *config);
+long long get_build_timestamp(build_config_t *config);
+void get_ubuntu_mirror(build_config_t *config, char *url, size_t size);
+void get_build_uuid(build_config_t *config, const char *name, char *uuid, size_t size);
+void set_layout_guids(build_config_t *config, partition_layout_t *layout);
+void restore_live_sources(build_config_t *config, const char *rootfs_dir);
+int normalize_rootfs(build_config_t *config, const char *rootfs_dir);
+int populate_partitions_offline(build_config_t *config, const char *loop_dev, int primary);
+int compare_images(const char *image_a, const char *image_b);
+int verify_reproducible_image(build_config_t *config, const char *image_path, long image_mb, long root_mb);
+
+// Function prototypes from tmpfs_stage.c
+int tmpfs_stage_begin(build_config_t *config);
+int tmpfs_stage_check(build_config_t *config, long need_mb);
+int tmpfs_stage_end(build_config_t *config);
+void tmpfs_stage_release(build_config_t *config);
+
+// Function prototypes from host_exec.c
+host_exec_t detect_host_exec(build_config_t *config);
+const char *host_exec_name(host_exec_t exec);
+void chroot_exec_prepare(build_config_t *config, const char *rootfs_dir);
+void chroot_exec_release(build_config_t *config, const char *rootfs_dir);
+void stage_timer_begin(const char *name, stage_kind_t kind);
+void stage_timer_remote(const char *how);
+void stage_timer_end(void);
+void print_stage_report(build_config_t *config);
+
+// Function prototypes from artifact_store.c
+void artifact_store_path(build_config_t *config, const char *stage, const char *key, char *path, size_t size);
+int artifact_key_from_command(const char *stage, const char *cmd, char key[SHA256_HEX_SIZE]);
+int artifact_store_has(build_config_t *config, const char *stage, const char *key);
+int artifact_store_extract(build_config_t *config, const char *stage, const char *key, const char *dest_dir);
+int artifact_store_put(build_config_t *config, const char *stage, const char *key, const char *producer);
+
+// Function prototypes from remote_worker.c
+int validate_build_workers(const char *workers);
+int remote_worker_pick(build_config_t *config, char *host, size_t size);
+int remote_build_kernel(build_config_t *config, const char *kernel_dir, const char *key);
+void remote_filter_command(build_config_t *config, const char *filter, char *cmd, size_t size);
+
+// Function prototypes from remote_cache.c
+int validate_remote_cache_url(const char *url);
+int remote_cache_fetch(build_config_t *config, const char *name, const char *path);
+void remote_cache_upload(build_config_t *config, const char *name, const char *path);
+void remote_cache_wait(void);
+int ccache_setup(build_config_t *config);
+
+// Function prototypes from distcc.c
+int distcc_slots(const char *hosts);
+int distcc_setup(build_config_t *config);
+void get_compile_make(build_config_t *config, char *make, size_t size);
+void get_cmake_launcher(build_config_t *config, char *args, size_t size);
+
+// Function prototypes from cache_manager.c
+int validate_cache_quotas(const char *quotas);
+void cache_session_begin(void);
+void cache_record(build_config_t *config, const char *cache_name, const char *entry_name, int hit);
+int cache_set_pinned(build_config_t *config, const char *cache_name, const char *entry_name, int pinned);
+int cache_gc(build_config_t *config, const char *only);
+void print_cache_stats(build_config_t *config);
+
+// Function prototypes from offline_bundle.c
+int offline_setup(build_config_t *config);
+void get_fetch_command(build_config_t *config, const char *url, const char *dest, char *cmd, size_t size);
+void get_offline_mirror(build_config_t *config, char *url, size_t size);
+int offline_mount_bundle(build_config_t *config, const char *rootfs_dir);
+void offline_unmount_bundle(build_config_t *config, const char *rootfs_dir);
+int export_offline_bundle(build_config_t *config, const char *bundle_dir);
+
+// Function prototypes from finalize.c
+int finalize_rootfs(build_config_t *config, const char *rootfs_dir);
+
+// Function prototypes from footprint.c
+int analyze_package_footprint(build_config_t *config, const char *extra_groups, const char *extra_packages,
+                              int recommends, int top_recommends);
+
+// Function prototypes from commands.c
+int run_subcommand(build_config_t *config, int argc, char *argv[]);
+
 // Function prototypes from builder.c (main build logic)
 int start_full_build(build_config_t *config);
 int start_interactive_build(build_config_t *config);
+void apply_quick_setup_defaults(build_config_t *config);
 int perform_quick_setup(build_config_t *config);
 int perform_custom_build(build_config_t *config);
 void init_build_config(build_config_t *config);
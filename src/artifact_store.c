@@ -0,0 +1,102 @@
+/*
+ * artifact_store.c - Stage output store for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the artifact store: the outputs of a build stage packed
+ * as one tar under <output_dir>/artifacts, named by the stage and a SHA-256
+ * key over the stage's inputs. A stage whose key is already stored is
+ * restored instead of rebuilt, and remote workers return their outputs
+ * through it, so a local tree only ever receives complete stage outputs.
+ * With a remote cache configured, misses are looked up there and new
+ * entries are uploaded to it. Every lookup is recorded in the cache ledger
+ * for quota and hit rate accounting.
+ */
+
+#include "../builder.h"
+
+// The entry this process stored last; unpacking it again is not a cache hit
+static char last_put[MAX_PATH_LEN];
+
+void artifact_store_path(build_config_t *config, const char *stage, const char *key, char *path, size_t size) {
+    snprintf(path, size, "%s/artifacts/%s-%s.tar", config->output_dir, stage, key);
+}
+
+// Hash everything a shell command prints; the command describes the stage inputs
+int artifact_key_from_command(const char *stage, const char *cmd, char key[SHA256_HEX_SIZE]) {
+    sha256_ctx_t ctx;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char buffer[65536];
+    size_t n;
+
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        return -1;
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, stage, strlen(stage) + 1);
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        sha256_update(&ctx, buffer, n);
+    }
+    if (pclose(fp) != 0) {
+        return -1;
+    }
+    sha256_final(&ctx, digest);
+    sha256_to_hex(digest, key);
+    return 0;
+}
+
+int artifact_store_has(build_config_t *config, const char *stage, const char *key) {
+    char path[MAX_PATH_LEN];
+
+    artifact_store_path(config, stage, key, path, sizeof(path));
+    return access(path, R_OK) == 0;
+}
+
+// Unpack a stored stage into dest_dir
+int artifact_store_extract(build_config_t *config, const char *stage, const char *key, const char *dest_dir) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+
+    artifact_store_path(config, stage, key, path, sizeof(path));
+    if (!artifact_store_has(config, stage, key) &&
+        remote_cache_fetch(config, strrchr(path, '/') + 1, path) != ERROR_SUCCESS) {
+        cache_record(config, "artifacts", strrchr(path, '/') + 1, 0);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    snprintf(cmd, sizeof(cmd), "tar --xattrs --acls -C %s -xf %s", dest_dir, path);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        snprintf(msg, sizeof(msg), "Stored %s outputs are unreadable, rebuilding", stage);
+        LOG_WARNING(msg);
+        unlink(path);
+        return ERROR_UNKNOWN;
+    }
+    cache_record(config, "artifacts", strrchr(path, '/') + 1, strcmp(path, last_put) == 0 ? -1 : 1);
+    snprintf(msg, sizeof(msg), "Restored %s outputs from the artifact store (%.12s)", stage, key);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
+
+// Store what producer writes as a tar on stdout; it is published only once complete
+int artifact_store_put(build_config_t *config, const char *stage, const char *key, const char *producer) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+
+    artifact_store_path(config, stage, key, path, sizeof(path));
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/artifacts && { %s; } > %s.part && mv %s.part %s",
+             config->output_dir, producer, path, path, path);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        snprintf(cmd, sizeof(cmd), "rm -f %s.part", path);
+        execute_command_safe(cmd, 0, &error_ctx);
+        snprintf(msg, sizeof(msg), "Failed to store %s outputs", stage);
+        LOG_ERROR(msg);
+        return ERROR_UNKNOWN;
+    }
+    snprintf(last_put, sizeof(last_put), "%s", path);
+    cache_record(config, "artifacts", strrchr(path, '/') + 1, -1);
+    remote_cache_upload(config, strrchr(path, '/') + 1, path);
+    return ERROR_SUCCESS;
+}
@@ -0,0 +1,521 @@
+/*
+ * cache_manager.c - Build cache quotas for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the cache manager. Every cache the builder keeps (the
+ * artifact store, source trees, apt indexes, ccache) has a quota; a ledger
+ * in each cache directory records when every entry was last used, whether
+ * it is pinned, and the cache's hit and miss counts. Garbage collection
+ * evicts unpinned entries least recently used first until the cache fits
+ * its quota, never touching what the current build has used. ccache keeps
+ * its own LRU, so it only gets its quota and reports its own counters.
+ */
+
+#include "../builder.h"
+#include <dirent.h>
+
+#define CACHE_LEDGER ".cache-ledger"
+#define CACHE_LEDGER_HEADER "# orangepi-cache-ledger v1"
+
+typedef struct {
+    const char *name;
+    int in_output;              // Under output_dir rather than build_dir
+    const char *subdir;         // "" is the directory itself; NULL for ccache
+    const char *const *names;   // The only entries of a shared directory; NULL when it holds nothing else
+    long default_quota_mb;      // 0 means unlimited
+    const char *description;
+} cache_def_t;
+
+// build_dir also holds the rootfs, clone scratch space and often output_dir; only these are sources
+static const char *const source_entries[] = {"linux", "u-boot", "arm-trusted-firmware", "rkbin", NULL};
+
+static const cache_def_t cache_defs[] = {
+    {"artifacts", 1, "artifacts", NULL, 20480, "Kernel, bootloader and base rootfs outputs"},
+    {"sources", 0, "", source_entries, 20480, "Source trees"},
+    {"apt-indexes", 0, "apt-indexes", NULL, 1024, "Package indexes"},
+    {"ccache", 0, NULL, NULL, 10240, "Compiler cache"},
+    {NULL, 0, NULL, NULL, 0, NULL}
+};
+
+typedef struct {
+    char name[256];
+    time_t last_used;
+    int pinned;
+    long long size_kb;
+    int present;
+} cache_entry_t;
+
+typedef struct {
+    cache_entry_t *entries;
+    int count;
+    int capacity;
+    long hits;
+    long misses;
+} cache_ledger_t;
+
+// Entries used after this are part of the running build and never evicted
+static time_t build_started;
+
+static const cache_def_t *find_cache(const char *name) {
+    for (int i = 0; cache_defs[i].name; i++) {
+        if (strcmp(cache_defs[i].name, name) == 0) {
+            return &cache_defs[i];
+        }
+    }
+    return NULL;
+}
+
+static void cache_dir(build_config_t *config, const cache_def_t *cache, char *path, size_t size) {
+    const char *base = cache->in_output ? config->output_dir : config->build_dir;
+    if (cache->subdir && cache->subdir[0]) {
+        snprintf(path, size, "%s/%s", base, cache->subdir);
+    } else {
+        snprintf(path, size, "%s", base);
+    }
+}
+
+// Quota from config->cache_quotas ("name=MB,...") or the cache's default
+static long cache_quota_mb(build_config_t *config, const cache_def_t *cache) {
+    char list[sizeof(config->cache_quotas)];
+    char *saveptr = NULL;
+    size_t len = strlen(cache->name);
+
+    snprintf(list, sizeof(list), "%s", config->cache_quotas);
+    for (char *item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        if (strncmp(item, cache->name, len) == 0 && item[len] == '=') {
+            return atol(item + len + 1);
+        }
+    }
+    return cache->default_quota_mb;
+}
+
+int validate_cache_quotas(const char *quotas) {
+    char list[256];
+    char *saveptr = NULL;
+
+    snprintf(list, sizeof(list), "%s", quotas);
+    for (char *item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        char *eq = strchr(item, '=');
+        if (!eq || atol(eq + 1) < 0) {
+            return -1;
+        }
+        *eq = '\0';
+        const cache_def_t *cache = find_cache(item);
+        if (!cache) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static cache_entry_t *ledger_find(cache_ledger_t *ledger, const char *name, int add) {
+    for (int i = 0; i < ledger->count; i++) {
+        if (strcmp(ledger->entries[i].name, name) == 0) {
+            return &ledger->entries[i];
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+    if (ledger->count == ledger->capacity) {
+        int capacity = ledger->capacity ? ledger->capacity * 2 : 64;
+        cache_entry_t *entries = realloc(ledger->entries, capacity * sizeof(*entries));
+        if (!entries) {
+            return NULL;
+        }
+        ledger->entries = entries;
+        ledger->capacity = capacity;
+    }
+    cache_entry_t *entry = &ledger->entries[ledger->count++];
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    return entry;
+}
+
+static void ledger_load(const char *dir, cache_ledger_t *ledger) {
+    char path[MAX_PATH_LEN];
+    char line[512];
+
+    memset(ledger, 0, sizeof(*ledger));
+    snprintf(path, sizeof(path), "%s/%s", dir, CACHE_LEDGER);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        long long last_used;
+        int pinned, offset;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "stats %ld %ld", &ledger->hits, &ledger->misses) == 2) {
+            continue;
+        }
+        if (sscanf(line, "entry %lld %d %n", &last_used, &pinned, &offset) == 2) {
+            cache_entry_t *entry = ledger_find(ledger, line + offset, 1);
+            if (entry) {
+                entry->last_used = (time_t)last_used;
+                entry->pinned = pinned;
+            }
+        }
+    }
+    fclose(fp);
+}
+
+static int ledger_save(const char *dir, cache_ledger_t *ledger) {
+    char path[MAX_PATH_LEN];
+    char part[MAX_PATH_LEN + 8];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, CACHE_LEDGER);
+    snprintf(part, sizeof(part), "%s.part", path);
+    FILE *fp = fopen(part, "w");
+    if (!fp) {
+        return -1;
+    }
+    fprintf(fp, "%s\n", CACHE_LEDGER_HEADER);
+    fprintf(fp, "stats %ld %ld\n", ledger->hits, ledger->misses);
+    for (int i = 0; i < ledger->count; i++) {
+        fprintf(fp, "entry %lld %d %s\n", (long long)ledger->entries[i].last_used,
+                ledger->entries[i].pinned, ledger->entries[i].name);
+    }
+    if (fclose(fp) != 0 || rename(part, path) != 0) {
+        unlink(part);
+        return -1;
+    }
+    return 0;
+}
+
+static void ledger_free(cache_ledger_t *ledger) {
+    free(ledger->entries);
+    memset(ledger, 0, sizeof(*ledger));
+}
+
+static int is_cache_entry(const cache_def_t *cache, const char *name) {
+    if (!cache->names) {
+        return 1;
+    }
+    for (int i = 0; cache->names[i]; i++) {
+        if (strcmp(cache->names[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// An entry that is, or holds, the output directory is never evicted
+static int holds_output_dir(build_config_t *config, const char *path) {
+    char entry[PATH_MAX];
+    char output[PATH_MAX];
+
+    if (!realpath(path, entry) || !realpath(config->output_dir, output)) {
+        return 0;
+    }
+    size_t len = strlen(entry);
+    return strncmp(output, entry, len) == 0 && (output[len] == '\0' || output[len] == '/');
+}
+
+// Subdirectories of a cache that belong to other caches
+static int owned_by_other_cache(const cache_def_t *cache, const char *name) {
+    for (int i = 0; cache_defs[i].name; i++) {
+        const cache_def_t *other = &cache_defs[i];
+        if (other != cache && other->in_output == cache->in_output && other->subdir &&
+            other->subdir[0] && strcmp(other->subdir, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static long long entry_size_kb(const char *path, const struct stat *st) {
+    char cmd[MAX_CMD_LEN];
+    long long kb = 0;
+
+    if (!S_ISDIR(st->st_mode)) {
+        return (long long)st->st_blocks / 2;
+    }
+    snprintf(cmd, sizeof(cmd), "du -sk '%s' 2>/dev/null", path);
+    FILE *fp = popen(cmd, "r");
+    if (fp) {
+        if (fscanf(fp, "%lld", &kb) != 1) {
+            kb = 0;
+        }
+        pclose(fp);
+    }
+    return kb;
+}
+
+// Size every entry on disk; ledger entries that are gone are dropped
+static void scan_cache(const cache_def_t *cache, const char *dir, cache_ledger_t *ledger) {
+    char path[MAX_PATH_LEN];
+    struct stat st;
+    struct dirent *de;
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        ledger->count = 0;
+        return;
+    }
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+            strncmp(de->d_name, CACHE_LEDGER, strlen(CACHE_LEDGER)) == 0 ||
+            (len > 5 && strcmp(de->d_name + len - 5, ".part") == 0) ||
+            owned_by_other_cache(cache, de->d_name) || !is_cache_entry(cache, de->d_name)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+        cache_entry_t *entry = ledger_find(ledger, de->d_name, 1);
+        if (!entry) {
+            continue;
+        }
+        if (!entry->last_used) {
+            entry->last_used = st.st_mtime;
+        }
+        entry->size_kb = entry_size_kb(path, &st);
+        entry->present = 1;
+    }
+    closedir(d);
+
+    int kept = 0;
+    for (int i = 0; i < ledger->count; i++) {
+        if (ledger->entries[i].present) {
+            ledger->entries[kept++] = ledger->entries[i];
+        }
+    }
+    ledger->count = kept;
+}
+
+// Everything used from now on belongs to this build
+void cache_session_begin(void) {
+    build_started = time(NULL);
+}
+
+// Note a use of entry; hit is 1 for a hit, 0 for a miss, -1 for a plain use
+void cache_record(build_config_t *config, const char *cache_name, const char *entry_name, int hit) {
+    char dir[MAX_PATH_LEN];
+    cache_ledger_t ledger;
+    const cache_def_t *cache = find_cache(cache_name);
+
+    if (!cache || !cache->subdir) {
+        return;
+    }
+    cache_dir(config, cache, dir, sizeof(dir));
+    if (access(dir, W_OK) != 0) {
+        return;
+    }
+    ledger_load(dir, &ledger);
+    cache_entry_t *entry = ledger_find(&ledger, entry_name, 1);
+    if (entry) {
+        entry->last_used = time(NULL);
+        if (config->pin_artifacts && strcmp(cache_name, "artifacts") == 0) {
+            entry->pinned = 1;
+        }
+    }
+    if (hit == 1) {
+        ledger.hits++;
+    } else if (hit == 0) {
+        ledger.misses++;
+    }
+    ledger_save(dir, &ledger);
+    ledger_free(&ledger);
+}
+
+int cache_set_pinned(build_config_t *config, const char *cache_name, const char *entry_name, int pinned) {
+    char dir[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    cache_ledger_t ledger;
+    const cache_def_t *cache = find_cache(cache_name);
+
+    if (!cache || !cache->subdir || !is_cache_entry(cache, entry_name)) {
+        return ERROR_UNKNOWN;
+    }
+    cache_dir(config, cache, dir, sizeof(dir));
+    snprintf(path, sizeof(path), "%s/%s", dir, entry_name);
+    if (access(path, F_OK) != 0) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    ledger_load(dir, &ledger);
+    cache_entry_t *entry = ledger_find(&ledger, entry_name, 1);
+    if (entry) {
+        if (!entry->last_used) {
+            entry->last_used = time(NULL);
+        }
+        entry->pinned = pinned;
+    }
+    int result = ledger_save(dir, &ledger) == 0 ? ERROR_SUCCESS : ERROR_UNKNOWN;
+    ledger_free(&ledger);
+    return result;
+}
+
+static int compare_last_used(const void *a, const void *b) {
+    const cache_entry_t *ea = a;
+    const cache_entry_t *eb = b;
+    return (ea->last_used > eb->last_used) - (ea->last_used < eb->last_used);
+}
+
+static int ccache_available(void) {
+    error_context_t error_ctx = {0};
+    return execute_command_safe("command -v ccache", 0, &error_ctx) == 0;
+}
+
+// Evict least recently used entries until every cache (or the named one) fits its quota
+int cache_gc(build_config_t *config, const char *only) {
+    char dir[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[MAX_PATH_LEN + 128];
+    error_context_t error_ctx = {0};
+
+    for (int c = 0; cache_defs[c].name; c++) {
+        const cache_def_t *cache = &cache_defs[c];
+        long quota_mb = cache_quota_mb(config, cache);
+        cache_ledger_t ledger;
+        long long total_kb = 0, freed_kb = 0;
+        int evicted = 0;
+
+        if (only && strcmp(only, cache->name) != 0) {
+            continue;
+        }
+        if (!cache->subdir) {
+            if (ccache_available()) {
+                snprintf(cmd, sizeof(cmd), "ccache --max-size=%ldM", quota_mb);
+                execute_command_safe(cmd, 0, &error_ctx);
+            }
+            continue;
+        }
+
+        cache_dir(config, cache, dir, sizeof(dir));
+        ledger_load(dir, &ledger);
+        scan_cache(cache, dir, &ledger);
+        for (int i = 0; i < ledger.count; i++) {
+            total_kb += ledger.entries[i].size_kb;
+        }
+
+        if (quota_mb > 0 && total_kb > (long long)quota_mb * 1024) {
+            qsort(ledger.entries, ledger.count, sizeof(cache_entry_t), compare_last_used);
+            for (int i = 0; i < ledger.count && total_kb > (long long)quota_mb * 1024; i++) {
+                cache_entry_t *entry = &ledger.entries[i];
+                if (entry->pinned || (build_started && entry->last_used >= build_started)) {
+                    continue;
+                }
+                snprintf(path, sizeof(path), "%s/%s", dir, entry->name);
+                if (holds_output_dir(config, path)) {
+                    continue;
+                }
+                // Never follow a chroot's bind mounts out of the cache
+                snprintf(cmd, sizeof(cmd), "rm -rf --one-file-system '%s'", path);
+                if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+                    continue;
+                }
+                total_kb -= entry->size_kb;
+                freed_kb += entry->size_kb;
+                entry->present = 0;
+                evicted++;
+            }
+            int kept = 0;
+            for (int i = 0; i < ledger.count; i++) {
+                if (ledger.entries[i].present) {
+                    ledger.entries[kept++] = ledger.entries[i];
+                }
+            }
+            ledger.count = kept;
+        }
+
+        if (access(dir, W_OK) == 0) {
+            ledger_save(dir, &ledger);
+        }
+        if (evicted) {
+            snprintf(msg, sizeof(msg), "Cache %s: evicted %d entries (%.1f MB), %.1f of %ld MB used",
+                     cache->name, evicted, freed_kb / 1024.0, total_kb / 1024.0, quota_mb);
+            LOG_INFO(msg);
+        } else if (quota_mb > 0 && total_kb > (long long)quota_mb * 1024) {
+            snprintf(msg, sizeof(msg), "Cache %s is over its %ld MB quota with only pinned or in-use entries",
+                     cache->name, quota_mb);
+            LOG_WARNING(msg);
+        }
+        ledger_free(&ledger);
+    }
+    return ERROR_SUCCESS;
+}
+
+// ccache's own counters and size, from --print-stats
+static void ccache_stats(long *hits, long *misses, long long *size_kb, int *entries) {
+    char line[256];
+    char key[128];
+    long long value;
+
+    *hits = *misses = 0;
+    *size_kb = 0;
+    *entries = 0;
+    FILE *fp = popen("ccache --print-stats 2>/dev/null", "r");
+    if (!fp) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%127s %lld", key, &value) != 2) {
+            continue;
+        }
+        if (strcmp(key, "direct_cache_hit") == 0 || strcmp(key, "preprocessed_cache_hit") == 0) {
+            *hits += (long)value;
+        } else if (strcmp(key, "cache_miss") == 0) {
+            *misses += (long)value;
+        } else if (strcmp(key, "cache_size_kibibyte") == 0) {
+            *size_kb = value;
+        } else if (strcmp(key, "files_in_cache") == 0) {
+            *entries = (int)value;
+        }
+    }
+    pclose(fp);
+}
+
+// Per-cache entries, space against quota, pins and hit rate
+void print_cache_stats(build_config_t *config) {
+    char dir[MAX_PATH_LEN];
+
+    printf("%-12s %8s %10s %10s %7s %8s %8s %8s\n",
+           "Cache", "Entries", "Size MB", "Quota MB", "Pinned", "Hits", "Misses", "Hit rate");
+    for (int c = 0; cache_defs[c].name; c++) {
+        const cache_def_t *cache = &cache_defs[c];
+        long quota_mb = cache_quota_mb(config, cache);
+        long hits, misses;
+        long long total_kb = 0;
+        int entries = 0, pinned = 0;
+        char quota[16];
+        char rate[16];
+
+        if (!cache->subdir) {
+            if (!ccache_available()) {
+                continue;
+            }
+            ccache_stats(&hits, &misses, &total_kb, &entries);
+        } else {
+            cache_ledger_t ledger;
+            cache_dir(config, cache, dir, sizeof(dir));
+            ledger_load(dir, &ledger);
+            scan_cache(cache, dir, &ledger);
+            for (int i = 0; i < ledger.count; i++) {
+                total_kb += ledger.entries[i].size_kb;
+                pinned += ledger.entries[i].pinned;
+            }
+            entries = ledger.count;
+            hits = ledger.hits;
+            misses = ledger.misses;
+            ledger_free(&ledger);
+        }
+
+        if (quota_mb > 0) {
+            snprintf(quota, sizeof(quota), "%ld", quota_mb);
+        } else {
+            snprintf(quota, sizeof(quota), "-");
+        }
+        if (hits + misses > 0) {
+            snprintf(rate, sizeof(rate), "%.0f%%", 100.0 * hits / (hits + misses));
+        } else {
+            snprintf(rate, sizeof(rate), "-");
+        }
+        printf("%-12s %8d %10.1f %10s %7d %8ld %8ld %8s\n",
+               cache->name, entries, total_kb / 1024.0, quota, pinned, hits, misses, rate);
+    }
+}
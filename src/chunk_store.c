@@ -0,0 +1,603 @@
+/*
+ * chunk_store.c - Content-defined chunk store for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the image chunk store used to distribute nightly images
+ * as deltas. Images are split with FastCDC (gear-hash, normalized chunking)
+ * so unchanged regions produce identical chunks from build to build; chunks
+ * are stored once under <store>/chunks by SHA-256 and each image gets a small
+ * index. chunk_sync() rebuilds an image or updates a device from an index,
+ * taking chunks from a seed (the old image or the device itself), a local
+ * cache, and only then from the store, which may be a directory or a URL.
+ */
+
+#include "../builder.h"
+#include <limits.h>
+
+// Chunk sizes: 256 KiB average keeps an 8 GB image at ~32k chunks
+#define CHUNK_MIN_SIZE (64 * 1024)
+#define CHUNK_AVG_BITS 18
+#define CHUNK_AVG_SIZE (1 << CHUNK_AVG_BITS)
+#define CHUNK_MAX_SIZE (1024 * 1024)
+
+#define CHUNK_INDEX_HEADER "# orangepi-chunk-index v1"
+#define NO_SEED_OFFSET UINT64_MAX
+
+static uint64_t gear_table[256];
+static int gear_ready;
+
+// The gear table must be identical everywhere chunks are cut, so derive it
+// from a fixed seed instead of shipping 2 KB of constants
+static void init_gear_table(void) {
+    uint64_t x = 0x6f72616e67657069ULL;
+
+    if (gear_ready) {
+        return;
+    }
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+    gear_ready = 1;
+}
+
+// FastCDC cut point: a stricter mask before the average size and a looser one
+// after it pulls chunk sizes towards the average
+static size_t fastcdc_cut(const uint8_t *data, size_t len) {
+    const uint64_t mask_small = ((1ULL << (CHUNK_AVG_BITS + 2)) - 1) << (64 - (CHUNK_AVG_BITS + 2));
+    const uint64_t mask_large = ((1ULL << (CHUNK_AVG_BITS - 2)) - 1) << (64 - (CHUNK_AVG_BITS - 2));
+    size_t normal = CHUNK_AVG_SIZE;
+    uint64_t fp = 0;
+    size_t i;
+
+    if (len <= CHUNK_MIN_SIZE) {
+        return len;
+    }
+    if (len > CHUNK_MAX_SIZE) {
+        len = CHUNK_MAX_SIZE;
+    }
+    if (len < normal) {
+        normal = len;
+    }
+
+    for (i = CHUNK_MIN_SIZE; i < normal; i++) {
+        fp = (fp << 1) + gear_table[data[i]];
+        if (!(fp & mask_small)) {
+            return i + 1;
+        }
+    }
+    for (; i < len; i++) {
+        fp = (fp << 1) + gear_table[data[i]];
+        if (!(fp & mask_large)) {
+            return i + 1;
+        }
+    }
+    return len;
+}
+
+typedef int (*chunk_callback_t)(const uint8_t *data, size_t len, uint64_t offset, void *user);
+
+// Split a file into content-defined chunks, calling back for each one in order
+static int chunk_file(const char *path, chunk_callback_t callback, void *user) {
+    size_t capacity = CHUNK_MAX_SIZE * 2;
+    size_t buffered = 0;
+    uint64_t offset = 0;
+    int eof = 0;
+    int result = 0;
+
+    init_gear_table();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    uint8_t *buffer = malloc(capacity);
+    if (!buffer) {
+        close(fd);
+        return -1;
+    }
+
+    while (!eof || buffered > 0) {
+        // Keep at least one maximum-size chunk buffered so cut points are stable
+        while (!eof && buffered < CHUNK_MAX_SIZE) {
+            ssize_t n = read(fd, buffer + buffered, capacity - buffered);
+            if (n < 0) {
+                result = -1;
+                eof = 1;
+                buffered = 0;
+            } else if (n == 0) {
+                eof = 1;
+            } else {
+                buffered += (size_t)n;
+            }
+        }
+        if (buffered == 0) {
+            break;
+        }
+
+        size_t len = fastcdc_cut(buffer, buffered);
+        if (callback(buffer, len, offset, user) != 0) {
+            result = -1;
+            break;
+        }
+        offset += len;
+        buffered -= len;
+        memmove(buffer, buffer + len, buffered);
+    }
+
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+static void chunk_path(const char *dir, const uint8_t digest[SHA256_DIGEST_SIZE], char *path, size_t size) {
+    char hex[SHA256_HEX_SIZE];
+
+    sha256_to_hex(digest, hex);
+    snprintf(path, size, "%s/chunks/%.4s/%s.chunk", dir, hex, hex);
+}
+
+// Write a chunk into a store unless it is already there; returns 1 if it was new
+static int store_chunk(const char *dir, const uint8_t digest[SHA256_DIGEST_SIZE],
+                       const uint8_t *data, size_t len) {
+    char path[MAX_PATH_LEN];
+    char tmp_path[MAX_PATH_LEN + 32];
+
+    chunk_path(dir, digest, path, sizeof(path));
+    if (access(path, F_OK) == 0) {
+        return 0;
+    }
+
+    // Fan-out directory (first 4 hex digits)
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    mkdir(path, 0755);
+    *slash = '/';
+
+    // Write-then-rename so readers never see a partial chunk
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, (int)getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t written = write(fd, data, len);
+    close(fd);
+    if (written != (ssize_t)len || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 1;
+}
+
+typedef struct {
+    const char *store_dir;
+    FILE *index;
+    chunk_store_stats_t *stats;
+} add_state_t;
+
+static int add_chunk(const uint8_t *data, size_t len, uint64_t offset, void *user) {
+    add_state_t *state = user;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+
+    sha256_buffer(data, len, digest);
+    int stored = store_chunk(state->store_dir, digest, data, len);
+    if (stored < 0) {
+        return -1;
+    }
+
+    sha256_to_hex(digest, hex);
+    fprintf(state->index, "%s %llu %zu\n", hex, (unsigned long long)offset, len);
+
+    state->stats->chunks++;
+    state->stats->bytes += len;
+    if (stored) {
+        state->stats->new_chunks++;
+        state->stats->new_bytes += len;
+    }
+    return 0;
+}
+
+// Split an image into the store and write its index
+int chunk_store_add_image(const char *store_dir, const char *image_path, const char *index_path,
+                          chunk_store_stats_t *stats) {
+    char path[MAX_PATH_LEN];
+    struct stat st;
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (stat(image_path, &st) != 0) {
+        LOG_ERROR("Image to chunk not found");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    mkdir(store_dir, 0755);
+    snprintf(path, sizeof(path), "%s/chunks", store_dir);
+    mkdir(path, 0755);
+
+    FILE *index = fopen(index_path, "w");
+    if (!index) {
+        LOG_ERROR("Failed to write chunk index");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    fprintf(index, "%s\n", CHUNK_INDEX_HEADER);
+    fprintf(index, "size %llu\n", (unsigned long long)st.st_size);
+
+    add_state_t state = {store_dir, index, stats};
+    int result = chunk_file(image_path, add_chunk, &state);
+
+    if (fclose(index) != 0 || result != 0) {
+        LOG_ERROR("Failed to add image to chunk store");
+        unlink(index_path);
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Publish a finished image: chunks into <output_dir>/chunks, index next to the image and in the store
+int publish_image_chunks(build_config_t *config, const char *image_path) {
+    char store_dir[MAX_PATH_LEN];
+    char index_path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[512];
+    chunk_store_stats_t stats;
+    error_context_t error_ctx = {0};
+
+    snprintf(store_dir, sizeof(store_dir), "%s/chunks", config->output_dir);
+    snprintf(index_path, sizeof(index_path), "%s.caidx", image_path);
+
+    LOG_INFO("Adding image to the chunk store...");
+    int result = chunk_store_add_image(store_dir, image_path, index_path, &stats);
+    if (result != ERROR_SUCCESS) {
+        return result;
+    }
+
+    // Indexes are served alongside the chunks so clients only need the store URL
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/indexes && cp -f %s %s/indexes/",
+             store_dir, index_path, store_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(msg, sizeof(msg), "Chunk store: %zu chunks, %zu new (%llu of %llu MB not already stored)",
+             stats.chunks, stats.new_chunks,
+             (unsigned long long)(stats.new_bytes / (1024 * 1024)),
+             (unsigned long long)(stats.bytes / (1024 * 1024)));
+    LOG_INFO(msg);
+
+    return ERROR_SUCCESS;
+}
+
+static int hex_to_digest(const char *hex, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) {
+            return -1;
+        }
+        digest[i] = (uint8_t)byte;
+    }
+    return 0;
+}
+
+int chunk_index_load(const char *path, chunk_index_t *index) {
+    char line[256];
+    char hex[SHA256_HEX_SIZE];
+
+    memset(index, 0, sizeof(*index));
+
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        unsigned long long a, b;
+
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "size %llu", &a) == 1) {
+            index->size = a;
+            continue;
+        }
+        if (sscanf(line, "%64s %llu %llu", hex, &a, &b) != 3) {
+            continue;
+        }
+
+        if (index->count == index->capacity) {
+            size_t capacity = index->capacity ? index->capacity * 2 : 4096;
+            chunk_index_entry_t *entries = realloc(index->entries, capacity * sizeof(*entries));
+            if (!entries) {
+                fclose(in);
+                chunk_index_free(index);
+                return ERROR_UNKNOWN;
+            }
+            index->entries = entries;
+            index->capacity = capacity;
+        }
+
+        chunk_index_entry_t *e = &index->entries[index->count];
+        if (hex_to_digest(hex, e->digest) != 0 || b == 0 || b > CHUNK_MAX_SIZE) {
+            continue;
+        }
+        e->offset = a;
+        e->length = (uint32_t)b;
+        index->count++;
+    }
+    fclose(in);
+
+    if (index->size == 0 || index->count == 0) {
+        chunk_index_free(index);
+        return ERROR_UNKNOWN;
+    }
+    return ERROR_SUCCESS;
+}
+
+void chunk_index_free(chunk_index_t *index) {
+    free(index->entries);
+    memset(index, 0, sizeof(*index));
+}
+
+// Unique chunk needed by an index, with where a copy can be found locally
+typedef struct {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint64_t seed_offset;
+    uint32_t seed_length;
+    int staged;             // Copied to the cache before an in-place update overwrites it
+} needed_chunk_t;
+
+static int compare_needed(const void *a, const void *b) {
+    return memcmp(((const needed_chunk_t *)a)->digest, ((const needed_chunk_t *)b)->digest,
+                  SHA256_DIGEST_SIZE);
+}
+
+static needed_chunk_t* find_needed(needed_chunk_t *needed, size_t count, const uint8_t *digest) {
+    needed_chunk_t key;
+
+    memcpy(key.digest, digest, SHA256_DIGEST_SIZE);
+    return bsearch(&key, needed, count, sizeof(needed_chunk_t), compare_needed);
+}
+
+typedef struct {
+    needed_chunk_t *needed;
+    size_t count;
+    size_t found;
+} seed_state_t;
+
+static int seed_chunk(const uint8_t *data, size_t len, uint64_t offset, void *user) {
+    seed_state_t *state = user;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    sha256_buffer(data, len, digest);
+    needed_chunk_t *n = find_needed(state->needed, state->count, digest);
+    if (n && n->seed_offset == NO_SEED_OFFSET) {
+        n->seed_offset = offset;
+        n->seed_length = (uint32_t)len;
+        state->found++;
+    }
+    return 0;
+}
+
+static int read_exact(int fd, uint8_t *buffer, size_t len, uint64_t offset) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(fd, buffer + done, len - done, (off_t)(offset + done));
+        if (n <= 0) {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static int read_chunk_file(const char *path, uint8_t *buffer, size_t len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = read_exact(fd, buffer, len, 0);
+    close(fd);
+    return result;
+}
+
+// Fetch a chunk from a store directory or an http(s) URL
+static int fetch_chunk(const char *store, const uint8_t digest[SHA256_DIGEST_SIZE], uint8_t *buffer, size_t len) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+
+    chunk_path(store, digest, path, sizeof(path));
+
+    if (strncmp(store, "http://", 7) != 0 && strncmp(store, "https://", 8) != 0) {
+        return read_chunk_file(path, buffer, len);
+    }
+
+    snprintf(cmd, sizeof(cmd), "curl -fsSL --retry 3 '%s'", path);
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        return -1;
+    }
+    size_t got = fread(buffer, 1, len, fp);
+    int status = pclose(fp);
+    return (got == len && status == 0) ? 0 : -1;
+}
+
+static int chunk_matches(const uint8_t *data, size_t len, const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint8_t actual[SHA256_DIGEST_SIZE];
+
+    sha256_buffer(data, len, actual);
+    return memcmp(actual, digest, SHA256_DIGEST_SIZE) == 0;
+}
+
+// Rebuild an image (or update a device in place) from an index
+int chunk_sync(const char *index_path, const char *store, const char *seed_path,
+               const char *output_path, const char *cache_dir, chunk_sync_stats_t *stats) {
+    chunk_index_t index;
+    char path[MAX_PATH_LEN];
+    char msg[512];
+    char seed_real[PATH_MAX] = "";
+    char output_real[PATH_MAX] = "";
+    int result = ERROR_SUCCESS;
+    int seed_fd = -1;
+    int in_place = 0;
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (chunk_index_load(index_path, &index) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to load chunk index");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    // One entry per distinct chunk, sorted by digest for lookups
+    needed_chunk_t *needed = calloc(index.count, sizeof(needed_chunk_t));
+    uint8_t *buffer = malloc(CHUNK_MAX_SIZE);
+    if (!needed || !buffer) {
+        free(needed);
+        free(buffer);
+        chunk_index_free(&index);
+        return ERROR_UNKNOWN;
+    }
+    for (size_t i = 0; i < index.count; i++) {
+        memcpy(needed[i].digest, index.entries[i].digest, SHA256_DIGEST_SIZE);
+        needed[i].seed_offset = NO_SEED_OFFSET;
+    }
+    qsort(needed, index.count, sizeof(needed_chunk_t), compare_needed);
+    size_t needed_count = 0;
+    for (size_t i = 0; i < index.count; i++) {
+        if (needed_count == 0 || compare_needed(&needed[needed_count - 1], &needed[i]) != 0) {
+            needed[needed_count++] = needed[i];
+        }
+    }
+
+    if (seed_path) {
+        seed_state_t seed = {needed, needed_count, 0};
+
+        LOG_INFO("Scanning seed for reusable chunks...");
+        if (chunk_file(seed_path, seed_chunk, &seed) != 0) {
+            LOG_WARNING("Failed to read seed, fetching every chunk");
+        } else {
+            seed_fd = open(seed_path, O_RDONLY);
+        }
+
+        if (realpath(seed_path, seed_real) && realpath(output_path, output_real) &&
+            strcmp(seed_real, output_real) == 0) {
+            in_place = 1;
+        }
+    }
+
+    if (cache_dir) {
+        snprintf(path, sizeof(path), "%s/chunks", cache_dir);
+        mkdir(cache_dir, 0755);
+        mkdir(path, 0755);
+    }
+
+    // In place, a seed chunk that moves would be overwritten before it is read;
+    // copy those into the cache first
+    if (in_place && seed_fd >= 0) {
+        if (!cache_dir) {
+            LOG_ERROR("Updating a device in place needs a cache directory");
+            result = ERROR_UNKNOWN;
+        }
+        for (size_t i = 0; result == ERROR_SUCCESS && i < index.count; i++) {
+            needed_chunk_t *n = find_needed(needed, needed_count, index.entries[i].digest);
+            if (n->seed_offset == NO_SEED_OFFSET || n->seed_offset == index.entries[i].offset || n->staged) {
+                continue;
+            }
+            if (read_exact(seed_fd, buffer, n->seed_length, n->seed_offset) != 0 ||
+                store_chunk(cache_dir, n->digest, buffer, n->seed_length) < 0) {
+                LOG_ERROR("Failed to stage seed chunk");
+                result = ERROR_UNKNOWN;
+            }
+            n->staged = 1;
+        }
+    }
+
+    int out_fd = -1;
+    if (result == ERROR_SUCCESS) {
+        out_fd = open(output_path, O_WRONLY | O_CREAT, 0644);
+        if (out_fd < 0) {
+            LOG_ERROR("Failed to open sync output");
+            result = ERROR_FILE_NOT_FOUND;
+        } else {
+            struct stat st;
+            if (fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(out_fd, (off_t)index.size) != 0) {
+                result = ERROR_UNKNOWN;
+            }
+        }
+    }
+
+    for (size_t i = 0; result == ERROR_SUCCESS && i < index.count; i++) {
+        const chunk_index_entry_t *e = &index.entries[i];
+        needed_chunk_t *n = find_needed(needed, needed_count, e->digest);
+        int have = 0;
+
+        // Already in place on the device
+        if (in_place && n->seed_offset == e->offset && n->seed_length == e->length) {
+            stats->reused_in_place++;
+            continue;
+        }
+
+        if (cache_dir) {
+            chunk_path(cache_dir, e->digest, path, sizeof(path));
+            if (read_chunk_file(path, buffer, e->length) == 0 && chunk_matches(buffer, e->length, e->digest)) {
+                have = 1;
+                stats->from_cache++;
+            }
+        }
+        if (!have && !in_place && n->seed_offset != NO_SEED_OFFSET &&
+            read_exact(seed_fd, buffer, e->length, n->seed_offset) == 0 &&
+            chunk_matches(buffer, e->length, e->digest)) {
+            have = 1;
+            stats->from_seed++;
+        }
+        if (!have) {
+            if (fetch_chunk(store, e->digest, buffer, e->length) != 0 ||
+                !chunk_matches(buffer, e->length, e->digest)) {
+                LOG_ERROR("Failed to fetch a valid chunk from the store");
+                result = ERROR_NETWORK_FAILURE;
+                break;
+            }
+            stats->downloaded++;
+            stats->downloaded_bytes += e->length;
+            if (cache_dir) {
+                store_chunk(cache_dir, e->digest, buffer, e->length);
+            }
+        }
+
+        size_t done = 0;
+        while (done < e->length) {
+            ssize_t n_written = pwrite(out_fd, buffer + done, e->length - done, (off_t)(e->offset + done));
+            if (n_written <= 0) {
+                LOG_ERROR("Failed to write sync output");
+                result = ERROR_UNKNOWN;
+                break;
+            }
+            done += (size_t)n_written;
+        }
+    }
+
+    if (out_fd >= 0) {
+        if (fsync(out_fd) != 0 && result == ERROR_SUCCESS) {
+            result = ERROR_UNKNOWN;
+        }
+        close(out_fd);
+    }
+    if (seed_fd >= 0) {
+        close(seed_fd);
+    }
+
+    stats->chunks = index.count;
+    snprintf(msg, sizeof(msg),
+             "Chunk sync: %zu chunks, %zu in place, %zu from seed, %zu from cache, %zu downloaded (%llu MB)",
+             stats->chunks, stats->reused_in_place, stats->from_seed, stats->from_cache,
+             stats->downloaded, (unsigned long long)(stats->downloaded_bytes / (1024 * 1024)));
+    LOG_INFO(msg);
+
+    free(needed);
+    free(buffer);
+    chunk_index_free(&index);
+    return result;
+}
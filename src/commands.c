@@ -0,0 +1,541 @@
+/*
+ * commands.c - Image tool subcommands for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the subcommands run as "builder COMMAND [ARGS]" instead
+ * of a build: tools that work on finished images, on the build host or on a
+ * board (the builder cross-compiles cleanly for aarch64).
+ */
+
+#include "../builder.h"
+
+typedef struct {
+    const char *name;
+    const char *usage;
+    const char *description;
+    int (*run)(build_config_t *config, int argc, char *argv[]);
+} subcommand_t;
+
+static int cmd_help(build_config_t *config, int argc, char *argv[]);
+static int cmd_chunk_store(build_config_t *config, int argc, char *argv[]);
+static int cmd_chunk_sync(build_config_t *config, int argc, char *argv[]);
+static int cmd_hash_tree(build_config_t *config, int argc, char *argv[]);
+static int cmd_verify(build_config_t *config, int argc, char *argv[]);
+static int cmd_inspect(build_config_t *config, int argc, char *argv[]);
+static int cmd_image_diff(build_config_t *config, int argc, char *argv[]);
+static int cmd_repro_check(build_config_t *config, int argc, char *argv[]);
+static int cmd_footprint(build_config_t *config, int argc, char *argv[]);
+static int cmd_cache(build_config_t *config, int argc, char *argv[]);
+static int cmd_export_bundle(build_config_t *config, int argc, char *argv[]);
+
+static const subcommand_t subcommands[] = {
+    {"help", "help", "List image tool commands", cmd_help},
+    {"chunk-store", "chunk-store IMAGE [--store DIR] [--index FILE]",
+     "Split an image into a chunk store and write its index", cmd_chunk_store},
+    {"chunk-sync", "chunk-sync --index FILE|URL --store DIR|URL --output FILE|DEVICE [--seed FILE|DEVICE] [--cache DIR]",
+     "Rebuild an image or update a device, fetching only chunks the seed lacks", cmd_chunk_sync},
+    {"hash-tree", "hash-tree IMAGE [--output FILE] [--leaf-size BYTES] [--jobs N]",
+     "Write a per-partition Merkle tree for an image", cmd_hash_tree},
+    {"verify", "verify IMAGE|DEVICE [--tree FILE] [--region NAME] [--offset BYTES] [--length BYTES] [--jobs N]",
+     "Check an image or flashed device against its Merkle tree (writable partitions differ once booted)", cmd_verify},
+    {"inspect", "inspect IMAGE [df | ls PATH | cat PATH | extract PATH DIR | diff [ROOTFS]] [--part NAME|N]",
+     "Look inside an image or compressed image without root or loop devices", cmd_inspect},
+    {"image-diff", "image-diff OLD NEW [--limit N]",
+     "Compare two images (or .manifest files): files, packages, kernel config, boot files", cmd_image_diff},
+    {"repro-check", "repro-check IMAGE_A IMAGE_B",
+     "Check that two reproducible builds are bit-identical and show what differs if not", cmd_repro_check},
+    {"footprint", "footprint [--distro desktop|server|emulation|minimal] [--ubuntu VERSION] [--snapshot TIMESTAMP] "
+     "[--groups LIST] [--packages LIST] [--no-recommends] [--top N]",
+     "Size a distro profile's packages from the apt indexes before anything is installed", cmd_footprint},
+    {"cache", "cache stats|gc|pin CACHE ENTRY|unpin CACHE ENTRY [--build-dir DIR] [--output-dir DIR] "
+     "[--quota NAME=MB]",
+     "Show cache sizes and hit rates, trim caches to their quotas, or pin entries against eviction", cmd_cache},
+    {"export-bundle", "export-bundle DIR [BUILD OPTIONS]",
+     "Capture the sources, blobs and packages a build fetches, for later builds with --offline DIR", cmd_export_bundle},
+};
+
+#define SUBCOMMAND_COUNT (sizeof(subcommands) / sizeof(subcommands[0]))
+
+static void print_usage(const char *name) {
+    for (size_t i = 0; i < SUBCOMMAND_COUNT; i++) {
+        if (strcmp(subcommands[i].name, name) == 0) {
+            printf("Usage: %s\n", subcommands[i].usage);
+        }
+    }
+}
+
+static int cmd_help(build_config_t *config, int argc, char *argv[]) {
+    (void)config;
+    (void)argc;
+    (void)argv;
+
+    printf("Image tool commands:\n");
+    for (size_t i = 0; i < SUBCOMMAND_COUNT; i++) {
+        printf("  %-14s %s\n", subcommands[i].name, subcommands[i].description);
+        printf("  %-14s   %s\n", "", subcommands[i].usage);
+    }
+    return ERROR_SUCCESS;
+}
+
+static int cmd_chunk_store(build_config_t *config, int argc, char *argv[]) {
+    char store_dir[MAX_PATH_LEN];
+    char index_path[MAX_PATH_LEN] = "";
+    char msg[512];
+    const char *image = NULL;
+    chunk_store_stats_t stats;
+
+    snprintf(store_dir, sizeof(store_dir), "%s/chunks", config->output_dir);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--store") == 0 && i + 1 < argc) {
+            snprintf(store_dir, sizeof(store_dir), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--index") == 0 && i + 1 < argc) {
+            snprintf(index_path, sizeof(index_path), "%s", argv[++i]);
+        } else if (argv[i][0] != '-' && !image) {
+            image = argv[i];
+        } else {
+            print_usage("chunk-store");
+            return ERROR_UNKNOWN;
+        }
+    }
+
+    if (!image) {
+        print_usage("chunk-store");
+        return ERROR_UNKNOWN;
+    }
+    if (!index_path[0]) {
+        snprintf(index_path, sizeof(index_path), "%s.caidx", image);
+    }
+
+    int result = chunk_store_add_image(store_dir, image, index_path, &stats);
+    if (result == ERROR_SUCCESS) {
+        snprintf(msg, sizeof(msg), "%zu chunks, %zu new (%llu of %llu MB added to %s)",
+                 stats.chunks, stats.new_chunks,
+                 (unsigned long long)(stats.new_bytes / (1024 * 1024)),
+                 (unsigned long long)(stats.bytes / (1024 * 1024)), store_dir);
+        LOG_INFO(msg);
+    }
+    return result;
+}
+
+static int cmd_chunk_sync(build_config_t *config, int argc, char *argv[]) {
+    const char *index = NULL;
+    const char *store = NULL;
+    const char *seed = NULL;
+    const char *output = NULL;
+    const char *cache = NULL;
+    char index_path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    chunk_sync_stats_t stats;
+    error_context_t error_ctx = {0};
+    (void)config;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            print_usage("chunk-sync");
+            return ERROR_UNKNOWN;
+        }
+        if (strcmp(argv[i], "--index") == 0) {
+            index = argv[++i];
+        } else if (strcmp(argv[i], "--store") == 0) {
+            store = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            seed = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            cache = argv[++i];
+        } else {
+            print_usage("chunk-sync");
+            return ERROR_UNKNOWN;
+        }
+    }
+
+    if (!index || !store || !output) {
+        print_usage("chunk-sync");
+        return ERROR_UNKNOWN;
+    }
+
+    // A remote index is fetched once; chunks are fetched individually as needed
+    snprintf(index_path, sizeof(index_path), "%s", index);
+    if (strncmp(index, "http://", 7) == 0 || strncmp(index, "https://", 8) == 0) {
+        snprintf(index_path, sizeof(index_path), "/tmp/orangepi-chunk-index.%d", (int)getpid());
+        snprintf(cmd, sizeof(cmd), "curl -fsSL --retry 3 -o %s '%s'", index_path, index);
+        if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+            LOG_ERROR("Failed to download chunk index");
+            return ERROR_NETWORK_FAILURE;
+        }
+    }
+
+    int result = chunk_sync(index_path, store, seed, output, cache, &stats);
+
+    if (strcmp(index_path, index) != 0) {
+        unlink(index_path);
+    }
+    return result;
+}
+
+static int cmd_hash_tree(build_config_t *config, int argc, char *argv[]) {
+    char tree_path[MAX_PATH_LEN] = "";
+    char hex[SHA256_HEX_SIZE];
+    char msg[512];
+    const char *image = NULL;
+    unsigned long leaf_size = MERKLE_DEFAULT_LEAF_SIZE;
+    int jobs = config->jobs;
+    merkle_tree_t tree;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            snprintf(tree_path, sizeof(tree_path), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--leaf-size") == 0 && i + 1 < argc) {
+            leaf_size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && !image) {
+            image = argv[i];
+        } else {
+            print_usage("hash-tree");
+            return ERROR_UNKNOWN;
+        }
+    }
+
+    // Leaves must be whole 4K blocks so device reads stay aligned
+    if (!image || leaf_size < 4096 || leaf_size % 4096 != 0 || leaf_size > 64UL * 1024 * 1024) {
+        print_usage("hash-tree");
+        return ERROR_UNKNOWN;
+    }
+    if (!tree_path[0]) {
+        snprintf(tree_path, sizeof(tree_path), "%s.merkle", image);
+    }
+
+    merkle_init(&tree, (uint32_t)leaf_size);
+    if (merkle_add_gpt_regions(&tree, image) != 0) {
+        LOG_ERROR("Failed to read the image partition table");
+        merkle_free(&tree);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    if (merkle_compute(&tree, image, jobs) != 0 || merkle_save(&tree, tree_path) != 0) {
+        LOG_ERROR("Failed to write image hash tree");
+        merkle_free(&tree);
+        return ERROR_UNKNOWN;
+    }
+
+    for (size_t r = 0; r < tree.count; r++) {
+        sha256_to_hex(tree.regions[r].root, hex);
+        printf("%-12s %12llu %12llu %s\n", tree.regions[r].name,
+               (unsigned long long)tree.regions[r].offset, (unsigned long long)tree.regions[r].size, hex);
+    }
+    sha256_to_hex(tree.root, hex);
+    snprintf(msg, sizeof(msg), "Hash tree root %s written to %s", hex, tree_path);
+    LOG_INFO(msg);
+
+    merkle_free(&tree);
+    return ERROR_SUCCESS;
+}
+
+static void report_bad_leaf(const merkle_region_t *region, uint64_t offset, uint64_t size, void *user) {
+    (void)user;
+    printf("MISMATCH %-12s offset %llu size %llu\n", region->name,
+           (unsigned long long)offset, (unsigned long long)size);
+}
+
+static int cmd_verify(build_config_t *config, int argc, char *argv[]) {
+    char tree_path[MAX_PATH_LEN] = "";
+    char msg[512];
+    const char *target = NULL;
+    const char *region = NULL;
+    unsigned long long offset = 0;
+    unsigned long long length = 0;
+    int jobs = config->jobs;
+    merkle_tree_t tree;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--tree") == 0 && i + 1 < argc) {
+            snprintf(tree_path, sizeof(tree_path), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--region") == 0 && i + 1 < argc) {
+            region = argv[++i];
+        } else if (strcmp(argv[i], "--offset") == 0 && i + 1 < argc) {
+            offset = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--length") == 0 && i + 1 < argc) {
+            length = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && !target) {
+            target = argv[i];
+        } else {
+            print_usage("verify");
+            return ERROR_UNKNOWN;
+        }
+    }
+
+    if (!target) {
+        print_usage("verify");
+        return ERROR_UNKNOWN;
+    }
+    // A device has no .merkle of its own; the tree of the image that was flashed must be given
+    if (!tree_path[0]) {
+        snprintf(tree_path, sizeof(tree_path), "%s.merkle", target);
+    }
+
+    if (merkle_load(tree_path, &tree) != 0) {
+        snprintf(msg, sizeof(msg), "Failed to load hash tree %s", tree_path);
+        LOG_ERROR(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    if (merkle_check_tree(&tree) != 0) {
+        LOG_ERROR("Hash tree is inconsistent with its own roots");
+        merkle_free(&tree);
+        return ERROR_UNKNOWN;
+    }
+
+    long bad = merkle_verify(&tree, target, region, offset, length, jobs, report_bad_leaf, NULL);
+    merkle_free(&tree);
+
+    if (bad < 0) {
+        snprintf(msg, sizeof(msg), "Failed to read %s", target);
+        LOG_ERROR(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    if (bad > 0) {
+        snprintf(msg, sizeof(msg), "%ld leaves of %s do not match", bad, target);
+        LOG_ERROR(msg);
+        return ERROR_UNKNOWN;
+    }
+
+    LOG_INFO("All checked leaves match");
+    return ERROR_SUCCESS;
+}
+
+static int cmd_inspect(build_config_t *config, int argc, char *argv[]) {
+    char rootfs_dir[MAX_PATH_LEN];
+    const char *args[4] = {NULL, NULL, NULL, NULL};
+    const char *partition = NULL;
+    int count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--part") == 0 && i + 1 < argc) {
+            partition = argv[++i];
+        } else if (argv[i][0] != '-' && count < 4) {
+            args[count++] = argv[i];
+        } else {
+            print_usage("inspect");
+            return ERROR_UNKNOWN;
+        }
+    }
+
+    const char *image = args[0];
+    const char *action = args[1] ? args[1] : "df";
+
+    if (!image) {
+        print_usage("inspect");
+        return ERROR_UNKNOWN;
+    }
+
+    if (strcmp(action, "df") == 0 && count <= 2) {
+        return inspect_partition_usage(image);
+    } else if (strcmp(action, "ls") == 0 && count <= 3) {
+        return inspect_list(image, partition, args[2] ? args[2] : "/");
+    } else if (strcmp(action, "cat") == 0 && count == 3) {
+        return inspect_cat(image, partition, args[2]);
+    } else if (strcmp(action, "extract") == 0 && count == 4) {
+        return inspect_extract(image, partition, args[2], args[3]);
+    } else if (strcmp(action, "diff") == 0 && count <= 3) {
+        snprintf(rootfs_dir, sizeof(rootfs_dir), "%s/rootfs", config->output_dir);
+        return inspect_diff(image, args[2] ? args[2] : rootfs_dir);
+    }
+
+    print_usage("inspect");
+    return ERROR_UNKNOWN;
+}
+
+static int cmd_image_diff(build_config_t *config, int argc, char *argv[]) {
+    const char *images[2] = {NULL, NULL};
+    int count = 0;
+    int limit = 25;
+    (void)config;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            limit = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && count < 2) {
+            images[count++] = argv[i];
+        } else {
+            print_usage("image-diff");
+            return ERROR_UNKNOWN;
+        }
+    }
+
+    if (count != 2 || limit <= 0) {
+        print_usage("image-diff");
+        return ERROR_UNKNOWN;
+    }
+    return image_diff(images[0], images[1], limit);
+}
+
+static int cmd_repro_check(build_config_t *config, int argc, char *argv[]) {
+    (void)config;
+
+    if (argc != 3) {
+        print_usage("repro-check");
+        return ERROR_UNKNOWN;
+    }
+
+    int result = compare_images(argv[1], argv[2]);
+    if (result == ERROR_UNKNOWN) {
+        // Name the files behind the differing blocks
+        image_diff(argv[1], argv[2], 25);
+    }
+    return result;
+}
+
+static int cmd_footprint(build_config_t *config, int argc, char *argv[]) {
+    const char *distros[] = {"desktop", "server", "emulation", "minimal", NULL};
+    const distro_type_t distro_types[] = {DISTRO_DESKTOP, DISTRO_SERVER, DISTRO_EMULATION, DISTRO_MINIMAL};
+    const char *groups = NULL;
+    const char *packages = NULL;
+    int recommends = 1;
+    int top = 15;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-recommends") == 0) {
+            recommends = 0;
+        } else if (i + 1 >= argc) {
+            print_usage("footprint");
+            return ERROR_UNKNOWN;
+        } else if (strcmp(argv[i], "--distro") == 0) {
+            int found = 0;
+            for (int d = 0; distros[d]; d++) {
+                if (strcmp(distros[d], argv[i + 1]) == 0) {
+                    config->distro_type = distro_types[d];
+                    found = 1;
+                }
+            }
+            if (!found) {
+                print_usage("footprint");
+                return ERROR_UNKNOWN;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--ubuntu") == 0) {
+            ubuntu_release_t *release = find_ubuntu_release(argv[++i]);
+            if (!release) {
+                printf("Unknown Ubuntu release: %s\n", argv[i]);
+                return ERROR_UNKNOWN;
+            }
+            snprintf(config->ubuntu_release, sizeof(config->ubuntu_release), "%s", release->version);
+            snprintf(config->ubuntu_codename, sizeof(config->ubuntu_codename), "%s", release->codename);
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            snprintf(config->apt_snapshot, sizeof(config->apt_snapshot), "%s", argv[++i]);
+            config->reproducible = 1;
+        } else if (strcmp(argv[i], "--groups") == 0) {
+            groups = argv[++i];
+        } else if (strcmp(argv[i], "--packages") == 0) {
+            packages = argv[++i];
+        } else if (strcmp(argv[i], "--top") == 0) {
+            top = atoi(argv[++i]);
+        } else {
+            print_usage("footprint");
+            return ERROR_UNKNOWN;
+        }
+    }
+
+    if (groups) {
+        char list[256];
+        char *saveptr = NULL;
+        snprintf(list, sizeof(list), "%s", groups);
+        for (char *name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+            if (!get_package_group(name)) {
+                printf("Unknown package group: %s (known:", name);
+                for (int g = 0; package_groups[g].name; g++) {
+                    printf(" %s", package_groups[g].name);
+                }
+                printf(")\n");
+                return ERROR_UNKNOWN;
+            }
+        }
+    }
+    if (config->reproducible && resolve_reproducible_build(config) != ERROR_SUCCESS) {
+        return ERROR_UNKNOWN;
+    }
+    return analyze_package_footprint(config, groups, packages, recommends, top);
+}
+
+static int cmd_cache(build_config_t *config, int argc, char *argv[]) {
+    const char *args[3];
+    int count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            if (count == 3) {
+                print_usage("cache");
+                return ERROR_UNKNOWN;
+            }
+            args[count++] = argv[i];
+        } else if (i + 1 >= argc) {
+            print_usage("cache");
+            return ERROR_UNKNOWN;
+        } else if (strcmp(argv[i], "--build-dir") == 0) {
+            snprintf(config->build_dir, sizeof(config->build_dir), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--output-dir") == 0) {
+            snprintf(config->output_dir, sizeof(config->output_dir), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--quota") == 0) {
+            size_t len = strlen(config->cache_quotas);
+            snprintf(config->cache_quotas + len, sizeof(config->cache_quotas) - len,
+                     "%s%s", len ? "," : "", argv[++i]);
+        } else {
+            print_usage("cache");
+            return ERROR_UNKNOWN;
+        }
+    }
+    if (validate_cache_quotas(config->cache_quotas) != 0) {
+        printf("Invalid cache quota: %s\n", config->cache_quotas);
+        return ERROR_UNKNOWN;
+    }
+
+    if (count == 1 && strcmp(args[0], "stats") == 0) {
+        print_cache_stats(config);
+        return ERROR_SUCCESS;
+    }
+    if (count == 1 && strcmp(args[0], "gc") == 0) {
+        cache_gc(config, NULL);
+        print_cache_stats(config);
+        return ERROR_SUCCESS;
+    }
+    if (count == 3 && (strcmp(args[0], "pin") == 0 || strcmp(args[0], "unpin") == 0)) {
+        int result = cache_set_pinned(config, args[1], args[2], strcmp(args[0], "pin") == 0);
+        if (result != ERROR_SUCCESS) {
+            printf("No entry %s in cache %s\n", args[2], args[1]);
+        }
+        return result;
+    }
+    print_usage("cache");
+    return ERROR_UNKNOWN;
+}
+
+static int cmd_export_bundle(build_config_t *config, int argc, char *argv[]) {
+    if (argc < 2 || strncmp(argv[1], "--", 2) == 0) {
+        print_usage("export-bundle");
+        return ERROR_UNKNOWN;
+    }
+
+    // Same settings the build ends up with: its options, then the quick setup defaults
+    process_args(argc - 1, argv + 1, config);
+    apply_quick_setup_defaults(config);
+    config->offline_bundle[0] = '\0';
+    if (validate_config(config) != ERROR_SUCCESS) {
+        return ERROR_UNKNOWN;
+    }
+    return export_offline_bundle(config, argv[1]);
+}
+
+// Dispatch "builder COMMAND [ARGS]"; argv[0] is the command name
+int run_subcommand(build_config_t *config, int argc, char *argv[]) {
+    for (size_t i = 0; i < SUBCOMMAND_COUNT; i++) {
+        if (strcmp(argv[0], subcommands[i].name) == 0) {
+            return subcommands[i].run(config, argc, argv);
+        }
+    }
+
+    printf("Unknown command: %s\n", argv[0]);
+    cmd_help(config, 0, NULL);
+    return ERROR_UNKNOWN;
+}
@@ -0,0 +1,699 @@
+/*
+ * delta.c - Delta update packages for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the functions that turn two consecutive builds into a
+ * delta package for devices in the field. Writable roots are updated file by
+ * file: every changed file ships either as a zstd binary patch against the
+ * previous version or whole, whichever is smaller. Read-only roots are updated
+ * block by block; a root that is mounted or mapped is never written live, its
+ * blocks are staged and the initramfs writes them on the next boot, before the
+ * root is opened. Boot partition files are always handled per file. The package carries an
+ * apply-delta script that checks the device against the previous build before
+ * changing anything and verifies every result afterwards.
+ */
+
+#include "../builder.h"
+
+#define DELTA_BLOCK_SIZE (64 * 1024)
+#define DELTA_PATCH_MIN_SIZE (64 * 1024)
+
+// On-device applier shipped in every package; patched files are staged next to their targets
+static const char *delta_applier_script =
+    "#!/bin/bash\n"
+    "# Apply an Orange Pi 5 Plus delta update from the unpacked package directory.\n"
+    "# ROOT=/mnt/target updates a mounted image instead of the running system.\n"
+    "set -euo pipefail\n"
+    "PKG=$(cd \"$(dirname \"$0\")\" && pwd)\n"
+    "ROOT=${ROOT:-/}\n"
+    ". \"$PKG/delta-info\"\n"
+    "\n"
+    "fail() { echo \"apply-delta: $*\" >&2; exit 1; }\n"
+    "part_dir() { if [ \"$1\" = boot ]; then echo \"${ROOT%/}/boot\"; else echo \"$ROOT\"; fi; }\n"
+    "digest() { sha256sum < \"$1\" | cut -d' ' -f1; }\n"
+    "in_use() {\n"
+    "    local dev\n"
+    "    dev=$(readlink -f \"$1\")\n"
+    "    [ -n \"$(findmnt -n -S \"$dev\" 2>/dev/null)\" ] || [ -n \"$(ls -A \"/sys/class/block/${dev##*/}/holders\" 2>/dev/null)\" ]\n"
+    "}\n"
+    "ROOT_STAGED=0\n"
+    "\n"
+    "[ \"$(id -u)\" = 0 ] || fail \"must run as root\"\n"
+    "\n"
+    "# Before: patch bases and the build identity must match the build this delta starts from\n"
+    "for part in boot root; do\n"
+    "    [ -s \"$PKG/$part.before\" ] || continue\n"
+    "    (cd \"$(part_dir $part)\" && sha256sum --quiet --strict -c \"$PKG/$part.before\") ||\n"
+    "        fail \"$part does not match $FROM_IMAGE\"\n"
+    "done\n"
+    "if [ \"$MODE\" = block ]; then\n"
+    "    ROOT_DEV=${ROOT_DEV:-$(findmnt -n -o SOURCE /run/overlay/lower)}\n"
+    "    # A dm-verity root is written through its data partition\n"
+    "    case \"$ROOT_DEV\" in /dev/mapper/*|/dev/dm-*) ROOT_DEV=$(lsblk -n -l -p -s -o NAME \"$ROOT_DEV\" | sed -n 2p) ;; esac\n"
+    "    [ -b \"$ROOT_DEV\" ] || fail \"read-only root partition not found, set ROOT_DEV\"\n"
+    "    [ \"$(blockdev --getsize64 \"$ROOT_DEV\")\" = \"$ROOT_PART_BYTES\" ] || fail \"root partition size differs\"\n"
+    "    echo \"Verifying root partition...\"\n"
+    "    [ \"$(digest \"$ROOT_DEV\")\" = \"$ROOT_BEFORE\" ] || fail \"root partition does not match $FROM_IMAGE\"\n"
+    "fi\n"
+    "\n"
+    "# Rebuild patched files next to their targets and verify them before anything is replaced\n"
+    "for part in boot root; do\n"
+    "    [ -s \"$PKG/$part.patches\" ] || continue\n"
+    "    dir=$(part_dir $part)\n"
+    "    while IFS=$'\\t' read -r n hash mode uid gid mtime path; do\n"
+    "        zstd -q -d -f --long=31 --patch-from=\"$dir/$path\" \"$PKG/$part.patch/$n.zst\" -o \"$dir/$path.delta-new\"\n"
+    "        [ \"$(digest \"$dir/$path.delta-new\")\" = \"$hash\" ] || fail \"patched $path does not verify\"\n"
+    "    done < \"$PKG/$part.patches\"\n"
+    "done\n"
+    "\n"
+    "if [ \"$MODE\" = block ] && in_use \"$ROOT_DEV\"; then\n"
+    "    # Pages of a mounted (or dm-verity-mapped) root must not change under it: stage the\n"
+    "    # blocks where the initramfs finds them and let it write them before the root is opened\n"
+    "    if mountpoint -q /run/overlay/rw && [ \"$(findmnt -n -o FSTYPE /run/overlay/rw)\" != tmpfs ]; then\n"
+    "        STAGE=/run/overlay/rw/delta\n"
+    "    else\n"
+    "        STAGE=\"${ROOT%/}/boot/orangepi-delta\"\n"
+    "    fi\n"
+    "    rm -rf \"$STAGE\"\n"
+    "    mkdir -p \"$STAGE\"\n"
+    "    need=$(awk '{n += $2} END {print n * 65536 + 1048576}' \"$PKG/root.extents\")\n"
+    "    [ \"$(df --output=avail -B1 \"$STAGE\" | tail -n1)\" -gt \"$need\" ] ||\n"
+    "        { rm -rf \"$STAGE\"; fail \"not enough space in $STAGE to stage the root update\"; }\n"
+    "    echo \"Staging root partition blocks in $STAGE...\"\n"
+    "    zstd -q -d -f \"$PKG/root.blocks.zst\" -o \"$STAGE/root.blocks\"\n"
+    "    cp \"$PKG/root.extents\" \"$STAGE/\"\n"
+    "    printf 'ROOT_BEFORE=%s\\nROOT_AFTER=%s\\n' \"$ROOT_BEFORE\" \"$ROOT_AFTER\" > \"$STAGE/pending.tmp\"\n"
+    "    sync\n"
+    "    # The initramfs only acts on a complete stage\n"
+    "    mv \"$STAGE/pending.tmp\" \"$STAGE/pending\"\n"
+    "    sync\n"
+    "    ROOT_STAGED=1\n"
+    "elif [ \"$MODE\" = block ]; then\n"
+    "    echo \"Writing root partition blocks...\"\n"
+    "    exec 3< <(zstd -q -d -c \"$PKG/root.blocks.zst\")\n"
+    "    while read -r start count; do\n"
+    "        dd of=\"$ROOT_DEV\" bs=64K seek=\"$start\" count=\"$count\" iflag=fullblock conv=notrunc status=none <&3\n"
+    "    done < \"$PKG/root.extents\"\n"
+    "    exec 3<&-\n"
+    "    sync\n"
+    "    blockdev --flushbufs \"$ROOT_DEV\"\n"
+    "    [ \"$(digest \"$ROOT_DEV\")\" = \"$ROOT_AFTER\" ] || fail \"root partition does not verify, reflash required\"\n"
+    "fi\n"
+    "\n"
+    "for part in boot root; do\n"
+    "    dir=$(part_dir $part)\n"
+    "    if [ -s \"$PKG/$part.remove\" ]; then\n"
+    "        (cd \"$dir\" && xargs -0 -r rm -rf -- < \"$PKG/$part.remove\")\n"
+    "    fi\n"
+    "    if [ -f \"$PKG/$part.tar.zst\" ]; then\n"
+    "        if [ $part = root ]; then\n"
+    "            zstd -q -d -c \"$PKG/$part.tar.zst\" | tar -C \"$dir\" -x -p --xattrs --acls --numeric-owner -f -\n"
+    "        else\n"
+    "            zstd -q -d -c \"$PKG/$part.tar.zst\" | tar -C \"$dir\" -x --no-same-owner --no-same-permissions -f -\n"
+    "        fi\n"
+    "    fi\n"
+    "    if [ -s \"$PKG/$part.patches\" ]; then\n"
+    "        while IFS=$'\\t' read -r n hash mode uid gid mtime path; do\n"
+    "            if [ $part = root ]; then\n"
+    "                chown \"$uid:$gid\" \"$dir/$path.delta-new\"\n"
+    "                chmod \"$mode\" \"$dir/$path.delta-new\"\n"
+    "            fi\n"
+    "            touch -d \"@$mtime\" \"$dir/$path.delta-new\"\n"
+    "            mv -f \"$dir/$path.delta-new\" \"$dir/$path\"\n"
+    "        done < \"$PKG/$part.patches\"\n"
+    "    fi\n"
+    "done\n"
+    "sync\n"
+    "\n"
+    "# After: every file the update wrote must match the new build\n"
+    "for part in boot root; do\n"
+    "    [ -s \"$PKG/$part.after\" ] || continue\n"
+    "    (cd \"$(part_dir $part)\" && sha256sum --quiet --strict -c \"$PKG/$part.after\") ||\n"
+    "        fail \"$part does not match $TO_IMAGE after the update\"\n"
+    "done\n"
+    "\n"
+    "if [ $ROOT_STAGED = 1 ]; then\n"
+    "    echo \"Staged $FROM_IMAGE -> $TO_IMAGE, the root partition is written on the next boot\"\n"
+    "else\n"
+    "    echo \"Updated $FROM_IMAGE -> $TO_IMAGE, reboot to finish\"\n"
+    "fi\n";
+
+typedef struct {
+    char work_dir[MAX_PATH_LEN];
+    char pkg_dir[MAX_PATH_LEN];
+    char old_loop[32];
+    char new_loop[32];
+    int old_boot_mounted;
+    int old_root_mounted;
+    int new_boot_mounted;
+} delta_state_t;
+
+// Attach an image read-only with partition scanning
+static int attach_image(const char *image, char *loop_dev, size_t size) {
+    char cmd[MAX_CMD_LEN];
+
+    snprintf(cmd, sizeof(cmd), "losetup -r -P -f --show %s", image);
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        return -1;
+    }
+    loop_dev[0] = '\0';
+    if (fgets(loop_dev, (int)size, fp)) {
+        loop_dev[strcspn(loop_dev, "\n")] = '\0';
+    }
+    pclose(fp);
+    return loop_dev[0] ? 0 : -1;
+}
+
+static int mount_readonly(const char *loop_dev, int partition, const char *mount_point) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s && mount -o ro %sp%d %s", mount_point, loop_dev, partition, mount_point);
+    return execute_command_safe(cmd, 0, &error_ctx);
+}
+
+static void release_delta_state(delta_state_t *state) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    if (state->old_boot_mounted) {
+        snprintf(cmd, sizeof(cmd), "umount %s/old-boot", state->work_dir);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+    if (state->old_root_mounted) {
+        snprintf(cmd, sizeof(cmd), "umount %s/old-root", state->work_dir);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+    if (state->new_boot_mounted) {
+        snprintf(cmd, sizeof(cmd), "umount %s/new-boot", state->work_dir);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+    if (state->old_loop[0]) {
+        snprintf(cmd, sizeof(cmd), "losetup -d %s", state->old_loop);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+    if (state->new_loop[0]) {
+        snprintf(cmd, sizeof(cmd), "losetup -d %s", state->new_loop);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+}
+
+static int is_manifest_file(const char *path) {
+    char line[64] = "";
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    if (!fgets(line, sizeof(line), fp)) {
+        line[0] = '\0';
+    }
+    fclose(fp);
+    return strncmp(line, "# orangepi-manifest", 19) == 0;
+}
+
+// Copy the boot/ entries (prefix stripped) or the root entries of a rootfs manifest
+static int split_manifest(const manifest_t *all, int want_boot, manifest_t *out) {
+    memset(out, 0, sizeof(*out));
+    out->entries = calloc(all->count ? all->count : 1, sizeof(manifest_entry_t));
+    if (!out->entries) {
+        return ERROR_UNKNOWN;
+    }
+    out->capacity = all->count;
+
+    for (size_t i = 0; i < all->count; i++) {
+        const manifest_entry_t *e = &all->entries[i];
+        int in_boot = strncmp(e->path, "boot/", 5) == 0;
+
+        // The mount points themselves belong to neither side
+        if (strcmp(e->path, "boot") == 0 || strcmp(e->path, "lost+found") == 0 || in_boot != want_boot) {
+            continue;
+        }
+        out->entries[out->count] = *e;
+        out->entries[out->count].path = strdup(in_boot ? e->path + 5 : e->path);
+        if (!out->entries[out->count].path) {
+            manifest_free(out);
+            return ERROR_UNKNOWN;
+        }
+        out->count++;
+    }
+    return ERROR_SUCCESS;
+}
+
+// vfat has no owners or modes and cp does not keep mtimes; compare boot files by contents only
+static void normalize_boot_manifest(manifest_t *manifest) {
+    for (size_t i = 0; i < manifest->count; i++) {
+        manifest->entries[i].mode = 0;
+        manifest->entries[i].uid = 0;
+        manifest->entries[i].gid = 0;
+        manifest->entries[i].mtime = 0;
+    }
+}
+
+// Paths that cannot be written to a tab-separated or sha256sum list go into the tarball unverified
+static int path_is_listable(const char *path) {
+    return strpbrk(path, "\t\n\\'") == NULL;
+}
+
+static off_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+// File-level delta of one partition: patches, a tarball of everything else, and removals
+static int write_file_delta(const char *part, const manifest_t *old, const manifest_t *new,
+                            const char *old_dir, const char *new_dir, const char *pkg_dir, int keep_owner,
+                            uint64_t *patched_count) {
+    char path[MAX_PATH_LEN];
+    char patch_path[MAX_PATH_LEN];
+    char full_path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[512];
+    char *updates = NULL;
+    size_t updates_size = 0;
+    manifest_diff_stats_t stats;
+    error_context_t error_ctx = {0};
+    int result = ERROR_SUCCESS;
+
+    snprintf(path, sizeof(path), "%s/%s.remove", pkg_dir, part);
+    FILE *remove_list = fopen(path, "w");
+    FILE *update_list = open_memstream(&updates, &updates_size);
+    if (!remove_list || !update_list) {
+        if (remove_list) fclose(remove_list);
+        if (update_list) fclose(update_list);
+        free(updates);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    manifest_diff(old, new, update_list, remove_list, &stats);
+    fclose(update_list);
+    fclose(remove_list);
+
+    snprintf(path, sizeof(path), "%s/%s.patch", pkg_dir, part);
+    mkdir(path, 0755);
+
+    snprintf(path, sizeof(path), "%s/%s.patches", pkg_dir, part);
+    FILE *patches = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s/%s.before", pkg_dir, part);
+    FILE *before = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s/%s.after", pkg_dir, part);
+    FILE *after = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s/%s.files", pkg_dir, part);
+    FILE *files = fopen(path, "w");
+    if (!patches || !before || !after || !files) {
+        result = ERROR_FILE_NOT_FOUND;
+    }
+
+    // The build identity file proves which build the device runs
+    const manifest_entry_t *identity = manifest_find(old, "etc/orangepi-image-info");
+    if (result == ERROR_SUCCESS && identity && identity->type == 'f') {
+        fprintf(before, "%s  %s\n", identity->hash, identity->path);
+    }
+
+    size_t files_count = 0;
+    for (size_t offset = 0; result == ERROR_SUCCESS && offset < updates_size; offset += strlen(updates + offset) + 1) {
+        const char *name = updates + offset;
+        const manifest_entry_t *e = manifest_find(new, name);
+        const manifest_entry_t *o = manifest_find(old, name);
+        int patched = 0;
+
+        if (!e) {
+            continue;
+        }
+
+        // Binary patch against the previous version when that beats shipping the file
+        if (old_dir && o && o->type == 'f' && e->type == 'f' &&
+            e->size >= DELTA_PATCH_MIN_SIZE && path_is_listable(name)) {
+            snprintf(patch_path, sizeof(patch_path), "%s/%s.patch/%llu.zst",
+                     pkg_dir, part, (unsigned long long)*patched_count);
+            snprintf(full_path, sizeof(full_path), "%s.full", patch_path);
+            snprintf(cmd, sizeof(cmd),
+                     "(zstd -q -f -19 --long=31 --patch-from='%s/%s' '%s/%s' -o %s && "
+                     "zstd -q -f -19 '%s/%s' -o %s)",
+                     old_dir, name, new_dir, name, patch_path, new_dir, name, full_path);
+            if (execute_command_safe(cmd, 0, &error_ctx) == 0 &&
+                file_size(patch_path) >= 0 && file_size(patch_path) < file_size(full_path)) {
+                fprintf(patches, "%llu\t%s\t%04o\t%u\t%u\t%lld\t%s\n",
+                        (unsigned long long)*patched_count, e->hash, e->mode, e->uid, e->gid, e->mtime, name);
+                if (o != identity) {
+                    fprintf(before, "%s  %s\n", o->hash, name);
+                }
+                (*patched_count)++;
+                patched = 1;
+            } else {
+                unlink(patch_path);
+            }
+            unlink(full_path);
+        }
+
+        if (!patched) {
+            fprintf(files, "%s%c", name, '\0');
+            files_count++;
+        }
+        if (e->type == 'f' && path_is_listable(name)) {
+            fprintf(after, "%s  %s\n", e->hash, name);
+        }
+    }
+
+    if (patches) fclose(patches);
+    if (before) fclose(before);
+    if (after) fclose(after);
+    if (files) fclose(files);
+    free(updates);
+
+    // Everything not patched ships in one tarball so small files compress together
+    if (result == ERROR_SUCCESS && files_count > 0) {
+        snprintf(cmd, sizeof(cmd),
+                 "tar -C %s --null --no-recursion -T %s/%s.files %s -cf - | "
+                 "zstd -q -19 -T0 -o %s/%s.tar.zst",
+                 new_dir, pkg_dir, part, keep_owner ? "--xattrs --acls --numeric-owner" : "",
+                 pkg_dir, part);
+        if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+            LOG_ERROR("Failed to pack changed files");
+            result = ERROR_INSTALLATION_FAILED;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/%s.files", pkg_dir, part);
+    unlink(path);
+
+    snprintf(msg, sizeof(msg), "Delta %s: %zu added, %zu changed, %zu removed (%lld MB changed)",
+             part, stats.added, stats.changed, stats.removed, stats.update_bytes / (1024 * 1024));
+    LOG_INFO(msg);
+
+    return result;
+}
+
+static int write_extent(FILE *extents, uint64_t start, uint64_t count) {
+    return fprintf(extents, "%llu %llu\n", (unsigned long long)start, (unsigned long long)count) < 0 ? -1 : 0;
+}
+
+// Block-level delta of the read-only root partition: changed 64 KiB blocks plus whole-partition hashes
+static int write_block_delta(const char *old_dev, const char *new_dev, const char *pkg_dir, FILE *info) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char hex[SHA256_HEX_SIZE];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256_ctx_t old_ctx, new_ctx;
+    error_context_t error_ctx = {0};
+    int result = ERROR_SUCCESS;
+
+    int old_fd = open(old_dev, O_RDONLY);
+    int new_fd = open(new_dev, O_RDONLY);
+    if (old_fd < 0 || new_fd < 0) {
+        if (old_fd >= 0) close(old_fd);
+        if (new_fd >= 0) close(new_fd);
+        LOG_ERROR("Failed to open root partitions for block delta");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    off_t size = lseek(new_fd, 0, SEEK_END);
+    if (size <= 0 || lseek(old_fd, 0, SEEK_END) != size) {
+        close(old_fd);
+        close(new_fd);
+        LOG_ERROR("Root partition size changed, a full image is required");
+        return ERROR_UNKNOWN;
+    }
+
+    snprintf(path, sizeof(path), "%s/root.extents", pkg_dir);
+    FILE *extents = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s/root.blocks", pkg_dir);
+    FILE *blocks = fopen(path, "w");
+    uint8_t *old_block = malloc(DELTA_BLOCK_SIZE);
+    uint8_t *new_block = malloc(DELTA_BLOCK_SIZE);
+    if (!extents || !blocks || !old_block || !new_block) {
+        result = ERROR_UNKNOWN;
+    }
+
+    sha256_init(&old_ctx);
+    sha256_init(&new_ctx);
+
+    uint64_t run_start = 0, run_count = 0, changed = 0;
+    for (uint64_t block = 0; result == ERROR_SUCCESS && (off_t)(block * DELTA_BLOCK_SIZE) < size; block++) {
+        off_t offset = (off_t)(block * DELTA_BLOCK_SIZE);
+        size_t len = (size - offset) < DELTA_BLOCK_SIZE ? (size_t)(size - offset) : DELTA_BLOCK_SIZE;
+
+        if (pread(old_fd, old_block, len, offset) != (ssize_t)len ||
+            pread(new_fd, new_block, len, offset) != (ssize_t)len) {
+            result = ERROR_UNKNOWN;
+            break;
+        }
+        sha256_update(&old_ctx, old_block, len);
+        sha256_update(&new_ctx, new_block, len);
+
+        if (memcmp(old_block, new_block, len) == 0) {
+            continue;
+        }
+        if (run_count > 0 && run_start + run_count == block) {
+            run_count++;
+        } else {
+            if (run_count > 0 && write_extent(extents, run_start, run_count) != 0) {
+                result = ERROR_UNKNOWN;
+            }
+            run_start = block;
+            run_count = 1;
+        }
+        if (fwrite(new_block, 1, len, blocks) != len) {
+            result = ERROR_UNKNOWN;
+        }
+        changed++;
+    }
+    if (result == ERROR_SUCCESS && run_count > 0 && write_extent(extents, run_start, run_count) != 0) {
+        result = ERROR_UNKNOWN;
+    }
+
+    if (extents && fclose(extents) != 0) result = ERROR_UNKNOWN;
+    if (blocks && fclose(blocks) != 0) result = ERROR_UNKNOWN;
+    free(old_block);
+    free(new_block);
+    close(old_fd);
+    close(new_fd);
+
+    if (result != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to write root block delta");
+        return result;
+    }
+
+    fprintf(info, "ROOT_PART_BYTES=\"%lld\"\n", (long long)size);
+    sha256_final(&old_ctx, digest);
+    sha256_to_hex(digest, hex);
+    fprintf(info, "ROOT_BEFORE=\"%s\"\n", hex);
+    sha256_final(&new_ctx, digest);
+    sha256_to_hex(digest, hex);
+    fprintf(info, "ROOT_AFTER=\"%s\"\n", hex);
+
+    snprintf(cmd, sizeof(cmd), "zstd -q -f -19 -T0 --rm %s/root.blocks -o %s/root.blocks.zst", pkg_dir, pkg_dir);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    snprintf(cmd, sizeof(cmd), "Delta root: %llu of %lld blocks changed",
+             (unsigned long long)changed, (long long)((size + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE));
+    LOG_INFO(cmd);
+    return ERROR_SUCCESS;
+}
+
+// Partition start and size from sysfs, to check that two images share a layout
+static int read_partition_geometry(const char *loop_dev, int partition, char *geometry, size_t size) {
+    char path[MAX_PATH_LEN];
+    char start[32] = "", sectors[32] = "";
+    const char *name = strrchr(loop_dev, '/') ? strrchr(loop_dev, '/') + 1 : loop_dev;
+
+    snprintf(path, sizeof(path), "/sys/class/block/%sp%d/start", name, partition);
+    FILE *fp = fopen(path, "r");
+    if (!fp || !fgets(start, sizeof(start), fp)) {
+        if (fp) fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    snprintf(path, sizeof(path), "/sys/class/block/%sp%d/size", name, partition);
+    fp = fopen(path, "r");
+    if (!fp || !fgets(sectors, sizeof(sectors), fp)) {
+        if (fp) fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    start[strcspn(start, "\n")] = '\0';
+    sectors[strcspn(sectors, "\n")] = '\0';
+    snprintf(geometry, size, "%s+%s", start, sectors);
+    return 0;
+}
+
+static void base_name(const char *path, char *name, size_t size) {
+    const char *slash = strrchr(path, '/');
+    snprintf(name, size, "%s", slash ? slash + 1 : path);
+}
+
+// Build <image>.delta.tar against the image (or rootfs manifest) in config->delta_from
+int build_delta_package(build_config_t *config, const char *image_path) {
+    char cmd[MAX_CMD_LEN];
+    char path[MAX_PATH_LEN];
+    char rootfs_dir[MAX_PATH_LEN];
+    char package[MAX_PATH_LEN];
+    char old_geometry[64], new_geometry[64];
+    char from_name[256], to_name[256];
+    char msg[512];
+    delta_state_t state;
+    manifest_t old_all = {0}, new_all = {0};
+    manifest_t old_boot = {0}, new_boot = {0}, old_root = {0}, new_root = {0};
+    uint64_t patched_count = 0;
+    error_context_t error_ctx = {0};
+    int readonly_root = rootfs_format_is_readonly(config);
+    int from_manifest = is_manifest_file(config->delta_from);
+    int result = ERROR_SUCCESS;
+
+    if (from_manifest && readonly_root) {
+        LOG_ERROR("Read-only root deltas need the previous image, not a manifest");
+        return ERROR_UNKNOWN;
+    }
+
+    LOG_INFO("Building delta update package...");
+
+    memset(&state, 0, sizeof(state));
+    snprintf(rootfs_dir, sizeof(rootfs_dir), "%s/rootfs", config->output_dir);
+    snprintf(state.work_dir, sizeof(state.work_dir), "%s/delta", config->output_dir);
+    snprintf(state.pkg_dir, sizeof(state.pkg_dir), "%s/delta/package", config->output_dir);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s && mkdir -p %s", state.pkg_dir, state.pkg_dir);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    // The new boot partition includes extlinux.conf, which the staged rootfs does not
+    if (attach_image(image_path, state.new_loop, sizeof(state.new_loop)) != 0) {
+        LOG_ERROR("Failed to attach the new image");
+        return ERROR_UNKNOWN;
+    }
+    snprintf(path, sizeof(path), "%s/new-boot", state.work_dir);
+    state.new_boot_mounted = mount_readonly(state.new_loop, 2, path) == 0;
+    if (!state.new_boot_mounted) {
+        result = ERROR_UNKNOWN;
+    }
+
+    if (result == ERROR_SUCCESS && from_manifest) {
+        result = manifest_load(config->delta_from, &old_all);
+        if (result == ERROR_SUCCESS) {
+            result = split_manifest(&old_all, 1, &old_boot);
+        }
+    } else if (result == ERROR_SUCCESS) {
+        if (attach_image(config->delta_from, state.old_loop, sizeof(state.old_loop)) != 0) {
+            LOG_ERROR("Failed to attach the previous image");
+            result = ERROR_UNKNOWN;
+        }
+
+        snprintf(path, sizeof(path), "%s/old-boot", state.work_dir);
+        if (result == ERROR_SUCCESS && !(state.old_boot_mounted = mount_readonly(state.old_loop, 2, path) == 0)) {
+            result = ERROR_UNKNOWN;
+        }
+        if (result == ERROR_SUCCESS) {
+            result = manifest_build(path, NULL, &old_boot);
+        }
+
+        if (result == ERROR_SUCCESS && !readonly_root) {
+            snprintf(path, sizeof(path), "%s/old-root", state.work_dir);
+            if (!(state.old_root_mounted = mount_readonly(state.old_loop, 3, path) == 0)) {
+                LOG_ERROR("Failed to mount the previous root filesystem");
+                result = ERROR_UNKNOWN;
+            } else {
+                result = manifest_build(path, NULL, &old_all);
+            }
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/new-boot", state.work_dir);
+    if (result == ERROR_SUCCESS) {
+        result = manifest_build(path, NULL, &new_boot);
+    }
+    normalize_boot_manifest(&old_boot);
+    normalize_boot_manifest(&new_boot);
+
+    snprintf(path, sizeof(path), "%s/delta-info", state.pkg_dir);
+    FILE *info = fopen(path, "w");
+    if (!info) {
+        result = ERROR_FILE_NOT_FOUND;
+    }
+
+    base_name(config->delta_from, from_name, sizeof(from_name));
+    base_name(image_path, to_name, sizeof(to_name));
+    if (result == ERROR_SUCCESS) {
+        fprintf(info, "# Orange Pi 5 Plus delta update\n");
+        fprintf(info, "FORMAT=\"1\"\n");
+        fprintf(info, "MODE=\"%s\"\n", readonly_root ? "block" : "file");
+        fprintf(info, "FROM_IMAGE=\"%s\"\n", from_name);
+        fprintf(info, "TO_IMAGE=\"%s\"\n", to_name);
+
+        char old_dir[MAX_PATH_LEN], new_dir[MAX_PATH_LEN];
+        snprintf(old_dir, sizeof(old_dir), "%s/old-boot", state.work_dir);
+        snprintf(new_dir, sizeof(new_dir), "%s/new-boot", state.work_dir);
+        result = write_file_delta("boot", &old_boot, &new_boot, from_manifest ? NULL : old_dir,
+                                  new_dir, state.pkg_dir, 0, &patched_count);
+    }
+
+    if (result == ERROR_SUCCESS && readonly_root) {
+        char old_dev[48], new_dev[48];
+
+        if (read_partition_geometry(state.old_loop, 3, old_geometry, sizeof(old_geometry)) != 0 ||
+            read_partition_geometry(state.new_loop, 3, new_geometry, sizeof(new_geometry)) != 0 ||
+            strcmp(old_geometry, new_geometry) != 0) {
+            LOG_ERROR("Partition layout changed, a full image is required");
+            result = ERROR_UNKNOWN;
+        } else {
+            snprintf(old_dev, sizeof(old_dev), "%sp3", state.old_loop);
+            snprintf(new_dev, sizeof(new_dev), "%sp3", state.new_loop);
+            result = write_block_delta(old_dev, new_dev, state.pkg_dir, info);
+        }
+    } else if (result == ERROR_SUCCESS) {
+        result = manifest_build(rootfs_dir, &old_all, &new_all);
+        if (result == ERROR_SUCCESS) {
+            result = split_manifest(&old_all, 0, &old_root);
+        }
+        if (result == ERROR_SUCCESS) {
+            result = split_manifest(&new_all, 0, &new_root);
+        }
+        if (result == ERROR_SUCCESS) {
+            snprintf(path, sizeof(path), "%s/old-root", state.work_dir);
+            result = write_file_delta("root", &old_root, &new_root, from_manifest ? NULL : path,
+                                      rootfs_dir, state.pkg_dir, 1, &patched_count);
+        }
+    }
+
+    if (info) {
+        fclose(info);
+    }
+    manifest_free(&old_all);
+    manifest_free(&new_all);
+    manifest_free(&old_boot);
+    manifest_free(&new_boot);
+    manifest_free(&old_root);
+    manifest_free(&new_root);
+    release_delta_state(&state);
+
+    if (result != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to build delta update package");
+        return result;
+    }
+
+    snprintf(path, sizeof(path), "%s/apply-delta", state.pkg_dir);
+    FILE *applier = fopen(path, "w");
+    if (!applier) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    fputs(delta_applier_script, applier);
+    fclose(applier);
+    chmod(path, 0755);
+
+    // Members are already compressed; the outer tar only bundles them
+    snprintf(package, sizeof(package), "%.*s.delta.tar",
+             (int)(strlen(image_path) - (strstr(image_path, ".img") ? 4 : 0)), image_path);
+    snprintf(cmd, sizeof(cmd), "tar -C %s -cf %s .", state.pkg_dir, package);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to write delta package");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    snprintf(msg, sizeof(msg), "Delta package: %s (%lld MB, %llu files patched)",
+             package, (long long)(file_size(package) / (1024 * 1024)), (unsigned long long)patched_count);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
@@ -0,0 +1,137 @@
+/*
+ * distcc.c - Distributed compilation for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the distcc wiring for the kernel, U-Boot and the
+ * components built from source. config->distcc_hosts uses DISTCC_HOSTS
+ * syntax (host/slots,options ...) and is exported as is. Compile jobs are
+ * raised to the slot count the hosts offer, and pump mode (preprocessing on
+ * the remote side too) is used when every host accepts it (",cpp").
+ */
+
+#include "../builder.h"
+
+// distcc runs the compiler by the name it is given on every farm host, so it always
+// gets the target triple; on arm64 Ubuntu that name is the native gcc
+#define DISTCC_TARGET_PREFIX "aarch64-linux-gnu-"
+
+// distcc's own defaults for a host without a /LIMIT
+#define DISTCC_LOCAL_SLOTS 2
+#define DISTCC_REMOTE_SLOTS 4
+
+// Total compile slots a DISTCC_HOSTS list offers
+int distcc_slots(const char *hosts) {
+    char list[512];
+    char *saveptr = NULL;
+    int slots = 0;
+
+    snprintf(list, sizeof(list), "%s", hosts);
+    for (char *host = strtok_r(list, " \t", &saveptr); host; host = strtok_r(NULL, " \t", &saveptr)) {
+        // Options such as --randomize and +zeroconf are not hosts
+        if (host[0] == '-' || host[0] == '+') {
+            continue;
+        }
+        char *limit = strchr(host, '/');
+        if (limit && atoi(limit + 1) > 0) {
+            slots += atoi(limit + 1);
+        } else {
+            host[strcspn(host, ":,")] = '\0';
+            slots += strcmp(host, "localhost") == 0 ? DISTCC_LOCAL_SLOTS : DISTCC_REMOTE_SLOTS;
+        }
+    }
+    return slots;
+}
+
+// Pump mode needs every host to preprocess remotely
+static int distcc_all_cpp(const char *hosts) {
+    char list[512];
+    char *saveptr = NULL;
+    int count = 0;
+
+    snprintf(list, sizeof(list), "%s", hosts);
+    for (char *host = strtok_r(list, " \t", &saveptr); host; host = strtok_r(NULL, " \t", &saveptr)) {
+        if (host[0] == '-' || host[0] == '+') {
+            continue;
+        }
+        if (!strstr(host, ",cpp")) {
+            return 0;
+        }
+        count++;
+    }
+    return count > 0;
+}
+
+// Export the host list and size compile jobs; distcc stays off if it is missing
+int distcc_setup(build_config_t *config) {
+    char msg[512];
+    error_context_t error_ctx = {0};
+
+    config->compile_jobs = config->jobs;
+    config->distcc_pump = 0;
+    if (!config->distcc_hosts[0]) {
+        return ERROR_SUCCESS;
+    }
+
+    if (execute_command_safe("command -v distcc", 0, &error_ctx) != 0) {
+        LOG_WARNING("distcc is not installed, compiling locally");
+        config->distcc_hosts[0] = '\0';
+        return ERROR_DEPENDENCY_MISSING;
+    }
+    if (setenv("DISTCC_HOSTS", config->distcc_hosts, 1) != 0) {
+        LOG_WARNING("Failed to set DISTCC_HOSTS, compiling locally");
+        config->distcc_hosts[0] = '\0';
+        return ERROR_UNKNOWN;
+    }
+
+    int slots = distcc_slots(config->distcc_hosts);
+    if (slots > config->compile_jobs) {
+        config->compile_jobs = slots;
+    }
+    config->distcc_pump = distcc_all_cpp(config->distcc_hosts) &&
+                          execute_command_safe("command -v pump", 0, &error_ctx) == 0;
+
+    snprintf(msg, sizeof(msg), "distcc: %d slots, compiling with -j%d%s", slots, config->compile_jobs,
+             config->distcc_pump ? " in pump mode" : "");
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
+
+// make with the compile job count, through ccache and/or distcc when they are set up
+void get_compile_make(build_config_t *config, char *make, size_t size) {
+    int jobs = config->compile_jobs > 0 ? config->compile_jobs : config->jobs;
+    const char *prefix = config->distcc_hosts[0] ? DISTCC_TARGET_PREFIX : config->cross_compile;
+
+    if (config->use_ccache) {
+        // ccache hands misses to distcc itself (CCACHE_PREFIX)
+        snprintf(make, size, "make -j%d CC='ccache %sgcc'", jobs, prefix);
+        if (config->distcc_hosts[0]) {
+            stage_timer_remote("distcc");
+        }
+    } else if (config->distcc_hosts[0]) {
+        snprintf(make, size, "%smake -j%d CC='distcc %sgcc'",
+                 config->distcc_pump ? "pump " : "", jobs, prefix);
+        stage_timer_remote("distcc");
+    } else {
+        snprintf(make, size, "make -j%d", jobs);
+    }
+}
+
+// cmake arguments that send a component's compiles through ccache or distcc
+void get_cmake_launcher(build_config_t *config, char *args, size_t size) {
+    // cmake would otherwise hand distcc the host's c++, which farm hosts resolve to their own
+    const char *compilers = config->distcc_hosts[0]
+        ? " -DCMAKE_C_COMPILER=" DISTCC_TARGET_PREFIX "gcc -DCMAKE_CXX_COMPILER=" DISTCC_TARGET_PREFIX "g++"
+        : "";
+
+    if (config->use_ccache) {
+        snprintf(args, size, "-DCMAKE_C_COMPILER_LAUNCHER=ccache -DCMAKE_CXX_COMPILER_LAUNCHER=ccache%s", compilers);
+        if (config->distcc_hosts[0]) {
+            stage_timer_remote("distcc");
+        }
+    } else if (config->distcc_hosts[0]) {
+        snprintf(args, size, "-DCMAKE_C_COMPILER_LAUNCHER=distcc -DCMAKE_CXX_COMPILER_LAUNCHER=distcc%s", compilers);
+        stage_timer_remote("distcc");
+    } else {
+        args[0] = '\0';
+    }
+}
@@ -0,0 +1,937 @@
+/*
+ * filesystem.c - Root filesystem formats for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the root filesystem format table and the functions that
+ * derive everything format-specific from it: mkfs and mount options for the
+ * writable formats, the compressed read-only root image and the overlay
+ * assembled in the initramfs, fstab, the kernel command line and the kernel
+ * config options each format needs.
+ */
+
+#include "../builder.h"
+
+// Root filesystem formats
+static const rootfs_format_info_t rootfs_formats[] = {
+    {ROOTFS_FORMAT_EXT4, "ext4", "ext4", 0, "mkfs.ext4",
+     "mkfs.ext4 -F -L rootfs%s %s", "defaults", 1, NULL,
+     {"CONFIG_EXT4_FS=y", NULL}},
+    {ROOTFS_FORMAT_EROFS, "erofs", "erofs", 1, "mkfs.erofs",
+     NULL, "ro", 0, NULL,
+     {"CONFIG_EROFS_FS=y", "CONFIG_EROFS_FS_ZIP=y", "CONFIG_OVERLAY_FS=y", NULL}},
+    {ROOTFS_FORMAT_SQUASHFS, "squashfs", "squashfs", 1, "mksquashfs",
+     NULL, "ro", 0, NULL,
+     {"CONFIG_SQUASHFS=y", "CONFIG_SQUASHFS_LZ4=y", "CONFIG_SQUASHFS_ZSTD=y",
+      "CONFIG_SQUASHFS_FILE_DIRECT=y", "CONFIG_SQUASHFS_DECOMP_MULTI_PERCPU=y",
+      "CONFIG_OVERLAY_FS=y", NULL}},
+    // Transparent zstd keeps the image small; level 1 is cheap enough for SD cards
+    {ROOTFS_FORMAT_BTRFS, "btrfs", "btrfs", 0, "mkfs.btrfs",
+     "mkfs.btrfs -f -L rootfs -m single -d single%s %s", "compress=zstd:1,ssd,space_cache=v2", 0,
+     "btrfs-progs",
+     {"CONFIG_BTRFS_FS=y", "CONFIG_BTRFS_FS_POSIX_ACL=y", "CONFIG_ZSTD_COMPRESS=y",
+      "CONFIG_ZSTD_DECOMPRESS=y", "CONFIG_LIBCRC32C=y", NULL}},
+    // Log-structured writes suit the FTL on SD/eMMC
+    {ROOTFS_FORMAT_F2FS, "f2fs", "f2fs", 0, "mkfs.f2fs",
+     "mkfs.f2fs -f -l rootfs -O extra_attr,inode_checksum,sb_checksum%s %s",
+     "background_gc=on,discard", 1, "f2fs-tools",
+     {"CONFIG_F2FS_FS=y", "CONFIG_F2FS_FS_XATTR=y", "CONFIG_F2FS_FS_POSIX_ACL=y",
+      "CONFIG_F2FS_FS_SECURITY=y", "CONFIG_F2FS_CHECK_FS=y", NULL}},
+    {-1, NULL, NULL, 0, NULL, NULL, NULL, 0, NULL, {NULL}}  // Sentinel
+};
+
+// Filesystem tuning profiles; inode tables and the journal are always
+// initialized at build time so the first boot does not run lazy init
+static const fs_tuning_profile_t fs_tuning_profiles[] = {
+    // Small journal, long commit interval and lazytime keep SD write amplification down
+    {"sd", "SD card: few, large writes", 16, 1, 60, "ordered", "noatime,lazytime", "defaults,noatime"},
+    {"emmc", "eMMC: balanced durability and write load", 32, 2, 30, "ordered", "noatime,lazytime", "defaults,noatime"},
+    {"nvme", "NVMe: default durability, large journal", 128, 2, 5, "ordered", "noatime", "defaults,noatime"},
+    // Read-mostly appliances: almost nothing to journal, no reserve needed
+    {"kiosk", "Read-mostly kiosk: minimal journal traffic", 8, 0, 300, "writeback", "noatime,lazytime", "defaults,noatime"},
+    {NULL, NULL, 0, 0, 0, NULL, NULL, NULL}  // Sentinel
+};
+
+// Look up the table entry for a format
+const rootfs_format_info_t* get_rootfs_format_info(rootfs_format_t format) {
+    for (int i = 0; rootfs_formats[i].name != NULL; i++) {
+        if ((int)rootfs_formats[i].format == (int)format) {
+            return &rootfs_formats[i];
+        }
+    }
+    return &rootfs_formats[0];
+}
+
+// Parse a format name from the command line or menu
+int parse_rootfs_format(const char *name, rootfs_format_t *format) {
+    if (!name || !format) {
+        return -1;
+    }
+
+    for (int i = 0; rootfs_formats[i].name != NULL; i++) {
+        if (strcmp(rootfs_formats[i].name, name) == 0) {
+            *format = rootfs_formats[i].format;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char* rootfs_format_name(rootfs_format_t format) {
+    return get_rootfs_format_info(format)->name;
+}
+
+// Check whether the root is a compressed read-only image with an overlay
+int rootfs_format_is_readonly(build_config_t *config) {
+    return config && get_rootfs_format_info(config->rootfs_format)->readonly;
+}
+
+// Check whether the writable overlay lives on its own partition
+int overlay_uses_partition(build_config_t *config) {
+    return rootfs_format_is_readonly(config) && config->overlay_type == OVERLAY_PARTITION;
+}
+
+// Path of the compressed root image built from the staged rootfs
+void get_readonly_root_image_path(build_config_t *config, char *path, size_t size) {
+    snprintf(path, size, "%s/rootfs.%s", config->output_dir, rootfs_format_name(config->rootfs_format));
+}
+
+// Whether the cloned kernel's fs/erofs/<file> mentions text; no tree means no support.
+// The 5.10 BSP kernel predates every optional EROFS on-disk feature.
+static int kernel_erofs_has(build_config_t *config, const char *file, const char *text) {
+    char path[MAX_PATH_LEN];
+    char line[256];
+    int found = 0;
+
+    snprintf(path, sizeof(path), "%s/linux/fs/erofs/%s", config->build_dir, file);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    while (!found && fgets(line, sizeof(line), fp)) {
+        found = strstr(line, text) != NULL;
+    }
+    fclose(fp);
+    return found;
+}
+
+// EROFS zstd arrived in Linux 6.10
+static int kernel_supports_erofs_zstd(build_config_t *config) {
+    return kernel_erofs_has(config, "Kconfig", "config EROFS_FS_ZIP_ZSTD");
+}
+
+// Compressor for mkfs.erofs: lz4hc unless zstd was asked for and the kernel can read it
+static const char* erofs_compressor(build_config_t *config) {
+    if (strcmp(config->rootfs_compression, "zstd") == 0) {
+        if (kernel_supports_erofs_zstd(config)) {
+            return "zstd";
+        }
+        LOG_WARNING("Kernel has no EROFS zstd support, compressing the root image with lz4hc");
+    }
+    return "lz4hc,12";
+}
+
+// mkfs.erofs layout options the kernel can mount: big pclusters (5.13),
+// ztailpacking (5.17) and fragments (6.1) each need newer on-disk support
+static void erofs_feature_options(build_config_t *config, char *options, size_t size) {
+    int ztailpacking = kernel_erofs_has(config, "erofs_fs.h", "EROFS_FEATURE_INCOMPAT_ZTAILPACKING");
+    int fragments = kernel_erofs_has(config, "erofs_fs.h", "EROFS_FEATURE_INCOMPAT_FRAGMENTS");
+
+    options[0] = '\0';
+    if (ztailpacking || fragments) {
+        snprintf(options, size, " -E%s%s%s", ztailpacking ? "ztailpacking" : "",
+                 ztailpacking && fragments ? "," : "", fragments ? "fragments" : "");
+    }
+    if (kernel_erofs_has(config, "erofs_fs.h", "EROFS_FEATURE_INCOMPAT_BIG_PCLUSTER")) {
+        size_t len = strlen(options);
+        snprintf(options + len, size - len, " -C65536");
+    }
+}
+
+// The primary or an extra image boots from NVMe
+static int nvme_root_possible(build_config_t *config) {
+    return strcmp(config->target_medium, "nvme") == 0 || output_target_enabled(config, "nvme");
+}
+
+// Append the kernel options the selected root format needs to .config
+int append_rootfs_kernel_options(build_config_t *config, FILE *kconfig) {
+    const rootfs_format_info_t *info = get_rootfs_format_info(config->rootfs_format);
+
+    if (!kconfig) {
+        return ERROR_KERNEL_CONFIG_FAILED;
+    }
+
+    for (int i = 0; info->kernel_options[i] != NULL; i++) {
+        fprintf(kconfig, "%s\n", info->kernel_options[i]);
+    }
+    if (config->rootfs_format == ROOTFS_FORMAT_EROFS && strcmp(config->rootfs_compression, "zstd") == 0 &&
+        kernel_supports_erofs_zstd(config)) {
+        fprintf(kconfig, "CONFIG_EROFS_FS_ZIP_ZSTD=y\n");
+    }
+    if (info->readonly && config->dm_verity) {
+        fprintf(kconfig, "CONFIG_MD=y\nCONFIG_BLK_DEV_DM=y\nCONFIG_DM_VERITY=y\n");
+    }
+    // An NVMe root must be reachable before any module can load: PCIe 3 PHY, host and driver built in.
+    // The DesignWare host is PCIE_DW_ROCKCHIP in the 5.10 BSP and PCIE_ROCKCHIP_DW_HOST in mainline.
+    if (nvme_root_possible(config)) {
+        fprintf(kconfig, "CONFIG_PCI=y\nCONFIG_PCIE_DW_ROCKCHIP=y\nCONFIG_PCIE_ROCKCHIP_DW_HOST=y\n"
+                         "CONFIG_PHY_ROCKCHIP_SNPS_PCIE3=y\nCONFIG_NVME_CORE=y\nCONFIG_BLK_DEV_NVME=y\n");
+    }
+    return ERROR_SUCCESS;
+}
+
+// After olddefconfig: unknown symbols are dropped silently, so confirm the NVMe root path survived
+int check_rootfs_kernel_options(build_config_t *config, const char *config_path) {
+    static const char *const required[] = {"CONFIG_PHY_ROCKCHIP_SNPS_PCIE3=y", "CONFIG_BLK_DEV_NVME=y", NULL};
+    char line[256];
+    char msg[256];
+    int host = 0, found[2] = {0, 0};
+
+    if (!nvme_root_possible(config)) {
+        return ERROR_SUCCESS;
+    }
+
+    FILE *fp = fopen(config_path, "r");
+    if (!fp) {
+        return ERROR_KERNEL_CONFIG_FAILED;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        host |= strcmp(line, "CONFIG_PCIE_DW_ROCKCHIP=y") == 0 || strcmp(line, "CONFIG_PCIE_ROCKCHIP_DW_HOST=y") == 0;
+        for (int i = 0; required[i]; i++) {
+            found[i] |= strcmp(line, required[i]) == 0;
+        }
+    }
+    fclose(fp);
+
+    if (!host) {
+        LOG_ERROR("Kernel config has no built-in Rockchip PCIe host; an NVMe root would not mount");
+        return ERROR_KERNEL_CONFIG_FAILED;
+    }
+    for (int i = 0; required[i]; i++) {
+        if (!found[i]) {
+            snprintf(msg, sizeof(msg), "Kernel config lacks %s; an NVMe root would not mount", required[i]);
+            LOG_ERROR(msg);
+            return ERROR_KERNEL_CONFIG_FAILED;
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+// Block device of partition N on the target medium, as the board names it
+void get_root_device(build_config_t *config, int partition, char *device, size_t size) {
+    if (strcmp(config->target_medium, "nvme") == 0) {
+        snprintf(device, size, "/dev/nvme0n1p%d", partition);
+    } else {
+        snprintf(device, size, "/dev/mmcblk0p%d", partition);
+    }
+}
+
+// dm-verity parameters recorded next to the read-only root image by build_readonly_root_image()
+int read_verity_params(build_config_t *config, char *root_hash, size_t size,
+                       unsigned long long *data_blocks, unsigned long long *hash_offset) {
+    char path[MAX_PATH_LEN];
+    char line[256];
+    int found = 0;
+
+    get_readonly_root_image_path(config, path, sizeof(path));
+    strncat(path, ".verity", sizeof(path) - strlen(path) - 1);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char value[128];
+        if (sscanf(line, "ROOT_HASH=%127s", value) == 1) {
+            snprintf(root_hash, size, "%s", value);
+            found |= 1;
+        } else if (sscanf(line, "DATA_BLOCKS=%llu", data_blocks) == 1) {
+            found |= 2;
+        } else if (sscanf(line, "HASH_OFFSET=%llu", hash_offset) == 1) {
+            found |= 4;
+        }
+    }
+    fclose(fp);
+
+    return found == 7 ? ERROR_SUCCESS : ERROR_FILE_NOT_FOUND;
+}
+
+// Tuning profile in use: the configured one, or the one matching the target medium
+const fs_tuning_profile_t* get_fs_tuning_profile(build_config_t *config) {
+    const char *name = config->fs_profile[0] ? config->fs_profile : config->target_medium;
+
+    for (int i = 0; fs_tuning_profiles[i].name != NULL; i++) {
+        if (strcmp(fs_tuning_profiles[i].name, name) == 0) {
+            return &fs_tuning_profiles[i];
+        }
+    }
+    return &fs_tuning_profiles[0];
+}
+
+int fs_tuning_profile_exists(const char *name) {
+    for (int i = 0; fs_tuning_profiles[i].name != NULL; i++) {
+        if (strcmp(fs_tuning_profiles[i].name, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Filesystem-specific root options only: the kernel hands rootflags= to the
+// filesystem's own parser, which rejects VFS flags such as noatime with EINVAL
+void get_root_fs_options(build_config_t *config, char *options, size_t size) {
+    const rootfs_format_info_t *info = get_rootfs_format_info(config->rootfs_format);
+    const fs_tuning_profile_t *profile = get_fs_tuning_profile(config);
+
+    if (info->readonly) {
+        snprintf(options, size, "%s", info->mount_options);
+    } else if (config->rootfs_format == ROOTFS_FORMAT_EXT4) {
+        // data= cannot change on remount, so it must also be in rootflags=
+        snprintf(options, size, "commit=%d,errors=remount-ro,data=%s",
+                 profile->commit_interval, profile->journal_mode);
+    } else if (config->rootfs_format == ROOTFS_FORMAT_BTRFS) {
+        snprintf(options, size, "%s,commit=%d", info->mount_options, profile->commit_interval);
+    } else {
+        snprintf(options, size, "%s", info->mount_options);
+    }
+}
+
+// Root mount options for fstab and mount(8): the filesystem options plus the profile's atime flags
+void get_root_mount_options(build_config_t *config, char *options, size_t size) {
+    const rootfs_format_info_t *info = get_rootfs_format_info(config->rootfs_format);
+    const fs_tuning_profile_t *profile = get_fs_tuning_profile(config);
+    char fs_options[192];
+
+    get_root_fs_options(config, fs_options, sizeof(fs_options));
+    if (info->readonly) {
+        snprintf(options, size, "%s", fs_options);
+    } else {
+        snprintf(options, size, "%s,%s", profile->atime_options, fs_options);
+    }
+}
+
+// mkfs.ext4 options for the tuning profile and erase-block geometry
+void build_ext4_mkfs_options(build_config_t *config, const char *label, char *options, size_t size) {
+    const fs_tuning_profile_t *profile = get_fs_tuning_profile(config);
+    partition_layout_t layout;
+    unsigned stride = 1, stripe_width = 1;
+    char uuid[40] = "";
+    char seed[40] = "";
+
+    if (init_image_layout(config, &layout) == ERROR_SUCCESS) {
+        layout_ext4_geometry(&layout, 4096, &stride, &stripe_width);
+    }
+
+    // Reproducible builds derive the filesystem UUID and directory hash seed from the build inputs
+    if (config->reproducible) {
+        char name[64];
+        snprintf(name, sizeof(name), "ext4-%s", label);
+        get_build_uuid(config, name, uuid, sizeof(uuid));
+        snprintf(name, sizeof(name), "ext4-hash-%s", label);
+        get_build_uuid(config, name, seed, sizeof(seed));
+    }
+
+    snprintf(options, size,
+             " -b 4096 -J size=%d -m %d -E stride=%u,stripe_width=%u,lazy_itable_init=0,lazy_journal_init=0%s%s%s%s",
+             profile->journal_size_mb, profile->reserved_percent, stride, stripe_width,
+             seed[0] ? ",hash_seed=" : "", seed, uuid[0] ? " -U " : "", uuid);
+}
+
+// Kernel command line arguments that locate and mount the root filesystem
+void build_root_cmdline(build_config_t *config, char *cmdline, size_t size) {
+    const rootfs_format_info_t *info = get_rootfs_format_info(config->rootfs_format);
+    char device[64];
+
+    get_root_device(config, 3, device, sizeof(device));
+
+    if (!info->readonly) {
+        char options[256];
+        get_root_fs_options(config, options, sizeof(options));
+        snprintf(cmdline, size, "root=%s rootfstype=%s rootflags=%s rw rootwait",
+                 device, info->fstype, options);
+    } else {
+        char root_hash[128];
+        char root[256];
+        unsigned long long data_blocks, hash_offset;
+
+        // The initramfs opens /dev/mapper/vroot; a root that fails verification never mounts
+        if (config->dm_verity &&
+            read_verity_params(config, root_hash, sizeof(root_hash), &data_blocks, &hash_offset) == ERROR_SUCCESS) {
+            snprintf(root, sizeof(root), "root=/dev/mapper/vroot orangepi.verity=%s:%llu:%llu:%s",
+                     device, data_blocks, hash_offset, root_hash);
+        } else {
+            snprintf(root, sizeof(root), "root=%s", device);
+        }
+
+        char boot[64];
+        get_root_device(config, 2, boot, sizeof(boot));
+        snprintf(cmdline, size, "%s rootfstype=%s ro rootwait fsck.mode=skip orangepi.overlay=%s orangepi.boot=%s",
+                 root, info->fstype, config->overlay_type == OVERLAY_TMPFS ? "tmpfs" : "PARTLABEL=overlay", boot);
+    }
+
+    // APST power-state exits add millisecond latency spikes, and some drives drop
+    // off the RK3588 PCIe bus entering deep states; a root drive stays in PS0
+    if (strcmp(config->target_medium, "nvme") == 0) {
+        strncat(cmdline, " nvme_core.default_ps_max_latency_us=0", size - strlen(cmdline) - 1);
+    }
+}
+
+// Write /etc/fstab for the selected root format
+int write_fstab(build_config_t *config, const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char options[256];
+    const rootfs_format_info_t *info = get_rootfs_format_info(config->rootfs_format);
+    const fs_tuning_profile_t *profile = get_fs_tuning_profile(config);
+    char root_device[64], boot_device[64];
+
+    get_root_mount_options(config, options, sizeof(options));
+    get_root_device(config, 3, root_device, sizeof(root_device));
+    get_root_device(config, 2, boot_device, sizeof(boot_device));
+
+    snprintf(path, sizeof(path), "%s/etc/fstab", rootfs_dir);
+    FILE *fstab = fopen(path, "w");
+    if (!fstab) {
+        LOG_ERROR("Failed to write fstab");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    fprintf(fstab, "# /etc/fstab: static file system information\n");
+    fprintf(fstab, "# Tuning profile: %s (%s)\n", profile->name, profile->description);
+    if (info->readonly) {
+        // The initramfs assembles the overlay; listing / here would make
+        // systemd-remount-fs try to remount the compressed image
+        fprintf(fstab, "# / is a read-only %s image with a %s overlay (see /run/overlay)\n",
+                info->name, config->overlay_type == OVERLAY_TMPFS ? "tmpfs" : "persistent");
+        fprintf(fstab, "# Installed from /boot/orangepi/etc by the initramfs for the %s medium\n",
+                config->target_medium);
+    } else {
+        fprintf(fstab, "%s  /       %s    %s        0 %d\n",
+                root_device, info->fstype, options, info->fsck_pass);
+    }
+    fprintf(fstab, "%s  /boot   vfat    %s        0 2\n", boot_device, profile->boot_mount_options);
+    fclose(fstab);
+
+    return ERROR_SUCCESS;
+}
+
+// Create the root filesystem on a writable-format partition
+int format_root_partition(build_config_t *config, const char *device) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    const rootfs_format_info_t *info = get_rootfs_format_info(config->rootfs_format);
+
+    if (info->readonly || !info->mkfs_command) {
+        LOG_ERROR("Root format has no writable partition to create");
+        return ERROR_UNKNOWN;
+    }
+
+    // Match the filesystem's allocation units to the partition alignment
+    partition_layout_t layout;
+    char geometry[MAX_PATH_LEN + 256] = "";
+    if (config->rootfs_format == ROOTFS_FORMAT_EXT4) {
+        build_ext4_mkfs_options(config, "rootfs", geometry, sizeof(geometry));
+        // Populated by mke2fs in sorted order instead of through a mount
+        if (config->reproducible) {
+            size_t len = strlen(geometry);
+            snprintf(geometry + len, sizeof(geometry) - len, " -d %s/rootfs", config->output_dir);
+        }
+    } else if (config->rootfs_format == ROOTFS_FORMAT_F2FS &&
+               init_image_layout(config, &layout) == ERROR_SUCCESS) {
+        // f2fs segments are 2 MiB; one section per erase block
+        unsigned long long segments = layout.erase_block_bytes / (2 * 1024 * 1024);
+        snprintf(geometry, sizeof(geometry), " -s %llu", segments ? segments : 1);
+    }
+
+    snprintf(cmd, sizeof(cmd), info->mkfs_command, geometry, device);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to create root filesystem");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // Put the system in its own subvolume so it can be snapshotted and rolled back;
+    // making it the default keeps root=/dev/mmcblk0p3 working without subvol=
+    if (config->rootfs_format == ROOTFS_FORMAT_BTRFS) {
+        snprintf(cmd, sizeof(cmd),
+                 "mkdir -p /mnt/btrfs-top && mount %s /mnt/btrfs-top && "
+                 "btrfs subvolume create /mnt/btrfs-top/@ && "
+                 "btrfs subvolume create /mnt/btrfs-top/@snapshots && "
+                 "btrfs subvolume set-default /mnt/btrfs-top/@ && "
+                 "umount /mnt/btrfs-top",
+                 device);
+        if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+            LOG_ERROR("Failed to create btrfs subvolumes");
+            return ERROR_INSTALLATION_FAILED;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Mount the root partition with its runtime options so copied files are compressed
+int mount_root_partition(build_config_t *config, const char *device, const char *mount_point) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    char options[256];
+    const rootfs_format_info_t *info = get_rootfs_format_info(config->rootfs_format);
+
+    get_root_mount_options(config, options, sizeof(options));
+    snprintf(cmd, sizeof(cmd), "mount -t %s -o %s %s %s",
+             info->fstype, options, device, mount_point);
+    return execute_command_safe(cmd, 1, &error_ctx);
+}
+
+// Build the compressed read-only root image from the staged rootfs
+int build_readonly_root_image(build_config_t *config, const char *rootfs_dir, long *image_mb) {
+    char cmd[MAX_CMD_LEN];
+    char image_path[MAX_PATH_LEN];
+    error_context_t error_ctx = {0};
+    struct stat st;
+
+    get_readonly_root_image_path(config, image_path, sizeof(image_path));
+    unlink(image_path);
+    snprintf(cmd, sizeof(cmd), "%s.verity", image_path);
+    unlink(cmd);
+
+    if (config->rootfs_format == ROOTFS_FORMAT_EROFS) {
+        LOG_INFO("Building compressed EROFS root image...");
+        // lz4hc decompresses as fast as lz4 but packs tighter; zstd trades CPU for size
+        char fixed[128] = "";
+        if (config->reproducible) {
+            char uuid[40];
+            get_build_uuid(config, "erofs-rootfs", uuid, sizeof(uuid));
+            snprintf(fixed, sizeof(fixed), " -T %lld -U %s", config->source_date_epoch, uuid);
+        }
+        char features[64];
+        erofs_feature_options(config, features, sizeof(features));
+        snprintf(cmd, sizeof(cmd),
+                 "mkfs.erofs -z%s%s%s %s %s",
+                 erofs_compressor(config), features, fixed, image_path, rootfs_dir);
+    } else {
+        LOG_INFO("Building compressed squashfs root image...");
+        snprintf(cmd, sizeof(cmd),
+                 "mksquashfs %s %s -noappend -b 131072 -processors %d -comp %s%s",
+                 rootfs_dir, image_path, config->jobs,
+                 strcmp(config->rootfs_compression, "zstd") == 0 ? "zstd" : "lz4",
+                 strcmp(config->rootfs_compression, "zstd") == 0 ? " -Xcompression-level 19" : " -Xhc");
+    }
+
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to build read-only root image");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    if (stat(image_path, &st) != 0) {
+        LOG_ERROR("Read-only root image was not created");
+        return ERROR_FILE_NOT_FOUND;
+    }
+    
+    // Append the dm-verity hash tree to the image itself so the root partition carries it
+    if (config->dm_verity) {
+        unsigned long long data_bytes = ((unsigned long long)st.st_size + 4095) / 4096 * 4096;
+        char verity_path[MAX_PATH_LEN + 16];
+        char fixed[128] = "";
+
+        // veritysetup picks a random salt and UUID, which would change the root hash every build
+        if (config->reproducible) {
+            char uuid[40];
+            char salt[40];
+            int n = 0;
+
+            get_build_uuid(config, "verity-salt", salt, sizeof(salt));
+            for (char *c = salt; *c; c++) {
+                if (*c != '-') {
+                    salt[n++] = *c;
+                }
+            }
+            salt[n] = '\0';
+            get_build_uuid(config, "verity-uuid", uuid, sizeof(uuid));
+            snprintf(fixed, sizeof(fixed), " --salt=%s --uuid=%s", salt, uuid);
+        }
+
+        snprintf(verity_path, sizeof(verity_path), "%s.verity", image_path);
+        snprintf(cmd, sizeof(cmd),
+                 "truncate -s %llu %s && "
+                 "veritysetup format%s --data-blocks=%llu --hash-offset=%llu --root-hash-file=%s.roothash %s %s",
+                 data_bytes, image_path, fixed, data_bytes / 4096, data_bytes, image_path, image_path, image_path);
+        if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+            LOG_ERROR("Failed to generate dm-verity hash tree");
+            return ERROR_INSTALLATION_FAILED;
+        }
+
+        snprintf(cmd, sizeof(cmd),
+                 "{ echo ROOT_HASH=$(cat %s.roothash); echo DATA_BLOCKS=%llu; echo HASH_OFFSET=%llu; } > %s",
+                 image_path, data_bytes / 4096, data_bytes, verity_path);
+        if (execute_command_safe(cmd, 0, &error_ctx) != 0 || stat(image_path, &st) != 0) {
+            LOG_ERROR("Failed to record dm-verity parameters");
+            return ERROR_INSTALLATION_FAILED;
+        }
+    }
+
+    // Partition is the image size rounded up to a whole MB
+    *image_mb = (long)((st.st_size + (1024 * 1024) - 1) / (1024 * 1024));
+
+    char msg[512];
+    snprintf(msg, sizeof(msg), "Read-only root image: %s (%ld MB, %s)",
+             image_path, *image_mb, config->rootfs_compression);
+    LOG_INFO(msg);
+
+    return ERROR_SUCCESS;
+}
+
+// Install the initramfs hook and script that open the root image through dm-verity
+static int install_verity_root_support(const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    LOG_INFO("Installing dm-verity root support...");
+
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/etc/initramfs-tools/hooks %s/etc/initramfs-tools/scripts/local-top",
+             rootfs_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(path, sizeof(path), "%s/etc/initramfs-tools/hooks/orangepi-verity", rootfs_dir);
+    FILE *hook = fopen(path, "w");
+    if (!hook) {
+        LOG_ERROR("Failed to write dm-verity initramfs hook");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    fprintf(hook,
+            "#!/bin/sh\n"
+            "PREREQ=\"\"\n"
+            "prereqs() { echo \"$PREREQ\"; }\n"
+            "case \"$1\" in prereqs) prereqs; exit 0 ;; esac\n"
+            "\n"
+            ". /usr/share/initramfs-tools/hook-functions\n"
+            "copy_exec /usr/sbin/veritysetup /sbin\n"
+            "manual_add_modules dm_mod dm_verity\n");
+    fclose(hook);
+    chmod(path, 0755);
+
+    // local-top runs before the initramfs waits for root=/dev/mapper/vroot
+    snprintf(path, sizeof(path), "%s/etc/initramfs-tools/scripts/local-top/orangepi-verity", rootfs_dir);
+    FILE *script = fopen(path, "w");
+    if (!script) {
+        LOG_ERROR("Failed to write dm-verity initramfs script");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    fprintf(script,
+            "#!/bin/sh\n"
+            "PREREQ=\"orangepi-delta\"\n"
+            "prereqs() { echo \"$PREREQ\"; }\n"
+            "case \"$1\" in prereqs) prereqs; exit 0 ;; esac\n"
+            "\n"
+            ". /scripts/functions\n"
+            "\n"
+            "VERITY=\"\"\n"
+            "for arg in $(cat /proc/cmdline); do\n"
+            "    case \"$arg\" in orangepi.verity=*) VERITY=\"${arg#orangepi.verity=}\" ;; esac\n"
+            "done\n"
+            "[ -n \"$VERITY\" ] || exit 0\n"
+            "\n"
+            "# device:data_blocks:hash_offset:root_hash\n"
+            "IFS=: read -r DEV BLOCKS OFFSET HASH <<EOF\n"
+            "$VERITY\n"
+            "EOF\n"
+            "\n"
+            "tries=0\n"
+            "while [ ! -b \"$DEV\" ] && [ $tries -lt 30 ]; do\n"
+            "    sleep 1\n"
+            "    tries=$((tries + 1))\n"
+            "done\n"
+            "\n"
+            "modprobe dm_verity 2>/dev/null || true\n"
+            "veritysetup open \"$DEV\" vroot \"$DEV\" \"$HASH\" --data-blocks=\"$BLOCKS\" --hash-offset=\"$OFFSET\" ||\n"
+            "    panic \"dm-verity: root image $DEV does not match its root hash\"\n");
+    fclose(script);
+    chmod(path, 0755);
+
+    return ERROR_SUCCESS;
+}
+
+// Install the initramfs hook and script that write a root update staged by apply-delta
+static int install_delta_apply_support(const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/etc/initramfs-tools/hooks %s/etc/initramfs-tools/scripts/local-top",
+             rootfs_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(path, sizeof(path), "%s/etc/initramfs-tools/hooks/orangepi-delta", rootfs_dir);
+    FILE *hook = fopen(path, "w");
+    if (!hook) {
+        LOG_ERROR("Failed to write delta update initramfs hook");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    fprintf(hook,
+            "#!/bin/sh\n"
+            "PREREQ=\"\"\n"
+            "prereqs() { echo \"$PREREQ\"; }\n"
+            "case \"$1\" in prereqs) prereqs; exit 0 ;; esac\n"
+            "\n"
+            ". /usr/share/initramfs-tools/hook-functions\n"
+            "copy_exec /usr/bin/sha256sum /bin\n");
+    fclose(hook);
+    chmod(path, 0755);
+
+    // Runs before orangepi-verity opens the root, so nothing has the partition open yet
+    snprintf(path, sizeof(path), "%s/etc/initramfs-tools/scripts/local-top/orangepi-delta", rootfs_dir);
+    FILE *script = fopen(path, "w");
+    if (!script) {
+        LOG_ERROR("Failed to write delta update initramfs script");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    fprintf(script,
+            "#!/bin/sh\n"
+            "PREREQ=\"\"\n"
+            "prereqs() { echo \"$PREREQ\"; }\n"
+            "case \"$1\" in prereqs) prereqs; exit 0 ;; esac\n"
+            "\n"
+            ". /scripts/functions\n"
+            "\n"
+            "OVERLAY=\"\"\n"
+            "BOOT=\"\"\n"
+            "DEV=\"\"\n"
+            "VERITY_DEV=\"\"\n"
+            "for arg in $(cat /proc/cmdline); do\n"
+            "    case \"$arg\" in\n"
+            "        orangepi.overlay=*) OVERLAY=\"${arg#orangepi.overlay=}\" ;;\n"
+            "        orangepi.boot=*) BOOT=\"${arg#orangepi.boot=}\" ;;\n"
+            "        orangepi.verity=*) VERITY_DEV=\"${arg#orangepi.verity=}\"; VERITY_DEV=\"${VERITY_DEV%%%%:*}\" ;;\n"
+            "        root=/dev/*) DEV=\"${arg#root=}\" ;;\n"
+            "    esac\n"
+            "done\n"
+            "DEV=\"${VERITY_DEV:-$DEV}\"\n"
+            "[ -n \"$DEV\" ] && [ -n \"$BOOT$OVERLAY\" ] || exit 0\n"
+            "\n"
+            "tries=0\n"
+            "while [ ! -b \"$DEV\" ] && [ $tries -lt 30 ]; do\n"
+            "    sleep 1\n"
+            "    tries=$((tries + 1))\n"
+            "done\n"
+            "\n"
+            "# apply-delta stages on the persistent overlay partition, or on the boot partition\n"
+            "STAGE=\"\"\n"
+            "mkdir -p /run/delta\n"
+            "if [ -n \"$OVERLAY\" ] && [ \"$OVERLAY\" != tmpfs ] &&\n"
+            "   mount -t ext4 \"$(resolve_device \"$OVERLAY\")\" /run/delta 2>/dev/null; then\n"
+            "    [ -f /run/delta/delta/pending ] && STAGE=/run/delta/delta || umount /run/delta\n"
+            "fi\n"
+            "if [ -z \"$STAGE\" ] && [ -n \"$BOOT\" ] &&\n"
+            "   mount -t vfat \"$(resolve_device \"$BOOT\")\" /run/delta 2>/dev/null; then\n"
+            "    [ -f /run/delta/orangepi-delta/pending ] && STAGE=/run/delta/orangepi-delta || umount /run/delta\n"
+            "fi\n"
+            "[ -n \"$STAGE\" ] || exit 0\n"
+            "\n"
+            ". \"$STAGE/pending\"\n"
+            "digest() { sha256sum < \"$1\" | cut -d' ' -f1; }\n"
+            "\n"
+            "log_begin_msg \"Applying staged root update\"\n"
+            "CURRENT=$(digest \"$DEV\")\n"
+            "if [ \"$CURRENT\" != \"$ROOT_AFTER\" ]; then\n"
+            "    # A stage marked applying was interrupted; writing the same blocks again is safe\n"
+            "    if [ \"$CURRENT\" != \"$ROOT_BEFORE\" ] && [ ! -e \"$STAGE/applying\" ]; then\n"
+            "        log_failure_msg \"Staged root update does not start from this root, discarding it\"\n"
+            "        rm -rf \"$STAGE\"\n"
+            "        umount /run/delta\n"
+            "        exit 0\n"
+            "    fi\n"
+            "    touch \"$STAGE/applying\"\n"
+            "    sync\n"
+            "    OFFSET=0\n"
+            "    while read -r START COUNT; do\n"
+            "        dd if=\"$STAGE/root.blocks\" of=\"$DEV\" bs=65536 skip=\"$OFFSET\" seek=\"$START\" count=\"$COUNT\" \\\n"
+            "            conv=notrunc 2>/dev/null || panic \"Writing the staged root update failed; it is retried on the next boot\"\n"
+            "        OFFSET=$((OFFSET + COUNT))\n"
+            "    done < \"$STAGE/root.extents\"\n"
+            "    sync\n"
+            "    [ \"$(digest \"$DEV\")\" = \"$ROOT_AFTER\" ] ||\n"
+            "        panic \"Root partition does not verify after the staged update; it is retried on the next boot\"\n"
+            "fi\n"
+            "rm -rf \"$STAGE\"\n"
+            "sync\n"
+            "umount /run/delta\n"
+            "log_end_msg\n");
+    fclose(script);
+    chmod(path, 0755);
+
+    return ERROR_SUCCESS;
+}
+
+// Install the initramfs overlay script, factory reset tool and initramfs modules
+int install_overlay_root_support(build_config_t *config, const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    LOG_INFO("Installing read-only root overlay support...");
+
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/etc/initramfs-tools/scripts/init-bottom %s/usr/local/sbin",
+             rootfs_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    // Overlay assembly runs after the initramfs has mounted the read-only root
+    snprintf(path, sizeof(path), "%s/etc/initramfs-tools/scripts/init-bottom/orangepi-overlay", rootfs_dir);
+    FILE *script = fopen(path, "w");
+    if (!script) {
+        LOG_ERROR("Failed to write initramfs overlay script");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    fprintf(script,
+            "#!/bin/sh\n"
+            "PREREQ=\"\"\n"
+            "prereqs() { echo \"$PREREQ\"; }\n"
+            "case \"$1\" in prereqs) prereqs; exit 0 ;; esac\n"
+            "\n"
+            ". /scripts/functions\n"
+            "\n"
+            "OVERLAY=\"\"\n"
+            "BOOT=\"\"\n"
+            "for arg in $(cat /proc/cmdline); do\n"
+            "    case \"$arg\" in\n"
+            "        orangepi.overlay=*) OVERLAY=\"${arg#orangepi.overlay=}\" ;;\n"
+            "        orangepi.boot=*) BOOT=\"${arg#orangepi.boot=}\" ;;\n"
+            "    esac\n"
+            "done\n"
+            "[ -n \"$OVERLAY\" ] || exit 0\n"
+            "\n"
+            "modprobe overlay 2>/dev/null || true\n"
+            "mkdir -p /run/overlay/lower /run/overlay/rw\n"
+            "mount -n -o move \"$rootmnt\" /run/overlay/lower\n"
+            "\n"
+            "if [ \"$OVERLAY\" = tmpfs ]; then\n"
+            "    mount -t tmpfs -o mode=0755 tmpfs /run/overlay/rw\n"
+            "else\n"
+            "    DEV=$(resolve_device \"$OVERLAY\")\n"
+            "    if ! mount -t ext4 -o noatime \"$DEV\" /run/overlay/rw; then\n"
+            "        log_failure_msg \"Overlay partition $OVERLAY unavailable, using tmpfs\"\n"
+            "        mount -t tmpfs -o mode=0755 tmpfs /run/overlay/rw\n"
+            "    fi\n"
+            "fi\n"
+            "\n"
+            "# Factory reset: drop every change made on top of the read-only root\n"
+            "if [ -e /run/overlay/rw/factory-reset ]; then\n"
+            "    log_begin_msg \"Factory reset: wiping overlay\"\n"
+            "    rm -rf /run/overlay/rw/upper /run/overlay/rw/work /run/overlay/rw/factory-reset\n"
+            "    log_end_msg\n"
+            "fi\n"
+            "\n"
+            "mkdir -p /run/overlay/rw/upper /run/overlay/rw/work\n"
+            "mount -t overlay -o lowerdir=/run/overlay/lower,upperdir=/run/overlay/rw/upper,workdir=/run/overlay/rw/work \\\n"
+            "    overlay \"$rootmnt\"\n"
+            "\n"
+            "# The image is shared by every medium: take fstab and image info from this medium's\n"
+            "# boot partition, unless the overlay already holds a copy (possibly edited)\n"
+            "if [ -n \"$BOOT\" ] && mkdir -p /run/overlay/boot &&\n"
+            "   mount -t vfat -o ro \"$(resolve_device \"$BOOT\")\" /run/overlay/boot; then\n"
+            "    for f in /run/overlay/boot/orangepi/etc/*; do\n"
+            "        [ -f \"$f\" ] && [ ! -e \"/run/overlay/rw/upper/etc/${f##*/}\" ] && cp \"$f\" \"$rootmnt/etc/\"\n"
+            "    done\n"
+            "    umount /run/overlay/boot\n"
+            "fi\n");
+    fclose(script);
+    chmod(path, 0755);
+
+    snprintf(path, sizeof(path), "%s/usr/local/sbin/orangepi-factory-reset", rootfs_dir);
+    FILE *reset = fopen(path, "w");
+    if (!reset) {
+        LOG_ERROR("Failed to write factory reset tool");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    fprintf(reset,
+            "#!/bin/sh\n"
+            "# Discard all local changes on the next boot by wiping the overlay\n"
+            "set -e\n"
+            "if [ ! -d /run/overlay/rw ]; then\n"
+            "    echo \"Root filesystem is not an overlay, nothing to reset\" >&2\n"
+            "    exit 1\n"
+            "fi\n"
+            "touch /run/overlay/rw/factory-reset\n"
+            "sync\n"
+            "echo \"Factory reset scheduled, rebooting...\"\n"
+            "systemctl reboot\n");
+    fclose(reset);
+    chmod(path, 0755);
+
+    if (install_delta_apply_support(rootfs_dir) != ERROR_SUCCESS) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    if (config->dm_verity && install_verity_root_support(rootfs_dir) != ERROR_SUCCESS) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // Make sure the root and overlay filesystems are available in the initramfs
+    snprintf(cmd, sizeof(cmd),
+             "for m in overlay %s ext4 vfat; do grep -qx $m %s/etc/initramfs-tools/modules 2>/dev/null || "
+             "echo $m >> %s/etc/initramfs-tools/modules; done",
+             get_rootfs_format_info(config->rootfs_format)->fstype, rootfs_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    return regenerate_initramfs(config, rootfs_dir);
+}
+
+// Add initramfs support for btrfs and f2fs roots
+int install_rootfs_format_support(build_config_t *config, const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    const rootfs_format_info_t *info = get_rootfs_format_info(config->rootfs_format);
+
+    if (info->readonly || !info->target_package) {
+        return ERROR_SUCCESS;
+    }
+
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Installing %s root filesystem support...", info->name);
+    LOG_INFO(msg);
+
+    // The tools package itself is installed with the system packages; make
+    // sure the filesystem driver and its hooks end up in the initramfs
+    snprintf(cmd, sizeof(cmd),
+             "grep -qx %s %s/etc/initramfs-tools/modules 2>/dev/null || "
+             "echo %s >> %s/etc/initramfs-tools/modules",
+             info->fstype, rootfs_dir, info->fstype, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    return regenerate_initramfs(config, rootfs_dir);
+}
+
+// Regenerate the initramfs inside the staged rootfs with initramfs-tools
+int regenerate_initramfs(build_config_t *config, const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    int result = ERROR_SUCCESS;
+
+    LOG_INFO("Regenerating initramfs...");
+
+    // The emulation binary was removed at the end of the rootfs stage
+    chroot_exec_prepare(config, rootfs_dir);
+
+    snprintf(cmd, sizeof(cmd), "mountpoint -q %s/proc || mount -t proc /proc %s/proc",
+             rootfs_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(cmd, sizeof(cmd),
+             "chroot %s /bin/sh -c 'for k in $(ls /lib/modules); do update-initramfs -c -k $k || exit 1; done'",
+             rootfs_dir);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to regenerate initramfs");
+        result = ERROR_INSTALLATION_FAILED;
+    } else {
+        // The boot configuration refers to the initrd by the configured kernel version
+        snprintf(cmd, sizeof(cmd),
+                 "cd %s/boot && k=$(ls ../lib/modules | head -n1) && "
+                 "[ \"$k\" = \"%s\" ] || cp -f initrd.img-$k initrd.img-%s",
+                 rootfs_dir, config->kernel_version, config->kernel_version);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+
+    snprintf(cmd, sizeof(cmd), "umount %s/proc || true", rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    chroot_exec_release(config, rootfs_dir);
+
+    return result;
+}
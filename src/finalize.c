@@ -0,0 +1,400 @@
+/*
+ * finalize.c - Rootfs finalization for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the finalization stage that runs on the staged rootfs
+ * just before it is imaged. Every cache a freshly flashed board would
+ * otherwise build on its first boot (linker cache, module maps, schema,
+ * icon, MIME and font caches, hwdb, journal catalog) is generated here
+ * instead, and the systemd update stamps are set so the matching
+ * ConditionNeedsUpdate= units stay idle. What is still left to the device
+ * is reported at build time and timed on the board's first boot.
+ */
+
+#include "../builder.h"
+#include <dirent.h>
+
+#define FINALIZE_MAX_UNITS 128
+#define FIRSTBOOT_UNITS_PATH "usr/share/orangepi/firstboot-units"
+
+typedef struct {
+    const char *name;
+    const char *tool;           // Must exist in the rootfs for the trigger to run
+    const char *command;        // Run inside the rootfs
+    int reproducible;           // Output depends only on the tree's contents
+} finalize_trigger_t;
+
+typedef struct {
+    char name[128];
+    char reason[256];
+    int skipped;                // Condition already satisfied in the image
+} firstboot_unit_t;
+
+#define MULTIARCH_LIB "/usr/lib/aarch64-linux-gnu"
+
+static const finalize_trigger_t finalize_triggers[] = {
+    {"shared library cache", "/sbin/ldconfig", "ldconfig", 1},
+    {"locale archive", "/usr/sbin/locale-gen",
+     "[ -s /usr/lib/locale/locale-archive ] || locale-gen", 1},
+    {"module dependencies", "/sbin/depmod",
+     "for k in /lib/modules/*; do [ -d \"$k/kernel\" ] && depmod -a $(basename $k); done; true", 1},
+    {"GSettings schemas", "/usr/bin/glib-compile-schemas",
+     "glib-compile-schemas /usr/share/glib-2.0/schemas", 1},
+    {"GIO modules", MULTIARCH_LIB "/glib-2.0/gio-querymodules",
+     MULTIARCH_LIB "/glib-2.0/gio-querymodules " MULTIARCH_LIB "/gio/modules", 1},
+    {"GdkPixbuf loaders", MULTIARCH_LIB "/gdk-pixbuf-2.0/gdk-pixbuf-query-loaders",
+     MULTIARCH_LIB "/gdk-pixbuf-2.0/gdk-pixbuf-query-loaders --update-cache", 1},
+    {"icon caches", "/usr/bin/gtk-update-icon-cache",
+     "for d in /usr/share/icons/*/; do [ -f \"$d/index.theme\" ] && gtk-update-icon-cache -q -f \"$d\"; done; true", 1},
+    {"MIME database", "/usr/bin/update-mime-database", "update-mime-database /usr/share/mime", 1},
+    {"desktop file database", "/usr/bin/update-desktop-database", "update-desktop-database -q", 1},
+    {"dconf database", "/usr/bin/dconf", "dconf update", 1},
+    {"hardware database", "/usr/bin/systemd-hwdb", "systemd-hwdb update", 1},
+    {"journal catalog", "/usr/bin/journalctl", "journalctl --update-catalog", 1},
+    // These record build-time mtimes and random IDs, so reproducible builds leave them to the board
+    {"font cache", "/usr/bin/fc-cache", "fc-cache -s", 0},
+    {"manual page index", "/usr/bin/mandb",
+     "[ -n \"$(ls /usr/share/man 2>/dev/null)\" ] && mandb -c -q; true", 0},
+    {"apt package cache", "/usr/bin/apt-cache",
+     "[ -n \"$(ls /var/lib/apt/lists/*_Packages 2>/dev/null)\" ] && apt-cache gencaches; true", 0},
+    {NULL, NULL, NULL, 0}
+};
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int run_triggers(build_config_t *config, const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    char path[MAX_PATH_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+    int failures = 0;
+
+    chroot_exec_prepare(config, rootfs_dir);
+    snprintf(cmd, sizeof(cmd), "mountpoint -q %s/proc || mount -t proc /proc %s/proc", rootfs_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    for (int i = 0; finalize_triggers[i].name; i++) {
+        const finalize_trigger_t *trigger = &finalize_triggers[i];
+        struct timespec start;
+
+        snprintf(path, sizeof(path), "%s%s", rootfs_dir, trigger->tool);
+        if (access(path, X_OK) != 0 || (config->reproducible && !trigger->reproducible)) {
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        snprintf(cmd, sizeof(cmd), "chroot %s /bin/sh -c '%s'", rootfs_dir, trigger->command);
+        if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+            snprintf(msg, sizeof(msg), "Failed to build %s; the board will build it on first use", trigger->name);
+            LOG_WARNING(msg);
+            failures++;
+            continue;
+        }
+        snprintf(msg, sizeof(msg), "Built %s (%.1fs)", trigger->name, elapsed_seconds(&start));
+        LOG_INFO(msg);
+    }
+
+    snprintf(cmd, sizeof(cmd), "umount %s/proc || true", rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+    chroot_exec_release(config, rootfs_dir);
+
+    return failures;
+}
+
+// Unit file as shipped, looking past /etc symlinks (which point at host paths here)
+static FILE *open_unit(const char *rootfs_dir, const char *name, int *masked) {
+    const char *dirs[] = {"etc/systemd/system", "usr/lib/systemd/system", "lib/systemd/system", NULL};
+    char path[MAX_PATH_LEN];
+    char target[MAX_PATH_LEN];
+    struct stat st;
+
+    *masked = 0;
+    for (int i = 0; dirs[i]; i++) {
+        snprintf(path, sizeof(path), "%s/%s/%s", rootfs_dir, dirs[i], name);
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISLNK(st.st_mode)) {
+            ssize_t len = readlink(path, target, sizeof(target) - 1);
+            if (len > 0) {
+                target[len] = '\0';
+                if (strcmp(target, "/dev/null") == 0) {
+                    *masked = 1;
+                    return NULL;
+                }
+            }
+            continue;
+        }
+        return fopen(path, "r");
+    }
+    return NULL;
+}
+
+static int machine_id_empty(const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/etc/machine-id", rootfs_dir);
+    return stat(path, &st) != 0 || st.st_size == 0;
+}
+
+static int compare_units(const void *a, const void *b) {
+    return strcmp(((const firstboot_unit_t *)a)->name, ((const firstboot_unit_t *)b)->name);
+}
+
+// Classify one enabled unit; returns 1 if it is first-boot work
+static int classify_unit(const char *rootfs_dir, const char *name, firstboot_unit_t *unit) {
+    char line[512];
+    char path[MAX_PATH_LEN];
+    int masked;
+    int found = 0;
+
+    // The timing unit itself is not work the image leaves behind
+    if (strcmp(name, "orangepi-firstboot-report.service") == 0) {
+        return 0;
+    }
+
+    FILE *fp = open_unit(rootfs_dir, name, &masked);
+    if (!fp) {
+        return 0;
+    }
+
+    memset(unit, 0, sizeof(*unit));
+    snprintf(unit->name, sizeof(unit->name), "%s", name);
+
+    while (!found && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (strcmp(line, "ConditionFirstBoot=yes") == 0 || strcmp(line, "ConditionFirstBoot=true") == 0) {
+            unit->skipped = !machine_id_empty(rootfs_dir);
+            snprintf(unit->reason, sizeof(unit->reason), "%s",
+                     unit->skipped ? "first boot, but /etc/machine-id is set" : "first boot (empty /etc/machine-id)");
+            found = 1;
+        } else if (strncmp(line, "ConditionNeedsUpdate=", 21) == 0) {
+            const char *dir = line + 21 + (line[21] == '|');
+            snprintf(path, sizeof(path), "%s%s/.updated", rootfs_dir, dir);
+            unit->skipped = access(path, F_OK) == 0;
+            snprintf(unit->reason, sizeof(unit->reason), "%s update of %s",
+                     unit->skipped ? "built at build time:" : "first boot:", dir);
+            found = 1;
+        } else if (strncmp(line, "ConditionPathExists=!/etc/", 26) == 0 ||
+                   strncmp(line, "ConditionPathExists=!/var/", 26) == 0) {
+            // One-shot units that leave a marker behind
+            const char *marker = line + 21;
+            snprintf(path, sizeof(path), "%s%s", rootfs_dir, marker);
+            if (access(path, F_OK) != 0) {
+                snprintf(unit->reason, sizeof(unit->reason), "until %s exists", marker);
+                found = 1;
+            }
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+// Enabled services whose conditions make them first-boot work
+static int scan_firstboot_units(const char *rootfs_dir, firstboot_unit_t *units, int max) {
+    const char *dirs[] = {"etc/systemd/system", "usr/lib/systemd/system", "lib/systemd/system", NULL};
+    char path[MAX_PATH_LEN];
+    int count = 0;
+
+    for (int d = 0; dirs[d]; d++) {
+        snprintf(path, sizeof(path), "%s/%s", rootfs_dir, dirs[d]);
+        DIR *dir = opendir(path);
+        if (!dir) {
+            continue;
+        }
+
+        struct dirent *target;
+        while ((target = readdir(dir))) {
+            size_t len = strlen(target->d_name);
+            if (len < 6 || strcmp(target->d_name + len - 6, ".wants") != 0) {
+                continue;
+            }
+
+            char wants_path[MAX_PATH_LEN];
+            snprintf(wants_path, sizeof(wants_path), "%s/%s", path, target->d_name);
+            DIR *wants = opendir(wants_path);
+            if (!wants) {
+                continue;
+            }
+
+            struct dirent *entry;
+            while ((entry = readdir(wants)) && count < max) {
+                size_t name_len = strlen(entry->d_name);
+                if (name_len < 8 || strcmp(entry->d_name + name_len - 8, ".service") != 0) {
+                    continue;
+                }
+                int duplicate = 0;
+                for (int i = 0; i < count; i++) {
+                    duplicate |= strcmp(units[i].name, entry->d_name) == 0;
+                }
+                if (!duplicate && classify_unit(rootfs_dir, entry->d_name, &units[count])) {
+                    count++;
+                }
+            }
+            closedir(wants);
+        }
+        closedir(dir);
+    }
+    return count;
+}
+
+// Write the build-time report and the unit list the board times on first boot
+static void write_firstboot_report(build_config_t *config, const char *rootfs_dir,
+                                   firstboot_unit_t *units, int count) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    int remaining = 0;
+
+    snprintf(path, sizeof(path), "%s/firstboot-report.txt", config->output_dir);
+    FILE *report = fopen(path, "w");
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/usr/share/orangepi", rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+    snprintf(path, sizeof(path), "%s/" FIRSTBOOT_UNITS_PATH, rootfs_dir);
+    FILE *list = fopen(path, "w");
+
+    for (int pass = 0; pass < 2; pass++) {
+        const char *title = pass ? "Skipped on first boot:" : "First-boot work left on the board:";
+        printf("%s\n", title);
+        if (report) {
+            fprintf(report, "%s\n", title);
+        }
+        for (int i = 0; i < count; i++) {
+            if (units[i].skipped != pass) {
+                continue;
+            }
+            printf("  %-40s %s\n", units[i].name, units[i].reason);
+            if (report) {
+                fprintf(report, "  %-40s %s\n", units[i].name, units[i].reason);
+            }
+            if (!pass) {
+                remaining++;
+                if (list) {
+                    fprintf(list, "%s\n", units[i].name);
+                }
+            }
+        }
+    }
+
+    if (config->reproducible) {
+        const char *note = "Font cache, man page index and apt cache are built on the board in reproducible builds.";
+        printf("%s\n", note);
+        if (report) {
+            fprintf(report, "%s\n", note);
+        }
+    }
+    printf("First-boot times are written to /var/log/orangepi-firstboot.txt on the board.\n\n");
+
+    if (report) {
+        fclose(report);
+    }
+    if (list) {
+        fclose(list);
+    }
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%d first-boot units left on the board", remaining);
+    LOG_INFO(msg);
+}
+
+// Oneshot that records how long the remaining first-boot units took, once
+static int install_firstboot_timing(const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/usr/local/sbin %s/etc/systemd/system/multi-user.target.wants",
+             rootfs_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(path, sizeof(path), "%s/usr/local/sbin/orangepi-firstboot-report", rootfs_dir);
+    FILE *script = fopen(path, "w");
+    if (!script) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+    fprintf(script,
+            "#!/bin/sh\n"
+            "# Record first-boot-to-ready time and the units the image left for this boot\n"
+            "i=0\n"
+            "while ! systemd-analyze time >/dev/null 2>&1 && [ $i -lt 300 ]; do sleep 2; i=$((i + 2)); done\n"
+            "{\n"
+            "    systemd-analyze time\n"
+            "    echo\n"
+            "    echo \"First-boot units:\"\n"
+            "    systemd-analyze blame | grep -F -f /" FIRSTBOOT_UNITS_PATH "\n"
+            "} > /var/log/orangepi-firstboot.txt 2>&1\n"
+            "mkdir -p /var/lib/orangepi\n"
+            "touch /var/lib/orangepi/firstboot-reported\n");
+    fclose(script);
+    chmod(path, 0755);
+
+    snprintf(path, sizeof(path), "%s/etc/systemd/system/orangepi-firstboot-report.service", rootfs_dir);
+    FILE *unit = fopen(path, "w");
+    if (!unit) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+    // Type=simple so waiting for boot to finish does not hold boot up
+    fprintf(unit,
+            "[Unit]\n"
+            "Description=Record first boot timing\n"
+            "After=multi-user.target\n"
+            "ConditionPathExists=!/var/lib/orangepi/firstboot-reported\n"
+            "\n"
+            "[Service]\n"
+            "Type=simple\n"
+            "ExecStart=/usr/local/sbin/orangepi-firstboot-report\n"
+            "\n"
+            "[Install]\n"
+            "WantedBy=multi-user.target\n");
+    fclose(unit);
+
+    snprintf(cmd, sizeof(cmd),
+             "ln -sf /etc/systemd/system/orangepi-firstboot-report.service "
+             "%s/etc/systemd/system/multi-user.target.wants/orangepi-firstboot-report.service",
+             rootfs_dir);
+    return execute_command_safe(cmd, 0, &error_ctx) == 0 ? ERROR_SUCCESS : ERROR_INSTALLATION_FAILED;
+}
+
+// Do first-boot cache work now and report what the board still has to do
+int finalize_rootfs(build_config_t *config, const char *rootfs_dir) {
+    firstboot_unit_t *units;
+    char cmd[MAX_CMD_LEN];
+    char msg[256];
+    error_context_t error_ctx = {0};
+
+    LOG_INFO("Finalizing root filesystem...");
+
+    int failures = run_triggers(config, rootfs_dir);
+    if (failures) {
+        snprintf(msg, sizeof(msg), "%d cache triggers failed", failures);
+        LOG_WARNING(msg);
+    }
+
+    units = calloc(FINALIZE_MAX_UNITS, sizeof(firstboot_unit_t));
+    if (!units) {
+        return ERROR_UNKNOWN;
+    }
+    // /etc and /var are now up to date with /usr, so ConditionNeedsUpdate= units
+    // (ldconfig, hwdb, catalog, sysusers) stay idle. The directories written to
+    // below are created first so nothing changes /usr after the stamps
+    snprintf(cmd, sizeof(cmd), "cd %s && mkdir -p usr/share/orangepi usr/local/sbin && "
+             "touch -r usr etc/.updated var/.updated", rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    int count = scan_firstboot_units(rootfs_dir, units, FINALIZE_MAX_UNITS);
+    // Directory order differs between hosts; the unit list ships in the image
+    qsort(units, count, sizeof(firstboot_unit_t), compare_units);
+    write_firstboot_report(config, rootfs_dir, units, count);
+    free(units);
+
+    if (install_firstboot_timing(rootfs_dir) != ERROR_SUCCESS) {
+        LOG_WARNING("First boot timing will not be recorded");
+    }
+    return ERROR_SUCCESS;
+}
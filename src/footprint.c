@@ -0,0 +1,727 @@
+/*
+ * footprint.c - Package footprint analysis for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the package footprint analyzer. It downloads the apt
+ * indexes for the configured release, resolves the dependency closure of
+ * every package a distro profile installs the way apt would (first
+ * satisfiable alternative, recommends included) on top of the debootstrap
+ * base, and reports what each top-level package costs and which recommends
+ * weigh the most. Profiles can be trimmed from this report without building
+ * a rootfs.
+ */
+
+#include "../builder.h"
+
+#define FOOTPRINT_MAX_TOPS 256
+#define FOOTPRINT_INDEX_MAX_AGE (24 * 60 * 60)
+
+// Per-package flags used while resolving
+#define FLAG_BASE    0x01       // Installed by debootstrap
+#define FLAG_NEEDED  0x02       // Required by the profile without recommends
+#define FLAG_PROFILE 0x04       // Installed by the profile
+#define FLAG_SEEN    0x08
+
+typedef struct {
+    char *name;
+    char *depends;              // Pre-Depends and Depends as in the index
+    char *recommends;
+    int *dep_ids;
+    int *rec_ids;
+    int dep_count;
+    int rec_count;
+    int resolved;
+    int provider;               // First real package providing this name, or -1
+    int real;                   // Has its own stanza (not only provided)
+    int base_priority;          // Priority required or important
+    unsigned long installed_kb;
+} apt_package_t;
+
+typedef struct {
+    apt_package_t *packages;
+    size_t count;
+    size_t capacity;
+    int *slots;
+    size_t slot_count;
+} apt_index_t;
+
+typedef struct {
+    const char *group;
+    char name[128];
+    int id;
+    int *closure;
+    int closure_count;
+    unsigned long closure_kb;
+    unsigned long unique_kb;
+} footprint_top_t;
+
+typedef struct {
+    int id;
+    int recommended_by;
+    unsigned long kb;
+} footprint_rec_t;
+
+static const char *index_components[] = {"main", "restricted", "universe", "multiverse", NULL};
+// Later pockets replace earlier versions, as the newer package would be installed
+static const char *index_pockets[] = {"", "-security", "-updates", NULL};
+
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int find_package(apt_index_t *index, const char *name, size_t len) {
+    if (!index->slot_count) {
+        return -1;
+    }
+    size_t mask = index->slot_count - 1;
+    for (size_t slot = name_hash(name, len) & mask; index->slots[slot] >= 0; slot = (slot + 1) & mask) {
+        const char *candidate = index->packages[index->slots[slot]].name;
+        if (strncmp(candidate, name, len) == 0 && candidate[len] == '\0') {
+            return index->slots[slot];
+        }
+    }
+    return -1;
+}
+
+static int grow_index(apt_index_t *index) {
+    size_t slot_count = index->slot_count ? index->slot_count * 2 : 65536;
+    int *slots = malloc(slot_count * sizeof(int));
+    if (!slots) {
+        return -1;
+    }
+    memset(slots, 0xff, slot_count * sizeof(int));
+
+    for (size_t i = 0; i < index->count; i++) {
+        const char *name = index->packages[i].name;
+        size_t slot = name_hash(name, strlen(name)) & (slot_count - 1);
+        while (slots[slot] >= 0) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots[slot] = (int)i;
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->slot_count = slot_count;
+    return 0;
+}
+
+// Index of a package name, adding an empty entry the first time it is seen
+static int intern_package(apt_index_t *index, const char *name, size_t len) {
+    int id = find_package(index, name, len);
+    if (id >= 0) {
+        return id;
+    }
+
+    if ((index->count + 1) * 2 > index->slot_count && grow_index(index) != 0) {
+        return -1;
+    }
+    if (index->count == index->capacity) {
+        size_t capacity = index->capacity ? index->capacity * 2 : 16384;
+        apt_package_t *packages = realloc(index->packages, capacity * sizeof(apt_package_t));
+        if (!packages) {
+            return -1;
+        }
+        index->packages = packages;
+        index->capacity = capacity;
+    }
+
+    apt_package_t *package = &index->packages[index->count];
+    memset(package, 0, sizeof(*package));
+    package->name = strndup(name, len);
+    package->provider = -1;
+
+    size_t slot = name_hash(name, len) & (index->slot_count - 1);
+    while (index->slots[slot] >= 0) {
+        slot = (slot + 1) & (index->slot_count - 1);
+    }
+    index->slots[slot] = (int)index->count;
+    return (int)index->count++;
+}
+
+static void free_index(apt_index_t *index) {
+    for (size_t i = 0; i < index->count; i++) {
+        free(index->packages[i].name);
+        free(index->packages[i].depends);
+        free(index->packages[i].recommends);
+        free(index->packages[i].dep_ids);
+        free(index->packages[i].rec_ids);
+    }
+    free(index->packages);
+    free(index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
+// Length of the package name at the start of a relation ("name:any (>= 1) [arm64]")
+static size_t relation_name_length(const char *relation) {
+    size_t len = 0;
+    while (relation[len] && !isspace((unsigned char)relation[len]) && !strchr(":(<[,|", relation[len])) {
+        len++;
+    }
+    return len;
+}
+
+static void commit_stanza(apt_index_t *index, const char *name, char *depends, char *recommends,
+                          const char *provides, unsigned long installed_kb, int base_priority) {
+    int id = intern_package(index, name, strlen(name));
+    if (id < 0) {
+        free(depends);
+        free(recommends);
+        return;
+    }
+
+    apt_package_t *package = &index->packages[id];
+    free(package->depends);
+    free(package->recommends);
+    package->depends = depends;
+    package->recommends = recommends;
+    package->installed_kb = installed_kb;
+    package->base_priority = base_priority;
+    package->real = 1;
+
+    for (const char *p = provides; p && *p; ) {
+        while (*p == ' ' || *p == ',') {
+            p++;
+        }
+        size_t len = relation_name_length(p);
+        if (len) {
+            int virtual_id = intern_package(index, p, len);
+            if (virtual_id >= 0 && index->packages[virtual_id].provider < 0) {
+                index->packages[virtual_id].provider = id;
+            }
+        }
+        p = strchr(p, ',');
+    }
+}
+
+static char *join_fields(char *first, const char *second) {
+    if (!first) {
+        return strdup(second);
+    }
+    size_t len = strlen(first) + strlen(second) + 3;
+    char *joined = malloc(len);
+    if (joined) {
+        snprintf(joined, len, "%s, %s", first, second);
+    }
+    free(first);
+    return joined;
+}
+
+static int load_packages_file(apt_index_t *index, const char *path) {
+    char cmd[MAX_CMD_LEN];
+    char name[256] = "";
+    char *provides = NULL;
+    char *depends = NULL;
+    char *recommends = NULL;
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned long installed_kb = 0;
+    int base_priority = 0;
+    ssize_t len;
+
+    snprintf(cmd, sizeof(cmd), "xz -dc %s", path);
+    FILE *input = popen(cmd, "r");
+    if (!input) {
+        return -1;
+    }
+
+    do {
+        len = getline(&line, &line_size, input);
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        // A blank line (or the end of the file) closes a stanza
+        if (len <= 0) {
+            if (name[0]) {
+                commit_stanza(index, name, depends, recommends, provides, installed_kb, base_priority);
+            } else {
+                free(depends);
+                free(recommends);
+            }
+            free(provides);
+            name[0] = '\0';
+            provides = depends = recommends = NULL;
+            installed_kb = 0;
+            base_priority = 0;
+            continue;
+        }
+
+        if (strncmp(line, "Package: ", 9) == 0) {
+            snprintf(name, sizeof(name), "%s", line + 9);
+        } else if (strncmp(line, "Installed-Size: ", 16) == 0) {
+            installed_kb = strtoul(line + 16, NULL, 10);
+        } else if (strncmp(line, "Priority: ", 10) == 0) {
+            base_priority = strcmp(line + 10, "required") == 0 || strcmp(line + 10, "important") == 0;
+        } else if (strncmp(line, "Depends: ", 9) == 0 || strncmp(line, "Pre-Depends: ", 13) == 0) {
+            depends = join_fields(depends, strchr(line, ' ') + 1);
+        } else if (strncmp(line, "Recommends: ", 12) == 0) {
+            recommends = join_fields(recommends, line + 12);
+        } else if (strncmp(line, "Provides: ", 10) == 0) {
+            provides = join_fields(provides, line + 10);
+        }
+    } while (len >= 0);
+
+    free(line);
+    return pclose(input) == 0 ? 0 : -1;
+}
+
+// Package apt would pick for one "a | b | c" clause: an alternative the base
+// system already has, else the first real package, else a provider
+static int resolve_clause(apt_index_t *index, const char *clause, size_t clause_len, const unsigned char *flags) {
+    int first_real = -1;
+    int first_provider = -1;
+    const char *end = clause + clause_len;
+
+    for (const char *p = clause; p < end; ) {
+        while (p < end && (*p == ' ' || *p == '|')) {
+            p++;
+        }
+        size_t len = relation_name_length(p);
+        if (len) {
+            int id = find_package(index, p, len);
+            if (id >= 0) {
+                apt_package_t *package = &index->packages[id];
+                int target = package->real ? id : package->provider;
+                if (target >= 0 && (flags[target] & FLAG_BASE)) {
+                    return target;
+                }
+                if (package->real && first_real < 0) {
+                    first_real = id;
+                } else if (!package->real && first_provider < 0) {
+                    first_provider = package->provider;
+                }
+            }
+        }
+        while (p < end && *p != '|') {
+            p++;
+        }
+    }
+    return first_real >= 0 ? first_real : first_provider;
+}
+
+static int *resolve_relations(apt_index_t *index, const char *field, int *count, const unsigned char *flags) {
+    int *ids = NULL;
+    int capacity = 0;
+
+    *count = 0;
+    for (const char *p = field; p && *p; ) {
+        const char *comma = strchr(p, ',');
+        size_t len = comma ? (size_t)(comma - p) : strlen(p);
+        int id = resolve_clause(index, p, len, flags);
+        if (id >= 0) {
+            if (*count == capacity) {
+                capacity = capacity ? capacity * 2 : 8;
+                int *grown = realloc(ids, capacity * sizeof(int));
+                if (!grown) {
+                    break;
+                }
+                ids = grown;
+            }
+            ids[(*count)++] = id;
+        }
+        p = comma ? comma + 1 : NULL;
+    }
+    return ids;
+}
+
+static void resolve_package(apt_index_t *index, int id, const unsigned char *flags) {
+    apt_package_t *package = &index->packages[id];
+    if (!package->resolved) {
+        package->dep_ids = resolve_relations(index, package->depends, &package->dep_count, flags);
+        package->rec_ids = resolve_relations(index, package->recommends, &package->rec_count, flags);
+        package->resolved = 1;
+    }
+}
+
+// Everything installing root pulls in, skipping packages with any of skip_flags;
+// fills out (sized for the whole index) and returns the number of packages
+static int collect_closure(apt_index_t *index, int root, int recommends, unsigned char *flags,
+                           unsigned char skip_flags, int *out) {
+    int count = 0;
+
+    if (flags[root] & (skip_flags | FLAG_SEEN)) {
+        return 0;
+    }
+    flags[root] |= FLAG_SEEN;
+    out[count++] = root;
+
+    for (int i = 0; i < count; i++) {
+        resolve_package(index, out[i], flags);
+        apt_package_t *package = &index->packages[out[i]];
+        for (int pass = 0; pass < (recommends ? 2 : 1); pass++) {
+            int *ids = pass ? package->rec_ids : package->dep_ids;
+            int n = pass ? package->rec_count : package->dep_count;
+            for (int j = 0; j < n; j++) {
+                if (!(flags[ids[j]] & (skip_flags | FLAG_SEEN))) {
+                    flags[ids[j]] |= FLAG_SEEN;
+                    out[count++] = ids[j];
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        flags[out[i]] &= (unsigned char)~FLAG_SEEN;
+    }
+    return count;
+}
+
+static unsigned long closure_size(apt_index_t *index, const int *ids, int count) {
+    unsigned long kb = 0;
+    for (int i = 0; i < count; i++) {
+        kb += index->packages[ids[i]].installed_kb;
+    }
+    return kb;
+}
+
+// Download the Packages indexes of every pocket and component apt will use
+static int fetch_apt_indexes(build_config_t *config, const char *dir, apt_index_t *index) {
+    char mirror[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[MAX_PATH_LEN + 64];
+    error_context_t error_ctx = {0};
+    struct stat st;
+    int loaded = 0;
+
+    get_ubuntu_mirror(config, mirror, sizeof(mirror));
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s", dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    for (int p = 0; index_pockets[p]; p++) {
+        for (int c = 0; index_components[c]; c++) {
+            snprintf(path, sizeof(path), "%s/%s%s_%s_Packages.xz",
+                     dir, config->ubuntu_codename, index_pockets[p], index_components[c]);
+
+            // Snapshot indexes never change; live ones are refreshed daily
+            int stale = stat(path, &st) != 0 ||
+                        (!config->reproducible && time(NULL) - st.st_mtime > FOOTPRINT_INDEX_MAX_AGE);
+            cache_record(config, "apt-indexes", strrchr(path, '/') + 1, !stale);
+            if (stale) {
+                snprintf(cmd, sizeof(cmd),
+                         "wget -q -O %s.part %s/dists/%s%s/%s/binary-arm64/Packages.xz && mv %s.part %s",
+                         path, mirror, config->ubuntu_codename, index_pockets[p], index_components[c],
+                         path, path);
+                if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+                    unlink(path);
+                    snprintf(msg, sizeof(msg), "No package index for %s%s %s",
+                             config->ubuntu_codename, index_pockets[p], index_components[c]);
+                    LOG_WARNING(msg);
+                    continue;
+                }
+            }
+
+            if (load_packages_file(index, path) != 0) {
+                snprintf(msg, sizeof(msg), "Failed to read package index %s", path);
+                LOG_WARNING(msg);
+                continue;
+            }
+            loaded++;
+        }
+    }
+    return loaded ? 0 : -1;
+}
+
+static int add_top_packages(apt_index_t *index, footprint_top_t *tops, int *count,
+                            const char *group, const char *packages) {
+    char list[4096];
+    char *saveptr = NULL;
+
+    snprintf(list, sizeof(list), "%s", packages);
+    for (char *name = strtok_r(list, " ,", &saveptr); name; name = strtok_r(NULL, " ,", &saveptr)) {
+        int duplicate = 0;
+        for (int i = 0; i < *count; i++) {
+            duplicate |= strcmp(tops[i].name, name) == 0;
+        }
+        if (duplicate) {
+            continue;
+        }
+        if (*count >= FOOTPRINT_MAX_TOPS) {
+            return -1;
+        }
+
+        footprint_top_t *top = &tops[(*count)++];
+        memset(top, 0, sizeof(*top));
+        top->group = group;
+        snprintf(top->name, sizeof(top->name), "%s", name);
+        top->id = find_package(index, name, strlen(name));
+        if (top->id >= 0 && !index->packages[top->id].real) {
+            top->id = index->packages[top->id].provider;
+        }
+    }
+    return 0;
+}
+
+static int compare_tops(const void *a, const void *b) {
+    const footprint_top_t *ta = a;
+    const footprint_top_t *tb = b;
+    return tb->closure_kb > ta->closure_kb ? 1 : tb->closure_kb < ta->closure_kb ? -1 : 0;
+}
+
+static int compare_recs(const void *a, const void *b) {
+    const footprint_rec_t *ra = a;
+    const footprint_rec_t *rb = b;
+    return rb->kb > ra->kb ? 1 : rb->kb < ra->kb ? -1 : 0;
+}
+
+static const char *distro_group(distro_type_t type) {
+    switch (type) {
+        case DISTRO_DESKTOP:
+            return "desktop";
+        case DISTRO_SERVER:
+            return "server";
+        case DISTRO_EMULATION:
+            return "emulation";
+        default:
+            return NULL;
+    }
+}
+
+// Report the installed size of a distro profile: extra_groups names more
+// package groups, extra_packages adds packages of its own (both may be NULL)
+int analyze_package_footprint(build_config_t *config, const char *extra_groups, const char *extra_packages,
+                              int recommends, int top_recommends) {
+    apt_index_t index = {0};
+    footprint_top_t *tops = NULL;
+    footprint_rec_t *recs = NULL;
+    unsigned char *flags = NULL;
+    int *scratch = NULL;
+    int top_count = 0;
+    int rec_count = 0;
+    int result = ERROR_UNKNOWN;
+    char dir[MAX_PATH_LEN];
+    char msg[512];
+
+    snprintf(dir, sizeof(dir), "%s/apt-indexes", config->build_dir);
+    snprintf(msg, sizeof(msg), "Loading arm64 package indexes for Ubuntu %s (%s)...",
+             config->ubuntu_release, config->ubuntu_codename);
+    LOG_INFO(msg);
+    if (fetch_apt_indexes(config, dir, &index) != 0) {
+        LOG_ERROR("No package indexes could be loaded");
+        return ERROR_NETWORK_FAILURE;
+    }
+
+    tops = calloc(FOOTPRINT_MAX_TOPS, sizeof(footprint_top_t));
+    flags = calloc(index.count, 1);
+    scratch = malloc(index.count * sizeof(int));
+    if (!tops || !flags || !scratch) {
+        goto out;
+    }
+
+    // The debootstrap base: required and important packages plus its --include list
+    int base_count = 0;
+    unsigned long base_kb = 0;
+    for (size_t i = 0; i < index.count; i++) {
+        if (index.packages[i].real && index.packages[i].base_priority) {
+            flags[i] |= FLAG_BASE;
+        }
+    }
+    const char *includes[] = {"wget", "ca-certificates", "locales", NULL};
+    for (int i = 0; includes[i]; i++) {
+        int id = find_package(&index, includes[i], strlen(includes[i]));
+        if (id >= 0) {
+            flags[id] |= FLAG_BASE;
+        }
+    }
+    for (size_t i = 0; i < index.count; i++) {
+        if (flags[i] & FLAG_BASE) {
+            int n = collect_closure(&index, (int)i, 0, flags, 0, scratch);
+            for (int j = 0; j < n; j++) {
+                flags[scratch[j]] |= FLAG_BASE;
+            }
+        }
+    }
+    for (size_t i = 0; i < index.count; i++) {
+        if (flags[i] & FLAG_BASE) {
+            base_count++;
+            base_kb += index.packages[i].installed_kb;
+        }
+    }
+
+    // Top-level packages in the order build_ubuntu_rootfs() and install_system_packages() install them
+    const rootfs_format_info_t *format_info = get_rootfs_format_info(config->rootfs_format);
+    char base_name[32];   // tops keep a pointer to their group name
+    add_top_packages(&index, tops, &top_count, "locales", get_package_group("locales"));
+    add_top_packages(&index, tops, &top_count, "rootfs-base", get_package_group("rootfs-base"));
+    if (distro_group(config->distro_type) && get_distro_base_packages(config)[0]) {
+        snprintf(base_name, sizeof(base_name), "%s-base", distro_group(config->distro_type));
+        add_top_packages(&index, tops, &top_count, base_name, get_distro_base_packages(config));
+    }
+    add_top_packages(&index, tops, &top_count, "common", get_package_group("common"));
+    if (distro_group(config->distro_type)) {
+        add_top_packages(&index, tops, &top_count, distro_group(config->distro_type),
+                         get_package_group(distro_group(config->distro_type)));
+    }
+    if (config->install_gpu_blobs) {
+        add_top_packages(&index, tops, &top_count, "gpu", get_package_group("gpu"));
+    }
+    if (format_info->target_package) {
+        add_top_packages(&index, tops, &top_count, "rootfs-format", format_info->target_package);
+    }
+    if (config->dm_verity && rootfs_format_is_readonly(config)) {
+        add_top_packages(&index, tops, &top_count, "verity", get_package_group("verity"));
+    }
+    if (extra_groups) {
+        char list[256];
+        char *saveptr = NULL;
+        snprintf(list, sizeof(list), "%s", extra_groups);
+        for (char *name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+            for (int i = 0; package_groups[i].name; i++) {
+                if (strcmp(package_groups[i].name, name) == 0) {
+                    add_top_packages(&index, tops, &top_count, package_groups[i].name, package_groups[i].packages);
+                }
+            }
+        }
+    }
+    if (extra_packages) {
+        add_top_packages(&index, tops, &top_count, "extra", extra_packages);
+    }
+
+    // What each top-level package pulls in beyond the base, and how many others share it
+    unsigned short *refs = calloc(index.count, sizeof(unsigned short));
+    if (!refs) {
+        goto out;
+    }
+    for (int t = 0; t < top_count; t++) {
+        if (tops[t].id < 0) {
+            continue;
+        }
+        int n = collect_closure(&index, tops[t].id, recommends, flags, FLAG_BASE, scratch);
+        tops[t].closure = malloc(n * sizeof(int));
+        if (!tops[t].closure) {
+            continue;
+        }
+        memcpy(tops[t].closure, scratch, n * sizeof(int));
+        tops[t].closure_count = n;
+        tops[t].closure_kb = closure_size(&index, scratch, n);
+        for (int j = 0; j < n; j++) {
+            refs[scratch[j]]++;
+            flags[scratch[j]] |= FLAG_PROFILE;
+        }
+
+        // Packages needed even with --no-install-recommends
+        n = collect_closure(&index, tops[t].id, 0, flags, FLAG_BASE, scratch);
+        for (int j = 0; j < n; j++) {
+            flags[scratch[j]] |= FLAG_NEEDED;
+        }
+    }
+    for (int t = 0; t < top_count; t++) {
+        for (int j = 0; j < tops[t].closure_count; j++) {
+            if (refs[tops[t].closure[j]] == 1) {
+                tops[t].unique_kb += index.packages[tops[t].closure[j]].installed_kb;
+            }
+        }
+    }
+    free(refs);
+
+    int profile_count = 0;
+    unsigned long profile_kb = 0;
+    unsigned long needed_kb = 0;
+    for (size_t i = 0; i < index.count; i++) {
+        if (flags[i] & FLAG_PROFILE) {
+            profile_count++;
+            profile_kb += index.packages[i].installed_kb;
+        }
+        if (flags[i] & FLAG_NEEDED) {
+            needed_kb += index.packages[i].installed_kb;
+        }
+    }
+
+    // Recommends nothing depends on, weighed by everything only they pull in
+    if (recommends) {
+        recs = calloc(index.count, sizeof(footprint_rec_t));
+        if (!recs) {
+            goto out;
+        }
+        for (size_t i = 0; i < index.count; i++) {
+            if (!(flags[i] & FLAG_PROFILE)) {
+                continue;
+            }
+            apt_package_t *package = &index.packages[i];
+            for (int j = 0; j < package->rec_count; j++) {
+                int r = package->rec_ids[j];
+                if (flags[r] & (FLAG_BASE | FLAG_NEEDED)) {
+                    continue;
+                }
+                int duplicate = 0;
+                for (int k = 0; k < rec_count && !duplicate; k++) {
+                    duplicate = recs[k].id == r;
+                }
+                if (duplicate) {
+                    continue;
+                }
+                int n = collect_closure(&index, r, 1, flags, FLAG_BASE | FLAG_NEEDED, scratch);
+                recs[rec_count].id = r;
+                recs[rec_count].recommended_by = (int)i;
+                recs[rec_count].kb = closure_size(&index, scratch, n);
+                rec_count++;
+            }
+        }
+        qsort(recs, rec_count, sizeof(footprint_rec_t), compare_recs);
+    }
+
+    // Heaviest first within each group; groups stay in install order
+    for (int start = 0, end; start < top_count; start = end) {
+        for (end = start + 1; end < top_count && tops[end].group == tops[start].group; end++) {
+        }
+        qsort(tops + start, end - start, sizeof(footprint_top_t), compare_tops);
+    }
+
+    printf("\nPackage footprint: Ubuntu %s (%s) arm64, %s profile%s\n",
+           config->ubuntu_release, config->ubuntu_codename,
+           distro_group(config->distro_type) ? distro_group(config->distro_type) : "minimal",
+           recommends ? "" : ", without recommends");
+    printf("Base system (debootstrap): %d packages, %.1f MB\n\n", base_count, base_kb / 1024.0);
+    printf("%-36s %9s %7s %11s %10s\n", "Package", "Own MB", "Pulls", "Closure MB", "Unique MB");
+
+    const char *group = NULL;
+    for (int t = 0; t < top_count; t++) {
+        if (group != tops[t].group) {
+            group = tops[t].group;
+            printf("%s\n", group);
+        }
+        if (tops[t].id < 0) {
+            printf("  %-34s %s\n", tops[t].name, "not in the archive for this release");
+        } else if (!tops[t].closure_count) {
+            printf("  %-34s %s\n", tops[t].name, "already in the base system");
+        } else {
+            printf("  %-34s %9.1f %7d %11.1f %10.1f\n", tops[t].name,
+                   index.packages[tops[t].id].installed_kb / 1024.0, tops[t].closure_count - 1,
+                   tops[t].closure_kb / 1024.0, tops[t].unique_kb / 1024.0);
+        }
+    }
+
+    printf("\nProfile: %d packages, %.1f MB on top of the base", profile_count, profile_kb / 1024.0);
+    if (recommends) {
+        printf(" (%.1f MB with --no-install-recommends)", needed_kb / 1024.0);
+    }
+    printf("\nUnique MB is what dropping only that package would save.\n");
+
+    if (rec_count) {
+        printf("\nHeaviest recommends (nothing in the profile depends on them):\n");
+        for (int i = 0; i < rec_count && i < top_recommends; i++) {
+            printf("  %-36s %9.1f MB  recommended by %s\n", index.packages[recs[i].id].name,
+                   recs[i].kb / 1024.0, index.packages[recs[i].recommended_by].name);
+        }
+    }
+    result = ERROR_SUCCESS;
+
+out:
+    if (result != ERROR_SUCCESS) {
+        LOG_ERROR("Out of memory analyzing package footprint");
+    }
+    for (int t = 0; t < top_count; t++) {
+        free(tops[t].closure);
+    }
+    free(tops);
+    free(recs);
+    free(flags);
+    free(scratch);
+    free_index(&index);
+    return result;
+}
@@ -708,7 +708,7 @@ void advanced_options_menu(void) {
                 log_info("Custom kernel configuration not yet implemented");
                 break;
             case 2:
-                log_info("Manual package selection not yet implemented");
+                log_info("Run 'builder footprint' to size package selections against the apt indexes");
                 break;
             case 3:
                 log_info("Cross compilation settings not yet implemented");
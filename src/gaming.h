@@ -64,7 +64,7 @@ int create_emmc_image(void);
 int create_compressed_image(void);
 int flash_to_sd_card(void);
 int flash_to_emmc(void);
-int verify_image_integrity(void);
+int verify_image_integrity(const char* image_path);
 int create_live_usb(void);
 int backup_current_system(void);
 int image_management_tools(void);
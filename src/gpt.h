@@ -0,0 +1,38 @@
+#ifndef GPT_H
+#define GPT_H
+
+#include <stdint.h>
+
+#define GPT_SECTOR_SIZE 512ULL
+#define GPT_MAX_PARTITIONS 128
+
+// A used entry of a GPT partition table
+typedef struct {
+    int number;                 // 1-based, as in /dev/mmcblk0pN
+    char name[37];              // UTF-16 name reduced to ASCII
+    uint8_t type_guid[16];
+    uint64_t first_lba;
+    uint64_t last_lba;          // Inclusive
+    uint64_t attributes;
+} gpt_partition_t;
+
+typedef struct {
+    uint64_t disk_bytes;
+    int count;
+    gpt_partition_t partitions[GPT_MAX_PARTITIONS];
+} gpt_table_t;
+
+// Read the primary GPT of an image file or block device; returns 0 on success
+int gpt_read(const char *path, gpt_table_t *table);
+
+// Find a partition by name; NULL if there is none
+const gpt_partition_t* gpt_find(const gpt_table_t *table, const char *name);
+
+// Byte range of a partition
+uint64_t gpt_partition_offset(const gpt_partition_t *partition);
+uint64_t gpt_partition_size(const gpt_partition_t *partition);
+
+// Format a type GUID in its usual mixed-endian text form
+void gpt_guid_to_string(const uint8_t guid[16], char text[37]);
+
+#endif // GPT_H
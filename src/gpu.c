@@ -47,7 +47,7 @@ int download_mali_blobs(build_config_t *config) {
         LOG_INFO(msg);
         
         char cmd[MAX_CMD_LEN];
-        snprintf(cmd, sizeof(cmd), "wget -O %s \"%s\"", driver->filename, driver->url);
+        get_fetch_command(config, driver->url, driver->filename, cmd, sizeof(cmd));
         
         int download_failed = 1;
         
@@ -78,7 +78,7 @@ int download_mali_blobs(build_config_t *config) {
             char* custom_url = getenv(env_var_name);
             if (custom_url != NULL && strlen(custom_url) > 0) {
                 LOG_INFO("Trying custom URL from environment");
-                snprintf(cmd, sizeof(cmd), "wget -O %s \"%s\"", driver->filename, custom_url);
+                get_fetch_command(config, custom_url, driver->filename, cmd, sizeof(cmd));
                 if (execute_command_with_retry(cmd, 1, 2) == 0) {
                     struct stat st;
                     if (stat(driver->filename, &st) == 0 && st.st_size > 10000) {
@@ -92,7 +92,7 @@ int download_mali_blobs(build_config_t *config) {
             if (download_failed) {
                 for (int j = 0; mali_fallback_urls[j] != NULL; j++) {
                     LOG_INFO("Trying fallback URL...");
-                    snprintf(cmd, sizeof(cmd), "wget -O %s \"%s\"", driver->filename, mali_fallback_urls[j]);
+                    get_fetch_command(config, mali_fallback_urls[j], driver->filename, cmd, sizeof(cmd));
                     if (execute_command_with_retry(cmd, 1, 2) == 0) {
                         struct stat st;
                         if (stat(driver->filename, &st) == 0 && st.st_size > 10000) {
@@ -164,9 +164,8 @@ int install_mali_drivers(build_config_t *config) {
         LOG_WARNING("Mali firmware not found, trying to download it directly...");
         
         // Try to download firmware directly
-        snprintf(cmd, sizeof(cmd), 
-                 "wget -O /lib/firmware/mali/mali_csffw.bin "
-                 "https://github.com/JeffyCN/mirrors/raw/libmali/firmware/g610/mali_csffw.bin");
+        get_fetch_command(config, "https://github.com/JeffyCN/mirrors/raw/libmali/firmware/g610/mali_csffw.bin",
+                          "/lib/firmware/mali/mali_csffw.bin", cmd, sizeof(cmd));
         
         if (execute_command_with_retry(cmd, 1, 3) != 0) {
             LOG_WARNING("Failed to download Mali firmware");
@@ -682,8 +681,8 @@ int integrate_mali_into_kernel(build_config_t *config) {
     
     int patch_success = 0;
     
-    // Try to download from each source
-    for (int i = 0; mali_patch_sources[i] != NULL && !patch_success; i++) {
+    // Try to download from each source (offline, go straight to the manual integration)
+    for (int i = 0; mali_patch_sources[i] != NULL && !patch_success && !config->offline_bundle[0]; i++) {
         LOG_INFO("Trying to download Mali patches from:");
         LOG_INFO(mali_patch_sources[i]);
         
@@ -0,0 +1,225 @@
+/*
+ * host_exec.c - Build host detection for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the checks that decide how aarch64 code runs during a
+ * build. On an aarch64 host (an RK3588 board, Ampere, Graviton) chroot
+ * commands run natively and the kernel and U-Boot are built with the native
+ * compiler; elsewhere a binfmt_misc interpreter registered with the F flag
+ * runs them without copying qemu into the rootfs. It also times the build
+ * stages so the cost of emulation, and the time spent on remote build
+ * hosts, shows up in a report.
+ */
+
+#include "../builder.h"
+#include <sys/utsname.h>
+#include <dirent.h>
+
+#define QEMU_STATIC "/usr/bin/qemu-aarch64-static"
+#define BINFMT_DIR "/proc/sys/fs/binfmt_misc"
+#define MAX_STAGES 32
+
+typedef struct {
+    const char *name;
+    stage_kind_t kind;
+    const char *remote;         // How the stage used other hosts, NULL if it did not
+    double seconds;
+} stage_time_t;
+
+static stage_time_t stages[MAX_STAGES];
+static int stage_count = 0;
+static int stage_open = 0;
+static struct timespec stage_start;
+
+static int host_is_aarch64(void) {
+    struct utsname uts;
+
+    if (uname(&uts) != 0) {
+        return 0;
+    }
+    return strcmp(uts.machine, "aarch64") == 0 || strcmp(uts.machine, "arm64") == 0;
+}
+
+// An enabled aarch64 handler whose interpreter the kernel opened at registration
+// (flag F) works inside any chroot without a copy of qemu there
+static int binfmt_aarch64_fixed(void) {
+    char path[MAX_PATH_LEN];
+    char line[256];
+    int found = 0;
+
+    DIR *dir = opendir(BINFMT_DIR);
+    if (!dir) {
+        return 0;
+    }
+
+    struct dirent *entry;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        if (!strstr(entry->d_name, "aarch64")) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", BINFMT_DIR, entry->d_name);
+        FILE *fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        int enabled = 0;
+        while (fgets(line, sizeof(line), fp)) {
+            if (strncmp(line, "enabled", 7) == 0) {
+                enabled = 1;
+            } else if (enabled && strncmp(line, "flags: ", 7) == 0 && strchr(line + 7, 'F')) {
+                found = 1;
+            }
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+    return found;
+}
+
+const char *host_exec_name(host_exec_t exec) {
+    switch (exec) {
+        case HOST_EXEC_NATIVE: return "native aarch64";
+        case HOST_EXEC_BINFMT: return "binfmt_misc emulation";
+        default: return "qemu-user emulation";
+    }
+}
+
+// Pick how chroot commands and compilers run; call before anything is built
+host_exec_t detect_host_exec(build_config_t *config) {
+    char msg[256];
+
+    if (host_is_aarch64() && !config->force_emulation) {
+        config->host_exec = HOST_EXEC_NATIVE;
+        // Only the default toolchain prefix is swapped for the native compiler
+        if (strcmp(config->cross_compile, "aarch64-linux-gnu-") == 0) {
+            config->cross_compile[0] = '\0';
+        }
+    } else if (!config->force_emulation && binfmt_aarch64_fixed()) {
+        config->host_exec = HOST_EXEC_BINFMT;
+    } else {
+        config->host_exec = HOST_EXEC_QEMU;
+    }
+
+    snprintf(msg, sizeof(msg), "Build host: %s, compiler: %s",
+             host_exec_name(config->host_exec),
+             config->cross_compile[0] ? config->cross_compile : "native gcc");
+    LOG_INFO(msg);
+    return config->host_exec;
+}
+
+// Make the rootfs able to run its own binaries under chroot
+void chroot_exec_prepare(build_config_t *config, const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    if (config->host_exec != HOST_EXEC_QEMU) {
+        return;
+    }
+    snprintf(cmd, sizeof(cmd), "cp %s %s/usr/bin/", QEMU_STATIC, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+}
+
+// Remove what chroot_exec_prepare added so it never reaches an image
+void chroot_exec_release(build_config_t *config, const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    if (config->host_exec != HOST_EXEC_QEMU) {
+        return;
+    }
+    snprintf(cmd, sizeof(cmd), "rm -f %s%s", rootfs_dir, QEMU_STATIC);
+    execute_command_safe(cmd, 0, &error_ctx);
+}
+
+// Start timing a stage; a stage still open is closed first
+void stage_timer_begin(const char *name, stage_kind_t kind) {
+    stage_timer_end();
+    if (stage_count >= MAX_STAGES) {
+        return;
+    }
+    stages[stage_count].name = name;
+    stages[stage_count].kind = kind;
+    stages[stage_count].remote = NULL;
+    stages[stage_count].seconds = 0;
+    clock_gettime(CLOCK_MONOTONIC, &stage_start);
+    stage_open = 1;
+}
+
+// Mark the open stage as (partly) run on remote build hosts
+void stage_timer_remote(const char *how) {
+    if (stage_open) {
+        stages[stage_count].remote = how;
+    }
+}
+
+void stage_timer_end(void) {
+    struct timespec now;
+
+    if (!stage_open) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stages[stage_count].seconds = (double)(now.tv_sec - stage_start.tv_sec) +
+                                  (now.tv_nsec - stage_start.tv_nsec) / 1e9;
+    stage_count++;
+    stage_open = 0;
+}
+
+static const char *stage_mode(build_config_t *config, const stage_time_t *stage) {
+    if (stage->remote) {
+        return stage->remote;
+    }
+    switch (stage->kind) {
+        case STAGE_COMPILE: return config->cross_compile[0] ? "cross" : "native";
+        case STAGE_CHROOT: return config->host_exec == HOST_EXEC_NATIVE ? "native" : "emulated";
+        default: return "host";
+    }
+}
+
+// Per-stage wall times, printed and written to <output>/build-times.txt
+void print_stage_report(build_config_t *config) {
+    char path[MAX_PATH_LEN];
+    double total = 0, emulated = 0, remote = 0;
+
+    stage_timer_end();
+    if (stage_count == 0) {
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/build-times.txt", config->output_dir);
+    FILE *fp = fopen(path, "w");
+
+    for (int i = 0; i < stage_count; i++) {
+        total += stages[i].seconds;
+        if (stages[i].kind == STAGE_CHROOT && config->host_exec != HOST_EXEC_NATIVE) {
+            emulated += stages[i].seconds;
+        }
+        if (stages[i].remote) {
+            remote += stages[i].seconds;
+        }
+    }
+
+    printf("\n%sBuild stage times (%s):%s\n", COLOR_BOLD, host_exec_name(config->host_exec), COLOR_RESET);
+    if (fp) {
+        fprintf(fp, "host: %s\n", host_exec_name(config->host_exec));
+        fprintf(fp, "compiler: %s\n", config->cross_compile[0] ? config->cross_compile : "native");
+    }
+    for (int i = 0; i < stage_count; i++) {
+        const char *mode = stage_mode(config, &stages[i]);
+        printf("  %-28s %-9s %8.1fs\n", stages[i].name, mode, stages[i].seconds);
+        if (fp) {
+            fprintf(fp, "%s\t%s\t%.1f\n", stages[i].name, mode, stages[i].seconds);
+        }
+    }
+    printf("  %-28s %-9s %8.1fs\n", "Total", "", total);
+    if (emulated > 0) {
+        printf("  %.1fs (%.0f%%) ran aarch64 code under emulation\n", emulated, 100.0 * emulated / total);
+    }
+    if (remote > 0) {
+        printf("  %.1fs (%.0f%%) was spent in stages built on remote hosts\n", remote, 100.0 * remote / total);
+    }
+    if (fp) {
+        fprintf(fp, "total\t\t%.1f\nemulated\t\t%.1f\nremote\t\t%.1f\n", total, emulated, remote);
+        fclose(fp);
+    }
+}
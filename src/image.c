@@ -2,10 +2,15 @@
 #include "logging.h"
 #include "system_utils.h"
 #include "config.h"
+#include "partition_layout.h"
+#include "merkle.h"
+#include "sparsify.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
 
 // Create bootable Orange Pi 5 Plus image
 int create_boot_image(const char* config_path) {
@@ -17,10 +22,13 @@ int create_boot_image(const char* config_path) {
     long long image_size_mb = 6144; // 6GB for full system
     const char* mount_point = "/mnt/orangepi_image";
     
-    // Generate timestamped image name
+    // Generate timestamped image name; resolved here so <image>.merkle names the real file
+    char date[16];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y%m%d", localtime(&now));
     snprintf(image_path, sizeof(image_path), 
-        "%s/orangepi-5-plus-ubuntu-%s-$(date +%%Y%%m%%d).img", 
-        OUTPUT_DIR, UBUNTU_VERSION);
+        "%s/orangepi-5-plus-ubuntu-%s-%s.img", 
+        OUTPUT_DIR, UBUNTU_VERSION, date);
 
     // Create output directory
     snprintf(command, sizeof(command), "mkdir -p %s", OUTPUT_DIR);
@@ -97,20 +105,23 @@ int create_image_file(const char* image_path, long long size_mb) {
 int partition_orangepi_image(const char* image_path) {
     log_info("Creating Orange Pi 5 Plus partition layout...");
     
-    char command[2048];
+    partition_layout_t layout;
+    struct stat st;
     
-    // Create GPT partition table optimized for Orange Pi 5 Plus
-    snprintf(command, sizeof(command),
-        "sgdisk --zap-all %s && "
-        "sgdisk --clear "
-        "--new=1:64:8191 --change-name=1:'loader1' --typecode=1:8301 "
-        "--new=2:8192:16383 --change-name=2:'loader2' --typecode=2:8301 "
-        "--new=3:16384:24575 --change-name=3:'trust' --typecode=3:8301 "
-        "--new=4:24576:32767 --change-name=4:'boot' --typecode=4:8300 "
-        "--new=5:32768:-1 --change-name=5:'rootfs' --typecode=5:8300 "
-        "%s", image_path, image_path);
+    if (stat(image_path, &st) != 0) {
+        log_error("partition_orangepi_image", "Image file not found", 0);
+        return -1;
+    }
     
-    return execute_command(command, 1);
+    // Same erase-block-aligned layout as the interactive builder: loader, boot, rootfs
+    if (layout_init(&layout, "sd", 0) != 0 ||
+        layout_add_partition(&layout, "rootfs", LAYOUT_TYPE_LINUX, 0) != 0 ||
+        layout_resolve(&layout, (uint64_t)st.st_size) != 0) {
+        log_error("partition_orangepi_image", "Image too small for the partition layout", 0);
+        return -1;
+    }
+    
+    return layout_apply(&layout, image_path);
 }
 
 // Format Orange Pi partitions
@@ -118,13 +129,19 @@ int format_orangepi_partitions(const char* image_path) {
     log_info("Formatting Orange Pi partitions...");
     
     char command[1024];
+    partition_layout_t layout;
+    unsigned stride = 1, stripe_width = 1;
+    
+    if (layout_init(&layout, "sd", 0) == 0) {
+        layout_ext4_geometry(&layout, 4096, &stride, &stripe_width);
+    }
     
     // Setup loop device
     snprintf(command, sizeof(command), 
         "LOOP_DEV=$(losetup --find --show --partscan %s) && "
-        "mkfs.fat -F 32 -n BOOT ${LOOP_DEV}p4 && "
-        "mkfs.ext4 -L ROOTFS ${LOOP_DEV}p5 && "
-        "losetup -d $LOOP_DEV", image_path);
+        "mkfs.fat -F 32 -n BOOT ${LOOP_DEV}p2 && "
+        "mkfs.ext4 -L ROOTFS -E stride=%u,stripe_width=%u ${LOOP_DEV}p3 && "
+        "losetup -d $LOOP_DEV", image_path, stride, stripe_width);
     
     return execute_command(command, 1);
 }
@@ -139,8 +156,8 @@ int mount_orangepi_partitions(const char* image_path, const char* mount_point) {
     snprintf(command, sizeof(command),
         "mkdir -p %s %s/boot && "
         "LOOP_DEV=$(losetup --find --show --partscan %s) && "
-        "mount ${LOOP_DEV}p5 %s && "
-        "mount ${LOOP_DEV}p4 %s/boot && "
+        "mount ${LOOP_DEV}p3 %s && "
+        "mount ${LOOP_DEV}p2 %s/boot && "
         "echo $LOOP_DEV > /tmp/orangepi_loop_device",
         mount_point, mount_point, image_path, mount_point, mount_point);
     
@@ -205,9 +222,9 @@ int configure_boot_files(const char* mount_point) {
         "cat > %s/boot/boot.cmd << 'EOF'\n"
         "# Orange Pi 5 Plus Boot Script\n"
         "setenv bootargs \"root=LABEL=ROOTFS rootwait rw console=ttyS2,1500000 console=tty1 consoleblank=0 loglevel=1 ubootpart=\\${partition} usb-storage.quirks=\\${usbstoragequirks} \\${extraargs}\"\n"
-        "if load mmc \\${devnum}:1 \\${kernel_addr_r} /Image; then\n"
-        "  if load mmc \\${devnum}:1 \\${fdt_addr_r} /rk3588-orangepi-5-plus.dtb; then\n"
-        "    if load mmc \\${devnum}:1 \\${ramdisk_addr_r} /initrd.img; then\n"
+        "if load mmc \\${devnum}:2 \\${kernel_addr_r} /Image; then\n"
+        "  if load mmc \\${devnum}:2 \\${fdt_addr_r} /rk3588-orangepi-5-plus.dtb; then\n"
+        "    if load mmc \\${devnum}:2 \\${ramdisk_addr_r} /initrd.img; then\n"
         "      booti \\${kernel_addr_r} \\${ramdisk_addr_r}:\\${filesize} \\${fdt_addr_r};\n"
         "    else\n"
         "      booti \\${kernel_addr_r} - \\${fdt_addr_r};\n"
@@ -259,6 +276,28 @@ int unmount_orangepi_partitions(const char* mount_point) {
 
 // Compress final image
 int compress_final_image(const char* image_path) {
+    // The hash tree needs the raw image, so it is written before xz replaces it
+    char tree_path[1024];
+    merkle_tree_t tree;
+    sparsify_stats_t stats;
+    
+    // Stale data in free blocks would otherwise be compressed along with the files
+    if (sparsify_image(image_path, &stats) == 0) {
+        log_info("Released %llu MB of free space before compression",
+                 (unsigned long long)((stats.free_bytes + stats.zero_bytes) >> 20));
+    } else {
+        log_warn("Image free space was not released");
+    }
+    
+    snprintf(tree_path, sizeof(tree_path), "%s.merkle", image_path);
+    merkle_init(&tree, MERKLE_DEFAULT_LEAF_SIZE);
+    if (merkle_add_gpt_regions(&tree, image_path) != 0 ||
+        merkle_compute(&tree, image_path, (int)sysconf(_SC_NPROCESSORS_ONLN)) != 0 ||
+        merkle_save(&tree, tree_path) != 0) {
+        log_warn("Image hash tree was not written");
+    }
+    merkle_free(&tree);
+    
     log_info("Compressing final image...");
     
     char command[1024];
@@ -274,6 +313,53 @@ int compress_final_image(const char* image_path) {
     return 0;
 }
 
+static void log_bad_leaf(const merkle_region_t *region, uint64_t offset, uint64_t size, void *user) {
+    (void)user;
+    log_warn("Mismatch in %s at offset %llu (%llu bytes)", region->name,
+             (unsigned long long)offset, (unsigned long long)size);
+}
+
+// Verify an image against <image>.merkle (or its xz checksum once compressed)
+int verify_image_integrity(const char* image_path) {
+    char tree_path[1024];
+    char command[2048];
+    merkle_tree_t tree;
+    
+    snprintf(tree_path, sizeof(tree_path), "%s.merkle", image_path);
+    if (merkle_load(tree_path, &tree) != 0) {
+        log_error("verify_image_integrity", "Failed to load image hash tree", 0);
+        return -1;
+    }
+    
+    if (merkle_check_tree(&tree) != 0) {
+        merkle_free(&tree);
+        log_error("verify_image_integrity", "Image hash tree is inconsistent", 0);
+        return -1;
+    }
+    
+    // A compressed image can only be checked as a whole
+    if (access(image_path, F_OK) != 0) {
+        merkle_free(&tree);
+        log_info("Verifying compressed image %s.xz...", image_path);
+        snprintf(command, sizeof(command), "cd $(dirname %s) && sha256sum -c $(basename %s).xz.sha256",
+            image_path, image_path);
+        return execute_command(command, 1);
+    }
+    
+    log_info("Verifying %s against its hash tree...", image_path);
+    long bad = merkle_verify(&tree, image_path, NULL, 0, 0, (int)sysconf(_SC_NPROCESSORS_ONLN),
+                             log_bad_leaf, NULL);
+    merkle_free(&tree);
+    
+    if (bad != 0) {
+        log_error("verify_image_integrity", "Image does not match its hash tree", (int)bad);
+        return -1;
+    }
+    
+    log_info("Image integrity verified");
+    return 0;
+}
+
 // Legacy wrapper functions
 int create_system_image(build_config_t *config) {
     (void)config; // Suppress unused parameter warning
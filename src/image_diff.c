@@ -0,0 +1,640 @@
+/*
+ * image_diff.c - Structural image comparison for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains functions for explaining what changed between two
+ * builds. Every image is written with three small companions: the rootfs
+ * manifest (<image>.manifest), the installed package list (<image>.packages)
+ * and the kernel config (<image>.kconfig). Comparing two images reads only
+ * those, so it takes seconds however large the images are; an image without
+ * them is read through the rootless inspector instead.
+ */
+
+#include "../builder.h"
+#include <glob.h>
+
+#define PACKAGES_HEADER "# orangepi-packages v1"
+
+typedef struct {
+    char *name;
+    char *version;
+    long long size_kb;
+} package_entry_t;
+
+typedef struct {
+    package_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} package_list_t;
+
+// A kernel config symbol; unset symbols have the value "n"
+typedef struct {
+    char *name;
+    char *value;
+} kconfig_entry_t;
+
+typedef struct {
+    kconfig_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} kconfig_list_t;
+
+typedef struct {
+    manifest_t files;
+    package_list_t packages;
+    kconfig_list_t kconfig;
+    int have_packages;
+    int have_kconfig;
+} image_contents_t;
+
+// A file whose presence or size changed
+typedef struct {
+    const char *path;
+    long long old_size;
+    long long new_size;
+    char kind;                      // '+', '-' or 'M'
+} file_change_t;
+
+// Size change rolled up to a two-level directory such as usr/lib
+typedef struct {
+    char prefix[256];
+    long long delta;
+} dir_change_t;
+
+static int compare_packages(const void *a, const void *b) {
+    return strcmp(((const package_entry_t *)a)->name, ((const package_entry_t *)b)->name);
+}
+
+static int compare_kconfig(const void *a, const void *b) {
+    return strcmp(((const kconfig_entry_t *)a)->name, ((const kconfig_entry_t *)b)->name);
+}
+
+static long long abs_delta(long long delta) {
+    return delta < 0 ? -delta : delta;
+}
+
+static int compare_file_changes(const void *a, const void *b) {
+    const file_change_t *x = a, *y = b;
+    long long dx = abs_delta(x->new_size - x->old_size);
+    long long dy = abs_delta(y->new_size - y->old_size);
+    return dx < dy ? 1 : dx > dy ? -1 : strcmp(x->path, y->path);
+}
+
+static int compare_dir_changes(const void *a, const void *b) {
+    long long dx = abs_delta(((const dir_change_t *)a)->delta);
+    long long dy = abs_delta(((const dir_change_t *)b)->delta);
+    return dx < dy ? 1 : dx > dy ? -1 : 0;
+}
+
+static int package_append(package_list_t *list, const char *name, const char *version, long long size_kb) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        package_entry_t *entries = realloc(list->entries, capacity * sizeof(*entries));
+        if (!entries) {
+            return -1;
+        }
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+
+    package_entry_t *e = &list->entries[list->count];
+    e->name = strdup(name);
+    e->version = strdup(version);
+    e->size_kb = size_kb;
+    if (!e->name || !e->version) {
+        free(e->name);
+        free(e->version);
+        return -1;
+    }
+    list->count++;
+    return 0;
+}
+
+static void package_list_free(package_list_t *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->entries[i].name);
+        free(list->entries[i].version);
+    }
+    free(list->entries);
+    memset(list, 0, sizeof(*list));
+}
+
+// Installed packages from a dpkg status file, sorted by name
+static int parse_dpkg_status(const char *path, package_list_t *list) {
+    char line[1024];
+    char name[256] = "", version[256] = "";
+    long long size_kb = 0;
+    int installed = 0;
+
+    memset(list, 0, sizeof(*list));
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    // Stanzas are separated by blank lines; a final one without a trailing blank is flushed at EOF
+    int done = 0;
+    while (!done) {
+        done = fgets(line, sizeof(line), fp) == NULL;
+        if (done || line[0] == '\n') {
+            if (name[0] && installed && package_append(list, name, version, size_kb) != 0) {
+                break;
+            }
+            name[0] = version[0] = '\0';
+            size_kb = 0;
+            installed = 0;
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+
+        if (strncmp(line, "Package: ", 9) == 0) {
+            snprintf(name, sizeof(name), "%s", line + 9);
+        } else if (strncmp(line, "Version: ", 9) == 0) {
+            snprintf(version, sizeof(version), "%s", line + 9);
+        } else if (strncmp(line, "Installed-Size: ", 16) == 0) {
+            size_kb = atoll(line + 16);
+        } else if (strncmp(line, "Status: ", 8) == 0) {
+            installed = strstr(line, " installed") != NULL;
+        }
+    }
+    fclose(fp);
+
+    qsort(list->entries, list->count, sizeof(package_entry_t), compare_packages);
+    return ERROR_SUCCESS;
+}
+
+static int save_packages(const package_list_t *list, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    fprintf(fp, "%s\n", PACKAGES_HEADER);
+    for (size_t i = 0; i < list->count; i++) {
+        fprintf(fp, "%s\t%s\t%lld\n", list->entries[i].name, list->entries[i].version, list->entries[i].size_kb);
+    }
+    return fclose(fp) == 0 ? ERROR_SUCCESS : ERROR_FILE_NOT_FOUND;
+}
+
+static int load_packages(const char *path, package_list_t *list) {
+    char line[1024];
+    char name[256], version[256];
+    long long size_kb;
+
+    memset(list, 0, sizeof(*list));
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] != '#' && sscanf(line, "%255[^\t]\t%255[^\t]\t%lld", name, version, &size_kb) == 3) {
+            package_append(list, name, version, size_kb);
+        }
+    }
+    fclose(fp);
+
+    qsort(list->entries, list->count, sizeof(package_entry_t), compare_packages);
+    return ERROR_SUCCESS;
+}
+
+static void kconfig_list_free(kconfig_list_t *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->entries[i].name);
+        free(list->entries[i].value);
+    }
+    free(list->entries);
+    memset(list, 0, sizeof(*list));
+}
+
+// CONFIG_X=value and "# CONFIG_X is not set" lines of a kernel .config
+static int load_kconfig(const char *path, kconfig_list_t *list) {
+    char line[1024];
+    char name[256];
+
+    memset(list, 0, sizeof(*list));
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        const char *value;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "CONFIG_", 7) == 0 && strchr(line, '=')) {
+            char *eq = strchr(line, '=');
+            *eq = '\0';
+            snprintf(name, sizeof(name), "%s", line);
+            value = eq + 1;
+        } else if (sscanf(line, "# %255s is not set", name) == 1 && strncmp(name, "CONFIG_", 7) == 0) {
+            value = "n";
+        } else {
+            continue;
+        }
+
+        if (list->count == list->capacity) {
+            size_t capacity = list->capacity ? list->capacity * 2 : 4096;
+            kconfig_entry_t *entries = realloc(list->entries, capacity * sizeof(*entries));
+            if (!entries) {
+                break;
+            }
+            list->entries = entries;
+            list->capacity = capacity;
+        }
+        list->entries[list->count].name = strdup(name);
+        list->entries[list->count].value = strdup(value);
+        list->count++;
+    }
+    fclose(fp);
+
+    qsort(list->entries, list->count, sizeof(kconfig_entry_t), compare_kconfig);
+    return ERROR_SUCCESS;
+}
+
+// Find boot/config-* in a directory tree
+static int find_kernel_config(const char *root_dir, char *path, size_t size) {
+    char pattern[MAX_PATH_LEN];
+    glob_t matches;
+
+    snprintf(pattern, sizeof(pattern), "%s/boot/config-*", root_dir);
+    if (glob(pattern, 0, NULL, &matches) != 0) {
+        return -1;
+    }
+    snprintf(path, size, "%s", matches.gl_pathv[matches.gl_pathc - 1]);
+    globfree(&matches);
+    return 0;
+}
+
+// Write <image>.manifest, .packages and .kconfig from the staged rootfs
+int write_image_contents(build_config_t *config, const char *image_path) {
+    char rootfs_dir[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    char source[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    manifest_t previous, manifest;
+    package_list_t packages;
+
+    LOG_INFO("Recording image contents...");
+
+    snprintf(rootfs_dir, sizeof(rootfs_dir), "%s/rootfs", config->output_dir);
+
+    // The incremental base, when there is one, saves re-hashing unchanged files
+    snprintf(path, sizeof(path), "%s/incremental/base.manifest", config->output_dir);
+    int have_previous = manifest_load(path, &previous) == ERROR_SUCCESS;
+
+    int result = manifest_build(rootfs_dir, have_previous ? &previous : NULL, &manifest);
+    if (have_previous) {
+        manifest_free(&previous);
+    }
+    if (result != ERROR_SUCCESS) {
+        return result;
+    }
+    snprintf(path, sizeof(path), "%s.manifest", image_path);
+    result = manifest_save(&manifest, path);
+    manifest_free(&manifest);
+    if (result != ERROR_SUCCESS) {
+        return result;
+    }
+
+    snprintf(source, sizeof(source), "%s/var/lib/dpkg/status", rootfs_dir);
+    snprintf(path, sizeof(path), "%s.packages", image_path);
+    if (parse_dpkg_status(source, &packages) == ERROR_SUCCESS) {
+        result = save_packages(&packages, path);
+        package_list_free(&packages);
+    }
+
+    snprintf(path, sizeof(path), "%s.kconfig", image_path);
+    unlink(path);
+    if (result == ERROR_SUCCESS && find_kernel_config(rootfs_dir, source, sizeof(source)) == 0) {
+        snprintf(cmd, sizeof(cmd), "cp %s %s", source, path);
+        result = execute_command_safe(cmd, 0, &error_ctx) == 0 ? ERROR_SUCCESS : ERROR_FILE_NOT_FOUND;
+    }
+
+    return result;
+}
+
+static void free_contents(image_contents_t *contents) {
+    manifest_free(&contents->files);
+    package_list_free(&contents->packages);
+    kconfig_list_free(&contents->kconfig);
+}
+
+// Read an image without companions through the inspector: slow, but needs no root
+static int extract_contents(const char *image, image_contents_t *contents) {
+    char work_dir[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    static int serial;
+
+    snprintf(work_dir, sizeof(work_dir), "/tmp/orangepi-image-diff.%d.%d", (int)getpid(), serial++);
+    snprintf(path, sizeof(path), "No manifest next to %s, reading the image", image);
+    LOG_INFO(path);
+
+    int result = inspect_extract(image, NULL, "/", work_dir);
+    if (result == ERROR_SUCCESS) {
+        snprintf(path, sizeof(path), "%s/boot", work_dir);
+        result = inspect_extract(image, "boot", "/", path);
+    }
+    if (result == ERROR_SUCCESS) {
+        result = manifest_build(work_dir, NULL, &contents->files);
+    }
+    if (result == ERROR_SUCCESS) {
+        snprintf(path, sizeof(path), "%s/var/lib/dpkg/status", work_dir);
+        contents->have_packages = parse_dpkg_status(path, &contents->packages) == ERROR_SUCCESS;
+        contents->have_kconfig = find_kernel_config(work_dir, path, sizeof(path)) == 0 &&
+                                 load_kconfig(path, &contents->kconfig) == ERROR_SUCCESS;
+    }
+
+    snprintf(cmd, sizeof(cmd), "chmod -R u+rwX %s; rm -rf %s", work_dir, work_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+    return result;
+}
+
+// Accept an image with companions, a bare image, or a .manifest file
+static int load_contents(const char *arg, image_contents_t *contents) {
+    char base[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    size_t len = strlen(arg);
+
+    memset(contents, 0, sizeof(*contents));
+
+    if (len > 9 && strcmp(arg + len - 9, ".manifest") == 0) {
+        snprintf(base, sizeof(base), "%.*s", (int)(len - 9), arg);
+    } else {
+        snprintf(base, sizeof(base), "%s", arg);
+        snprintf(path, sizeof(path), "%s.manifest", arg);
+        if (access(path, R_OK) != 0) {
+            return extract_contents(arg, contents);
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s.manifest", base);
+    if (manifest_load(path, &contents->files) != ERROR_SUCCESS) {
+        snprintf(base, sizeof(base), "Failed to load manifest %s", path);
+        LOG_ERROR(base);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    snprintf(path, sizeof(path), "%s.packages", base);
+    contents->have_packages = load_packages(path, &contents->packages) == ERROR_SUCCESS;
+    snprintf(path, sizeof(path), "%s.kconfig", base);
+    contents->have_kconfig = load_kconfig(path, &contents->kconfig) == ERROR_SUCCESS;
+    return ERROR_SUCCESS;
+}
+
+static void format_size(long long bytes, char *text, size_t size) {
+    long long magnitude = abs_delta(bytes);
+    const char *sign = bytes < 0 ? "-" : "+";
+
+    if (magnitude >= 1024 * 1024) {
+        snprintf(text, size, "%s%.1f MB", sign, magnitude / (1024.0 * 1024.0));
+    } else if (magnitude >= 1024) {
+        snprintf(text, size, "%s%.1f KB", sign, magnitude / 1024.0);
+    } else {
+        snprintf(text, size, "%s%lld B", sign, magnitude);
+    }
+}
+
+static void add_dir_change(dir_change_t **dirs, size_t *count, size_t *capacity, const char *path, long long delta) {
+    char prefix[256];
+    const char *slash = strchr(path, '/');
+
+    // Two levels (usr/lib) say where growth happened without drowning in detail
+    if (slash && strchr(slash + 1, '/')) {
+        slash = strchr(slash + 1, '/');
+        snprintf(prefix, sizeof(prefix), "%.*s", (int)(slash - path), path);
+    } else if (slash) {
+        snprintf(prefix, sizeof(prefix), "%.*s", (int)(slash - path), path);
+    } else {
+        snprintf(prefix, sizeof(prefix), "/");
+    }
+
+    for (size_t i = 0; i < *count; i++) {
+        if (strcmp((*dirs)[i].prefix, prefix) == 0) {
+            (*dirs)[i].delta += delta;
+            return;
+        }
+    }
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 256;
+        dir_change_t *resized = realloc(*dirs, grown * sizeof(dir_change_t));
+        if (!resized) {
+            return;
+        }
+        *dirs = resized;
+        *capacity = grown;
+    }
+    snprintf((*dirs)[*count].prefix, sizeof((*dirs)[*count].prefix), "%s", prefix);
+    (*dirs)[*count].delta = delta;
+    (*count)++;
+}
+
+static void report_files(const manifest_t *old, const manifest_t *new, int limit) {
+    file_change_t *changes = malloc((old->count + new->count + 1) * sizeof(file_change_t));
+    dir_change_t *dirs = NULL;
+    size_t change_count = 0, dir_count = 0, dir_capacity = 0;
+    size_t added = 0, removed = 0, resized = 0, modified = 0;
+    long long added_bytes = 0, removed_bytes = 0, net = 0;
+    char text[64];
+    size_t i = 0, j = 0;
+
+    if (!changes) {
+        return;
+    }
+
+    while (i < old->count || j < new->count) {
+        const manifest_entry_t *o = i < old->count ? &old->entries[i] : NULL;
+        const manifest_entry_t *n = j < new->count ? &new->entries[j] : NULL;
+        int cmp = !o ? 1 : !n ? -1 : strcmp(o->path, n->path);
+        long long old_size = (cmp <= 0 && o->type == 'f') ? o->size : 0;
+        long long new_size = (cmp >= 0 && n->type == 'f') ? n->size : 0;
+        char kind = 0;
+
+        if (cmp < 0) {
+            kind = '-';
+            removed++;
+            removed_bytes += old_size;
+            i++;
+        } else if (cmp > 0) {
+            kind = '+';
+            added++;
+            added_bytes += new_size;
+            j++;
+        } else {
+            if (o->type != n->type || old_size != new_size) {
+                kind = 'M';
+                resized++;
+            } else if (strcmp(o->hash, n->hash) != 0) {
+                modified++;
+            }
+            i++;
+            j++;
+        }
+
+        if (kind) {
+            const manifest_entry_t *e = cmp < 0 ? o : n;
+            changes[change_count].path = e->path;
+            changes[change_count].old_size = old_size;
+            changes[change_count].new_size = new_size;
+            changes[change_count].kind = kind;
+            change_count++;
+            net += new_size - old_size;
+            add_dir_change(&dirs, &dir_count, &dir_capacity, e->path, new_size - old_size);
+        }
+    }
+
+    printf("\nFiles\n");
+    format_size(added_bytes, text, sizeof(text));
+    printf("  %zu added (%s)", added, text);
+    format_size(-removed_bytes, text, sizeof(text));
+    printf(", %zu removed (%s), %zu resized, %zu modified in place\n", removed, text, resized, modified);
+    format_size(net, text, sizeof(text));
+    printf("  Net change: %s\n", text);
+
+    qsort(changes, change_count, sizeof(file_change_t), compare_file_changes);
+    if (change_count) {
+        printf("\n  Largest changes:\n");
+    }
+    for (size_t k = 0; k < change_count && (int)k < limit; k++) {
+        format_size(changes[k].new_size - changes[k].old_size, text, sizeof(text));
+        printf("  %c %12s  %s\n", changes[k].kind, text, changes[k].path);
+    }
+
+    qsort(dirs, dir_count, sizeof(dir_change_t), compare_dir_changes);
+    if (dir_count) {
+        printf("\n  By directory:\n");
+    }
+    for (size_t k = 0; k < dir_count && (int)k < limit && dirs[k].delta != 0; k++) {
+        format_size(dirs[k].delta, text, sizeof(text));
+        printf("    %12s  %s\n", text, dirs[k].prefix);
+    }
+
+    free(changes);
+    free(dirs);
+}
+
+static void report_packages(const package_list_t *old, const package_list_t *new) {
+    size_t added = 0, removed = 0, changed = 0;
+    size_t i = 0, j = 0;
+
+    printf("\nPackages\n");
+    while (i < old->count || j < new->count) {
+        const package_entry_t *o = i < old->count ? &old->entries[i] : NULL;
+        const package_entry_t *n = j < new->count ? &new->entries[j] : NULL;
+        int cmp = !o ? 1 : !n ? -1 : strcmp(o->name, n->name);
+
+        if (cmp < 0) {
+            printf("  - %s %s\n", o->name, o->version);
+            removed++;
+            i++;
+        } else if (cmp > 0) {
+            printf("  + %s %s (%lld KB)\n", n->name, n->version, n->size_kb);
+            added++;
+            j++;
+        } else {
+            if (strcmp(o->version, n->version) != 0) {
+                printf("  ~ %s %s -> %s (%+lld KB)\n", n->name, o->version, n->version, n->size_kb - o->size_kb);
+                changed++;
+            }
+            i++;
+            j++;
+        }
+    }
+    printf("  %zu added, %zu removed, %zu changed version\n", added, removed, changed);
+}
+
+static void report_kconfig(const kconfig_list_t *old, const kconfig_list_t *new) {
+    size_t changed = 0;
+    size_t i = 0, j = 0;
+
+    printf("\nKernel config\n");
+    while (i < old->count || j < new->count) {
+        const kconfig_entry_t *o = i < old->count ? &old->entries[i] : NULL;
+        const kconfig_entry_t *n = j < new->count ? &new->entries[j] : NULL;
+        int cmp = !o ? 1 : !n ? -1 : strcmp(o->name, n->name);
+
+        // A symbol missing from one side is as good as unset there
+        const char *old_value = cmp <= 0 ? o->value : "n";
+        const char *new_value = cmp >= 0 ? n->value : "n";
+        const char *name = cmp <= 0 ? o->name : n->name;
+
+        if (strcmp(old_value, new_value) != 0) {
+            printf("  %s: %s -> %s\n", name, old_value, new_value);
+            changed++;
+        }
+        if (cmp <= 0) i++;
+        if (cmp >= 0) j++;
+    }
+    printf("  %zu symbols changed\n", changed);
+}
+
+static void report_boot(const manifest_t *old, const manifest_t *new) {
+    size_t changed = 0;
+    size_t i = 0, j = 0;
+    char text[64];
+
+    printf("\nBoot files\n");
+    while (i < old->count || j < new->count) {
+        const manifest_entry_t *o = i < old->count ? &old->entries[i] : NULL;
+        const manifest_entry_t *n = j < new->count ? &new->entries[j] : NULL;
+        int cmp = !o ? 1 : !n ? -1 : strcmp(o->path, n->path);
+        const manifest_entry_t *e = cmp <= 0 ? o : n;
+
+        if (strncmp(e->path, "boot/", 5) == 0 && e->type != 'd') {
+            if (cmp < 0) {
+                printf("  - %s\n", o->path);
+                changed++;
+            } else if (cmp > 0) {
+                format_size(n->size, text, sizeof(text));
+                printf("  + %s (%s)\n", n->path, text);
+                changed++;
+            } else if (strcmp(o->hash, n->hash) != 0) {
+                format_size(n->size - o->size, text, sizeof(text));
+                printf("  M %s (%s)\n", n->path, text);
+                changed++;
+            }
+        }
+        if (cmp <= 0) i++;
+        if (cmp >= 0) j++;
+    }
+    printf("  %zu boot files changed\n", changed);
+}
+
+// Explain what changed between two images (or their manifests)
+int image_diff(const char *old_path, const char *new_path, int limit) {
+    image_contents_t old_contents, new_contents;
+
+    if (load_contents(old_path, &old_contents) != ERROR_SUCCESS) {
+        free_contents(&old_contents);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    if (load_contents(new_path, &new_contents) != ERROR_SUCCESS) {
+        free_contents(&old_contents);
+        free_contents(&new_contents);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    printf("%s -> %s\n", old_path, new_path);
+    report_files(&old_contents.files, &new_contents.files, limit);
+
+    if (old_contents.have_packages && new_contents.have_packages) {
+        report_packages(&old_contents.packages, &new_contents.packages);
+    } else {
+        printf("\nPackages: no package list on %s side\n", old_contents.have_packages ? "the new" : "the old");
+    }
+
+    if (old_contents.have_kconfig && new_contents.have_kconfig) {
+        report_kconfig(&old_contents.kconfig, &new_contents.kconfig);
+    } else {
+        printf("\nKernel config: no kernel config on %s side\n", old_contents.have_kconfig ? "the new" : "the old");
+    }
+
+    report_boot(&old_contents.files, &new_contents.files);
+
+    free_contents(&old_contents);
+    free_contents(&new_contents);
+    return ERROR_SUCCESS;
+}
@@ -0,0 +1,91 @@
+/*
+ * image_metadata.c - Image metadata for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the function that records how an image was built:
+ * release, kernel, partition layout, root filesystem format and tuning
+ * profile. The same key=value file is installed in the image as
+ * /etc/orangepi-image-info and written next to the image as <image>.info.
+ * Finished images also get a per-partition Merkle tree in <image>.merkle.
+ */
+
+#include "../builder.h"
+
+// Write image metadata as shell-sourceable key=value lines; image_mb < 0 omits the size
+int write_image_metadata(build_config_t *config, const char *path, long image_mb) {
+    char mount_options[256];
+    partition_layout_t layout;
+    const fs_tuning_profile_t *profile = get_fs_tuning_profile(config);
+
+    FILE *info = fopen(path, "w");
+    if (!info) {
+        LOG_ERROR("Failed to write image metadata");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    get_root_mount_options(config, mount_options, sizeof(mount_options));
+
+    fprintf(info, "# Orange Pi 5 Plus image metadata\n");
+    fprintf(info, "BUILDER_VERSION=\"%s\"\n", VERSION);
+    fprintf(info, "BUILD_DATE=\"%lld\"\n", get_build_timestamp(config));
+    fprintf(info, "UBUNTU_RELEASE=\"%s\"\n", config->ubuntu_release);
+    fprintf(info, "UBUNTU_CODENAME=\"%s\"\n", config->ubuntu_codename);
+    fprintf(info, "KERNEL_VERSION=\"%s\"\n", config->kernel_version);
+    fprintf(info, "TARGET_MEDIUM=\"%s\"\n", config->target_medium);
+    if (init_image_layout(config, &layout) == ERROR_SUCCESS) {
+        fprintf(info, "ERASE_BLOCK_KB=\"%llu\"\n", (unsigned long long)(layout.erase_block_bytes / 1024));
+    }
+    fprintf(info, "ROOTFS_FORMAT=\"%s\"\n", rootfs_format_name(config->rootfs_format));
+    if (rootfs_format_is_readonly(config)) {
+        char root_hash[128];
+        unsigned long long data_blocks, hash_offset;
+
+        fprintf(info, "ROOTFS_COMPRESSION=\"%s\"\n", config->rootfs_compression);
+        fprintf(info, "OVERLAY=\"%s\"\n", config->overlay_type == OVERLAY_TMPFS ? "tmpfs" : "partition");
+        if (config->dm_verity && image_mb >= 0 &&
+            read_verity_params(config, root_hash, sizeof(root_hash), &data_blocks, &hash_offset) == ERROR_SUCCESS) {
+            fprintf(info, "VERITY_ROOT_HASH=\"%s\"\n", root_hash);
+        }
+    }
+    fprintf(info, "FS_PROFILE=\"%s\"\n", profile->name);
+    fprintf(info, "FS_JOURNAL_SIZE_MB=\"%d\"\n", profile->journal_size_mb);
+    fprintf(info, "FS_RESERVED_PERCENT=\"%d\"\n", profile->reserved_percent);
+    fprintf(info, "ROOT_MOUNT_OPTIONS=\"%s\"\n", mount_options);
+    if (image_mb >= 0) {
+        fprintf(info, "IMAGE_SIZE_MB=\"%ld\"\n", image_mb);
+    }
+    fclose(info);
+
+    return ERROR_SUCCESS;
+}
+
+// Hash every partition of the finished image into <image>.merkle, using all build jobs
+int write_image_hash_tree(build_config_t *config, const char *image_path) {
+    char path[MAX_PATH_LEN];
+    char hex[SHA256_HEX_SIZE];
+    char msg[512];
+    merkle_tree_t tree;
+
+    LOG_INFO("Computing image hash tree...");
+
+    merkle_init(&tree, MERKLE_DEFAULT_LEAF_SIZE);
+    if (merkle_add_gpt_regions(&tree, image_path) != 0) {
+        LOG_ERROR("Failed to read the image partition table");
+        merkle_free(&tree);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    snprintf(path, sizeof(path), "%s.merkle", image_path);
+    if (merkle_compute(&tree, image_path, config->jobs) != 0 || merkle_save(&tree, path) != 0) {
+        LOG_ERROR("Failed to write image hash tree");
+        merkle_free(&tree);
+        return ERROR_UNKNOWN;
+    }
+
+    sha256_to_hex(tree.root, hex);
+    snprintf(msg, sizeof(msg), "Image hash tree: %zu regions, root %s", tree.count, hex);
+    LOG_INFO(msg);
+
+    merkle_free(&tree);
+    return ERROR_SUCCESS;
+}
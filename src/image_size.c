@@ -0,0 +1,303 @@
+/*
+ * image_size.c - Image sizing for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains functions for sizing the system image to the staged
+ * rootfs ("auto" image size) and for installing the first-boot unit that
+ * grows the root partition and filesystem to fill the card.
+ */
+
+#include "../builder.h"
+
+// Smallest root partition we are willing to create in auto mode
+#define MIN_ROOT_PART_MB 1024
+// ext4 default inode ratio (mke2fs.conf "default" usage type)
+#define EXT4_BYTES_PER_INODE 16384
+
+// Run a command and read a single number from its output
+static long read_command_number(const char *cmd) {
+    char line[128];
+    long value = -1;
+    FILE *fp = popen(cmd, "r");
+
+    if (!fp) {
+        return -1;
+    }
+
+    if (fgets(line, sizeof(line), fp)) {
+        value = atol(line);
+    }
+    pclose(fp);
+
+    return value;
+}
+
+// Measure the disk usage of a staged rootfs in MB
+long measure_rootfs_mb(const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+
+    snprintf(cmd, sizeof(cmd), "du -sxm %s 2>/dev/null | cut -f1", rootfs_dir);
+    return read_command_number(cmd);
+}
+
+// Count the files (inodes) in a staged rootfs
+long count_rootfs_inodes(const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+
+    snprintf(cmd, sizeof(cmd), "find %s -xdev 2>/dev/null | wc -l", rootfs_dir);
+    return read_command_number(cmd);
+}
+
+// Check whether the image size is set to "auto"
+int image_size_is_auto(build_config_t *config) {
+    return config && strcmp(config->image_size, "auto") == 0;
+}
+
+// Start the partition layout (loader + boot) for the configured target medium
+int init_image_layout(build_config_t *config, partition_layout_t *layout) {
+    if (layout_init(layout, config->target_medium, (uint64_t)config->erase_block_kb) != 0) {
+        LOG_ERROR("Unknown target medium or invalid erase block size");
+        return ERROR_UNKNOWN;
+    }
+    return ERROR_SUCCESS;
+}
+
+// Image size for data_mb of partitions after the loader and boot area, with
+// one erase block at the end for the backup GPT so the last partition stays aligned
+static long layout_image_mb(partition_layout_t *layout, long data_mb) {
+    long erase_mb = (long)layout_erase_block_mb(layout);
+    long image_mb = (long)layout_next_start_mb(layout) + data_mb + erase_mb;
+
+    return ((image_mb + erase_mb - 1) / erase_mb) * erase_mb;
+}
+
+// Resolve the configured image size into MB
+int resolve_image_size(build_config_t *config, long *image_mb) {
+    char rootfs_dir[MAX_PATH_LEN];
+    char msg[512];
+
+    if (!config || !image_mb) {
+        LOG_ERROR("Configuration is NULL");
+        return ERROR_UNKNOWN;
+    }
+
+    if (!image_size_is_auto(config)) {
+        *image_mb = atol(config->image_size);
+        return ERROR_SUCCESS;
+    }
+
+    partition_layout_t layout;
+    if (init_image_layout(config, &layout) != ERROR_SUCCESS) {
+        return ERROR_UNKNOWN;
+    }
+
+    // A read-only root is sized exactly; only the overlay gets the free space
+    if (rootfs_format_is_readonly(config)) {
+        char root_image[MAX_PATH_LEN];
+        struct stat st;
+
+        get_readonly_root_image_path(config, root_image, sizeof(root_image));
+        if (stat(root_image, &st) != 0) {
+            LOG_ERROR("Read-only root image must be built before sizing the image");
+            return ERROR_FILE_NOT_FOUND;
+        }
+
+        long root_mb = (long)((st.st_size + (1024 * 1024) - 1) / (1024 * 1024));
+        long erase_mb = (long)layout_erase_block_mb(&layout);
+        long data_mb = ((root_mb + erase_mb - 1) / erase_mb) * erase_mb;
+        if (overlay_uses_partition(config)) {
+            data_mb += config->overlay_size_mb;
+        }
+        *image_mb = layout_image_mb(&layout, data_mb);
+
+        snprintf(msg, sizeof(msg), "Auto image size: %ld MB root image -> %ld MB image",
+                 root_mb, *image_mb);
+        LOG_INFO(msg);
+        return ERROR_SUCCESS;
+    }
+
+    snprintf(rootfs_dir, sizeof(rootfs_dir), "%s/rootfs", config->output_dir);
+
+    long used_mb = measure_rootfs_mb(rootfs_dir);
+    long inodes = count_rootfs_inodes(rootfs_dir);
+    if (used_mb <= 0 || inodes <= 0) {
+        LOG_ERROR("Failed to measure staged rootfs for auto image size");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    // Headroom for the user, plus ext4 metadata, journal and reserved blocks
+    long root_mb = used_mb + (used_mb * config->image_headroom_percent) / 100;
+    root_mb += (used_mb * 6) / 100 + 128;
+
+    // Make sure the default inode ratio leaves enough inodes for every file
+    long inode_mb = ((inodes + inodes / 5) * EXT4_BYTES_PER_INODE) / (1024 * 1024);
+    if (root_mb < inode_mb) {
+        root_mb = inode_mb;
+    }
+
+    if (root_mb < MIN_ROOT_PART_MB) {
+        root_mb = MIN_ROOT_PART_MB;
+    }
+
+    // Loader/boot area in front, backup GPT behind, rounded to the erase block
+    *image_mb = layout_image_mb(&layout, root_mb);
+
+    snprintf(msg, sizeof(msg),
+             "Auto image size: rootfs uses %ld MB in %ld files, +%d%% headroom -> %ld MB image",
+             used_mb, inodes, config->image_headroom_percent, *image_mb);
+    LOG_INFO(msg);
+
+    return ERROR_SUCCESS;
+}
+
+// f2fs cannot grow while mounted: resize it from the initramfs before root is mounted
+static int install_f2fs_resize_support(const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/etc/initramfs-tools/hooks %s/etc/initramfs-tools/scripts/local-premount",
+             rootfs_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(path, sizeof(path), "%s/etc/initramfs-tools/hooks/orangepi-f2fs-resize", rootfs_dir);
+    FILE *hook = fopen(path, "w");
+    if (!hook) {
+        LOG_ERROR("Failed to write f2fs resize initramfs hook");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    fprintf(hook,
+            "#!/bin/sh\n"
+            "PREREQ=\"\"\n"
+            "prereqs() { echo \"$PREREQ\"; }\n"
+            "case \"$1\" in prereqs) prereqs; exit 0 ;; esac\n"
+            "\n"
+            ". /usr/share/initramfs-tools/hook-functions\n"
+            "copy_exec /usr/sbin/resize.f2fs /sbin\n");
+    fclose(hook);
+    chmod(path, 0755);
+
+    snprintf(path, sizeof(path), "%s/etc/initramfs-tools/scripts/local-premount/orangepi-f2fs-resize", rootfs_dir);
+    FILE *script = fopen(path, "w");
+    if (!script) {
+        LOG_ERROR("Failed to write f2fs resize initramfs script");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    fprintf(script,
+            "#!/bin/sh\n"
+            "PREREQ=\"\"\n"
+            "prereqs() { echo \"$PREREQ\"; }\n"
+            "case \"$1\" in prereqs) prereqs; exit 0 ;; esac\n"
+            "\n"
+            ". /scripts/functions\n"
+            "\n"
+            "DEV=$(readlink -f \"$(resolve_device \"$ROOT\")\") || exit 0\n"
+            "[ -b \"$DEV\" ] && [ \"$(get_fstype \"$DEV\")\" = f2fs ] || exit 0\n"
+            "\n"
+            "# block_count (4 KiB blocks) is 36 bytes into the superblock at 1 KiB\n"
+            "FS_BLOCKS=$(dd if=\"$DEV\" bs=1 skip=1060 count=8 2>/dev/null | od -An -t u8 | tr -d ' ')\n"
+            "PART_BLOCKS=$(( $(cat \"/sys/class/block/$(basename \"$DEV\")/size\") / 8 ))\n"
+            "\n"
+            "# Only after orangepi-expand-rootfs grew the partition; segment rounding leaves a few MB\n"
+            "if [ -n \"$FS_BLOCKS\" ] && [ $((PART_BLOCKS - FS_BLOCKS)) -gt 1024 ]; then\n"
+            "    log_begin_msg \"Growing f2fs root filesystem\"\n"
+            "    resize.f2fs \"$DEV\" || true\n"
+            "    log_end_msg\n"
+            "fi\n");
+    fclose(script);
+    chmod(path, 0755);
+
+    return ERROR_SUCCESS;
+}
+
+// Install the first-boot unit that grows the root partition to fill the medium
+int install_rootfs_expand_service(build_config_t *config, const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    // With a read-only root the writable overlay partition is the one to grow
+    const char *target = rootfs_format_is_readonly(config) ? "/run/overlay/rw" : "/";
+
+    LOG_INFO("Installing first-boot root filesystem expansion...");
+
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/usr/local/sbin %s/etc/systemd/system/local-fs.target.wants",
+             rootfs_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    snprintf(path, sizeof(path), "%s/usr/local/sbin/orangepi-expand-rootfs", rootfs_dir);
+    FILE *script = fopen(path, "w");
+    if (!script) {
+        LOG_ERROR("Failed to write root expansion script");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    fprintf(script,
+            "#!/bin/sh\n"
+            "# Grow the root partition to the end of the boot medium, then the filesystem\n"
+            "set -e\n"
+            "TARGET=%s\n"
+            "# -v drops the [/subvolume] suffix btrfs adds to the source\n"
+            "ROOT_DEV=$(findmnt -n -v -o SOURCE \"$TARGET\")\n"
+            "ROOT_NAME=$(basename \"$ROOT_DEV\")\n"
+            "DISK=\"/dev/$(lsblk -n -o PKNAME \"$ROOT_DEV\" | head -n1)\"\n"
+            "PART_NUM=$(cat \"/sys/class/block/$ROOT_NAME/partition\")\n"
+            "\n"
+            "# The image was sized to its contents, so the backup GPT is not at the end of the card\n"
+            "sfdisk --relocate gpt-bak-std \"$DISK\" || true\n"
+            "echo ', +' | sfdisk --no-reread --no-tell-kernel -N \"$PART_NUM\" \"$DISK\"\n"
+            "partx --update --nr \"$PART_NUM\" \"$DISK\"\n"
+            "\n"
+            "case \"$(findmnt -n -o FSTYPE \"$TARGET\")\" in\n"
+            "    ext4) resize2fs \"$ROOT_DEV\" ;;\n"
+            "    btrfs) btrfs filesystem resize max \"$TARGET\" ;;\n"
+            "    f2fs) echo \"Partition grown; the initramfs grows f2fs on the next boot\" ;;\n"
+            "    *) echo \"Root filesystem cannot be grown online, skipping\" ;;\n"
+            "esac\n"
+            "\n"
+            "mkdir -p /var/lib/orangepi\n"
+            "touch /var/lib/orangepi/rootfs-expanded\n",
+            target);
+    fclose(script);
+    chmod(path, 0755);
+
+    snprintf(path, sizeof(path), "%s/etc/systemd/system/orangepi-expand-rootfs.service", rootfs_dir);
+    FILE *unit = fopen(path, "w");
+    if (!unit) {
+        LOG_ERROR("Failed to write root expansion service");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    fprintf(unit,
+            "[Unit]\n"
+            "Description=Grow root partition and filesystem to fill the boot medium\n"
+            "DefaultDependencies=no\n"
+            "After=systemd-remount-fs.service\n"
+            "Before=local-fs.target shutdown.target\n"
+            "Conflicts=shutdown.target\n"
+            "ConditionPathExists=!/var/lib/orangepi/rootfs-expanded\n"
+            "\n"
+            "[Service]\n"
+            "Type=oneshot\n"
+            "ExecStart=/usr/local/sbin/orangepi-expand-rootfs\n"
+            "RemainAfterExit=yes\n"
+            "\n"
+            "[Install]\n"
+            "WantedBy=local-fs.target\n");
+    fclose(unit);
+
+    // Picked up when install_rootfs_format_support() regenerates the initramfs
+    if (config->rootfs_format == ROOTFS_FORMAT_F2FS && install_f2fs_resize_support(rootfs_dir) != ERROR_SUCCESS) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    // Enable without a chroot so this works after the emulation files are gone
+    snprintf(cmd, sizeof(cmd),
+             "ln -sf /etc/systemd/system/orangepi-expand-rootfs.service "
+             "%s/etc/systemd/system/local-fs.target.wants/orangepi-expand-rootfs.service",
+             rootfs_dir);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_WARNING("Failed to enable root expansion service");
+        return ERROR_INSTALLATION_FAILED;
+    }
+
+    return ERROR_SUCCESS;
+}
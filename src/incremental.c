@@ -0,0 +1,278 @@
+/*
+ * incremental.c - Incremental image refresh for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains functions for refreshing an image from the previous
+ * build instead of assembling it from scratch. The last image, its rootfs
+ * manifest and a key describing its layout are kept in
+ * <output_dir>/incremental; when the layout key still matches, a copy of the
+ * image is updated with only the files whose manifest entries changed. The
+ * root partition is last, so a larger image only grows it and its filesystem.
+ */
+
+#include "../builder.h"
+
+static void incremental_path(build_config_t *config, const char *name, char *path, size_t size) {
+    snprintf(path, size, "%s/incremental/%s", config->output_dir, name);
+}
+
+// Everything that changes partitioning or mkfs; any difference forces a full rebuild.
+// The image size is left out: it only moves the end of the root partition.
+static void build_layout_key(build_config_t *config, char *key, size_t size) {
+    partition_layout_t layout;
+    unsigned long long erase_kb = 0;
+    unsigned long long root_start_mb = 0;
+
+    if (init_image_layout(config, &layout) == ERROR_SUCCESS) {
+        erase_kb = (unsigned long long)(layout.erase_block_bytes / 1024);
+        root_start_mb = (unsigned long long)layout_next_start_mb(&layout);
+    }
+
+    snprintf(key, size, "version=%s medium=%s erase_kb=%llu root_start_mb=%llu format=%s profile=%s",
+             VERSION, config->target_medium, erase_kb, root_start_mb,
+             rootfs_format_name(config->rootfs_format), get_fs_tuning_profile(config)->name);
+}
+
+// Extend the copied image to image_mb and move the root partition's end to the new disk end
+static int grow_incremental_image(build_config_t *config, const char *image_path, long image_mb) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    partition_layout_t layout;
+
+    if (init_image_layout(config, &layout) != ERROR_SUCCESS ||
+        layout_add_partition(&layout, "root", LAYOUT_TYPE_LINUX, 0) != 0 ||
+        layout_resolve(&layout, (uint64_t)image_mb * 1024 * 1024) != 0) {
+        return ERROR_UNKNOWN;
+    }
+
+    // Move the backup GPT to the new end, then resize partition 3 in place (start unchanged)
+    snprintf(cmd, sizeof(cmd),
+             "truncate -s %ldM %s && sfdisk --quiet --relocate gpt-bak-std %s && "
+             "echo ',%llu' | sfdisk --quiet --no-reread --no-tell-kernel -N %d %s",
+             image_mb, image_path, image_path,
+             (unsigned long long)layout.parts[layout.count - 1].sectors, layout.count, image_path);
+    return execute_command_safe(cmd, 1, &error_ctx) == 0 ? ERROR_SUCCESS : ERROR_UNKNOWN;
+}
+
+// Copy the previous image to image_path if its layout matches; ERROR_SUCCESS means update in place.
+// A smaller image_mb keeps the previous size, since filesystems cannot all shrink online.
+int prepare_incremental_image(build_config_t *config, const char *image_path, long *image_mb) {
+    char cmd[MAX_CMD_LEN];
+    char base_image[MAX_PATH_LEN];
+    char base_manifest[MAX_PATH_LEN];
+    char key_path[MAX_PATH_LEN];
+    char key[512];
+    char saved_key[512] = "";
+    char msg[512];
+    error_context_t error_ctx = {0};
+    struct stat st;
+
+    if (rootfs_format_is_readonly(config)) {
+        LOG_INFO("Read-only root images are always assembled in full");
+        return ERROR_UNKNOWN;
+    }
+
+    incremental_path(config, "base.img", base_image, sizeof(base_image));
+    incremental_path(config, "base.manifest", base_manifest, sizeof(base_manifest));
+    incremental_path(config, "layout", key_path, sizeof(key_path));
+
+    // Never let a manifest from an earlier, interrupted build be saved as the base
+    incremental_path(config, "manifest.new", cmd, sizeof(cmd));
+    unlink(cmd);
+
+    if (stat(base_image, &st) != 0 || access(base_manifest, F_OK) != 0) {
+        LOG_INFO("No previous image to refresh, assembling in full");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    FILE *fp = fopen(key_path, "r");
+    if (fp) {
+        if (fgets(saved_key, sizeof(saved_key), fp)) {
+            saved_key[strcspn(saved_key, "\n")] = '\0';
+        }
+        fclose(fp);
+    }
+
+    build_layout_key(config, key, sizeof(key));
+    if (strcmp(key, saved_key) != 0) {
+        LOG_INFO("Image layout changed since the last build, assembling in full");
+        return ERROR_UNKNOWN;
+    }
+
+    long base_mb = (long)(st.st_size / (1024 * 1024));
+    if (*image_mb > base_mb && config->rootfs_format == ROOTFS_FORMAT_F2FS) {
+        // resize.f2fs only works on an unmounted filesystem
+        LOG_INFO("Image grew and F2FS cannot be resized online, assembling in full");
+        return ERROR_UNKNOWN;
+    }
+    if (*image_mb < base_mb) {
+        snprintf(msg, sizeof(msg), "Keeping the previous image size of %ld MB (%ld MB needed)",
+                 base_mb, *image_mb);
+        LOG_INFO(msg);
+        *image_mb = base_mb;
+    }
+
+    LOG_INFO("Refreshing the previous image incrementally...");
+
+    // Reflinks make this free on btrfs/XFS; elsewhere it is still cheaper than mkfs + full copy
+    snprintf(cmd, sizeof(cmd), "cp --reflink=auto --sparse=always %s %s", base_image, image_path);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_WARNING("Failed to copy the previous image, assembling in full");
+        return ERROR_UNKNOWN;
+    }
+
+    if (*image_mb > base_mb && grow_incremental_image(config, image_path, *image_mb) != ERROR_SUCCESS) {
+        LOG_WARNING("Failed to grow the previous image, assembling in full");
+        unlink(image_path);
+        return ERROR_UNKNOWN;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Bring the root filesystem mounted at mount_point in line with the staged rootfs
+int apply_incremental_update(build_config_t *config, const char *rootfs_dir, const char *mount_point) {
+    char cmd[MAX_CMD_LEN];
+    char base_manifest[MAX_PATH_LEN];
+    char new_manifest[MAX_PATH_LEN];
+    char update_path[MAX_PATH_LEN];
+    char remove_path[MAX_PATH_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+    manifest_t old_manifest, manifest;
+    manifest_diff_stats_t stats;
+
+    incremental_path(config, "base.manifest", base_manifest, sizeof(base_manifest));
+    incremental_path(config, "manifest.new", new_manifest, sizeof(new_manifest));
+    incremental_path(config, "update.list", update_path, sizeof(update_path));
+    incremental_path(config, "remove.list", remove_path, sizeof(remove_path));
+
+    if (manifest_load(base_manifest, &old_manifest) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to load the previous image manifest");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    if (manifest_build(rootfs_dir, &old_manifest, &manifest) != ERROR_SUCCESS) {
+        manifest_free(&old_manifest);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    FILE *update_list = fopen(update_path, "w");
+    FILE *remove_list = fopen(remove_path, "w");
+    if (!update_list || !remove_list) {
+        if (update_list) fclose(update_list);
+        if (remove_list) fclose(remove_list);
+        manifest_free(&old_manifest);
+        manifest_free(&manifest);
+        LOG_ERROR("Failed to write incremental file lists");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    manifest_diff(&old_manifest, &manifest, update_list, remove_list, &stats);
+    fclose(update_list);
+    fclose(remove_list);
+
+    snprintf(msg, sizeof(msg),
+             "Incremental update: %zu added, %zu changed, %zu removed, %zu unchanged (%lld MB to copy)",
+             stats.added, stats.changed, stats.removed, stats.unchanged,
+             stats.update_bytes / (1024 * 1024));
+    LOG_INFO(msg);
+
+    int result = ERROR_SUCCESS;
+
+    // Take up any space the root partition gained in prepare_incremental_image(); a no-op otherwise
+    if (config->rootfs_format == ROOTFS_FORMAT_BTRFS) {
+        snprintf(cmd, sizeof(cmd), "btrfs filesystem resize max %s", mount_point);
+    } else {
+        snprintf(cmd, sizeof(cmd), "resize2fs $(findmnt -n -o SOURCE %s)", mount_point);
+    }
+    if (config->rootfs_format != ROOTFS_FORMAT_F2FS && execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        result = ERROR_INSTALLATION_FAILED;
+    }
+
+    snprintf(cmd, sizeof(cmd), "cd %s && xargs -0 -r rm -rf -- < %s", mount_point, remove_path);
+    if (result == ERROR_SUCCESS && execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        result = ERROR_INSTALLATION_FAILED;
+    }
+
+    // --files-from copies exactly the listed paths (no recursion) and creates parent directories
+    snprintf(cmd, sizeof(cmd), "rsync -aHAX --force --from0 --files-from=%s %s/ %s/",
+             update_path, rootfs_dir, mount_point);
+    if (result == ERROR_SUCCESS && execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        result = ERROR_INSTALLATION_FAILED;
+    }
+
+    if (result == ERROR_SUCCESS) {
+        result = manifest_save(&manifest, new_manifest);
+    } else {
+        LOG_ERROR("Failed to apply incremental update");
+    }
+
+    manifest_free(&old_manifest);
+    manifest_free(&manifest);
+    return result;
+}
+
+// Keep the finished image and its manifest as the base for the next build
+int save_incremental_base(build_config_t *config, const char *image_path) {
+    char cmd[MAX_CMD_LEN];
+    char rootfs_dir[MAX_PATH_LEN];
+    char base_image[MAX_PATH_LEN];
+    char base_manifest[MAX_PATH_LEN];
+    char new_manifest[MAX_PATH_LEN];
+    char key_path[MAX_PATH_LEN];
+    char key[512];
+    error_context_t error_ctx = {0};
+
+    if (rootfs_format_is_readonly(config)) {
+        return ERROR_SUCCESS;
+    }
+
+    snprintf(rootfs_dir, sizeof(rootfs_dir), "%s/rootfs", config->output_dir);
+    incremental_path(config, "base.img", base_image, sizeof(base_image));
+    incremental_path(config, "base.manifest", base_manifest, sizeof(base_manifest));
+    incremental_path(config, "manifest.new", new_manifest, sizeof(new_manifest));
+    incremental_path(config, "layout", key_path, sizeof(key_path));
+
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/incremental", config->output_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    // A full assembly has no manifest yet; reuse hashes from the old one where possible
+    if (access(new_manifest, F_OK) != 0) {
+        manifest_t old_manifest, manifest;
+        int have_old = manifest_load(base_manifest, &old_manifest) == ERROR_SUCCESS;
+
+        int result = manifest_build(rootfs_dir, have_old ? &old_manifest : NULL, &manifest);
+        if (have_old) {
+            manifest_free(&old_manifest);
+        }
+        if (result != ERROR_SUCCESS) {
+            return result;
+        }
+        result = manifest_save(&manifest, new_manifest);
+        manifest_free(&manifest);
+        if (result != ERROR_SUCCESS) {
+            return result;
+        }
+    }
+
+    snprintf(cmd, sizeof(cmd),
+             "cp --reflink=auto --sparse=always %s %s.tmp && mv -f %s.tmp %s && mv -f %s %s",
+             image_path, base_image, base_image, base_image, new_manifest, base_manifest);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_WARNING("Failed to save the image as incremental base");
+        unlink(base_manifest);
+        return ERROR_UNKNOWN;
+    }
+
+    FILE *fp = fopen(key_path, "w");
+    if (!fp) {
+        unlink(base_manifest);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    build_layout_key(config, key, sizeof(key));
+    fprintf(fp, "%s\n", key);
+    fclose(fp);
+
+    return ERROR_SUCCESS;
+}
@@ -0,0 +1,544 @@
+/*
+ * inspect.c - Rootless image inspection for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains functions for looking inside a finished image without
+ * root, loop devices or mounts. The GPT is parsed directly, partition usage
+ * is read from the filesystem superblocks, and files are listed or copied
+ * out with the userspace tools of each filesystem pointed at the partition's
+ * byte offset (debugfs, mtools, unsquashfs, erofs-utils). Compressed images
+ * are decompressed to a temporary sparse file, only as far as needed.
+ */
+
+#include "../builder.h"
+
+typedef struct {
+    char path[MAX_PATH_LEN];        // Raw image, or its temporary decompressed copy
+    int temporary;
+    int number;
+    char name[40];
+    const char *fs;
+    uint64_t offset;
+    uint64_t size;
+} inspect_partition_t;
+
+static uint32_t le16(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return le16(p) | (le16(p + 2) << 16);
+}
+
+static int read_at(const char *path, uint64_t offset, void *buffer, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = pread(fd, buffer, size, (off_t)offset);
+    close(fd);
+    return n == (ssize_t)size ? 0 : -1;
+}
+
+static const char* image_decompressor(const char *image) {
+    size_t len = strlen(image);
+
+    if (len > 3 && strcmp(image + len - 3, ".xz") == 0) return "xz -dc";
+    if (len > 4 && strcmp(image + len - 4, ".zst") == 0) return "zstd -dc";
+    if (len > 3 && strcmp(image + len - 3, ".gz") == 0) return "gzip -dc";
+    return NULL;
+}
+
+// Make the first length bytes of image (0 = all) readable at path
+static int open_image(const char *image, uint64_t length, inspect_partition_t *part) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    const char *decompress = image_decompressor(image);
+
+    if (!decompress) {
+        snprintf(part->path, sizeof(part->path), "%s", image);
+        part->temporary = 0;
+        return access(image, R_OK);
+    }
+
+    // Streams have no index to seek with, but the decompressor stops once head has enough
+    snprintf(part->path, sizeof(part->path), "/tmp/orangepi-inspect.%d.img", (int)getpid());
+    part->temporary = 1;
+    if (length) {
+        snprintf(cmd, sizeof(cmd), "%s %s | head -c %llu | cp --sparse=always /dev/stdin %s",
+                 decompress, image, (unsigned long long)length, part->path);
+    } else {
+        snprintf(cmd, sizeof(cmd), "%s %s | cp --sparse=always /dev/stdin %s", decompress, image, part->path);
+    }
+    return execute_command_safe(cmd, 0, &error_ctx);
+}
+
+static void close_image(inspect_partition_t *part) {
+    if (part->temporary) {
+        unlink(part->path);
+        part->temporary = 0;
+    }
+}
+
+static const char* detect_fs(const char *path, uint64_t offset) {
+    uint8_t sb[2048];
+
+    if (read_at(path, offset, sb, sizeof(sb)) != 0) {
+        return "unknown";
+    }
+    if (le16(sb + 1024 + 56) == 0xEF53) return "ext4";
+    if (le32(sb + 1024) == 0xE0F5E1E2) return "erofs";
+    if (memcmp(sb, "hsqs", 4) == 0) return "squashfs";
+    if (memcmp(sb + 1024 + 64, "_BHRfS_M", 8) == 0) return "btrfs";
+    if (le32(sb + 1024) == 0xF2F52010) return "f2fs";
+    if (sb[510] == 0x55 && sb[511] == 0xAA && (memcmp(sb + 54, "FAT", 3) == 0 || memcmp(sb + 82, "FAT", 3) == 0)) {
+        return "vfat";
+    }
+    return "unknown";
+}
+
+static int part_matches(const gpt_partition_t *p, const char *name) {
+    if (strcmp(p->name, name) == 0) {
+        return 1;
+    }
+    if (name[0] == 'p') {
+        name++;
+    }
+    return isdigit((unsigned char)name[0]) && atoi(name) == p->number;
+}
+
+// Locate a partition by GPT name or number (default: the root partition)
+static int open_partition(const char *image, const char *name, inspect_partition_t *part) {
+    gpt_table_t table;
+    const gpt_partition_t *found = NULL;
+    char msg[512];
+
+    memset(part, 0, sizeof(*part));
+
+    // Entries end at LBA 33, well inside the first MiB
+    if (open_image(image, 1024 * 1024, part) != 0 || gpt_read(part->path, &table) != 0) {
+        close_image(part);
+        snprintf(msg, sizeof(msg), "No GPT found in %s", image);
+        LOG_ERROR(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    close_image(part);
+
+    for (int i = 0; i < table.count && !found; i++) {
+        if (name ? part_matches(&table.partitions[i], name) :
+                   (strcmp(table.partitions[i].name, "root") == 0 || strcmp(table.partitions[i].name, "rootfs") == 0)) {
+            found = &table.partitions[i];
+        }
+    }
+    if (!found) {
+        snprintf(msg, sizeof(msg), "Partition %s not found in %s", name ? name : "root", image);
+        LOG_ERROR(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    part->number = found->number;
+    snprintf(part->name, sizeof(part->name), "%s", found->name[0] ? found->name : "-");
+    part->offset = gpt_partition_offset(found);
+    part->size = gpt_partition_size(found);
+
+    if (open_image(image, part->offset + part->size, part) != 0) {
+        close_image(part);
+        LOG_ERROR("Failed to decompress image");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    part->fs = detect_fs(part->path, part->offset);
+    return ERROR_SUCCESS;
+}
+
+// Used bytes from the superblock; returns -1 when the filesystem is not understood
+static int ext4_usage(const char *path, uint64_t offset, uint64_t *total, uint64_t *used) {
+    uint8_t sb[1024];
+
+    if (read_at(path, offset + 1024, sb, sizeof(sb)) != 0) {
+        return -1;
+    }
+
+    uint64_t block_size = 1024ULL << le32(sb + 24);
+    uint64_t blocks = le32(sb + 4);
+    uint64_t free_blocks = le32(sb + 12);
+    if (le32(sb + 96) & 0x80) {   // INCOMPAT_64BIT
+        blocks |= (uint64_t)le32(sb + 0x150) << 32;
+        free_blocks |= (uint64_t)le32(sb + 0x158) << 32;
+    }
+
+    *total = blocks * block_size;
+    *used = (blocks - free_blocks) * block_size;
+    return 0;
+}
+
+// FAT keeps no reliable free count, so the allocation table is scanned
+static int fat_usage(const char *path, uint64_t offset, uint64_t *total, uint64_t *used) {
+    uint8_t bs[512];
+
+    if (read_at(path, offset, bs, sizeof(bs)) != 0) {
+        return -1;
+    }
+
+    uint32_t bytes_per_sector = le16(bs + 11);
+    uint32_t sectors_per_cluster = bs[13];
+    uint32_t reserved = le16(bs + 14);
+    uint32_t fats = bs[16];
+    uint32_t root_entries = le16(bs + 17);
+    uint32_t sectors = le16(bs + 19) ? le16(bs + 19) : le32(bs + 32);
+    uint32_t fat_sectors = le16(bs + 22) ? le16(bs + 22) : le32(bs + 36);
+    if (!bytes_per_sector || !sectors_per_cluster) {
+        return -1;
+    }
+
+    uint32_t root_sectors = (root_entries * 32 + bytes_per_sector - 1) / bytes_per_sector;
+    uint32_t data_start = reserved + fats * fat_sectors + root_sectors;
+    if (sectors <= data_start) {
+        return -1;
+    }
+    uint32_t clusters = (sectors - data_start) / sectors_per_cluster;
+    int bits = clusters < 4085 ? 12 : clusters < 65525 ? 16 : 32;
+
+    size_t fat_bytes = (size_t)fat_sectors * bytes_per_sector;
+    uint8_t *fat = malloc(fat_bytes);
+    if (!fat || read_at(path, offset + (uint64_t)reserved * bytes_per_sector, fat, fat_bytes) != 0) {
+        free(fat);
+        return -1;
+    }
+
+    uint64_t used_clusters = 0;
+    for (uint32_t c = 2; c < clusters + 2; c++) {
+        uint32_t entry;
+        if (bits == 12) {
+            size_t at = c + c / 2;
+            if (at + 1 >= fat_bytes) break;
+            entry = le16(fat + at);
+            entry = (c & 1) ? entry >> 4 : entry & 0xFFF;
+        } else if (bits == 16) {
+            if ((size_t)c * 2 + 1 >= fat_bytes) break;
+            entry = le16(fat + c * 2);
+        } else {
+            if ((size_t)c * 4 + 3 >= fat_bytes) break;
+            entry = le32(fat + (size_t)c * 4) & 0x0FFFFFFF;
+        }
+        if (entry != 0) {
+            used_clusters++;
+        }
+    }
+    free(fat);
+
+    uint64_t cluster_bytes = (uint64_t)sectors_per_cluster * bytes_per_sector;
+    *total = (uint64_t)clusters * cluster_bytes;
+    *used = used_clusters * cluster_bytes;
+    return 0;
+}
+
+// Read-only filesystems are always full: used is the filesystem size
+static int readonly_usage(const char *path, uint64_t offset, const char *fs, uint64_t *total, uint64_t *used) {
+    uint8_t sb[2048];
+
+    if (read_at(path, offset, sb, sizeof(sb)) != 0) {
+        return -1;
+    }
+    if (strcmp(fs, "squashfs") == 0) {
+        *used = le32(sb + 40) | ((uint64_t)le32(sb + 44) << 32);
+    } else {
+        *used = (uint64_t)le32(sb + 1024 + 36) << sb[1024 + 12];
+    }
+    *total = *used;
+    return 0;
+}
+
+// Print every partition with its filesystem and how full it is
+int inspect_partition_usage(const char *image) {
+    inspect_partition_t img;
+    gpt_table_t table;
+
+    memset(&img, 0, sizeof(img));
+    if (open_image(image, 0, &img) != 0 || gpt_read(img.path, &table) != 0) {
+        close_image(&img);
+        LOG_ERROR("Failed to read the image partition table");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    printf("%-3s %-10s %-9s %12s %10s %10s %10s %5s\n",
+           "#", "Name", "FS", "Offset", "Size MB", "Used MB", "Free MB", "Use%");
+
+    for (int i = 0; i < table.count; i++) {
+        const gpt_partition_t *p = &table.partitions[i];
+        uint64_t offset = gpt_partition_offset(p);
+        uint64_t size = gpt_partition_size(p);
+        uint64_t total = 0, used = 0;
+        const char *fs = detect_fs(img.path, offset);
+        int known;
+
+        if (strcmp(fs, "ext4") == 0) {
+            known = ext4_usage(img.path, offset, &total, &used) == 0;
+        } else if (strcmp(fs, "vfat") == 0) {
+            known = fat_usage(img.path, offset, &total, &used) == 0;
+        } else if (strcmp(fs, "squashfs") == 0 || strcmp(fs, "erofs") == 0) {
+            known = readonly_usage(img.path, offset, fs, &total, &used) == 0;
+        } else {
+            known = 0;
+        }
+
+        if (known && total) {
+            printf("%-3d %-10s %-9s %12llu %10llu %10llu %10llu %4llu%%\n",
+                   p->number, p->name[0] ? p->name : "-", fs, (unsigned long long)offset,
+                   (unsigned long long)(size / (1024 * 1024)), (unsigned long long)(used / (1024 * 1024)),
+                   (unsigned long long)((total - used) / (1024 * 1024)),
+                   (unsigned long long)(used * 100 / total));
+        } else {
+            printf("%-3d %-10s %-9s %12llu %10llu %10s %10s %5s\n",
+                   p->number, p->name[0] ? p->name : "-", fs, (unsigned long long)offset,
+                   (unsigned long long)(size / (1024 * 1024)), "-", "-", "-");
+        }
+    }
+
+    close_image(&img);
+    return ERROR_SUCCESS;
+}
+
+// Shell command that runs a filesystem tool on one partition of the image.
+// op is "ls", "cat" or "extract"; dest is the directory for "extract".
+static int build_tool_command(const inspect_partition_t *part, const char *op, const char *path,
+                              const char *dest, char *cmd, size_t size) {
+    unsigned long long offset = (unsigned long long)part->offset;
+    const char *rel = path[0] == '/' ? path + 1 : path;
+
+    if (strcmp(part->fs, "ext4") == 0) {
+        if (strcmp(op, "ls") == 0) {
+            snprintf(cmd, size, "debugfs -R 'ls -l \"%s\"' '%s?offset=%llu'", path, part->path, offset);
+        } else if (strcmp(op, "cat") == 0) {
+            snprintf(cmd, size, "debugfs -R 'cat \"%s\"' '%s?offset=%llu' 2>/dev/null", path, part->path, offset);
+        } else {
+            // rdump keeps modes and symlinks; ownership needs root and is skipped otherwise
+            snprintf(cmd, size, "debugfs -R 'rdump \"%s\" \"%s\"' '%s?offset=%llu'", path, dest, part->path, offset);
+        }
+    } else if (strcmp(part->fs, "vfat") == 0) {
+        if (strcmp(op, "ls") == 0) {
+            snprintf(cmd, size, "MTOOLS_SKIP_CHECK=1 mdir -i '%s@@%llu' '::/%s'", part->path, offset, rel);
+        } else if (strcmp(op, "cat") == 0) {
+            snprintf(cmd, size, "MTOOLS_SKIP_CHECK=1 mcopy -n -i '%s@@%llu' '::/%s' -", part->path, offset, rel);
+        } else if (rel[0] == '\0') {
+            snprintf(cmd, size, "MTOOLS_SKIP_CHECK=1 mcopy -s -n -m -i '%s@@%llu' '::/*' '%s/'",
+                     part->path, offset, dest);
+        } else {
+            snprintf(cmd, size, "MTOOLS_SKIP_CHECK=1 mcopy -s -n -m -i '%s@@%llu' '::/%s' '%s/'",
+                     part->path, offset, rel, dest);
+        }
+    } else if (strcmp(part->fs, "squashfs") == 0) {
+        if (strcmp(op, "ls") == 0) {
+            snprintf(cmd, size, "unsquashfs -o %llu -lls '%s' '%s'", offset, part->path, path);
+        } else if (strcmp(op, "cat") == 0) {
+            snprintf(cmd, size, "unsquashfs -o %llu -cat '%s' '%s'", offset, part->path, path);
+        } else {
+            // unsquashfs recreates the full path, so extract beside dest and move the result in
+            snprintf(cmd, size,
+                     "rm -rf '%s/.inspect' && unsquashfs -q -n -o %llu -d '%s/.inspect' '%s' '%s' && "
+                     "mv '%s/.inspect/%s'%s '%s/' && rm -rf '%s/.inspect'",
+                     dest, offset, dest, part->path, path, dest, rel, rel[0] ? "" : "*", dest, dest);
+        }
+    } else if (strcmp(part->fs, "erofs") == 0) {
+        if (strcmp(op, "ls") == 0) {
+            snprintf(cmd, size, "dump.erofs --offset=%llu --ls --path='%s' '%s'", offset, path, part->path);
+        } else if (strcmp(op, "cat") == 0) {
+            snprintf(cmd, size, "dump.erofs --offset=%llu --cat --path='%s' '%s'", offset, path, part->path);
+        } else {
+            // fsck.erofs only extracts whole filesystems
+            snprintf(cmd, size,
+                     "rm -rf '%s/.inspect' && fsck.erofs --offset=%llu --extract='%s/.inspect' --no-preserve '%s' && "
+                     "mv '%s/.inspect/%s'%s '%s/' && rm -rf '%s/.inspect'",
+                     dest, offset, dest, part->path, dest, rel, rel[0] ? "" : "*", dest, dest);
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Run a tool and stream its output to stdout unchanged
+static int run_to_stdout(const char *cmd) {
+    char buffer[65536];
+    size_t n;
+
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        return -1;
+    }
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        fwrite(buffer, 1, n, stdout);
+    }
+    return pclose(fp) == 0 ? 0 : -1;
+}
+
+static int unsupported_fs(const inspect_partition_t *part) {
+    char msg[256];
+
+    snprintf(msg, sizeof(msg), "Cannot read %s filesystem on partition %s without mounting", part->fs, part->name);
+    LOG_ERROR(msg);
+    return ERROR_UNKNOWN;
+}
+
+int inspect_list(const char *image, const char *partition, const char *path) {
+    char cmd[MAX_CMD_LEN];
+    inspect_partition_t part;
+
+    if (open_partition(image, partition, &part) != ERROR_SUCCESS) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    int result = ERROR_SUCCESS;
+    if (build_tool_command(&part, "ls", path, NULL, cmd, sizeof(cmd)) != 0) {
+        result = unsupported_fs(&part);
+    } else if (run_to_stdout(cmd) != 0) {
+        result = ERROR_FILE_NOT_FOUND;
+    }
+
+    close_image(&part);
+    return result;
+}
+
+int inspect_cat(const char *image, const char *partition, const char *path) {
+    char cmd[MAX_CMD_LEN];
+    inspect_partition_t part;
+
+    if (open_partition(image, partition, &part) != ERROR_SUCCESS) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    int result = ERROR_SUCCESS;
+    if (build_tool_command(&part, "cat", path, NULL, cmd, sizeof(cmd)) != 0) {
+        result = unsupported_fs(&part);
+    } else if (run_to_stdout(cmd) != 0) {
+        result = ERROR_FILE_NOT_FOUND;
+    }
+
+    close_image(&part);
+    return result;
+}
+
+// Copy a file or directory tree out of the image into dest_dir
+int inspect_extract(const char *image, const char *partition, const char *path, const char *dest_dir) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    inspect_partition_t part;
+
+    if (open_partition(image, partition, &part) != ERROR_SUCCESS) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    int result = ERROR_SUCCESS;
+    snprintf(cmd, sizeof(cmd), "mkdir -p '%s'", dest_dir);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        result = ERROR_FILE_NOT_FOUND;
+    } else if (build_tool_command(&part, "extract", path, dest_dir, cmd, sizeof(cmd)) != 0) {
+        result = unsupported_fs(&part);
+    } else if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to extract from image");
+        result = ERROR_FILE_NOT_FOUND;
+    }
+
+    close_image(&part);
+    return result;
+}
+
+// Device nodes, FIFOs and sockets cannot be created without root, and the
+// image gains lost+found; neither says anything about the build
+static int diff_skipped(const manifest_entry_t *entry) {
+    return strchr("cbps", entry->type) != NULL ||
+           strcmp(entry->path, "lost+found") == 0 || strncmp(entry->path, "lost+found/", 11) == 0;
+}
+
+static int diff_entry_changed(const manifest_entry_t *image, const manifest_entry_t *staged) {
+    if (image->type != staged->type) {
+        return 1;
+    }
+    // FAT has no modes; ownership and mtimes are not kept by unprivileged extraction
+    if (strncmp(staged->path, "boot/", 5) != 0 && image->type != 'l' &&
+        (image->mode & 07777) != (staged->mode & 07777)) {
+        return 1;
+    }
+    if (image->type == 'd') {
+        return 0;
+    }
+    return image->size != staged->size || strcmp(image->hash, staged->hash) != 0;
+}
+
+// Compare the root and boot partitions with a staged rootfs, path by path
+int inspect_diff(const char *image, const char *rootfs_dir) {
+    char work_dir[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+    manifest_t image_manifest, staged_manifest;
+    size_t only_image = 0, only_staged = 0, changed = 0, same = 0;
+    int result;
+
+    snprintf(work_dir, sizeof(work_dir), "/tmp/orangepi-inspect.%d", (int)getpid());
+
+    LOG_INFO("Extracting image contents...");
+    result = inspect_extract(image, NULL, "/", work_dir);
+    if (result == ERROR_SUCCESS) {
+        // The boot partition is mounted over /boot on the board
+        snprintf(cmd, sizeof(cmd), "%s/boot", work_dir);
+        result = inspect_extract(image, "boot", "/", cmd);
+    }
+
+    if (result == ERROR_SUCCESS) {
+        LOG_INFO("Hashing image and staged rootfs...");
+        result = manifest_build(work_dir, NULL, &image_manifest);
+    }
+    if (result == ERROR_SUCCESS && manifest_build(rootfs_dir, NULL, &staged_manifest) != ERROR_SUCCESS) {
+        manifest_free(&image_manifest);
+        result = ERROR_FILE_NOT_FOUND;
+    }
+
+    // Extracted directories keep their modes, so open them up before removing
+    snprintf(cmd, sizeof(cmd), "chmod -R u+rwX %s; rm -rf %s", work_dir, work_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    if (result != ERROR_SUCCESS) {
+        return result;
+    }
+
+    // Both manifests are sorted by path, so one merge pass finds every difference
+    size_t i = 0, j = 0;
+    while (i < image_manifest.count || j < staged_manifest.count) {
+        const manifest_entry_t *a = i < image_manifest.count ? &image_manifest.entries[i] : NULL;
+        const manifest_entry_t *b = j < staged_manifest.count ? &staged_manifest.entries[j] : NULL;
+        int cmp = !a ? 1 : !b ? -1 : strcmp(a->path, b->path);
+
+        if (cmp < 0) {
+            if (!diff_skipped(a)) {
+                printf("+ %s\n", a->path);
+                only_image++;
+            }
+            i++;
+        } else if (cmp > 0) {
+            if (!diff_skipped(b)) {
+                printf("- %s\n", b->path);
+                only_staged++;
+            }
+            j++;
+        } else {
+            if (!diff_skipped(a) && diff_entry_changed(a, b)) {
+                printf("M %s\n", a->path);
+                changed++;
+            } else {
+                same++;
+            }
+            i++;
+            j++;
+        }
+    }
+
+    manifest_free(&image_manifest);
+    manifest_free(&staged_manifest);
+
+    snprintf(msg, sizeof(msg), "Image vs %s: %zu identical, %zu differ, %zu only in image, %zu missing from image",
+             rootfs_dir, same, changed, only_image, only_staged);
+    LOG_INFO(msg);
+
+    return (changed || only_image || only_staged) ? ERROR_UNKNOWN : ERROR_SUCCESS;
+}
@@ -57,6 +57,9 @@ int download_kernel_source(build_config_t *config) {
     LOG_INFO("Cleaning up previous download attempts...");
     execute_command_safe("rm -rf linux_temp", 0, &error_ctx);
     
+    // The tree is always fetched again, so this is a sources cache miss
+    cache_record(config, "sources", "linux", 0);
+    
     // Create a clean source directory if it doesn't exist
     if (create_directory_safe(source_dir, &error_ctx) != 0) {
         LOG_ERROR("Failed to create kernel source directory");
@@ -120,6 +123,13 @@ int download_kernel_source(build_config_t *config) {
         }
     }
     
+    // A bundle holds the tree this config uses; the fallbacks below are never in it
+    if (config->offline_bundle[0]) {
+        execute_command_safe("rm -rf linux_temp", 0, &error_ctx);
+        LOG_ERROR("The offline bundle has no Orange Pi kernel source; export it again for this config");
+        return ERROR_FILE_NOT_FOUND;
+    }
+    
     LOG_WARNING("Could not download Orange Pi kernel source, trying Rockchip source...");
     
     // Clean up failed attempt
@@ -415,6 +425,7 @@ int configure_kernel(build_config_t *config) {
         for (i = 0; config_options[i] != NULL; i++) {
             fprintf(config_file, "%s\n", config_options[i]);
         }
+        append_rootfs_kernel_options(config, config_file);
         fclose(config_file);
     }
     
@@ -430,6 +441,9 @@ int configure_kernel(build_config_t *config) {
     // Resolve dependencies and create final config
     LOG_INFO("Finalizing kernel configuration...");
     execute_command_safe("make olddefconfig", 1, &error_ctx);
+    if (check_rootfs_kernel_options(config, ".config") != ERROR_SUCCESS) {
+        return ERROR_KERNEL_CONFIG_FAILED;
+    }
     
     LOG_INFO("Kernel configured successfully for Orange Pi 5 Plus");
     return ERROR_SUCCESS;
@@ -438,10 +452,28 @@ int configure_kernel(build_config_t *config) {
 // Build kernel
 int build_kernel(build_config_t *config) {
     char cmd[MAX_CMD_LEN];
+    char kernel_dir[MAX_PATH_LEN];
+    char key[SHA256_HEX_SIZE];
+    char make[256];
     error_context_t error_ctx = {0};
     
     LOG_INFO("Building kernel with Mali GPU support (this may take a while)...");
     
+    // Sources, local patches, .config, the compiler and the build stamps decide the outputs
+    snprintf(kernel_dir, sizeof(kernel_dir), "%s/linux", config->build_dir);
+    snprintf(cmd, sizeof(cmd),
+             "cd %s && git rev-parse HEAD && git diff HEAD && "
+             "git ls-files -o --exclude-standard -z | xargs -0r sha256sum && cat .config && echo %s && "
+             "%sgcc --version | head -1 && "
+             "echo \"$KBUILD_BUILD_TIMESTAMP|$KBUILD_BUILD_USER|$KBUILD_BUILD_HOST|$SOURCE_DATE_EPOCH\"",
+             kernel_dir, config->arch, config->cross_compile);
+    int keyed = artifact_key_from_command("kernel", cmd, key) == 0;
+    if (keyed && (artifact_store_extract(config, "kernel", key, kernel_dir) == ERROR_SUCCESS ||
+                  remote_build_kernel(config, kernel_dir, key) == ERROR_SUCCESS)) {
+        LOG_INFO("Kernel built successfully");
+        return ERROR_SUCCESS;
+    }
+    
     // Set environment variables
     if (setenv("ARCH", config->arch, 1) != 0) {
         LOG_WARNING("Failed to set ARCH environment variable");
@@ -451,26 +483,33 @@ int build_kernel(build_config_t *config) {
     }
     
     // Build kernel image
-    snprintf(cmd, sizeof(cmd), "make -j%d Image", config->jobs);
+    get_compile_make(config, make, sizeof(make));
+    snprintf(cmd, sizeof(cmd), "%s Image", make);
     if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
         LOG_ERROR("Failed to build kernel image");
         return ERROR_COMPILATION_FAILED;
     }
     
     // Build device tree blobs
-    snprintf(cmd, sizeof(cmd), "make -j%d dtbs", config->jobs);
+    snprintf(cmd, sizeof(cmd), "%s dtbs", make);
     if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
         LOG_ERROR("Failed to build device tree blobs");
         return ERROR_COMPILATION_FAILED;
     }
     
     // Build modules
-    snprintf(cmd, sizeof(cmd), "make -j%d modules", config->jobs);
+    snprintf(cmd, sizeof(cmd), "%s modules", make);
     if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
         LOG_ERROR("Failed to build kernel modules");
         return ERROR_COMPILATION_FAILED;
     }
     
+    // Keep the outputs for later builds and other hosts
+    if (keyed) {
+        snprintf(cmd, sizeof(cmd), "cd %s && %s | tar -cf - -T -", kernel_dir, KERNEL_OUTPUT_LIST);
+        artifact_store_put(config, "kernel", key, cmd);
+    }
+    
     LOG_INFO("Kernel built successfully");
     return ERROR_SUCCESS;
 }
@@ -509,6 +548,10 @@ int install_kernel(build_config_t *config) {
         return ERROR_INSTALLATION_FAILED;
     }
     
+    // Keep the config next to the kernel, as Debian kernels do, so images can be compared
+    snprintf(cmd, sizeof(cmd), "cp .config %s/rootfs/boot/config-%s", config->output_dir, config->kernel_version);
+    execute_command_safe(cmd, 0, &error_ctx);
+    
     // Install device tree blobs
     LOG_INFO("Installing device tree blobs...");
     snprintf(cmd, sizeof(cmd),
@@ -548,6 +591,9 @@ int download_uboot_source(build_config_t *config) {
     LOG_INFO("Downloading U-Boot source for RK3588...");
     
     snprintf(uboot_dir, sizeof(uboot_dir), "%s/u-boot", config->build_dir);
+    cache_record(config, "sources", "u-boot", 0);
+    cache_record(config, "sources", "arm-trusted-firmware", 0);
+    cache_record(config, "sources", "rkbin", 0);
     
     // Clone U-Boot with Rockchip support
     auth_url = add_github_token_to_url("https://github.com/u-boot/u-boot.git");
@@ -593,12 +639,25 @@ int download_uboot_source(build_config_t *config) {
 int build_uboot(build_config_t *config) {
     char cmd[MAX_CMD_LEN];
     char uboot_dir[MAX_PATH_LEN];
+    char make[256];
+    char key[SHA256_HEX_SIZE];
     error_context_t error_ctx = {0};
     
     LOG_INFO("Building U-Boot for Orange Pi 5 Plus...");
     
     snprintf(uboot_dir, sizeof(uboot_dir), "%s/u-boot", config->build_dir);
     
+    // U-Boot, TF-A and the Rockchip blobs together decide the loader images
+    snprintf(cmd, sizeof(cmd),
+             "cd %s && for d in u-boot arm-trusted-firmware rkbin; do echo $d; "
+             "git -C $d rev-parse HEAD 2>/dev/null && git -C $d diff HEAD; done; echo %s",
+             config->build_dir, config->cross_compile);
+    int keyed = artifact_key_from_command("bootloader", cmd, key) == 0;
+    if (keyed && artifact_store_extract(config, "bootloader", key, config->output_dir) == ERROR_SUCCESS) {
+        LOG_INFO("U-Boot built successfully");
+        return ERROR_SUCCESS;
+    }
+    
     if (chdir(uboot_dir) != 0) {
         LOG_ERROR("Failed to change to U-Boot directory");
         return ERROR_FILE_NOT_FOUND;
@@ -618,9 +677,10 @@ int build_uboot(build_config_t *config) {
     }
     
     // Build U-Boot
+    get_compile_make(config, make, sizeof(make));
     snprintf(cmd, sizeof(cmd),
-             "make ARCH=arm CROSS_COMPILE=%s -j%d",
-             config->cross_compile, config->jobs);
+             "%s ARCH=arm CROSS_COMPILE=%s",
+             make, config->cross_compile);
     
     if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
         LOG_ERROR("Failed to build U-Boot");
@@ -633,7 +693,11 @@ int build_uboot(build_config_t *config) {
              "cd %s/arm-trusted-firmware && "
              "make CROSS_COMPILE=%s PLAT=rk3588 bl31",
              config->build_dir, config->cross_compile);
-    execute_command_safe(cmd, 1, &error_ctx);
+    // A loader set missing a stage must not be cached and restored as if complete
+    int complete = execute_command_safe(cmd, 1, &error_ctx) == 0;
+    if (!complete) {
+        LOG_WARNING("ARM Trusted Firmware build failed");
+    }
     
     // Create final bootloader image
     LOG_INFO("Creating bootloader image...");
@@ -642,12 +706,53 @@ int build_uboot(build_config_t *config) {
              "%s/rkbin/bin/rk35/rk3588_ddr_lp4_2112MHz_lp5_2736MHz_v1.08.bin:%s/spl/u-boot-spl.bin "
              "%s/idbloader.img",
              config->build_dir, config->build_dir, uboot_dir, config->output_dir);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_WARNING("Failed to create idbloader.img");
+        complete = 0;
+    }
+    
+    // The same loader in SPI NOR format, for boards that boot NVMe from SPI flash
+    snprintf(cmd, sizeof(cmd),
+             "%s/rkbin/tools/mkimage -n rk3588 -T rkspi -d "
+             "%s/rkbin/bin/rk35/rk3588_ddr_lp4_2112MHz_lp5_2736MHz_v1.08.bin:%s/spl/u-boot-spl.bin "
+             "%s/idbloader-spi.img",
+             config->build_dir, config->build_dir, uboot_dir, config->output_dir);
     execute_command_safe(cmd, 1, &error_ctx);
     
+    snprintf(cmd, sizeof(cmd),
+             "for f in u-boot.itb u-boot-rockchip.bin u-boot-rockchip-spi.bin; do "
+             "[ -f %s/$f ] && cp %s/$f %s/; done; true",
+             uboot_dir, uboot_dir, config->output_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+    
+    // The put fails, and nothing is stored, unless both boot stages are there
+    if (keyed && complete) {
+        snprintf(cmd, sizeof(cmd),
+                 "cd %s && test -s idbloader.img && test -s u-boot.itb && "
+                 "ls idbloader.img idbloader-spi.img u-boot.itb u-boot-rockchip.bin "
+                 "u-boot-rockchip-spi.bin 2>/dev/null | tar -cf - -T -",
+                 config->output_dir);
+        artifact_store_put(config, "bootloader", key, cmd);
+    }
+    
     LOG_INFO("U-Boot built successfully");
     return ERROR_SUCCESS;
 }
 
+// Base packages of the configured distribution, installed with rootfs-base
+const char *get_distro_base_packages(build_config_t *config) {
+    switch (config->distro_type) {
+        case DISTRO_DESKTOP:
+            return get_package_group("desktop-base");
+        case DISTRO_SERVER:
+            return get_package_group("server-base");
+        case DISTRO_EMULATION:
+            return get_package_group("emulation-base");
+        default:
+            return "";
+    }
+}
+
 // Build Ubuntu rootfs
 int build_ubuntu_rootfs(build_config_t *config) {
     char cmd[MAX_CMD_LEN];
@@ -697,34 +802,45 @@ int build_ubuntu_rootfs(build_config_t *config) {
     // Suppress Python warnings for the entire process
     setenv("PYTHONWARNINGS", "ignore", 1);
     
-    // Run debootstrap first stage
-    LOG_INFO("Running debootstrap first stage...");
-    snprintf(cmd, sizeof(cmd),
-             "debootstrap --arch=arm64 --foreign --include=wget,ca-certificates,locales "
-             "%s %s http://ports.ubuntu.com/ubuntu-ports",
-             config->ubuntu_codename, rootfs_dir);
-    
-    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
-        LOG_ERROR("Failed to run debootstrap first stage");
-        LOG_ERROR("This usually means the Ubuntu release is not supported");
-        LOG_ERROR("Try using Ubuntu 22.04 (jammy) or 20.04 (focal) instead");
-        return ERROR_INSTALLATION_FAILED;
-    }
-    
-    // Check if debootstrap created the necessary files
-    char debootstrap_dir[MAX_PATH_LEN];
-    snprintf(debootstrap_dir, sizeof(debootstrap_dir), "%s/debootstrap", rootfs_dir);
-    if (access(debootstrap_dir, F_OK) != 0) {
-        LOG_ERROR("Debootstrap did not create the expected directory structure");
-        return ERROR_INSTALLATION_FAILED;
+    char mirror[MAX_PATH_LEN];
+    get_ubuntu_mirror(config, mirror, sizeof(mirror));
+    
+    // The debootstrap result is a base layer shared through the artifact store.
+    // A pinned snapshot fixes its contents; a live mirror is reused for a day
+    char base_key[SHA256_HEX_SIZE];
+    snprintf(cmd, sizeof(cmd), "echo %s %s arm64 wget,ca-certificates,locales; %s",
+             config->ubuntu_codename, mirror, config->apt_snapshot[0] ? "true" : "date -u +%F");
+    int base_keyed = artifact_key_from_command("base-rootfs", cmd, base_key) == 0;
+    int have_base = base_keyed &&
+                    artifact_store_extract(config, "base-rootfs", base_key, rootfs_dir) == ERROR_SUCCESS;
+    
+    if (!have_base) {
+        // Run debootstrap first stage
+        LOG_INFO("Running debootstrap first stage...");
+        snprintf(cmd, sizeof(cmd),
+                 "debootstrap --arch=arm64 --foreign --include=wget,ca-certificates,locales "
+                 "%s %s %s",
+                 config->ubuntu_codename, rootfs_dir, mirror);
+        
+        if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+            LOG_ERROR("Failed to run debootstrap first stage");
+            LOG_ERROR("This usually means the Ubuntu release is not supported");
+            LOG_ERROR("Try using Ubuntu 22.04 (jammy) or 20.04 (focal) instead");
+            return ERROR_INSTALLATION_FAILED;
+        }
+        
+        // Check if debootstrap created the necessary files
+        char debootstrap_dir[MAX_PATH_LEN];
+        snprintf(debootstrap_dir, sizeof(debootstrap_dir), "%s/debootstrap", rootfs_dir);
+        if (access(debootstrap_dir, F_OK) != 0) {
+            LOG_ERROR("Debootstrap did not create the expected directory structure");
+            return ERROR_INSTALLATION_FAILED;
+        }
     }
     
-    // Copy qemu static for arm64 emulation
+    // Copy qemu static for arm64 emulation (not needed natively or with binfmt F)
     LOG_INFO("Setting up ARM64 emulation...");
-    snprintf(cmd, sizeof(cmd),
-             "cp /usr/bin/qemu-aarch64-static %s/usr/bin/",
-             rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
+    chroot_exec_prepare(config, rootfs_dir);
     
     // Mount essential filesystems for chroot
     LOG_INFO("Mounting essential filesystems for chroot environment...");
@@ -740,14 +856,30 @@ int build_ubuntu_rootfs(build_config_t *config) {
     snprintf(cmd, sizeof(cmd), "mount -o bind /dev/pts %s/dev/pts", rootfs_dir);
     execute_command_safe(cmd, 0, &error_ctx);
     
-    // Run debootstrap second stage
-    LOG_INFO("Running debootstrap second stage...");
-    snprintf(cmd, sizeof(cmd),
-             "chroot %s /debootstrap/debootstrap --second-stage",
-             rootfs_dir);
+    if (!have_base) {
+        // Run debootstrap second stage
+        LOG_INFO("Running debootstrap second stage...");
+        snprintf(cmd, sizeof(cmd),
+                 "chroot %s /debootstrap/debootstrap --second-stage",
+                 rootfs_dir);
+        
+        if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+            LOG_ERROR("Failed to run debootstrap second stage");
+            goto cleanup_mounts;
+        }
+        
+        // The chroot mounts and the emulator are not part of the layer
+        if (base_keyed) {
+            snprintf(cmd, sizeof(cmd),
+                     "tar -C %s --one-file-system --numeric-owner --xattrs --acls "
+                     "--exclude=./usr/bin/qemu-aarch64-static -cpf - .",
+                     rootfs_dir);
+            artifact_store_put(config, "base-rootfs", base_key, cmd);
+        }
+    }
     
-    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
-        LOG_ERROR("Failed to run debootstrap second stage");
+    // Offline, apt inside the chroot reads the bundle at the path it has on the host
+    if (config->offline_bundle[0] && offline_mount_bundle(config, rootfs_dir) != ERROR_SUCCESS) {
         goto cleanup_mounts;
     }
     
@@ -784,10 +916,11 @@ int build_ubuntu_rootfs(build_config_t *config) {
     FILE *sources_file = fopen("/tmp/sources.list", "w");
     if (sources_file) {
         fprintf(sources_file,
-                "deb http://ports.ubuntu.com/ubuntu-ports %s main restricted universe multiverse\n"
-                "deb http://ports.ubuntu.com/ubuntu-ports %s-updates main restricted universe multiverse\n"
-                "deb http://ports.ubuntu.com/ubuntu-ports %s-security main restricted universe multiverse\n",
-                config->ubuntu_codename, config->ubuntu_codename, config->ubuntu_codename);
+                "deb %s %s main restricted universe multiverse\n"
+                "deb %s %s-updates main restricted universe multiverse\n"
+                "deb %s %s-security main restricted universe multiverse\n",
+                mirror, config->ubuntu_codename, mirror, config->ubuntu_codename,
+                mirror, config->ubuntu_codename);
         fclose(sources_file);
         
         snprintf(cmd, sizeof(cmd),
@@ -796,6 +929,27 @@ int build_ubuntu_rootfs(build_config_t *config) {
         execute_command_safe(cmd, 0, &error_ctx);
     }
     
+    // Snapshot and bundled Release files are past their Valid-Until date; removed again before imaging.
+    // A bundle carries only the package indexes, so apt must not ask for translations or metadata
+    if (config->reproducible || config->offline_bundle[0]) {
+        snprintf(cmd, sizeof(cmd),
+                 "mkdir -p %s/etc/apt/apt.conf.d && "
+                 "echo 'Acquire::Check-Valid-Until \"false\";' > %s/etc/apt/apt.conf.d/99-orangepi-snapshot",
+                 rootfs_dir, rootfs_dir);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+    if (config->offline_bundle[0]) {
+        snprintf(cmd, sizeof(cmd),
+                 "printf '%%s\\n' 'Acquire::Languages \"none\";' "
+                 "'Acquire::IndexTargets::deb::DEP-11::DefaultEnabled \"false\";' "
+                 "'Acquire::IndexTargets::deb::DEP-11-icons::DefaultEnabled \"false\";' "
+                 "'Acquire::IndexTargets::deb::DEP-11-icons-small::DefaultEnabled \"false\";' "
+                 "'Acquire::IndexTargets::deb::CNF::DefaultEnabled \"false\";' "
+                 ">> %s/etc/apt/apt.conf.d/99-orangepi-snapshot",
+                 rootfs_dir);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+    
     // Update package database in chroot with locale set
     LOG_INFO("Updating package database...");
     snprintf(cmd, sizeof(cmd),
@@ -807,8 +961,8 @@ int build_ubuntu_rootfs(build_config_t *config) {
     LOG_INFO("Ensuring locale system is properly configured...");
     snprintf(cmd, sizeof(cmd),
              "chroot %s /bin/bash -c 'export DEBIAN_FRONTEND=noninteractive; "
-             "apt-get install -y locales language-pack-en'",
-             rootfs_dir);
+             "apt-get install -y %s'",
+             rootfs_dir, get_package_group("locales"));
     execute_command_safe(cmd, 1, &error_ctx);
     
     // Reconfigure locales to be absolutely sure
@@ -841,25 +995,8 @@ int build_ubuntu_rootfs(build_config_t *config) {
     }
     
     // Install base packages based on distribution type
-    const char *base_packages = "ubuntu-minimal init systemd sudo";
-    const char *extra_packages = "";
-    
-    switch (config->distro_type) {
-        case DISTRO_DESKTOP:
-            extra_packages = "ubuntu-desktop network-manager";
-            break;
-        case DISTRO_SERVER:
-            extra_packages = "ubuntu-server openssh-server";
-            break;
-        case DISTRO_EMULATION:
-            extra_packages = "xserver-xorg-core openbox";
-            break;
-        case DISTRO_MINIMAL:
-            extra_packages = "";
-            break;
-        default:
-            break;
-    }
+    const char *base_packages = get_package_group("rootfs-base");
+    const char *extra_packages = get_distro_base_packages(config);
     
     LOG_INFO("Installing base system packages...");
     snprintf(cmd, sizeof(cmd),
@@ -914,8 +1051,7 @@ int build_ubuntu_rootfs(build_config_t *config) {
     
     // Clean up qemu binary
     LOG_INFO("Cleaning up emulation files...");
-    snprintf(cmd, sizeof(cmd), "rm -f %s/usr/bin/qemu-aarch64-static", rootfs_dir);
-    execute_command_safe(cmd, 0, &error_ctx);
+    chroot_exec_release(config, rootfs_dir);
     
     // Success - now unmount filesystems
     LOG_INFO("Ubuntu root filesystem created successfully");
@@ -932,6 +1068,8 @@ cleanup_mounts:
     sleep(1);
     
     // Unmount in reverse order
+    offline_unmount_bundle(config, rootfs_dir);
+    
     snprintf(cmd, sizeof(cmd), "umount %s/dev/pts || true", rootfs_dir);
     execute_command_safe(cmd, 0, &error_ctx);
     
@@ -952,138 +1090,443 @@ cleanup_mounts:
     return ERROR_SUCCESS;
 }
 
-// Create system image
-int create_system_image(build_config_t *config) {
+// Write extlinux/extlinux.conf (and the medium's /etc files for a read-only root) under boot_dir
+int write_boot_config(build_config_t *config, const char *boot_dir) {
+    char path[MAX_PATH_LEN];
+    char root_cmdline[512];
+    
+    snprintf(path, sizeof(path), "%s/extlinux", boot_dir);
+    mkdir(path, 0755);
+    
+    snprintf(path, sizeof(path), "%s/extlinux/extlinux.conf", boot_dir);
+    FILE *boot_cfg = fopen(path, "w");
+    if (!boot_cfg) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    
+    build_root_cmdline(config, root_cmdline, sizeof(root_cmdline));
+    fprintf(boot_cfg,
+            "label Ubuntu\n"
+            "    kernel /vmlinuz-%s\n"
+            "    initrd /initrd.img-%s\n"
+            "    devicetreedir /dtbs\n"
+            "    append console=ttyS2,1500000 %s\n",
+            config->kernel_version, config->kernel_version, root_cmdline);
+    fclose(boot_cfg);
+    
+    // Every medium shares one read-only root image; the initramfs copies this medium's
+    // fstab and metadata from here into the overlay (see install_overlay_root_support)
+    if (rootfs_format_is_readonly(config)) {
+        snprintf(path, sizeof(path), "%s/orangepi", boot_dir);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/orangepi/etc", boot_dir);
+        mkdir(path, 0755);
+    
+        snprintf(path, sizeof(path), "%s/orangepi", boot_dir);
+        if (write_fstab(config, path) != ERROR_SUCCESS) {
+            return ERROR_FILE_NOT_FOUND;
+        }
+        snprintf(path, sizeof(path), "%s/orangepi/etc/orangepi-image-info", boot_dir);
+        if (write_image_metadata(config, path, -1) != ERROR_SUCCESS) {
+            return ERROR_FILE_NOT_FOUND;
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+// Punch unused blocks out of a finished image so compression and copies skip them
+static void release_image_free_space(const char *image_path) {
     char cmd[MAX_CMD_LEN];
-    char image_path[MAX_PATH_LEN];
+    char msg[512];
+    sparsify_stats_t stats;
     error_context_t error_ctx = {0};
     
-    LOG_INFO("Creating system image...");
+    LOG_INFO("Releasing free space in image...");
+    if (sparsify_image(image_path, &stats) != 0) {
+        LOG_WARNING("Image free space was not released; compression will include stale blocks");
+        return;
+    }
     
-    snprintf(image_path, sizeof(image_path), 
-             "%s/orangepi5plus-%s-%s.img",
-             config->output_dir, config->ubuntu_codename, config->kernel_version);
+    snprintf(msg, sizeof(msg), "Released %llu MB of free blocks and %llu MB of zeros in %d partitions; image occupies %llu MB",
+             (unsigned long long)(stats.free_bytes >> 20), (unsigned long long)(stats.zero_bytes >> 20),
+             stats.partitions, (unsigned long long)(stats.allocated_bytes >> 20));
+    LOG_INFO(msg);
     
-    // Create empty image file
-    LOG_INFO("Creating image file...");
-    snprintf(cmd, sizeof(cmd),
-             "dd if=/dev/zero of=%s bs=1M count=%s status=progress",
-             image_path, config->image_size);
+    // A block map lets bmaptool write only the used blocks when flashing
+    snprintf(cmd, sizeof(cmd), "command -v bmaptool >/dev/null && bmaptool create -o %s.bmap %s; true",
+             image_path, image_path);
+    execute_command_safe(cmd, 0, &error_ctx);
+}
+
+// The initramfs refuses a root whose hash tree does not match, so check the finished image
+static int verify_verity_root(build_config_t *config, const char *image_path) {
+    char cmd[MAX_CMD_LEN];
+    char root_hash[128];
+    unsigned long long data_blocks, hash_offset;
+    error_context_t error_ctx = {0};
     
+    if (read_verity_params(config, root_hash, sizeof(root_hash), &data_blocks, &hash_offset) != ERROR_SUCCESS) {
+        LOG_ERROR("dm-verity parameters are missing");
+        return ERROR_FILE_NOT_FOUND;
+    }
+    snprintf(cmd, sizeof(cmd),
+             "loop=$(losetup --show -f -r -P %s) && "
+             "{ veritysetup verify --data-blocks=%llu --hash-offset=%llu ${loop}p3 ${loop}p3 %s; r=$?; "
+             "losetup -d $loop; exit $r; }",
+             image_path, data_blocks, hash_offset, root_hash);
     if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
-        LOG_ERROR("Failed to create image file");
-        return ERROR_UNKNOWN;
+        LOG_ERROR("dm-verity root of the finished image does not verify");
+        return ERROR_INSTALLATION_FAILED;
     }
+    LOG_INFO("dm-verity root verified");
+    return ERROR_SUCCESS;
+}
+
+// Partition, format and fill one image for config->target_medium from the staged rootfs.
+// The primary image may be refreshed incrementally; other media get their own fstab and metadata.
+int assemble_system_image(build_config_t *config, const char *image_path, long image_mb,
+                          long root_mb, int incremental, int primary) {
+    char cmd[MAX_CMD_LEN];
+    char rootfs_dir[MAX_PATH_LEN];
+    char boot_mount[MAX_PATH_LEN];
+    char root_mount[MAX_PATH_LEN];
+    error_context_t error_ctx = {0};
+    int readonly_root = rootfs_format_is_readonly(config);
+    // Reproducible images are filled without mounting: mkfs populates the root, mtools the boot partition
+    int offline = config->reproducible && !incremental &&
+                  (readonly_root || config->rootfs_format == ROOTFS_FORMAT_EXT4);
     
-    // Create partition table
-    LOG_INFO("Creating partition table...");
-    snprintf(cmd, sizeof(cmd),
-             "parted -s %s mklabel gpt", image_path);
-    execute_command_safe(cmd, 1, &error_ctx);
+    snprintf(rootfs_dir, sizeof(rootfs_dir), "%s/rootfs", config->output_dir);
     
-    // Create partitions
-    snprintf(cmd, sizeof(cmd),
-             "parted -s %s mkpart loader 64s 8MiB", image_path);
-    execute_command_safe(cmd, 1, &error_ctx);
+    // Each medium has its own mount points so images can be assembled side by side
+    snprintf(boot_mount, sizeof(boot_mount), "/mnt/orangepi-%s/boot", config->target_medium);
+    snprintf(root_mount, sizeof(root_mount), "/mnt/orangepi-%s/root", config->target_medium);
     
-    snprintf(cmd, sizeof(cmd),
-             "parted -s %s mkpart boot fat32 8MiB 256MiB", image_path);
-    execute_command_safe(cmd, 1, &error_ctx);
+    if (!incremental) {
+        // Create empty image file; sparse, so space is only taken by what gets written
+        LOG_INFO("Creating image file...");
+        snprintf(cmd, sizeof(cmd), "rm -f %s && truncate -s %ldM %s", image_path, image_mb, image_path);
     
-    snprintf(cmd, sizeof(cmd),
-             "parted -s %s mkpart root ext4 256MiB 100%%", image_path);
-    execute_command_safe(cmd, 1, &error_ctx);
+        if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+            LOG_ERROR("Failed to create image file");
+            return ERROR_UNKNOWN;
+        }
     
-    snprintf(cmd, sizeof(cmd),
-             "parted -s %s set 2 boot on", image_path);
-    execute_command_safe(cmd, 1, &error_ctx);
+        // Create partition table aligned to the medium's erase block
+        LOG_INFO("Creating partition table...");
+        partition_layout_t layout;
+        if (init_image_layout(config, &layout) != ERROR_SUCCESS) {
+            return ERROR_UNKNOWN;
+        }
+    
+        if (overlay_uses_partition(config)) {
+            // Root partition holds the image exactly; the overlay gets the rest
+            layout_add_partition(&layout, "root", LAYOUT_TYPE_LINUX, (uint64_t)root_mb);
+            layout_add_partition(&layout, "overlay", LAYOUT_TYPE_LINUX, 0);
+        } else {
+            layout_add_partition(&layout, "root", LAYOUT_TYPE_LINUX, 0);
+        }
+    
+        if (config->reproducible) {
+            set_layout_guids(config, &layout);
+        }
+    
+        if (layout_resolve(&layout, (uint64_t)image_mb * 1024 * 1024) != 0 ||
+            layout_apply(&layout, image_path) != 0) {
+            LOG_ERROR("Failed to create partition table");
+            return ERROR_UNKNOWN;
+        }
+    }
     
     // Setup loop device
     LOG_INFO("Setting up loop device...");
-    snprintf(cmd, sizeof(cmd),
-             "losetup -P -f %s", image_path);
-    execute_command_safe(cmd, 1, &error_ctx);
-    
-    // Get loop device name
-    char cmd_buf[MAX_CMD_LEN];
-    snprintf(cmd_buf, sizeof(cmd_buf), "losetup -j %s | cut -d: -f1", image_path);
-    FILE *fp = popen(cmd_buf, "r");
+    snprintf(cmd, sizeof(cmd), "losetup -P -f --show %s", image_path);
+    FILE *fp = popen(cmd, "r");
     char loop_dev[32];
     if (fp && fgets(loop_dev, sizeof(loop_dev), fp)) {
         loop_dev[strcspn(loop_dev, "\n")] = 0;
         pclose(fp);
     } else {
+        if (fp) {
+            pclose(fp);
+        }
         LOG_ERROR("Failed to get loop device");
         return ERROR_UNKNOWN;
     }
     
-    // Format partitions
-    LOG_INFO("Formatting partitions...");
-    snprintf(cmd, sizeof(cmd), "mkfs.vfat -F 32 %sp2", loop_dev);
-    execute_command_safe(cmd, 1, &error_ctx);
+    if (!incremental) {
+        // Format partitions
+        LOG_INFO("Formatting partitions...");
+        if (config->reproducible) {
+            char uuid[40];
+            get_build_uuid(config, "vfat-boot", uuid, sizeof(uuid));
+            snprintf(cmd, sizeof(cmd), "mkfs.vfat -F 32 --invariant -i %.8s %sp2", uuid, loop_dev);
+        } else {
+            snprintf(cmd, sizeof(cmd), "mkfs.vfat -F 32 %sp2", loop_dev);
+        }
+        execute_command_safe(cmd, 1, &error_ctx);
     
-    snprintf(cmd, sizeof(cmd), "mkfs.ext4 -F %sp3", loop_dev);
-    execute_command_safe(cmd, 1, &error_ctx);
+        if (readonly_root) {
+            // Write the prebuilt root image straight into its partition
+            char root_image[MAX_PATH_LEN];
+            get_readonly_root_image_path(config, root_image, sizeof(root_image));
+            snprintf(cmd, sizeof(cmd), "dd if=%s of=%sp3 bs=4M conv=fsync", root_image, loop_dev);
+            execute_command_safe(cmd, 1, &error_ctx);
+        
+            if (overlay_uses_partition(config)) {
+                char ext4_options[256];
+                build_ext4_mkfs_options(config, "overlay", ext4_options, sizeof(ext4_options));
+                snprintf(cmd, sizeof(cmd), "mkfs.ext4 -F -L overlay%s %sp4", ext4_options, loop_dev);
+                execute_command_safe(cmd, 1, &error_ctx);
+            }
+        } else {
+            snprintf(cmd, sizeof(cmd), "%sp3", loop_dev);
+            if (format_root_partition(config, cmd) != ERROR_SUCCESS) {
+                snprintf(cmd, sizeof(cmd), "losetup -d %s", loop_dev);
+                execute_command_safe(cmd, 0, &error_ctx);
+                return ERROR_INSTALLATION_FAILED;
+            }
+        }
+    }
     
-    // Mount partitions
-    LOG_INFO("Mounting partitions...");
-    execute_command_safe("mkdir -p /mnt/boot /mnt/root", 0, &error_ctx);
+    if (offline) {
+        if (populate_partitions_offline(config, loop_dev, primary) != ERROR_SUCCESS) {
+            snprintf(cmd, sizeof(cmd), "losetup -d %s", loop_dev);
+            execute_command_safe(cmd, 0, &error_ctx);
+            return ERROR_INSTALLATION_FAILED;
+        }
+    } else {
+        // Mount partitions
+        LOG_INFO("Mounting partitions...");
+        snprintf(cmd, sizeof(cmd), "mkdir -p %s %s", boot_mount, root_mount);
+        execute_command_safe(cmd, 0, &error_ctx);
     
-    snprintf(cmd, sizeof(cmd), "mount %sp2 /mnt/boot", loop_dev);
-    execute_command_safe(cmd, 1, &error_ctx);
+        snprintf(cmd, sizeof(cmd), "mount %sp2 %s", loop_dev, boot_mount);
+        execute_command_safe(cmd, 1, &error_ctx);
     
-    snprintf(cmd, sizeof(cmd), "mount %sp3 /mnt/root", loop_dev);
-    execute_command_safe(cmd, 1, &error_ctx);
+        if (!readonly_root) {
+            snprintf(cmd, sizeof(cmd), "%sp3", loop_dev);
+            mount_root_partition(config, cmd, root_mount);
+    
+            if (incremental) {
+                if (apply_incremental_update(config, rootfs_dir, root_mount) != ERROR_SUCCESS) {
+                    snprintf(cmd, sizeof(cmd), "umount %s %s", boot_mount, root_mount);
+                    execute_command_safe(cmd, 0, &error_ctx);
+                    snprintf(cmd, sizeof(cmd), "losetup -d %s", loop_dev);
+                    execute_command_safe(cmd, 0, &error_ctx);
+                    return ERROR_INSTALLATION_FAILED;
+                }
     
-    // Copy rootfs
-    LOG_INFO("Copying root filesystem...");
-    snprintf(cmd, sizeof(cmd),
-             "rsync -aHAXx %s/rootfs/ /mnt/root/",
-             config->output_dir);
-    execute_command_safe(cmd, 1, &error_ctx);
+                // The boot partition is small; replace it rather than diffing it
+                snprintf(cmd, sizeof(cmd), "rm -rf %s/*", boot_mount);
+                execute_command_safe(cmd, 0, &error_ctx);
+            } else {
+                // Copy rootfs
+                LOG_INFO("Copying root filesystem...");
+                snprintf(cmd, sizeof(cmd),
+                         "rsync -aHAXx %s/rootfs/ %s/",
+                         config->output_dir, root_mount);
+                execute_command_safe(cmd, 1, &error_ctx);
+            }
     
-    // Copy boot files
-    LOG_INFO("Copying boot files...");
-    snprintf(cmd, sizeof(cmd),
-             "cp -r %s/rootfs/boot/* /mnt/boot/",
-             config->output_dir);
-    execute_command_safe(cmd, 1, &error_ctx);
+            // The staged tree carries the primary medium's mount options and metadata
+            if (!primary) {
+                write_fstab(config, root_mount);
+                snprintf(cmd, sizeof(cmd), "%s/etc/orangepi-image-info", root_mount);
+                write_image_metadata(config, cmd, -1);
+            }
+        }
     
-    // Install bootloader
-    LOG_INFO("Installing bootloader...");
-    snprintf(cmd, sizeof(cmd),
-             "dd if=%s/idbloader.img of=%s seek=64 conv=notrunc",
-             config->output_dir, loop_dev);
-    execute_command_safe(cmd, 1, &error_ctx);
+        // Copy boot files
+        LOG_INFO("Copying boot files...");
+        snprintf(cmd, sizeof(cmd),
+                 "cp -r %s/rootfs/boot/* %s/",
+                 config->output_dir, boot_mount);
+        execute_command_safe(cmd, 1, &error_ctx);
     
-    // Create boot configuration
-    execute_command_safe("mkdir -p /mnt/boot/extlinux", 0, &error_ctx);
-    FILE *boot_cfg = fopen("/mnt/boot/extlinux/extlinux.conf", "w");
-    if (boot_cfg) {
-        fprintf(boot_cfg,
-                "label Ubuntu\n"
-                "    kernel /vmlinuz-%s\n"
-                "    initrd /initrd.img-%s\n"
-                "    devicetreedir /dtbs\n"
-                "    append console=ttyS2,1500000 root=/dev/mmcblk0p3 rw rootwait\n",
-                config->kernel_version, config->kernel_version);
-        fclose(boot_cfg);
+        // Create boot configuration
+        write_boot_config(config, boot_mount);
+    }
+    
+    // Install bootloader; the BootROM cannot read NVMe, which boots from SPI flash instead
+    if (strcmp(config->target_medium, "nvme") != 0) {
+        LOG_INFO("Installing bootloader...");
+        snprintf(cmd, sizeof(cmd),
+                 "dd if=%s/idbloader.img of=%s seek=64 conv=notrunc",
+                 config->output_dir, loop_dev);
+        execute_command_safe(cmd, 1, &error_ctx);
+        
+        snprintf(cmd, sizeof(cmd), "%s/u-boot.itb", config->output_dir);
+        if (access(cmd, F_OK) == 0) {
+            snprintf(cmd, sizeof(cmd),
+                     "dd if=%s/u-boot.itb of=%s seek=16384 conv=notrunc",
+                     config->output_dir, loop_dev);
+            execute_command_safe(cmd, 1, &error_ctx);
+        }
     }
     
     // Cleanup
     LOG_INFO("Cleaning up...");
     execute_command_safe("sync", 0, &error_ctx);
-    execute_command_safe("umount /mnt/boot /mnt/root", 0, &error_ctx);
+    if (!offline) {
+        // The loop device turns discards into holes; this covers btrfs and f2fs,
+        // whose free space the sparsify pass below cannot read
+        snprintf(cmd, sizeof(cmd), "fstrim %s || true", boot_mount);
+        execute_command_safe(cmd, 0, &error_ctx);
+        if (!readonly_root) {
+            snprintf(cmd, sizeof(cmd), "fstrim %s || true", root_mount);
+            execute_command_safe(cmd, 0, &error_ctx);
+        }
+        snprintf(cmd, sizeof(cmd), "umount %s", boot_mount);
+        execute_command_safe(cmd, 0, &error_ctx);
+        if (!readonly_root) {
+            snprintf(cmd, sizeof(cmd), "umount %s", root_mount);
+            execute_command_safe(cmd, 0, &error_ctx);
+        }
+    }
     snprintf(cmd, sizeof(cmd), "losetup -d %s", loop_dev);
     execute_command_safe(cmd, 0, &error_ctx);
     
-    char msg[512];
-    snprintf(msg, sizeof(msg), "System image created successfully: %s", image_path);
-    LOG_INFO(msg);
+    release_image_free_space(image_path);
+    
+    if (readonly_root && config->dm_verity && verify_verity_root(config, image_path) != ERROR_SUCCESS) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+    
+    snprintf(cmd, sizeof(cmd), "%s.info", image_path);
+    write_image_metadata(config, cmd, image_mb);
+    
+    if (write_image_hash_tree(config, image_path) != ERROR_SUCCESS) {
+        LOG_WARNING("Image hash tree was not written");
+    }
     
     return ERROR_SUCCESS;
 }
 
+// Create system image
+int create_system_image(build_config_t *config) {
+    char cmd[MAX_CMD_LEN];
+    char image_path[MAX_PATH_LEN];
+    output_jobs_t jobs;
+    
+    LOG_INFO("Creating system image...");
+    
+    get_system_image_path(config, NULL, image_path, sizeof(image_path));
+    
+    char rootfs_dir[MAX_PATH_LEN];
+    snprintf(rootfs_dir, sizeof(rootfs_dir), "%s/rootfs", config->output_dir);
+    
+    int readonly_root = rootfs_format_is_readonly(config);
+    long root_mb = 0;
+    
+    // Slim first, so sizing, manifests and every output see the final tree
+    if (config->slim_rootfs && slim_rootfs(config, rootfs_dir) != ERROR_SUCCESS) {
+        LOG_WARNING("Rootfs slimming did not complete");
+    }
+    
+    // Grow the root (or overlay) partition to the real medium size on first boot
+    if (config->expand_rootfs_on_boot && (!readonly_root || overlay_uses_partition(config))) {
+        if (install_rootfs_expand_service(config, rootfs_dir) != ERROR_SUCCESS) {
+            LOG_WARNING("Image will not expand to fill the card on first boot");
+        }
+    }
+    
+    // Record how the image is built inside the image itself
+    snprintf(cmd, sizeof(cmd), "%s/etc/orangepi-image-info", rootfs_dir);
+    write_image_metadata(config, cmd, -1);
+    
+    // btrfs and f2fs need their driver in the initramfs to mount root
+    if (!readonly_root && install_rootfs_format_support(config, rootfs_dir) != ERROR_SUCCESS) {
+        LOG_WARNING("Initramfs was not regenerated for the root filesystem format");
+    }
+    
+    // A read-only root is packed into its image before sizing
+    if (readonly_root) {
+        if (install_overlay_root_support(config, rootfs_dir) != ERROR_SUCCESS) {
+            LOG_ERROR("Failed to install overlay root support");
+            return ERROR_INSTALLATION_FAILED;
+        }
+        write_fstab(config, rootfs_dir);
+    }
+    
+    // Caches the board would otherwise build on first boot
+    if (config->finalize_rootfs && finalize_rootfs(config, rootfs_dir) != ERROR_SUCCESS) {
+        LOG_WARNING("Rootfs finalization did not complete");
+    }
+    
+    // Point apt back at the live archive
+    if (config->reproducible || config->offline_bundle[0]) {
+        restore_live_sources(config, rootfs_dir);
+    }
+    
+    // Strip per-build state and pin timestamps before anything reads the tree
+    if (config->reproducible && normalize_rootfs(config, rootfs_dir) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to normalize rootfs for a reproducible build");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    
+    if (readonly_root && build_readonly_root_image(config, rootfs_dir, &root_mb) != ERROR_SUCCESS) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+    
+    // Resolve the image size ("auto" measures the staged rootfs)
+    long image_mb = 0;
+    if (resolve_image_size(config, &image_mb) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to determine image size");
+        return ERROR_UNKNOWN;
+    }
+    
+    // The staged tree is final from here on: other media, tarball and boot bundle
+    // are produced alongside the primary image and share its reads of the rootfs
+    start_output_targets(config, root_mb, &jobs);
+    
+    // Reuse the previous image when only files changed
+    int incremental = config->incremental_image &&
+                      prepare_incremental_image(config, image_path, &image_mb) == ERROR_SUCCESS;
+    
+    int result = assemble_system_image(config, image_path, image_mb, root_mb, incremental, 1);
+    
+    // Assemble again from the same tree and demand the same bytes
+    if (result == ERROR_SUCCESS && config->verify_reproducible &&
+        verify_reproducible_image(config, image_path, image_mb, root_mb) != ERROR_SUCCESS) {
+        result = ERROR_UNKNOWN;
+    }
+    
+    if (result == ERROR_SUCCESS) {
+        if (write_image_contents(config, image_path) != ERROR_SUCCESS) {
+            LOG_WARNING("Image contents were not recorded; image-diff will read the image instead");
+        }
+        
+        if (config->incremental_image && save_incremental_base(config, image_path) != ERROR_SUCCESS) {
+            LOG_WARNING("Next build will assemble the image in full");
+        }
+        
+        if (config->chunk_store && publish_image_chunks(config, image_path) != ERROR_SUCCESS) {
+            LOG_WARNING("Image was not added to the chunk store");
+        }
+        
+        if (config->delta_from[0] && build_delta_package(config, image_path) != ERROR_SUCCESS) {
+            LOG_WARNING("Delta update package was not created");
+        }
+        
+        if (output_target_enabled(config, "compressed") && compress_release_image(config, image_path) != ERROR_SUCCESS) {
+            result = ERROR_UNKNOWN;
+        }
+    }
+    
+    if (wait_output_targets(&jobs) != ERROR_SUCCESS && result == ERROR_SUCCESS) {
+        result = ERROR_UNKNOWN;
+    }
+    
+    if (result == ERROR_SUCCESS) {
+        char msg[512];
+        snprintf(msg, sizeof(msg), "System image created successfully: %s", image_path);
+        LOG_INFO(msg);
+    }
+    
+    return result;
+}
+
 // Install system packages
 int install_system_packages(build_config_t *config) {
     char cmd[MAX_CMD_LEN];
@@ -1118,6 +1561,13 @@ int install_system_packages(build_config_t *config) {
              rootfs_dir, rootfs_dir);
     execute_command_safe(cmd, 0, &error_ctx);
     
+    if (config->offline_bundle[0] && offline_mount_bundle(config, rootfs_dir) != ERROR_SUCCESS) {
+        return ERROR_INSTALLATION_FAILED;
+    }
+    
+    // The emulator copied during debootstrap was removed again; apt needs it back
+    chroot_exec_prepare(config, rootfs_dir);
+    
     // Set environment variables to suppress warnings
     setenv("PYTHONWARNINGS", "ignore", 1);
     
@@ -1132,15 +1582,9 @@ int install_system_packages(build_config_t *config) {
     }
     
     // Common packages for all distributions
-    const char *common_packages = 
-        "linux-firmware wireless-tools wpasupplicant "
-        "network-manager usbutils pciutils i2c-tools "
-        "htop nano vim curl wget git sudo locales "
-        "software-properties-common dbus-x11 language-pack-en";
-    
     snprintf(cmd, sizeof(cmd),
              "chroot %s %s install -y %s",
-             rootfs_dir, apt_command, common_packages);
+             rootfs_dir, apt_command, get_package_group("common"));
     execute_command_safe(cmd, 1, &error_ctx);
     
     // Distribution-specific packages
@@ -1148,20 +1592,16 @@ int install_system_packages(build_config_t *config) {
         case DISTRO_DESKTOP:
             LOG_INFO("Installing desktop packages...");
             snprintf(cmd, sizeof(cmd),
-                     "chroot %s %s install -y "
-                     "gnome-shell gdm3 gnome-terminal firefox "
-                     "gnome-tweaks gnome-system-monitor",
-                     rootfs_dir, apt_command);
+                     "chroot %s %s install -y %s",
+                     rootfs_dir, apt_command, get_package_group("desktop"));
             execute_command_safe(cmd, 1, &error_ctx);
             break;
             
         case DISTRO_SERVER:
             LOG_INFO("Installing server packages...");
             snprintf(cmd, sizeof(cmd),
-                     "chroot %s %s install -y "
-                     "openssh-server fail2ban ufw "
-                     "docker.io docker-compose",
-                     rootfs_dir, apt_command);
+                     "chroot %s %s install -y %s",
+                     rootfs_dir, apt_command, get_package_group("server"));
             execute_command_safe(cmd, 1, &error_ctx);
             break;
             
@@ -1178,9 +1618,23 @@ int install_system_packages(build_config_t *config) {
     if (config->install_gpu_blobs) {
         LOG_INFO("Installing GPU support packages...");
         snprintf(cmd, sizeof(cmd),
-                 "chroot %s %s install -y "
-                 "mesa-utils glmark2-es2 vulkan-tools",
-                 rootfs_dir, apt_command);
+                 "chroot %s %s install -y %s",
+                 rootfs_dir, apt_command, get_package_group("gpu"));
+        execute_command_safe(cmd, 1, &error_ctx);
+    }
+    
+    // Userspace tools for btrfs/f2fs roots (fsck, resize, initramfs hooks)
+    const rootfs_format_info_t *format_info = get_rootfs_format_info(config->rootfs_format);
+    if (format_info->target_package) {
+        snprintf(cmd, sizeof(cmd),
+                 "chroot %s %s install -y %s",
+                 rootfs_dir, apt_command, format_info->target_package);
+        execute_command_safe(cmd, 1, &error_ctx);
+    }
+    
+    // veritysetup for the initramfs that opens a dm-verity root
+    if (config->dm_verity && rootfs_format_is_readonly(config)) {
+        snprintf(cmd, sizeof(cmd), "chroot %s %s install -y %s", rootfs_dir, apt_command, get_package_group("verity"));
         execute_command_safe(cmd, 1, &error_ctx);
     }
     
@@ -1191,8 +1645,12 @@ int install_system_packages(build_config_t *config) {
              rootfs_dir);
     execute_command_safe(cmd, 1, &error_ctx);
     
+    chroot_exec_release(config, rootfs_dir);
+    
     // Unmount filesystems
     LOG_INFO("Unmounting filesystems...");
+    offline_unmount_bundle(config, rootfs_dir);
+    
     snprintf(cmd, sizeof(cmd), "umount %s/dev/pts || true", rootfs_dir);
     execute_command_safe(cmd, 0, &error_ctx);
     
@@ -1225,6 +1683,8 @@ int configure_system_services(build_config_t *config) {
         return ERROR_FILE_NOT_FOUND;
     }
     
+    chroot_exec_prepare(config, rootfs_dir);
+    
     // Enable essential services
     const char *enable_services[] = {
         "systemd-networkd",
@@ -1271,6 +1731,8 @@ int configure_system_services(build_config_t *config) {
             break;
     }
     
+    chroot_exec_release(config, rootfs_dir);
+    
     // Create netplan directory
     snprintf(cmd, sizeof(cmd), "mkdir -p %s/etc/netplan", rootfs_dir);
     execute_command_safe(cmd, 0, &error_ctx);
@@ -1294,20 +1756,8 @@ int configure_system_services(build_config_t *config) {
         execute_command_safe(cmd, 0, &error_ctx);
     }
     
-    // Configure fstab
-    FILE *fstab = fopen("/tmp/fstab", "w");
-    if (fstab) {
-        fprintf(fstab,
-                "# /etc/fstab: static file system information\n"
-                "/dev/mmcblk0p3  /       ext4    defaults        0 1\n"
-                "/dev/mmcblk0p2  /boot   vfat    defaults        0 2\n");
-        fclose(fstab);
-        
-        snprintf(cmd, sizeof(cmd),
-                 "cp /tmp/fstab %s/etc/",
-                 rootfs_dir);
-        execute_command_safe(cmd, 0, &error_ctx);
-    }
+    // Configure fstab for the selected root filesystem format
+    write_fstab(config, rootfs_dir);
     
     LOG_INFO("System services configured successfully");
     return ERROR_SUCCESS;
@@ -1320,16 +1770,7 @@ int install_emulation_packages(build_config_t *config) {
     LOG_INFO("Installing emulation platform packages...");
     
     // Common emulation dependencies
-    const char *common_packages = 
-        "libsdl2-dev libsdl2-image-dev libsdl2-mixer-dev libsdl2-ttf-dev "
-        "libboost-all-dev libavcodec-dev libavformat-dev libavutil-dev "
-        "libswscale-dev libfreeimage-dev libfreetype6-dev libcurl4-openssl-dev "
-        "libasound2-dev libpulse-dev libudev-dev libvlc-dev libvlccore-dev "
-        "libxml2-dev libxrandr-dev mesa-common-dev libglu1-mesa-dev "
-        "libgles2-mesa-dev libavfilter-dev libavresample-dev libvorbis-dev "
-        "libflac-dev";
-    
-    snprintf(cmd, sizeof(cmd), "apt install -y %s", common_packages);
+    snprintf(cmd, sizeof(cmd), "apt install -y %s", get_package_group("emulation"));
     
     if (execute_command_with_retry(cmd, 1, 2) != 0) {
         LOG_WARNING("Some emulation packages failed to install");
@@ -1396,6 +1837,7 @@ int setup_emulationstation(build_config_t *config) {
     
     char cmd[MAX_CMD_LEN];
     char es_dir[MAX_PATH_LEN];
+    char launcher[256];
     char* auth_url;
     
     snprintf(es_dir, sizeof(es_dir), "%s/emulationstation", config->build_dir);
@@ -1412,11 +1854,12 @@ int setup_emulationstation(build_config_t *config) {
     }
     
     // Build EmulationStation
+    get_cmake_launcher(config, launcher, sizeof(launcher));
     snprintf(cmd, sizeof(cmd), 
              "cd %s && mkdir build && cd build && "
-             "cmake .. -DFREETYPE_INCLUDE_DIRS=/usr/include/freetype2/ && "
+             "cmake .. -DFREETYPE_INCLUDE_DIRS=/usr/include/freetype2/ %s && "
              "make -j%d",
-             es_dir, config->jobs);
+             es_dir, launcher, config->compile_jobs > 0 ? config->compile_jobs : config->jobs);
     
     if (execute_command_safe(cmd, 1, NULL) != 0) {
         LOG_WARNING("Failed to build EmulationStation");
@@ -0,0 +1,408 @@
+/*
+ * manifest.c - Rootfs file manifests for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains functions for building, saving, loading and diffing
+ * rootfs manifests. A manifest lists every path with its type, mode,
+ * ownership, size, mtime, a SHA-256 of the contents (or symlink target), the
+ * device number of device nodes and the hardlink group a file belongs to,
+ * sorted by path so two manifests can be compared with a single merge pass.
+ */
+
+#include "../builder.h"
+#include <ftw.h>
+
+#define MANIFEST_HEADER "# orangepi-manifest v2"
+// v1 manifests have no device numbers or hardlink groups
+#define MANIFEST_HEADER_V1 "# orangepi-manifest v1"
+
+// nftw() has no user pointer, so the walk state lives here
+static manifest_t *walk_manifest;
+static const manifest_t *walk_previous;
+static size_t walk_root_len;
+static int walk_failed;
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const manifest_entry_t *)a)->path, ((const manifest_entry_t *)b)->path);
+}
+
+static manifest_entry_t* manifest_append(manifest_t *manifest) {
+    if (manifest->count == manifest->capacity) {
+        size_t capacity = manifest->capacity ? manifest->capacity * 2 : 4096;
+        manifest_entry_t *entries = realloc(manifest->entries, capacity * sizeof(*entries));
+        if (!entries) {
+            return NULL;
+        }
+        manifest->entries = entries;
+        manifest->capacity = capacity;
+    }
+
+    manifest_entry_t *entry = &manifest->entries[manifest->count++];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+static char entry_type(mode_t mode) {
+    if (S_ISREG(mode)) return 'f';
+    if (S_ISDIR(mode)) return 'd';
+    if (S_ISLNK(mode)) return 'l';
+    if (S_ISCHR(mode)) return 'c';
+    if (S_ISBLK(mode)) return 'b';
+    if (S_ISFIFO(mode)) return 'p';
+    return 's';
+}
+
+// Paths are written tab-separated, so escape the characters that would break a line
+static void write_escaped_path(FILE *out, const char *path) {
+    for (const char *p = path; *p; p++) {
+        switch (*p) {
+            case '\\': fputs("\\\\", out); break;
+            case '\n': fputs("\\n", out); break;
+            case '\t': fputs("\\t", out); break;
+            default: fputc(*p, out); break;
+        }
+    }
+}
+
+static void unescape_path(char *path) {
+    char *out = path;
+
+    for (char *p = path; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+            *out++ = (*p == 'n') ? '\n' : (*p == 't') ? '\t' : *p;
+        } else {
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+}
+
+static int manifest_walk_entry(const char *fpath, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)flag;
+
+    // The rootfs directory itself is not an entry
+    if (ftw->level == 0) {
+        return 0;
+    }
+
+    manifest_entry_t *entry = manifest_append(walk_manifest);
+    if (!entry || !(entry->path = strdup(fpath + walk_root_len + 1))) {
+        walk_failed = 1;
+        return 1;
+    }
+
+    entry->type = entry_type(st->st_mode);
+    entry->mode = st->st_mode & 07777;
+    entry->uid = st->st_uid;
+    entry->gid = st->st_gid;
+    entry->size = (long long)st->st_size;
+    entry->mtime = (long long)st->st_mtime;
+    entry->rdev = (entry->type == 'c' || entry->type == 'b') ? (unsigned long long)st->st_rdev : 0;
+    strcpy(entry->hash, "-");
+    strcpy(entry->link, "-");
+
+    // Inode numbers differ between builds; resolved to a stable group name after the walk
+    if (!S_ISDIR(st->st_mode) && st->st_nlink > 1) {
+        snprintf(entry->link, sizeof(entry->link), "@%llx:%llx",
+                 (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    }
+
+    if (entry->type == 'f') {
+        // Unchanged size and mtime: trust the hash from the previous manifest
+        const manifest_entry_t *old = walk_previous ? manifest_find(walk_previous, entry->path) : NULL;
+        if (old && old->type == 'f' && old->size == entry->size && old->mtime == entry->mtime) {
+            strcpy(entry->hash, old->hash);
+        } else if (sha256_file(fpath, entry->hash) != 0) {
+            walk_failed = 1;
+            return 1;
+        }
+    } else if (entry->type == 'l') {
+        char target[MAX_PATH_LEN];
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        ssize_t len = readlink(fpath, target, sizeof(target));
+        if (len < 0) {
+            len = 0;
+        }
+        sha256_buffer(target, (size_t)len, digest);
+        sha256_to_hex(digest, entry->hash);
+    }
+
+    return 0;
+}
+
+static int compare_link_members(const void *a, const void *b) {
+    const manifest_entry_t *x = *(manifest_entry_t * const *)a;
+    const manifest_entry_t *y = *(manifest_entry_t * const *)b;
+    int cmp = strcmp(x->link, y->link);
+    return cmp ? cmp : strcmp(x->path, y->path);
+}
+
+// Name each hardlink group after its first path; a lone member's other links are outside the tree
+static int resolve_link_groups(manifest_t *manifest) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < manifest->count; i++) {
+        count += manifest->entries[i].link[0] == '@';
+    }
+    if (count == 0) {
+        return ERROR_SUCCESS;
+    }
+
+    manifest_entry_t **members = malloc(count * sizeof(*members));
+    if (!members) {
+        return ERROR_UNKNOWN;
+    }
+    count = 0;
+    for (size_t i = 0; i < manifest->count; i++) {
+        if (manifest->entries[i].link[0] == '@') {
+            members[count++] = &manifest->entries[i];
+        }
+    }
+    qsort(members, count, sizeof(*members), compare_link_members);
+
+    for (size_t first = 0, end; first < count; first = end) {
+        for (end = first + 1; end < count && strcmp(members[end]->link, members[first]->link) == 0; end++) {
+        }
+
+        char group[SHA256_HEX_SIZE] = "-";
+        if (end - first > 1) {
+            uint8_t digest[SHA256_DIGEST_SIZE];
+            sha256_buffer(members[first]->path, strlen(members[first]->path), digest);
+            sha256_to_hex(digest, group);
+        }
+        for (size_t i = first; i < end; i++) {
+            strcpy(members[i]->link, group);
+        }
+    }
+
+    free(members);
+    return ERROR_SUCCESS;
+}
+
+// Build a manifest of a directory tree; hashes are reused from previous when size and mtime match
+int manifest_build(const char *root_dir, const manifest_t *previous, manifest_t *manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+
+    walk_manifest = manifest;
+    walk_previous = previous;
+    walk_root_len = strlen(root_dir);
+    walk_failed = 0;
+
+    // Stay on one filesystem and do not follow symlinks, like rsync -x
+    int result = nftw(root_dir, manifest_walk_entry, 64, FTW_PHYS | FTW_MOUNT);
+
+    walk_manifest = NULL;
+    walk_previous = NULL;
+
+    if (result != 0 || walk_failed) {
+        LOG_ERROR("Failed to build rootfs manifest");
+        manifest_free(manifest);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    qsort(manifest->entries, manifest->count, sizeof(manifest_entry_t), compare_entries);
+    if (resolve_link_groups(manifest) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to build rootfs manifest");
+        manifest_free(manifest);
+        return ERROR_UNKNOWN;
+    }
+    return ERROR_SUCCESS;
+}
+
+int manifest_save(const manifest_t *manifest, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        LOG_ERROR("Failed to write manifest");
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    fprintf(out, "%s\n", MANIFEST_HEADER);
+    for (size_t i = 0; i < manifest->count; i++) {
+        const manifest_entry_t *e = &manifest->entries[i];
+        fprintf(out, "%c\t%04o\t%u\t%u\t%lld\t%lld\t%s\t%llx\t%s\t",
+                e->type, e->mode, e->uid, e->gid, e->size, e->mtime, e->hash, e->rdev, e->link);
+        write_escaped_path(out, e->path);
+        fputc('\n', out);
+    }
+
+    if (fclose(out) != 0) {
+        LOG_ERROR("Failed to write manifest");
+        return ERROR_FILE_NOT_FOUND;
+    }
+    return ERROR_SUCCESS;
+}
+
+int manifest_load(const char *path, manifest_t *manifest) {
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    int v1 = 0;
+
+    memset(manifest, 0, sizeof(*manifest));
+
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    while ((len = getline(&line, &line_size, in)) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#') {
+            v1 |= strcmp(line, MANIFEST_HEADER_V1) == 0;
+            continue;
+        }
+
+        manifest_entry_t *e = manifest_append(manifest);
+        int path_offset = 0;
+        int fields = 0;
+        if (e && v1) {
+            strcpy(e->link, "-");
+            fields = sscanf(line, "%c\t%o\t%u\t%u\t%lld\t%lld\t%64s\t%n",
+                            &e->type, &e->mode, &e->uid, &e->gid, &e->size, &e->mtime,
+                            e->hash, &path_offset) + 2;
+        } else if (e) {
+            fields = sscanf(line, "%c\t%o\t%u\t%u\t%lld\t%lld\t%64s\t%llx\t%64s\t%n",
+                            &e->type, &e->mode, &e->uid, &e->gid, &e->size, &e->mtime,
+                            e->hash, &e->rdev, e->link, &path_offset);
+        }
+        if (!e || fields < 9 || path_offset == 0) {
+            if (e) {
+                manifest->count--;
+            }
+            LOG_WARNING("Skipping malformed manifest line");
+            continue;
+        }
+
+        e->path = strdup(line + path_offset);
+        if (!e->path) {
+            manifest->count--;
+            break;
+        }
+        unescape_path(e->path);
+    }
+
+    free(line);
+    fclose(in);
+
+    qsort(manifest->entries, manifest->count, sizeof(manifest_entry_t), compare_entries);
+    return ERROR_SUCCESS;
+}
+
+void manifest_free(manifest_t *manifest) {
+    for (size_t i = 0; i < manifest->count; i++) {
+        free(manifest->entries[i].path);
+    }
+    free(manifest->entries);
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+const manifest_entry_t* manifest_find(const manifest_t *manifest, const char *path) {
+    manifest_entry_t key;
+
+    if (!manifest || manifest->count == 0) {
+        return NULL;
+    }
+
+    key.path = (char *)path;
+    return bsearch(&key, manifest->entries, manifest->count, sizeof(manifest_entry_t), compare_entries);
+}
+
+// Check whether an entry changed; directory mtimes move with their contents and are ignored
+int manifest_entry_changed(const manifest_entry_t *old, const manifest_entry_t *new) {
+    if (old->type != new->type || old->mode != new->mode ||
+        old->uid != new->uid || old->gid != new->gid) {
+        return 1;
+    }
+    if (new->type == 'd') {
+        return 0;
+    }
+    return old->size != new->size || old->mtime != new->mtime || strcmp(old->hash, new->hash) != 0 ||
+           old->rdev != new->rdev || strcmp(old->link, new->link) != 0;
+}
+
+static int compare_links(const void *a, const void *b) {
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+// Hardlink groups with a new or changed member; rsync -H only links paths it is given,
+// so every member of such a group is copied again
+static const char **dirty_link_groups(const manifest_t *old, const manifest_t *new, size_t *count) {
+    const char **groups = malloc((new->count ? new->count : 1) * sizeof(*groups));
+
+    *count = 0;
+    if (!groups) {
+        return NULL;
+    }
+    for (size_t j = 0; j < new->count; j++) {
+        const manifest_entry_t *n = &new->entries[j];
+        if (strcmp(n->link, "-") != 0) {
+            const manifest_entry_t *o = manifest_find(old, n->path);
+            if (!o || manifest_entry_changed(o, n)) {
+                groups[(*count)++] = n->link;
+            }
+        }
+    }
+    qsort(groups, *count, sizeof(*groups), compare_links);
+    return groups;
+}
+
+// Write NUL-separated lists of paths to copy and to remove to go from old to new
+int manifest_diff(const manifest_t *old, const manifest_t *new,
+                  FILE *update_list, FILE *remove_list, manifest_diff_stats_t *stats) {
+    size_t i = 0, j = 0;
+    size_t dirty_count = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    const char **dirty = dirty_link_groups(old, new, &dirty_count);
+
+    while (i < old->count || j < new->count) {
+        int cmp;
+        if (i >= old->count) {
+            cmp = 1;
+        } else if (j >= new->count) {
+            cmp = -1;
+        } else {
+            cmp = strcmp(old->entries[i].path, new->entries[j].path);
+        }
+
+        if (cmp < 0) {
+            if (remove_list) {
+                fprintf(remove_list, "%s%c", old->entries[i].path, '\0');
+            }
+            stats->removed++;
+            i++;
+        } else if (cmp > 0) {
+            if (update_list) {
+                fprintf(update_list, "%s%c", new->entries[j].path, '\0');
+            }
+            stats->added++;
+            stats->update_bytes += new->entries[j].size;
+            j++;
+        } else {
+            const manifest_entry_t *o = &old->entries[i];
+            const manifest_entry_t *n = &new->entries[j];
+            const char *link = n->link;
+            if (manifest_entry_changed(o, n) ||
+                (strcmp(n->link, "-") != 0 && dirty &&
+                 bsearch(&link, dirty, dirty_count, sizeof(*dirty), compare_links))) {
+                // A file replaced by a directory (or the reverse) is removed first
+                if (o->type != n->type && remove_list) {
+                    fprintf(remove_list, "%s%c", o->path, '\0');
+                }
+                if (update_list) {
+                    fprintf(update_list, "%s%c", n->path, '\0');
+                }
+                stats->changed++;
+                stats->update_bytes += n->size;
+            } else {
+                stats->unchanged++;
+            }
+            i++;
+            j++;
+        }
+    }
+
+    free(dirty);
+    return ERROR_SUCCESS;
+}
@@ -0,0 +1,464 @@
+/*
+ * merkle.c - Merkle hash trees for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains per-region Merkle trees over images and flashed
+ * devices. Every region (bootloader area, each partition) is split into
+ * fixed-size leaves that are hashed in parallel; the leaf hashes are kept so
+ * any byte range can later be re-checked on its own, and a mismatch names
+ * the exact leaf that is bad instead of just failing a whole-file checksum.
+ */
+
+#define _GNU_SOURCE
+#include "merkle.h"
+#include "gpt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MERKLE_HEADER "# orangepi-merkle v1"
+
+// Leaf and node hashes are domain-separated (as in RFC 6962) so a leaf can never pass for a node
+#define MERKLE_LEAF_PREFIX 0x00
+#define MERKLE_NODE_PREFIX 0x01
+
+typedef struct {
+    const merkle_tree_t *tree;
+    int fd;
+    size_t total;
+    size_t *job_region;
+    size_t *job_leaf;
+    uint8_t *bad;               // Verification: set for leaves that do not match
+    int verify;
+    atomic_size_t next;
+    atomic_int failed;
+} merkle_work_t;
+
+static void hash_leaf(const uint8_t *data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    sha256_ctx_t ctx;
+    uint8_t prefix = MERKLE_LEAF_PREFIX;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, &prefix, 1);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
+
+// Fold a level of hashes up to a single root; an odd hash out moves up unchanged
+static int compute_root(const uint8_t (*hashes)[SHA256_DIGEST_SIZE], size_t count, uint8_t root[SHA256_DIGEST_SIZE]) {
+    if (count == 0) {
+        sha256_buffer("", 0, root);
+        return 0;
+    }
+
+    uint8_t (*level)[SHA256_DIGEST_SIZE] = malloc(count * SHA256_DIGEST_SIZE);
+    if (!level) {
+        return -1;
+    }
+    memcpy(level, hashes, count * SHA256_DIGEST_SIZE);
+
+    while (count > 1) {
+        size_t parents = 0;
+        for (size_t i = 0; i < count; i += 2) {
+            if (i + 1 < count) {
+                sha256_ctx_t ctx;
+                uint8_t prefix = MERKLE_NODE_PREFIX;
+                sha256_init(&ctx);
+                sha256_update(&ctx, &prefix, 1);
+                sha256_update(&ctx, level[i], SHA256_DIGEST_SIZE);
+                sha256_update(&ctx, level[i + 1], SHA256_DIGEST_SIZE);
+                sha256_final(&ctx, level[parents]);
+            } else {
+                memmove(level[parents], level[i], SHA256_DIGEST_SIZE);
+            }
+            parents++;
+        }
+        count = parents;
+    }
+
+    memcpy(root, level[0], SHA256_DIGEST_SIZE);
+    free(level);
+    return 0;
+}
+
+static void* merkle_worker(void *arg) {
+    merkle_work_t *work = arg;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint8_t *buffer = malloc(work->tree->leaf_size);
+
+    if (!buffer) {
+        atomic_store(&work->failed, 1);
+        return NULL;
+    }
+
+    size_t job;
+    while ((job = atomic_fetch_add(&work->next, 1)) < work->total && !atomic_load(&work->failed)) {
+        merkle_region_t *region = &work->tree->regions[work->job_region[job]];
+        size_t leaf = work->job_leaf[job];
+        uint64_t start = (uint64_t)leaf * work->tree->leaf_size;
+        size_t len = region->size - start < work->tree->leaf_size ?
+                     (size_t)(region->size - start) : work->tree->leaf_size;
+        size_t done = 0;
+
+        while (done < len) {
+            ssize_t n = pread(work->fd, buffer + done, len - done, (off_t)(region->offset + start + done));
+            if (n <= 0) {
+                break;
+            }
+            done += (size_t)n;
+        }
+        if (done < len) {
+            // A short device is a read failure, not a mismatch
+            atomic_store(&work->failed, 1);
+            break;
+        }
+
+        hash_leaf(buffer, len, digest);
+        if (work->verify) {
+            work->bad[job] = memcmp(digest, region->leaves[leaf], SHA256_DIGEST_SIZE) != 0;
+        } else {
+            memcpy(region->leaves[leaf], digest, SHA256_DIGEST_SIZE);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Run the queued leaf jobs on up to jobs threads
+static int run_workers(merkle_work_t *work, int jobs) {
+    pthread_t threads[64];
+    int started = 0;
+
+    if (jobs <= 0) {
+        jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    if (jobs > 64) {
+        jobs = 64;
+    }
+    if ((size_t)jobs > work->total) {
+        jobs = work->total ? (int)work->total : 1;
+    }
+
+    atomic_init(&work->next, 0);
+    atomic_init(&work->failed, 0);
+
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, merkle_worker, work) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        merkle_worker(work);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return atomic_load(&work->failed) ? -1 : 0;
+}
+
+void merkle_init(merkle_tree_t *tree, uint32_t leaf_size) {
+    memset(tree, 0, sizeof(*tree));
+    tree->leaf_size = leaf_size ? leaf_size : MERKLE_DEFAULT_LEAF_SIZE;
+}
+
+int merkle_add_region(merkle_tree_t *tree, const char *name, uint64_t offset, uint64_t size) {
+    merkle_region_t *regions = realloc(tree->regions, (tree->count + 1) * sizeof(merkle_region_t));
+    if (!regions) {
+        return -1;
+    }
+    tree->regions = regions;
+
+    merkle_region_t *region = &regions[tree->count];
+    memset(region, 0, sizeof(*region));
+    snprintf(region->name, sizeof(region->name), "%s", name);
+    region->offset = offset;
+    region->size = size;
+    region->leaf_count = (size_t)((size + tree->leaf_size - 1) / tree->leaf_size);
+    region->leaves = calloc(region->leaf_count ? region->leaf_count : 1, SHA256_DIGEST_SIZE);
+    if (!region->leaves) {
+        return -1;
+    }
+
+    tree->count++;
+    return 0;
+}
+
+int merkle_add_gpt_regions(merkle_tree_t *tree, const char *path) {
+    gpt_table_t table;
+    char name[40];
+    uint64_t first = UINT64_MAX;
+
+    if (gpt_read(path, &table) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < table.count; i++) {
+        if (gpt_partition_offset(&table.partitions[i]) < first) {
+            first = gpt_partition_offset(&table.partitions[i]);
+        }
+    }
+
+    // Protective MBR, GPT and the bootloader written between them and the first partition;
+    // not "loader", which is the name of GPT partition 1
+    if (first != UINT64_MAX && first > 0 && merkle_add_region(tree, "gpt+loader", 0, first) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < table.count; i++) {
+        const gpt_partition_t *p = &table.partitions[i];
+        if (p->name[0]) {
+            snprintf(name, sizeof(name), "%s", p->name);
+        } else {
+            snprintf(name, sizeof(name), "p%d", p->number);
+        }
+        if (merkle_add_region(tree, name, gpt_partition_offset(p), gpt_partition_size(p)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int merkle_compute(merkle_tree_t *tree, const char *path, int jobs) {
+    merkle_work_t work;
+    size_t total = 0;
+    int result = -1;
+
+    for (size_t r = 0; r < tree->count; r++) {
+        total += tree->regions[r].leaf_count;
+    }
+
+    memset(&work, 0, sizeof(work));
+    work.tree = tree;
+    work.total = total;
+    work.job_region = malloc((total ? total : 1) * sizeof(size_t));
+    work.job_leaf = malloc((total ? total : 1) * sizeof(size_t));
+    work.fd = open(path, O_RDONLY);
+
+    if (work.job_region && work.job_leaf && work.fd >= 0) {
+        size_t job = 0;
+        for (size_t r = 0; r < tree->count; r++) {
+            for (size_t l = 0; l < tree->regions[r].leaf_count; l++) {
+                work.job_region[job] = r;
+                work.job_leaf[job] = l;
+                job++;
+            }
+        }
+        result = run_workers(&work, jobs);
+    }
+
+    if (work.fd >= 0) {
+        close(work.fd);
+    }
+    free(work.job_region);
+    free(work.job_leaf);
+    if (result != 0) {
+        return -1;
+    }
+
+    uint8_t (*roots)[SHA256_DIGEST_SIZE] = malloc((tree->count ? tree->count : 1) * SHA256_DIGEST_SIZE);
+    if (!roots) {
+        return -1;
+    }
+    for (size_t r = 0; r < tree->count; r++) {
+        compute_root((const uint8_t (*)[SHA256_DIGEST_SIZE])tree->regions[r].leaves,
+                     tree->regions[r].leaf_count, tree->regions[r].root);
+        memcpy(roots[r], tree->regions[r].root, SHA256_DIGEST_SIZE);
+    }
+    result = compute_root((const uint8_t (*)[SHA256_DIGEST_SIZE])roots, tree->count, tree->root);
+    free(roots);
+    return result;
+}
+
+int merkle_save(const merkle_tree_t *tree, const char *path) {
+    char hex[SHA256_HEX_SIZE];
+
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        return -1;
+    }
+
+    fprintf(out, "%s\n", MERKLE_HEADER);
+    fprintf(out, "leaf_size %u\n", tree->leaf_size);
+    sha256_to_hex(tree->root, hex);
+    fprintf(out, "root %s\n", hex);
+    for (size_t r = 0; r < tree->count; r++) {
+        const merkle_region_t *region = &tree->regions[r];
+        sha256_to_hex(region->root, hex);
+        fprintf(out, "region %s %llu %llu %s\n", region->name,
+                (unsigned long long)region->offset, (unsigned long long)region->size, hex);
+        for (size_t l = 0; l < region->leaf_count; l++) {
+            sha256_to_hex(region->leaves[l], hex);
+            fprintf(out, "%s\n", hex);
+        }
+    }
+
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+static int parse_hex_digest(const char *hex, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) {
+            return -1;
+        }
+        digest[i] = (uint8_t)byte;
+    }
+    return 0;
+}
+
+int merkle_load(const char *path, merkle_tree_t *tree) {
+    char line[256];
+    char name[40], hex[SHA256_HEX_SIZE];
+    unsigned long long offset, size;
+    unsigned int leaf_size = 0;
+    merkle_region_t *region = NULL;
+    size_t next_leaf = 0;
+    int result = 0;
+
+    merkle_init(tree, 0);
+
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return -1;
+    }
+
+    while (result == 0 && fgets(line, sizeof(line), in)) {
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "leaf_size %u", &leaf_size) == 1) {
+            tree->leaf_size = leaf_size;
+        } else if (sscanf(line, "root %64s", hex) == 1) {
+            result = parse_hex_digest(hex, tree->root);
+        } else if (sscanf(line, "region %39s %llu %llu %64s", name, &offset, &size, hex) == 4) {
+            if ((region && next_leaf != region->leaf_count) || leaf_size == 0 ||
+                merkle_add_region(tree, name, offset, size) != 0) {
+                result = -1;
+                break;
+            }
+            region = &tree->regions[tree->count - 1];
+            next_leaf = 0;
+            result = parse_hex_digest(hex, region->root);
+        } else if (region && next_leaf < region->leaf_count && sscanf(line, "%64s", hex) == 1) {
+            result = parse_hex_digest(hex, region->leaves[next_leaf++]);
+        } else {
+            result = -1;
+        }
+    }
+    fclose(in);
+
+    if (result != 0 || (region && next_leaf != region->leaf_count)) {
+        merkle_free(tree);
+        return -1;
+    }
+    return 0;
+}
+
+void merkle_free(merkle_tree_t *tree) {
+    for (size_t r = 0; r < tree->count; r++) {
+        free(tree->regions[r].leaves);
+    }
+    free(tree->regions);
+    memset(tree, 0, sizeof(*tree));
+}
+
+int merkle_check_tree(const merkle_tree_t *tree) {
+    uint8_t root[SHA256_DIGEST_SIZE];
+    int result = 0;
+
+    uint8_t (*roots)[SHA256_DIGEST_SIZE] = malloc((tree->count ? tree->count : 1) * SHA256_DIGEST_SIZE);
+    if (!roots) {
+        return -1;
+    }
+
+    for (size_t r = 0; r < tree->count && result == 0; r++) {
+        if (compute_root((const uint8_t (*)[SHA256_DIGEST_SIZE])tree->regions[r].leaves,
+                         tree->regions[r].leaf_count, root) != 0 ||
+            memcmp(root, tree->regions[r].root, SHA256_DIGEST_SIZE) != 0) {
+            result = -1;
+        }
+        memcpy(roots[r], tree->regions[r].root, SHA256_DIGEST_SIZE);
+    }
+    if (result == 0 && (compute_root((const uint8_t (*)[SHA256_DIGEST_SIZE])roots, tree->count, root) != 0 ||
+                        memcmp(root, tree->root, SHA256_DIGEST_SIZE) != 0)) {
+        result = -1;
+    }
+
+    free(roots);
+    return result;
+}
+
+long merkle_verify(const merkle_tree_t *tree, const char *path, const char *region_name,
+                   uint64_t offset, uint64_t length, int jobs,
+                   merkle_mismatch_fn on_mismatch, void *user) {
+    merkle_work_t work;
+    size_t total = 0;
+    long bad = -1;
+    uint64_t end = length ? offset + length : UINT64_MAX;
+
+    for (size_t r = 0; r < tree->count; r++) {
+        total += tree->regions[r].leaf_count;
+    }
+
+    memset(&work, 0, sizeof(work));
+    work.tree = tree;
+    work.verify = 1;
+    work.job_region = malloc((total ? total : 1) * sizeof(size_t));
+    work.job_leaf = malloc((total ? total : 1) * sizeof(size_t));
+    work.bad = calloc(total ? total : 1, 1);
+    work.fd = open(path, O_RDONLY);
+
+    if (work.job_region && work.job_leaf && work.bad && work.fd >= 0) {
+        // Queue only the leaves that overlap the requested byte range (device offsets)
+        for (size_t r = 0; r < tree->count; r++) {
+            const merkle_region_t *region = &tree->regions[r];
+            if (region_name && strcmp(region->name, region_name) != 0) {
+                continue;
+            }
+            for (size_t l = 0; l < region->leaf_count; l++) {
+                uint64_t leaf_start = region->offset + (uint64_t)l * tree->leaf_size;
+                uint64_t leaf_end = leaf_start + tree->leaf_size;
+                if (leaf_end > offset && leaf_start < end) {
+                    work.job_region[work.total] = r;
+                    work.job_leaf[work.total] = l;
+                    work.total++;
+                }
+            }
+        }
+
+        if (run_workers(&work, jobs) == 0) {
+            bad = 0;
+            for (size_t job = 0; job < work.total; job++) {
+                if (!work.bad[job]) {
+                    continue;
+                }
+                const merkle_region_t *region = &tree->regions[work.job_region[job]];
+                uint64_t leaf_offset = (uint64_t)work.job_leaf[job] * tree->leaf_size;
+                uint64_t leaf_size = region->size - leaf_offset < tree->leaf_size ?
+                                     region->size - leaf_offset : tree->leaf_size;
+                if (on_mismatch) {
+                    on_mismatch(region, region->offset + leaf_offset, leaf_size, user);
+                }
+                bad++;
+            }
+        }
+    }
+
+    if (work.fd >= 0) {
+        close(work.fd);
+    }
+    free(work.job_region);
+    free(work.job_leaf);
+    free(work.bad);
+    return bad;
+}
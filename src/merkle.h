@@ -0,0 +1,53 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sha256.h"
+
+// 1 MiB leaves: a 16 GB device is 16k leaf hashes (512 KB) and a bad leaf pins the damage to 1 MiB
+#define MERKLE_DEFAULT_LEAF_SIZE (1024 * 1024)
+
+// A byte range of an image (a partition or the bootloader area) with its own tree
+typedef struct {
+    char name[40];
+    uint64_t offset;
+    uint64_t size;
+    size_t leaf_count;
+    uint8_t (*leaves)[SHA256_DIGEST_SIZE];
+    uint8_t root[SHA256_DIGEST_SIZE];
+} merkle_region_t;
+
+typedef struct {
+    uint32_t leaf_size;
+    size_t count;
+    merkle_region_t *regions;
+    uint8_t root[SHA256_DIGEST_SIZE];   // Tree over the region roots
+} merkle_tree_t;
+
+// Called for every leaf that does not match during verification
+typedef void (*merkle_mismatch_fn)(const merkle_region_t *region, uint64_t offset, uint64_t size, void *user);
+
+void merkle_init(merkle_tree_t *tree, uint32_t leaf_size);
+int merkle_add_region(merkle_tree_t *tree, const char *name, uint64_t offset, uint64_t size);
+
+// Regions for a GPT disk: the area before the first partition, then every partition
+int merkle_add_gpt_regions(merkle_tree_t *tree, const char *path);
+
+// Hash every leaf of every region with jobs threads, then compute the roots
+int merkle_compute(merkle_tree_t *tree, const char *path, int jobs);
+
+int merkle_save(const merkle_tree_t *tree, const char *path);
+int merkle_load(const char *path, merkle_tree_t *tree);
+void merkle_free(merkle_tree_t *tree);
+
+// Check that stored leaves still produce the stored roots; returns 0 if consistent
+int merkle_check_tree(const merkle_tree_t *tree);
+
+// Verify the leaves overlapping [offset, offset + length) of region (NULL = all regions);
+// returns the number of bad leaves, or -1 if the target cannot be read
+long merkle_verify(const merkle_tree_t *tree, const char *path, const char *region,
+                   uint64_t offset, uint64_t length, int jobs,
+                   merkle_mismatch_fn on_mismatch, void *user);
+
+#endif // MERKLE_H
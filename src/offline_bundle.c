@@ -0,0 +1,580 @@
+/*
+ * offline_bundle.c - Offline builds for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the offline bundle: everything a build fetches, captured
+ * once by "builder export-bundle DIR [OPTIONS]" for the settings those options
+ * give, and served from disk by "--offline DIR". A bundle holds
+ *   git/<host>/<path>.git     shallow bare mirrors (full ones for submodules)
+ *   files/<host>/<path>       blobs such as the Mali drivers and firmware
+ *   ubuntu-ports/             a partial apt mirror: the signed Release files and
+ *                             arm64 package indexes of every pocket, and the .debs
+ *                             debootstrap and the package installs use
+ * Offline, git reaches the mirrors through url.<base>.insteadOf and may not
+ * use any other transport, apt and debootstrap use the partial mirror, and a
+ * fetch the bundle cannot serve fails at once instead of retrying.
+ */
+
+#include "../builder.h"
+
+#define BUNDLE_MANIFEST "bundle.manifest"
+#define BUNDLE_HEADER "# orangepi-offline-bundle v1"
+#define BUNDLE_APT "ubuntu-ports"
+#define BUNDLE_FETCH_JOBS 8
+
+typedef struct {
+    const char *url;
+    const char *ref;            // Branch or tag the build clones; NULL for the default branch
+    int recursive;              // Cloned with its submodules
+    int (*needed)(build_config_t *config);
+} bundle_repo_t;
+
+static const char *bundle_pockets[] = {"", "-security", "-updates", NULL};
+// "SHA256  pool/path" for each stanza apt-cache show prints
+static const char *bundle_sums_awk =
+    "awk '/^Filename:/{f=$2} /^SHA256:/{s=$2} /^$/{if (f) print s \"  \" f; f=\"\"}'";
+static const char *bundle_components = "main restricted universe multiverse";
+
+static int always_needed(build_config_t *config) {
+    (void)config;
+    return 1;
+}
+
+static int uboot_needed(build_config_t *config) {
+    return config->build_uboot;
+}
+
+static int emulator_needed(build_config_t *config, emulation_platform_t platform) {
+    return config->distro_type == DISTRO_EMULATION &&
+           (config->emu_platform == platform || config->emu_platform == EMU_ALL);
+}
+
+static int libreelec_needed(build_config_t *config) {
+    return emulator_needed(config, EMU_LIBREELEC);
+}
+
+static int emulationstation_needed(build_config_t *config) {
+    return emulator_needed(config, EMU_EMULATIONSTATION);
+}
+
+static int retropie_needed(build_config_t *config) {
+    return emulator_needed(config, EMU_RETROPIE);
+}
+
+// Every repository the build clones first; fallbacks are for online builds only
+static const bundle_repo_t bundle_repos[] = {
+    {"https://github.com/orangepi-xunlong/linux-orangepi.git", "orange-pi-5.10-rk3588", 0, always_needed},
+    {"https://github.com/u-boot/u-boot.git", "v2024.01-rc4", 0, uboot_needed},
+    {"https://github.com/ARM-software/arm-trusted-firmware.git", NULL, 0, uboot_needed},
+    {"https://github.com/rockchip-linux/rkbin.git", NULL, 0, uboot_needed},
+    {"https://github.com/LibreELEC/LibreELEC.tv.git", NULL, 0, libreelec_needed},
+    {"https://github.com/RetroPie/EmulationStation.git", NULL, 1, emulationstation_needed},
+    {"https://github.com/RetroPie/RetroPie-Setup.git", NULL, 0, retropie_needed},
+    {NULL, NULL, 0, NULL}
+};
+
+// URL without its scheme, which is where the bundle keeps it
+static const char *url_location(const char *url) {
+    const char *p = strstr(url, "://");
+    return p ? p + 3 : url;
+}
+
+static void bundle_repo_path(const char *bundle, const char *url, char *path, size_t size) {
+    const char *location = url_location(url);
+    size_t len = strlen(location);
+
+    while (len > 0 && location[len - 1] == '/') {
+        len--;
+    }
+    if (len > 4 && strncmp(location + len - 4, ".git", 4) == 0) {
+        len -= 4;
+    }
+    snprintf(path, size, "%s/git/%.*s.git", bundle, (int)len, location);
+}
+
+void get_offline_mirror(build_config_t *config, char *url, size_t size) {
+    snprintf(url, size, "file://%s/%s", config->offline_bundle, BUNDLE_APT);
+}
+
+// Command that downloads url to dest, or copies it out of the bundle offline
+void get_fetch_command(build_config_t *config, const char *url, const char *dest, char *cmd, size_t size) {
+    if (config->offline_bundle[0]) {
+        snprintf(cmd, size, "cp %s/files/%s %s", config->offline_bundle, url_location(url), dest);
+    } else {
+        snprintf(cmd, size, "wget -O %s \"%s\"", dest, url);
+    }
+}
+
+// Check the bundle was exported for this build and route git to it
+int offline_setup(build_config_t *config) {
+    char path[MAX_PATH_LEN];
+    char line[MAX_PATH_LEN];
+    char key[32];
+    char value[MAX_PATH_LEN];
+    char codename[64] = "";
+    char snapshot[64] = "";
+    char msg[MAX_PATH_LEN + 128];
+
+    if (!realpath(config->offline_bundle, path)) {
+        snprintf(msg, sizeof(msg), "Offline bundle %s not found", config->offline_bundle);
+        LOG_ERROR(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    snprintf(config->offline_bundle, sizeof(config->offline_bundle), "%s", path);
+
+    snprintf(path, sizeof(path), "%s/%s", config->offline_bundle, BUNDLE_MANIFEST);
+    FILE *fp = fopen(path, "r");
+    if (!fp || !fgets(line, sizeof(line), fp) || strncmp(line, BUNDLE_HEADER, strlen(BUNDLE_HEADER)) != 0) {
+        if (fp) {
+            fclose(fp);
+        }
+        snprintf(msg, sizeof(msg), "%s is not an offline bundle (no %s)", config->offline_bundle, BUNDLE_MANIFEST);
+        LOG_ERROR(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%31s %511s", key, value) != 2) {
+            continue;
+        }
+        if (strcmp(key, "codename") == 0) {
+            snprintf(codename, sizeof(codename), "%s", value);
+        } else if (strcmp(key, "snapshot") == 0) {
+            snprintf(snapshot, sizeof(snapshot), "%s", value);
+        }
+    }
+    fclose(fp);
+
+    if (strcmp(codename, config->ubuntu_codename) != 0) {
+        snprintf(msg, sizeof(msg), "Offline bundle holds Ubuntu %s packages, this build needs %s",
+                 codename, config->ubuntu_codename);
+        LOG_ERROR(msg);
+        return ERROR_UNKNOWN;
+    }
+    if (config->reproducible && strcmp(snapshot, config->apt_snapshot) != 0) {
+        snprintf(msg, sizeof(msg), "Offline bundle holds apt snapshot %s, this build needs %s",
+                 snapshot, config->apt_snapshot);
+        LOG_ERROR(msg);
+        return ERROR_UNKNOWN;
+    }
+
+    // Every https clone comes from the bundle, and nothing may leave the host
+    snprintf(value, sizeof(value), "url.file://%s/git/.insteadOf", config->offline_bundle);
+    setenv("GIT_CONFIG_COUNT", "1", 1);
+    setenv("GIT_CONFIG_KEY_0", value, 1);
+    setenv("GIT_CONFIG_VALUE_0", "https://", 1);
+    setenv("GIT_ALLOW_PROTOCOL", "file", 1);
+    setenv("GIT_TERMINAL_PROMPT", "0", 1);
+
+    snprintf(msg, sizeof(msg), "Offline build: serving sources, blobs and packages from %s", config->offline_bundle);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
+
+// First directory the last mount created inside the rootfs, removed again on unmount
+static char created_dir[MAX_PATH_LEN * 2];
+
+// Bind the partial apt mirror into the rootfs at its host path, read-only
+int offline_mount_bundle(build_config_t *config, const char *rootfs_dir) {
+    char target[MAX_PATH_LEN * 2];
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    if (!config->offline_bundle[0]) {
+        return ERROR_SUCCESS;
+    }
+    snprintf(target, sizeof(target), "%s%s/%s", rootfs_dir, config->offline_bundle, BUNDLE_APT);
+
+    created_dir[0] = '\0';
+    for (char *slash = target + strlen(rootfs_dir); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int missing = slash != target && access(target, F_OK) != 0;
+        if (missing) {
+            snprintf(created_dir, sizeof(created_dir), "%s", target);
+        }
+        *slash = '/';
+        if (missing) {
+            break;
+        }
+    }
+    if (!created_dir[0] && access(target, F_OK) != 0) {
+        snprintf(created_dir, sizeof(created_dir), "%s", target);
+    }
+
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s && { mountpoint -q %s || mount --bind -o ro %s/%s %s; }",
+             target, target, config->offline_bundle, BUNDLE_APT, target);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to make the offline bundle available inside the rootfs");
+        return ERROR_INSTALLATION_FAILED;
+    }
+    return ERROR_SUCCESS;
+}
+
+void offline_unmount_bundle(build_config_t *config, const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    if (!config->offline_bundle[0]) {
+        return;
+    }
+    snprintf(cmd, sizeof(cmd), "umount %s%s/%s 2>/dev/null || true",
+             rootfs_dir, config->offline_bundle, BUNDLE_APT);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    // Only the empty directories the mount point needed
+    if (created_dir[0]) {
+        snprintf(cmd, sizeof(cmd), "find %s -depth -type d -empty -delete 2>/dev/null || true", created_dir);
+        execute_command_safe(cmd, 0, &error_ctx);
+        created_dir[0] = '\0';
+    }
+}
+
+// Shallow bare mirror of ref (full for submodules, whose pinned commits can be anywhere)
+static int mirror_repo(const char *bundle, const char *url, const char *ref, int recursive, int full, FILE *manifest) {
+    char path[MAX_PATH_LEN];
+    char auth[MAX_CMD_LEN];
+    char cmd[MAX_CMD_LEN];
+    char line[MAX_PATH_LEN];
+    char msg[MAX_PATH_LEN + 64];
+    const char *depth = full ? "" : "--depth 1 ";
+    error_context_t error_ctx = {0};
+
+    bundle_repo_path(bundle, url, path, sizeof(path));
+    snprintf(auth, sizeof(auth), "%s", add_github_token_to_url(url));
+    snprintf(msg, sizeof(msg), "Mirroring %s%s%s...", url, ref ? " " : "", ref ? ref : "");
+    LOG_INFO(msg);
+
+    if (access(path, F_OK) != 0) {
+        // The token is only used to fetch; the mirror remembers the plain URL
+        snprintf(cmd, sizeof(cmd), "git clone --bare %s%s%s %s %s && git -C %s remote set-url origin %s",
+                 depth, ref ? "--branch " : "", ref ? ref : "", auth, path, path, url);
+    } else if (full) {
+        snprintf(cmd, sizeof(cmd), "git -C %s fetch %s '+refs/heads/*:refs/heads/*' '+refs/tags/*:refs/tags/*'",
+                 path, auth);
+    } else if (ref) {
+        snprintf(cmd, sizeof(cmd),
+                 "git -C %s fetch --depth 1 %s '+refs/heads/%s:refs/heads/%s' || "
+                 "git -C %s fetch --depth 1 %s '+refs/tags/%s:refs/tags/%s'",
+                 path, auth, ref, ref, path, auth, ref, ref);
+    } else {
+        snprintf(cmd, sizeof(cmd), "git -C %s fetch --depth 1 %s \"+$(git -C %s symbolic-ref HEAD):$(git -C %s symbolic-ref HEAD)\"",
+                 path, auth, path, path);
+    }
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        snprintf(msg, sizeof(msg), "Failed to mirror %s", url);
+        LOG_ERROR(msg);
+        return ERROR_NETWORK_FAILURE;
+    }
+    fprintf(manifest, "git %s %s\n", url, ref ? ref : "HEAD");
+
+    if (!recursive) {
+        return ERROR_SUCCESS;
+    }
+
+    // Submodules are cloned from their own URLs, which the build redirects too
+    snprintf(cmd, sizeof(cmd), "git -C %s config --blob HEAD:.gitmodules --get-regexp '^submodule\\..*\\.url$' 2>/dev/null",
+             path);
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        return ERROR_UNKNOWN;
+    }
+    int result = ERROR_SUCCESS;
+    while (result == ERROR_SUCCESS && fgets(line, sizeof(line), fp)) {
+        char *sub_url = strchr(line, ' ');
+        if (!sub_url) {
+            continue;
+        }
+        sub_url++;
+        sub_url[strcspn(sub_url, "\n")] = '\0';
+        if (strncmp(sub_url, "https://", 8) != 0) {
+            snprintf(msg, sizeof(msg), "Submodule %s is not an https URL, not bundled", sub_url);
+            LOG_WARNING(msg);
+            continue;
+        }
+        result = mirror_repo(bundle, sub_url, NULL, 1, 1, manifest);
+    }
+    pclose(fp);
+    return result;
+}
+
+static int bundle_file(const char *bundle, const char *url, FILE *manifest) {
+    char path[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[MAX_PATH_LEN + 64];
+    error_context_t error_ctx = {0};
+
+    snprintf(path, sizeof(path), "%s/files/%s", bundle, url_location(url));
+    snprintf(cmd, sizeof(cmd), "mkdir -p $(dirname %s) && wget -q -O %s.part \"%s\" && mv %s.part %s",
+             path, path, url, path, path);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        snprintf(cmd, sizeof(cmd), "rm -f %s.part", path);
+        execute_command_safe(cmd, 0, &error_ctx);
+        snprintf(msg, sizeof(msg), "Failed to download %s", url);
+        LOG_ERROR(msg);
+        return ERROR_NETWORK_FAILURE;
+    }
+    fprintf(manifest, "file %s\n", url);
+    return ERROR_SUCCESS;
+}
+
+// The packages the rootfs stages install, in the order they install them
+static void bundle_package_list(build_config_t *config, char *list, size_t size) {
+    const rootfs_format_info_t *format_info = get_rootfs_format_info(config->rootfs_format);
+    const char *distro = NULL;
+
+    switch (config->distro_type) {
+        case DISTRO_DESKTOP:
+            distro = "desktop";
+            break;
+        case DISTRO_SERVER:
+            distro = "server";
+            break;
+        case DISTRO_EMULATION:
+            distro = "emulation";
+            break;
+        default:
+            break;
+    }
+
+    snprintf(list, size, "%s %s %s %s %s %s %s %s",
+             get_package_group("locales"), get_package_group("rootfs-base"), get_distro_base_packages(config),
+             get_package_group("common"), distro ? get_package_group(distro) : "",
+             config->install_gpu_blobs ? get_package_group("gpu") : "",
+             format_info->target_package ? format_info->target_package : "",
+             config->dm_verity && rootfs_format_is_readonly(config) ? get_package_group("verity") : "");
+}
+
+// Release files and arm64 indexes as published, so their signatures still hold
+static int bundle_apt_indexes(build_config_t *config, const char *apt_dir, const char *mirror) {
+    char cmd[MAX_CMD_LEN];
+    char msg[256];
+    error_context_t error_ctx = {0};
+
+    for (int p = 0; bundle_pockets[p]; p++) {
+        snprintf(msg, sizeof(msg), "Bundling package indexes of %s%s...", config->ubuntu_codename, bundle_pockets[p]);
+        LOG_INFO(msg);
+        snprintf(cmd, sizeof(cmd),
+                 "cd %s && d=dists/%s%s && mkdir -p $d && "
+                 "{ wget -q -O $d/Release.gpg.part %s/$d/Release.gpg && mv $d/Release.gpg.part $d/Release.gpg || "
+                 "rm -f $d/Release.gpg.part; } && "
+                 "wget -q -O $d/InRelease.part %s/$d/InRelease && mv $d/InRelease.part $d/InRelease && "
+                 "wget -q -O $d/Release.part %s/$d/Release && mv $d/Release.part $d/Release && "
+                 "for c in %s; do mkdir -p $d/$c/binary-arm64 && "
+                 "wget -q -O $d/$c/binary-arm64/Packages.xz.part %s/$d/$c/binary-arm64/Packages.xz && "
+                 "mv $d/$c/binary-arm64/Packages.xz.part $d/$c/binary-arm64/Packages.xz || exit 1; done",
+                 apt_dir, config->ubuntu_codename, bundle_pockets[p], mirror, mirror, mirror,
+                 bundle_components, mirror);
+        if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+            snprintf(msg, sizeof(msg), "Failed to download the %s%s package indexes",
+                     config->ubuntu_codename, bundle_pockets[p]);
+            LOG_ERROR(msg);
+            return ERROR_NETWORK_FAILURE;
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+// Resolve the debootstrap base (release suite only, as debootstrap reads it) and every
+// install (all pockets) with a private apt, then fetch exactly those .debs and verify them
+static int bundle_apt_packages(build_config_t *config, const char *bundle, const char *apt_dir,
+                               const char *mirror, FILE *manifest) {
+    char root[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN + 32];
+    char packages[4096];
+    char cmd[MAX_CMD_LEN];
+    char release_opts[MAX_PATH_LEN * 2 + 128];
+    char msg[256];
+    error_context_t error_ctx = {0};
+    int count = 0;
+
+    snprintf(root, sizeof(root), "%s/.export", bundle);
+    snprintf(cmd, sizeof(cmd),
+             "rm -rf %s && mkdir -p %s/etc/apt/apt.conf.d %s/etc/apt/preferences.d %s/etc/apt/sources.list.d "
+             "%s/var/lib/apt/lists/partial %s/var/lib/apt/release-lists/partial "
+             "%s/var/cache/apt/archives/partial %s/var/lib/dpkg && touch %s/var/lib/dpkg/status",
+             root, root, root, root, root, root, root, root, root);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    snprintf(path, sizeof(path), "%s/apt.conf", root);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    fprintf(fp,
+            "Dir \"%s/\";\n"
+            "Dir::State::status \"%s/var/lib/dpkg/status\";\n"
+            "APT::Architecture \"arm64\";\n"
+            "APT::Architectures { \"arm64\"; };\n"
+            "Acquire::Languages \"none\";\n"
+            "Acquire::Check-Valid-Until \"false\";\n"
+            "Acquire::IndexTargets::deb::CNF::DefaultEnabled \"false\";\n"
+            "Acquire::IndexTargets::deb::DEP-11::DefaultEnabled \"false\";\n"
+            "Acquire::IndexTargets::deb::DEP-11-icons::DefaultEnabled \"false\";\n"
+            "Acquire::IndexTargets::deb::DEP-11-icons-small::DefaultEnabled \"false\";\n"
+            "Debug::NoLocking \"true\";\n",
+            root, root);
+    fclose(fp);
+
+    snprintf(path, sizeof(path), "%s/etc/apt/sources.list", root);
+    fp = fopen(path, "w");
+    if (!fp) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    for (int p = 0; bundle_pockets[p]; p++) {
+        fprintf(fp, "deb [trusted=yes] file://%s %s%s %s\n",
+                apt_dir, config->ubuntu_codename, bundle_pockets[p], bundle_components);
+    }
+    fclose(fp);
+
+    // debootstrap reads only the release suite, never -updates or -security
+    snprintf(path, sizeof(path), "%s/release.list", root);
+    fp = fopen(path, "w");
+    if (!fp) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    fprintf(fp, "deb [trusted=yes] file://%s %s %s\n", apt_dir, config->ubuntu_codename, bundle_components);
+    fclose(fp);
+    snprintf(release_opts, sizeof(release_opts),
+             "-o Dir::Etc::sourcelist=%s/release.list -o Dir::Etc::sourceparts=- "
+             "-o Dir::State::lists=%s/var/lib/apt/release-lists/ "
+             "-o Dir::Cache::pkgcache= -o Dir::Cache::srcpkgcache=",
+             root, root);
+
+    // debootstrap's own package choice, with the --include list build_ubuntu_rootfs passes
+    LOG_INFO("Resolving the packages this build installs...");
+    bundle_package_list(config, packages, sizeof(packages));
+    snprintf(cmd, sizeof(cmd),
+             "export APT_CONFIG=%s/apt.conf && apt-get -qq update && apt-get -qq %s update && "
+             "debootstrap --print-debs --arch=arm64 --include=wget,ca-certificates,locales %s %s/debootstrap "
+             "file://%s > %s/debootstrap.debs",
+             root, release_opts, config->ubuntu_codename, root, apt_dir, root);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to resolve the packages for the bundle");
+        return ERROR_DEPENDENCY_MISSING;
+    }
+
+    // The base system at the release versions debootstrap installs...
+    snprintf(cmd, sizeof(cmd),
+             "export APT_CONFIG=%s/apt.conf && apt-cache %s show --no-all-versions $(cat %s/debootstrap.debs) | "
+             "%s > %s/SHA256SUMS.release",
+             root, release_opts, root, bundle_sums_awk, root);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to resolve the debootstrap base for the bundle");
+        return ERROR_DEPENDENCY_MISSING;
+    }
+
+    // ...and everything apt installs on top, at the candidate versions of every pocket
+    snprintf(cmd, sizeof(cmd),
+             "export APT_CONFIG=%s/apt.conf && "
+             "apt-get -s -qq -y install $(cat %s/debootstrap.debs) %s | "
+             "awk '/^Inst /{print $2 \"=\" substr($3, 2)}' | xargs apt-cache show --no-all-versions | "
+             "%s | cat - %s/SHA256SUMS.release | sort -u > %s/SHA256SUMS",
+             root, root, packages, bundle_sums_awk, root, root);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to resolve the packages for the bundle");
+        return ERROR_DEPENDENCY_MISSING;
+    }
+
+    // Already bundled .debs are kept; the pool path is the same on every mirror
+    snprintf(msg, sizeof(msg), "Downloading packages into the bundle (%d at a time)...", BUNDLE_FETCH_JOBS);
+    LOG_INFO(msg);
+    snprintf(cmd, sizeof(cmd),
+             "cd %s && awk '{print $2}' %s/SHA256SUMS | xargs -P %d -n 1 sh -c "
+             "'test -f \"$1\" || { mkdir -p \"${1%%/*}\" && wget -q -O \"$1.part\" \"%s/$1\" && mv \"$1.part\" \"$1\"; }' sh && "
+             "sha256sum -c --quiet %s/SHA256SUMS",
+             apt_dir, root, BUNDLE_FETCH_JOBS, mirror, root);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to download or verify the bundled packages");
+        return ERROR_NETWORK_FAILURE;
+    }
+
+    snprintf(path, sizeof(path), "%s/SHA256SUMS", root);
+    fp = fopen(path, "r");
+    if (fp) {
+        int c;
+        while ((c = fgetc(fp)) != EOF) {
+            count += c == '\n';
+        }
+        fclose(fp);
+    }
+    fprintf(manifest, "debs %d\n", count);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    execute_command_safe(cmd, 0, &error_ctx);
+    snprintf(msg, sizeof(msg), "Bundled %d packages", count);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
+
+// Capture every source, blob and package a build with config fetches
+int export_offline_bundle(build_config_t *config, const char *bundle_dir) {
+    char bundle[MAX_PATH_LEN];
+    char apt_dir[MAX_PATH_LEN + 32];
+    char mirror[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN + 32];
+    char part[MAX_PATH_LEN + 40];
+    char cmd[MAX_CMD_LEN];
+    char msg[MAX_PATH_LEN + 64];
+    error_context_t error_ctx = {0};
+    int result = ERROR_SUCCESS;
+
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/git %s/files %s/%s", bundle_dir, bundle_dir, bundle_dir, BUNDLE_APT);
+    if (strpbrk(bundle_dir, " '\"$`\\;&|") || execute_command_safe(cmd, 0, &error_ctx) != 0 ||
+        !realpath(bundle_dir, bundle)) {
+        snprintf(msg, sizeof(msg), "Cannot create offline bundle %s", bundle_dir);
+        LOG_ERROR(msg);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    snprintf(apt_dir, sizeof(apt_dir), "%s/%s", bundle, BUNDLE_APT);
+    get_ubuntu_mirror(config, mirror, sizeof(mirror));
+
+    snprintf(path, sizeof(path), "%s/%s", bundle, BUNDLE_MANIFEST);
+    snprintf(part, sizeof(part), "%s.part", path);
+    FILE *manifest = fopen(part, "w");
+    if (!manifest) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    fprintf(manifest, "%s\n", BUNDLE_HEADER);
+    fprintf(manifest, "created %lld\n", (long long)time(NULL));
+    fprintf(manifest, "codename %s\n", config->ubuntu_codename);
+    fprintf(manifest, "snapshot %s\n", config->reproducible ? config->apt_snapshot : "-");
+    fprintf(manifest, "mirror %s\n", mirror);
+
+    for (int i = 0; bundle_repos[i].url && result == ERROR_SUCCESS; i++) {
+        if (bundle_repos[i].needed(config)) {
+            result = mirror_repo(bundle, bundle_repos[i].url, bundle_repos[i].ref,
+                                 bundle_repos[i].recursive, 0, manifest);
+        }
+    }
+
+    // Mali blobs, skipped the way download_mali_blobs skips them
+    for (int i = 0; result == ERROR_SUCCESS && config->install_gpu_blobs && mali_drivers[i].url[0]; i++) {
+        if (!config->enable_vulkan && strstr(mali_drivers[i].description, "Vulkan")) {
+            continue;
+        }
+        result = bundle_file(bundle, mali_drivers[i].url, manifest);
+        if (result != ERROR_SUCCESS && !mali_drivers[i].required) {
+            result = ERROR_SUCCESS;
+        }
+    }
+
+    if (result == ERROR_SUCCESS && config->build_rootfs) {
+        result = bundle_apt_indexes(config, apt_dir, mirror);
+        if (result == ERROR_SUCCESS) {
+            result = bundle_apt_packages(config, bundle, apt_dir, mirror, manifest);
+        }
+    }
+
+    if (fclose(manifest) != 0 || result != ERROR_SUCCESS || rename(part, path) != 0) {
+        unlink(part);
+        LOG_ERROR("Offline bundle export failed; the bundle is left without a manifest");
+        return result != ERROR_SUCCESS ? result : ERROR_UNKNOWN;
+    }
+
+    snprintf(cmd, sizeof(cmd), "du -sh %s", bundle);
+    execute_command_safe(cmd, 1, &error_ctx);
+    snprintf(msg, sizeof(msg), "Offline bundle written to %s", bundle);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
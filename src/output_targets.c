@@ -0,0 +1,309 @@
+/*
+ * output_targets.c - Build output fan-out for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains functions for producing several outputs from one
+ * staged rootfs and one bootloader build. The primary image is always
+ * built for config->target_medium; config->output_targets adds images for
+ * other media, a compressed release copy of every image, a rootfs tarball,
+ * a boot-files bundle and an SPI flash image (always built for NVMe).
+ * Extra outputs run in child processes alongside the primary image, so
+ * the rootfs is read while it is still in page cache
+ * and each extra format costs far less than another full build.
+ */
+
+#include "../builder.h"
+
+static const char *output_artifacts[] = {"compressed", "tarball", "bootfiles", "spi", NULL};
+
+// Image path for the primary medium (medium NULL) or an extra one
+void get_system_image_path(build_config_t *config, const char *medium, char *path, size_t size) {
+    if (medium) {
+        snprintf(path, size, "%s/orangepi5plus-%s-%s-%s.img",
+                 config->output_dir, config->ubuntu_codename, config->kernel_version, medium);
+    } else {
+        snprintf(path, size, "%s/orangepi5plus-%s-%s.img",
+                 config->output_dir, config->ubuntu_codename, config->kernel_version);
+    }
+}
+
+static int is_medium_target(const char *name) {
+    partition_layout_t layout;
+    return layout_init(&layout, name, 0) == 0;
+}
+
+static int is_artifact_target(const char *name) {
+    for (int i = 0; output_artifacts[i]; i++) {
+        if (strcmp(output_artifacts[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Check a comma-separated target list; returns 0 if every entry is known
+int validate_output_targets(const char *targets) {
+    char list[256];
+    char msg[512];
+    char *saveptr = NULL;
+
+    snprintf(list, sizeof(list), "%s", targets);
+    for (char *name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+        if (!is_medium_target(name) && !is_artifact_target(name)) {
+            snprintf(msg, sizeof(msg), "Unknown output target: %s", name);
+            LOG_ERROR(msg);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int output_target_enabled(build_config_t *config, const char *name) {
+    char list[256];
+    char *saveptr = NULL;
+
+    snprintf(list, sizeof(list), "%s", config->output_targets);
+    for (char *entry = strtok_r(list, ",", &saveptr); entry; entry = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(entry, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// xz release copy next to the image, with its checksum; the raw image is kept
+int compress_release_image(build_config_t *config, const char *image_path) {
+    char cmd[MAX_CMD_LEN];
+    char xz[512];
+    error_context_t error_ctx = {0};
+
+    LOG_INFO("Compressing release image...");
+    remote_filter_command(config, "xz -T0 -6", xz, sizeof(xz));
+    snprintf(cmd, sizeof(cmd),
+             "%s < %s > %s.xz.part && mv %s.xz.part %s.xz && "
+             "cd $(dirname %s) && sha256sum $(basename %s).xz > $(basename %s).xz.sha256",
+             xz, image_path, image_path, image_path, image_path, image_path, image_path, image_path);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to compress release image");
+        return ERROR_UNKNOWN;
+    }
+    return ERROR_SUCCESS;
+}
+
+static int build_medium_image(build_config_t *config, const char *medium, long root_mb) {
+    build_config_t medium_config = *config;
+    char image_path[MAX_PATH_LEN];
+    long image_mb = 0;
+
+    snprintf(medium_config.target_medium, sizeof(medium_config.target_medium), "%s", medium);
+    // An erase block size given for the primary medium says nothing about this one
+    medium_config.erase_block_kb = 0;
+
+    get_system_image_path(config, medium, image_path, sizeof(image_path));
+    unlink(image_path);
+
+    if (resolve_image_size(&medium_config, &image_mb) != ERROR_SUCCESS ||
+        assemble_system_image(&medium_config, image_path, image_mb, root_mb, 0, 0) != ERROR_SUCCESS) {
+        return ERROR_UNKNOWN;
+    }
+    if (output_target_enabled(config, "compressed")) {
+        return compress_release_image(config, image_path);
+    }
+    return ERROR_SUCCESS;
+}
+
+// tar options that make an archive depend only on the tree it packs
+static void get_tar_order_options(build_config_t *config, char *options, size_t size) {
+    if (config->reproducible) {
+        snprintf(options, size,
+                 "--sort=name --mtime=@%lld --clamp-mtime "
+                 "--pax-option=exthdr.name=%%d/PaxHeaders/%%f,delete=atime,delete=ctime",
+                 config->source_date_epoch);
+    } else {
+        options[0] = '\0';
+    }
+}
+
+static int build_rootfs_tarball(build_config_t *config) {
+    char cmd[MAX_CMD_LEN];
+    char path[MAX_PATH_LEN];
+    char order[256];
+    char zstd[512];
+    error_context_t error_ctx = {0};
+
+    get_system_image_path(config, "rootfs", path, sizeof(path));
+    path[strlen(path) - strlen(".img")] = '\0';
+
+    LOG_INFO("Packing rootfs tarball...");
+    get_tar_order_options(config, order, sizeof(order));
+    remote_filter_command(config, "zstd -T0", zstd, sizeof(zstd));
+    // Numeric owners and xattrs so the tree unpacks identically on any host
+    snprintf(cmd, sizeof(cmd),
+             "tar -C %s/rootfs --numeric-owner --xattrs --acls %s -I '%s' -cpf %s.tar.zst .",
+             config->output_dir, order, zstd, path);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to pack rootfs tarball");
+        return ERROR_UNKNOWN;
+    }
+    return ERROR_SUCCESS;
+}
+
+// Kernel, initrd, device trees, extlinux.conf and the bootloader, ready to copy onto a boot partition
+static int build_boot_bundle(build_config_t *config) {
+    char cmd[MAX_CMD_LEN];
+    char path[MAX_PATH_LEN];
+    char stage[MAX_PATH_LEN];
+    char order[256];
+    error_context_t error_ctx = {0};
+
+    get_system_image_path(config, "boot", path, sizeof(path));
+    path[strlen(path) - strlen(".img")] = '\0';
+    snprintf(stage, sizeof(stage), "%s/bootfiles", config->output_dir);
+
+    LOG_INFO("Packing boot files bundle...");
+    snprintf(cmd, sizeof(cmd),
+             "rm -rf %s && mkdir -p %s && cp -r %s/rootfs/boot/. %s/ && "
+             "for f in idbloader.img idbloader-spi.img u-boot.itb u-boot-rockchip.bin u-boot-rockchip-spi.bin; do "
+             "[ -f %s/$f ] && cp %s/$f %s/; done; true",
+             stage, stage, config->output_dir, stage, config->output_dir, config->output_dir, stage);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0 || write_boot_config(config, stage) != ERROR_SUCCESS) {
+        LOG_ERROR("Failed to stage boot files");
+        return ERROR_UNKNOWN;
+    }
+
+    // gzip -n keeps the staging time out of the gzip header
+    get_tar_order_options(config, order, sizeof(order));
+    snprintf(cmd, sizeof(cmd), "tar -C %s --numeric-owner %s -cf - . | gzip -n > %s.tar.gz && rm -rf %s",
+             stage, order, path, stage);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to pack boot files bundle");
+        return ERROR_UNKNOWN;
+    }
+    return ERROR_SUCCESS;
+}
+
+// 16 MiB SPI NOR image: U-Boot's own SPI binary when it was built, otherwise
+// idbloader at sector 64 and u-boot.itb at sector 16384 as the RK3588 BootROM
+// and SPL expect them
+static int build_spi_flash_image(build_config_t *config) {
+    char cmd[MAX_CMD_LEN];
+    char path[MAX_PATH_LEN];
+    char source[MAX_PATH_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+
+    get_system_image_path(config, "spi", path, sizeof(path));
+    unlink(path);
+
+    LOG_INFO("Creating SPI flash image...");
+    snprintf(source, sizeof(source), "%s/u-boot-rockchip-spi.bin", config->output_dir);
+    if (access(source, F_OK) == 0) {
+        snprintf(cmd, sizeof(cmd), "cp %s %s && truncate -s 16M %s", source, path, path);
+    } else {
+        char idbloader[MAX_PATH_LEN];
+
+        snprintf(idbloader, sizeof(idbloader), "%s/idbloader-spi.img", config->output_dir);
+        if (access(idbloader, F_OK) != 0) {
+            snprintf(idbloader, sizeof(idbloader), "%s/idbloader.img", config->output_dir);
+        }
+        snprintf(source, sizeof(source), "%s/u-boot.itb", config->output_dir);
+        if (access(idbloader, F_OK) != 0 || access(source, F_OK) != 0) {
+            LOG_ERROR("SPI flash image needs idbloader and u-boot.itb from the U-Boot build");
+            return ERROR_FILE_NOT_FOUND;
+        }
+        snprintf(cmd, sizeof(cmd),
+                 "truncate -s 16M %s && dd if=%s of=%s seek=64 conv=notrunc && "
+                 "dd if=%s of=%s seek=16384 conv=notrunc",
+                 path, idbloader, path, source, path);
+    }
+
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_ERROR("Failed to create SPI flash image");
+        return ERROR_UNKNOWN;
+    }
+
+    snprintf(msg, sizeof(msg), "SPI flash image: %s (on the board: flashcp -v %s /dev/mtd0)", path, path);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
+
+static void start_job(output_jobs_t *jobs, const char *name, build_config_t *config, long root_mb) {
+    char msg[256];
+
+    if (jobs->count >= MAX_OUTPUT_JOBS) {
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int result;
+        if (strcmp(name, "tarball") == 0) {
+            result = build_rootfs_tarball(config);
+        } else if (strcmp(name, "bootfiles") == 0) {
+            result = build_boot_bundle(config);
+        } else if (strcmp(name, "spi") == 0) {
+            result = build_spi_flash_image(config);
+        } else {
+            result = build_medium_image(config, name, root_mb);
+        }
+        fflush(stdout);
+        _exit(result == ERROR_SUCCESS ? 0 : 1);
+    }
+
+    if (pid < 0) {
+        snprintf(msg, sizeof(msg), "Failed to start output target %s", name);
+        LOG_ERROR(msg);
+        return;
+    }
+
+    jobs->pids[jobs->count] = pid;
+    snprintf(jobs->names[jobs->count], sizeof(jobs->names[0]), "%s", name);
+    jobs->count++;
+
+    snprintf(msg, sizeof(msg), "Started output target %s", name);
+    LOG_INFO(msg);
+}
+
+// Fork a job for every extra output target; the primary image is left to the caller
+void start_output_targets(build_config_t *config, long root_mb, output_jobs_t *jobs) {
+    char list[256];
+    char *saveptr = NULL;
+
+    memset(jobs, 0, sizeof(*jobs));
+
+    snprintf(list, sizeof(list), "%s", config->output_targets);
+    for (char *name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(name, config->target_medium) == 0 || strcmp(name, "compressed") == 0) {
+            continue;
+        }
+        start_job(jobs, name, config, root_mb);
+    }
+
+    // An NVMe image cannot boot without the loader in SPI flash
+    if (!output_target_enabled(config, "spi") &&
+        (strcmp(config->target_medium, "nvme") == 0 || output_target_enabled(config, "nvme"))) {
+        start_job(jobs, "spi", config, root_mb);
+    }
+}
+
+int wait_output_targets(output_jobs_t *jobs) {
+    char msg[256];
+    int result = ERROR_SUCCESS;
+    int status;
+
+    for (int i = 0; i < jobs->count; i++) {
+        if (waitpid(jobs->pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            snprintf(msg, sizeof(msg), "Output target %s failed", jobs->names[i]);
+            LOG_ERROR(msg);
+            result = ERROR_UNKNOWN;
+        } else {
+            snprintf(msg, sizeof(msg), "Output target %s finished", jobs->names[i]);
+            LOG_INFO(msg);
+        }
+    }
+
+    jobs->count = 0;
+    return result;
+}
@@ -0,0 +1,64 @@
+/*
+ * package_profiles.c - Package lists for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the apt package lists the builds install, kept in one
+ * table so the installers and the footprint analyzer read the same lists.
+ */
+
+#include "package_profiles.h"
+#include <string.h>
+
+const package_group_t package_groups[] = {
+    // Installed right after debootstrap, before the distribution's base
+    {"locales", "locales language-pack-en"},
+    {"rootfs-base", "ubuntu-minimal init systemd sudo"},
+    {"desktop-base", "ubuntu-desktop network-manager"},
+    {"server-base", "ubuntu-server openssh-server"},
+    {"emulation-base", "xserver-xorg-core openbox"},
+    // Every distribution
+    {"common",
+     "linux-firmware wireless-tools wpasupplicant "
+     "network-manager usbutils pciutils i2c-tools "
+     "htop nano vim curl wget git sudo locales "
+     "software-properties-common dbus-x11 language-pack-en"},
+    {"desktop",
+     "gnome-shell gdm3 gnome-terminal firefox "
+     "gnome-tweaks gnome-system-monitor"},
+    {"server",
+     "openssh-server fail2ban ufw "
+     "docker.io docker-compose"},
+    {"emulation",
+     "libsdl2-dev libsdl2-image-dev libsdl2-mixer-dev libsdl2-ttf-dev "
+     "libboost-all-dev libavcodec-dev libavformat-dev libavutil-dev "
+     "libswscale-dev libfreeimage-dev libfreetype6-dev libcurl4-openssl-dev "
+     "libasound2-dev libpulse-dev libudev-dev libvlc-dev libvlccore-dev "
+     "libxml2-dev libxrandr-dev mesa-common-dev libglu1-mesa-dev "
+     "libgles2-mesa-dev libavfilter-dev libavresample-dev libvorbis-dev "
+     "libflac-dev"},
+    {"gpu", "mesa-utils glmark2-es2 vulkan-tools"},
+    // veritysetup for the initramfs that opens a dm-verity root
+    {"verity", "cryptsetup-bin"},
+    // Board support installed by the standalone rootfs builder
+    {"orangepi-hardware",
+     "linux-firmware-raspi2 wireless-regdb wpasupplicant bluetooth bluez bluez-tools "
+     "network-manager avahi-daemon i2c-tools spi-tools gpio-utils python3-rpi.gpio "
+     "device-tree-compiler"},
+    {"orangepi-multimedia",
+     "alsa-utils pulseaudio pulseaudio-utils pavucontrol gstreamer1.0-tools "
+     "gstreamer1.0-plugins-base gstreamer1.0-plugins-good gstreamer1.0-plugins-bad "
+     "gstreamer1.0-plugins-ugly gstreamer1.0-vaapi ffmpeg v4l-utils"},
+    {"orangepi-devel",
+     "gcc-aarch64-linux-gnu g++-aarch64-linux-gnu cmake ninja-build pkg-config "
+     "autotools-dev autoconf automake libtool python3-dev python3-pip nodejs npm"},
+    {NULL, NULL}
+};
+
+const char *get_package_group(const char *name) {
+    for (int i = 0; package_groups[i].name; i++) {
+        if (strcmp(package_groups[i].name, name) == 0) {
+            return package_groups[i].packages;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef PACKAGE_PROFILES_H
+#define PACKAGE_PROFILES_H
+
+// A named set of apt packages installed together by one build step
+typedef struct {
+    const char *name;
+    const char *packages;       // Space-separated package names
+} package_group_t;
+
+// Every group, terminated by an entry with a NULL name
+extern const package_group_t package_groups[];
+
+// Packages of the named group, or NULL if there is no such group
+const char *get_package_group(const char *name);
+
+#endif // PACKAGE_PROFILES_H
@@ -0,0 +1,230 @@
+/*
+ * partition_layout.c - Flash-geometry-aware partition layouts for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the declarative partition layout engine. Each target
+ * medium describes its bootloader area and boot partition; the engine places
+ * every partition on an erase-block boundary, emits an sfdisk script and
+ * derives matching ext4 stride/stripe settings. It has no dependency on the
+ * build configuration so both image paths can use it.
+ */
+
+#define _GNU_SOURCE
+#include "partition_layout.h"
+#include <string.h>
+#include <sys/wait.h>
+
+#define MIB (1024ULL * 1024ULL)
+// Sectors taken by the backup GPT at the end of the disk
+#define GPT_BACKUP_SECTORS 33ULL
+// BootROM reads idbloader from sector 64 on SD/eMMC
+#define LOADER_START_SECTOR 64ULL
+
+// Partition layout description per target medium
+typedef struct {
+    const char *medium;
+    uint64_t erase_block_kb;
+    uint64_t loader_end_mb;     // idbloader + u-boot.itb area, kept free of filesystems
+    uint64_t boot_size_mb;
+} medium_layout_t;
+
+static const medium_layout_t medium_layouts[] = {
+    // Cheap SD cards have 4 MiB allocation units; writes that straddle them are slow
+    {"sd",   LAYOUT_DEFAULT_ERASE_BLOCK_KB, 16, 240},
+    {"emmc", LAYOUT_DEFAULT_ERASE_BLOCK_KB, 16, 240},
+    // NVMe boots from SPI flash, the loader area only keeps partition numbers stable
+    {"nvme", 1024, 16, 240},
+    {NULL, 0, 0, 0}  // Sentinel
+};
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+    return ((value + align - 1) / align) * align;
+}
+
+static uint64_t align_down(uint64_t value, uint64_t align) {
+    return (value / align) * align;
+}
+
+// Start a layout from the medium description
+int layout_init(partition_layout_t *layout, const char *medium, uint64_t erase_block_kb) {
+    const medium_layout_t *desc = NULL;
+
+    if (!layout || !medium) {
+        return -1;
+    }
+
+    for (int i = 0; medium_layouts[i].medium != NULL; i++) {
+        if (strcmp(medium_layouts[i].medium, medium) == 0) {
+            desc = &medium_layouts[i];
+            break;
+        }
+    }
+    if (!desc) {
+        return -1;
+    }
+
+    memset(layout, 0, sizeof(*layout));
+    strncpy(layout->medium, desc->medium, sizeof(layout->medium) - 1);
+    layout->erase_block_bytes = (erase_block_kb ? erase_block_kb : desc->erase_block_kb) * 1024ULL;
+
+    // Erase blocks must be whole sectors
+    if (layout->erase_block_bytes < LAYOUT_SECTOR_SIZE ||
+        layout->erase_block_bytes % LAYOUT_SECTOR_SIZE != 0) {
+        return -1;
+    }
+
+    // For the fixed-start loader, size_mb is where the reserved area ends
+    layout_add_partition(layout, "loader", LAYOUT_TYPE_LINUX, desc->loader_end_mb);
+    layout->parts[0].fixed_start = LOADER_START_SECTOR;
+
+    layout_add_partition(layout, "boot", LAYOUT_TYPE_ESP, desc->boot_size_mb);
+    layout->parts[1].legacy_bootable = 1;
+
+    return 0;
+}
+
+// Append a partition after the ones already in the layout
+int layout_add_partition(partition_layout_t *layout, const char *name, const char *type, uint64_t size_mb) {
+    if (!layout || !name || layout->count >= LAYOUT_MAX_PARTITIONS) {
+        return -1;
+    }
+
+    // Only the last partition may fill the rest of the disk
+    if (layout->count > 0 && layout->parts[layout->count - 1].size_mb == 0) {
+        return -1;
+    }
+
+    layout_partition_t *part = &layout->parts[layout->count++];
+    memset(part, 0, sizeof(*part));
+    strncpy(part->name, name, sizeof(part->name) - 1);
+    part->type = type ? type : LAYOUT_TYPE_LINUX;
+    part->size_mb = size_mb;
+
+    return 0;
+}
+
+// Byte range of a partition given where the previous one ended; end 0 means "fill"
+static void place_partition(const partition_layout_t *layout, const layout_partition_t *part,
+                            uint64_t cursor, uint64_t *start, uint64_t *end) {
+    uint64_t eb = layout->erase_block_bytes;
+
+    if (part->fixed_start) {
+        *start = part->fixed_start * LAYOUT_SECTOR_SIZE;
+        *end = align_up(part->size_mb * MIB, eb);
+    } else {
+        *start = align_up(cursor, eb);
+        *end = part->size_mb ? *start + align_up(part->size_mb * MIB, eb) : 0;
+    }
+}
+
+// Place every partition on erase-block boundaries
+int layout_resolve(partition_layout_t *layout, uint64_t disk_bytes) {
+    uint64_t cursor = 0;
+
+    if (!layout || layout->count == 0 ||
+        disk_bytes <= GPT_BACKUP_SECTORS * LAYOUT_SECTOR_SIZE) {
+        return -1;
+    }
+
+    layout->disk_bytes = disk_bytes;
+    uint64_t usable_end = align_down(disk_bytes - GPT_BACKUP_SECTORS * LAYOUT_SECTOR_SIZE,
+                                     layout->erase_block_bytes);
+
+    for (int i = 0; i < layout->count; i++) {
+        layout_partition_t *part = &layout->parts[i];
+        uint64_t start, end;
+
+        place_partition(layout, part, cursor, &start, &end);
+        if (end == 0) {
+            end = usable_end;
+        }
+        if (start < cursor || end <= start || end > usable_end) {
+            return -1;
+        }
+
+        part->start = start / LAYOUT_SECTOR_SIZE;
+        part->sectors = (end - start) / LAYOUT_SECTOR_SIZE;
+        cursor = end;
+    }
+
+    return 0;
+}
+
+// MB offset where the next appended partition would start
+uint64_t layout_next_start_mb(const partition_layout_t *layout) {
+    uint64_t cursor = 0;
+
+    for (int i = 0; i < layout->count; i++) {
+        uint64_t start, end;
+        place_partition(layout, &layout->parts[i], cursor, &start, &end);
+        if (end == 0) {
+            break;
+        }
+        cursor = end;
+    }
+
+    return align_up(cursor, layout->erase_block_bytes) / MIB;
+}
+
+// Erase block size in whole MB, at least 1
+uint64_t layout_erase_block_mb(const partition_layout_t *layout) {
+    uint64_t mb = align_up(layout->erase_block_bytes, MIB) / MIB;
+    return mb ? mb : 1;
+}
+
+// Write the resolved layout as an sfdisk script
+int layout_write_sfdisk_script(const partition_layout_t *layout, FILE *out) {
+    if (!layout || !out || layout->count == 0) {
+        return -1;
+    }
+
+    fprintf(out, "label: gpt\n");
+    fprintf(out, "unit: sectors\n");
+    fprintf(out, "sector-size: %llu\n", LAYOUT_SECTOR_SIZE);
+    // The loader starts at sector 64, below sfdisk's default first usable LBA
+    fprintf(out, "first-lba: %llu\n", (unsigned long long)layout->parts[0].start);
+    if (layout->disk_guid[0]) {
+        fprintf(out, "label-id: %s\n", layout->disk_guid);
+    }
+    fprintf(out, "\n");
+
+    for (int i = 0; i < layout->count; i++) {
+        const layout_partition_t *part = &layout->parts[i];
+        fprintf(out, "start=%llu, size=%llu, type=%s, name=\"%s\"%s%s%s\n",
+                (unsigned long long)part->start, (unsigned long long)part->sectors,
+                part->type, part->name,
+                part->guid[0] ? ", uuid=" : "", part->guid,
+                part->legacy_bootable ? ", attrs=\"LegacyBIOSBootable\"" : "");
+    }
+
+    return 0;
+}
+
+// Partition an image file or block device with the resolved layout
+int layout_apply(const partition_layout_t *layout, const char *image_path) {
+    char cmd[1024];
+
+    snprintf(cmd, sizeof(cmd), "sfdisk --quiet --wipe always --no-reread --no-tell-kernel %s", image_path);
+    FILE *sfdisk = popen(cmd, "w");
+    if (!sfdisk) {
+        return -1;
+    }
+
+    int result = layout_write_sfdisk_script(layout, sfdisk);
+    int status = pclose(sfdisk);
+    if (result != 0 || status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// ext4 RAID geometry that keeps block groups aligned to the erase block
+void layout_ext4_geometry(const partition_layout_t *layout, unsigned block_size,
+                          unsigned *stride, unsigned *stripe_width) {
+    unsigned blocks = (unsigned)(layout->erase_block_bytes / block_size);
+
+    // One erase block per stripe: the allocator then fills whole units
+    *stride = blocks ? blocks : 1;
+    *stripe_width = *stride;
+}
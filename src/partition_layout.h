@@ -0,0 +1,63 @@
+#ifndef PARTITION_LAYOUT_H
+#define PARTITION_LAYOUT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define LAYOUT_SECTOR_SIZE 512ULL
+#define LAYOUT_MAX_PARTITIONS 8
+// Default erase block (allocation unit) for SD cards and eMMC
+#define LAYOUT_DEFAULT_ERASE_BLOCK_KB 4096
+
+// GPT partition type GUIDs used by the layouts
+#define LAYOUT_TYPE_LINUX "0FC63DAF-8483-4772-8E79-3D69D8477DE4"
+#define LAYOUT_TYPE_ESP   "C12A7328-F81F-11D2-BA4B-00A0C93EC93B"
+
+// A partition in a layout; start and size are filled in by layout_resolve()
+typedef struct {
+    char name[32];
+    const char *type;
+    uint64_t fixed_start;    // Fixed first sector (bootloader), 0 = next aligned boundary
+    uint64_t size_mb;        // Requested size, 0 = fill the rest of the disk
+    int legacy_bootable;     // U-Boot distro boot scans partitions with this attribute
+    char guid[37];           // Fixed partition GUID, empty = random
+    uint64_t start;          // Resolved first sector
+    uint64_t sectors;        // Resolved length in sectors
+} layout_partition_t;
+
+// A partition layout for one target medium
+typedef struct {
+    char medium[16];
+    uint64_t erase_block_bytes;
+    uint64_t disk_bytes;
+    char disk_guid[37];      // Fixed disk GUID, empty = random
+    int count;
+    layout_partition_t parts[LAYOUT_MAX_PARTITIONS];
+} partition_layout_t;
+
+// Start a layout from the medium description (sd, emmc, nvme); erase_block_kb 0 uses the medium default
+int layout_init(partition_layout_t *layout, const char *medium, uint64_t erase_block_kb);
+
+// Append a partition after the ones already in the layout
+int layout_add_partition(partition_layout_t *layout, const char *name, const char *type, uint64_t size_mb);
+
+// Place every partition on erase-block boundaries within a disk of disk_bytes
+int layout_resolve(partition_layout_t *layout, uint64_t disk_bytes);
+
+// MB offset where the next appended partition would start
+uint64_t layout_next_start_mb(const partition_layout_t *layout);
+
+// Erase block size in whole MB, at least 1
+uint64_t layout_erase_block_mb(const partition_layout_t *layout);
+
+// Write the resolved layout as an sfdisk script
+int layout_write_sfdisk_script(const partition_layout_t *layout, FILE *out);
+
+// Partition an image file or block device with the resolved layout
+int layout_apply(const partition_layout_t *layout, const char *image_path);
+
+// ext4 RAID geometry that keeps block groups aligned to the erase block
+void layout_ext4_geometry(const partition_layout_t *layout, unsigned block_size,
+                          unsigned *stride, unsigned *stripe_width);
+
+#endif // PARTITION_LAYOUT_H
@@ -0,0 +1,173 @@
+/*
+ * remote_cache.c - Shared HTTP build cache for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the HTTP backend shared by build hosts and CI runners.
+ * Artifact store entries are fetched with GET when they are missing locally
+ * and uploaded with PUT in the background once stored; every entry has a
+ * .sha256 next to it that is uploaded last and checked on every download,
+ * so a partial or corrupted upload is never used. The checksum comes from the
+ * same server, so it does not protect against anyone who can write to it;
+ * give write access to trusted builders only. Compiler output is shared
+ * through ccache's own HTTP remote storage under <url>/ccache. In read-only
+ * mode (untrusted runners) nothing is ever uploaded.
+ */
+
+#include "../builder.h"
+#include <sys/wait.h>
+
+#define MAX_UPLOADS 16
+#define CURL_CMD "curl -fsSL --retry 2 --connect-timeout 10"
+
+static pid_t uploads[MAX_UPLOADS];
+static int upload_count;
+
+int validate_remote_cache_url(const char *url) {
+    if (!url[0]) {
+        return 0;
+    }
+    if (strncmp(url, "http://", 7) != 0 && strncmp(url, "https://", 8) != 0) {
+        return -1;
+    }
+    for (const char *p = url; *p; p++) {
+        if (!isalnum((unsigned char)*p) && !strchr(":/._-~%@+=", *p)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Download name into path, accepted only if it matches its published checksum
+int remote_cache_fetch(build_config_t *config, const char *name, const char *path) {
+    char cmd[MAX_CMD_LEN];
+    char expected[SHA256_HEX_SIZE] = "";
+    char actual[SHA256_HEX_SIZE];
+    char part[MAX_PATH_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+
+    if (!config->remote_cache_url[0]) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    snprintf(cmd, sizeof(cmd), "%s %s/%s.sha256 2>/dev/null", CURL_CMD, config->remote_cache_url, name);
+    FILE *fp = popen(cmd, "r");
+    if (fp) {
+        if (fscanf(fp, "%64s", expected) != 1) {
+            expected[0] = '\0';
+        }
+        pclose(fp);
+    }
+    if (strlen(expected) != SHA256_HEX_SIZE - 1) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    snprintf(part, sizeof(part), "%s.part", path);
+    snprintf(cmd, sizeof(cmd), "mkdir -p $(dirname %s) && %s -o %s %s/%s",
+             path, CURL_CMD, part, config->remote_cache_url, name);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        unlink(part);
+        return ERROR_NETWORK_FAILURE;
+    }
+    if (sha256_file(part, actual) != 0 || strcmp(actual, expected) != 0) {
+        snprintf(msg, sizeof(msg), "Remote cache entry %s does not match its checksum, ignoring it", name);
+        LOG_WARNING(msg);
+        unlink(part);
+        return ERROR_UNKNOWN;
+    }
+    if (rename(part, path) != 0) {
+        unlink(part);
+        return ERROR_UNKNOWN;
+    }
+
+    snprintf(msg, sizeof(msg), "Fetched %s from the remote cache", name);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
+
+// PUT path as name in the background; the checksum goes up last and marks it complete
+void remote_cache_upload(build_config_t *config, const char *name, const char *path) {
+    char cmd[MAX_CMD_LEN];
+    char hex[SHA256_HEX_SIZE];
+    char msg[512];
+
+    if (!config->remote_cache_url[0] || config->remote_cache_readonly) {
+        return;
+    }
+    if (upload_count >= MAX_UPLOADS) {
+        remote_cache_wait();
+    }
+    if (sha256_file(path, hex) != 0) {
+        return;
+    }
+
+    snprintf(cmd, sizeof(cmd),
+             "%s -T %s %s/%s && printf '%%s\\n' %s | %s -T - %s/%s.sha256",
+             CURL_CMD, path, config->remote_cache_url, name,
+             hex, CURL_CMD, config->remote_cache_url, name);
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0) {
+        snprintf(msg, sizeof(msg), "Failed to start upload of %s", name);
+        LOG_WARNING(msg);
+        return;
+    }
+    uploads[upload_count++] = pid;
+}
+
+// Wait for background uploads; a failed upload only costs other hosts a cache miss
+void remote_cache_wait(void) {
+    char msg[256];
+    int status, failed = 0;
+
+    if (upload_count == 0) {
+        return;
+    }
+    snprintf(msg, sizeof(msg), "Waiting for %d remote cache upload(s)...", upload_count);
+    LOG_INFO(msg);
+    for (int i = 0; i < upload_count; i++) {
+        if (waitpid(uploads[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+    if (failed) {
+        snprintf(msg, sizeof(msg), "%d remote cache upload(s) failed", failed);
+        LOG_WARNING(msg);
+    }
+    upload_count = 0;
+}
+
+// Route compiles through ccache, sharing its objects via the remote cache
+int ccache_setup(build_config_t *config) {
+    char storage[sizeof(config->remote_cache_url) + 32];
+    error_context_t error_ctx = {0};
+
+    config->use_ccache = 0;
+    if (!config->remote_cache_url[0]) {
+        return ERROR_SUCCESS;
+    }
+    if (execute_command_safe("command -v ccache", 0, &error_ctx) != 0) {
+        LOG_WARNING("ccache is not installed, compiler output is not shared");
+        return ERROR_DEPENDENCY_MISSING;
+    }
+
+    snprintf(storage, sizeof(storage), "%s/ccache%s", config->remote_cache_url,
+             config->remote_cache_readonly ? "|read-only" : "");
+    setenv("CCACHE_REMOTE_STORAGE", storage, 1);
+    // Hits across hosts need paths relative to the build directory
+    setenv("CCACHE_BASEDIR", config->build_dir, 1);
+    if (config->distcc_hosts[0]) {
+        // ccache preprocesses locally, which pump mode cannot follow
+        setenv("CCACHE_PREFIX", "distcc", 1);
+        config->distcc_pump = 0;
+    }
+    config->use_ccache = 1;
+    LOG_INFO("Sharing compiler output through ccache remote storage");
+    return ERROR_SUCCESS;
+}
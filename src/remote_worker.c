@@ -0,0 +1,165 @@
+/*
+ * remote_worker.c - SSH build workers for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the offload of host-only stages to other machines over
+ * SSH. The kernel tree is synced to a worker with rsync, built there with
+ * the same gcc release as the local one and every core it has, and its outputs come back
+ * as one artifact store entry before they touch the local tree. Compression
+ * streams through a worker without staging anything on it. The remote
+ * output is tee'd into the local log like any other command. A worker that
+ * cannot be reached is skipped and the stage runs locally.
+ */
+
+#include "../builder.h"
+
+#define WORKER_SSH "ssh -o BatchMode=yes -o ConnectTimeout=10"
+#define WORKER_DIR ".cache/opi5plus-worker"
+#define MAX_WORKERS 16
+
+static int worker_down[MAX_WORKERS];
+static int next_worker;
+
+// Characters allowed in a worker list, which is pasted into shell commands
+int validate_build_workers(const char *workers) {
+    for (const char *p = workers; *p; p++) {
+        if (!isalnum((unsigned char)*p) && !strchr("@._-:,", *p)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Next reachable worker, round-robin; returns -1 when none is configured or up
+int remote_worker_pick(build_config_t *config, char *host, size_t size) {
+    char list[sizeof(config->build_workers)];
+    char *workers[MAX_WORKERS];
+    char *saveptr = NULL;
+    char cmd[MAX_CMD_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+    int count = 0;
+
+    snprintf(list, sizeof(list), "%s", config->build_workers);
+    for (char *name = strtok_r(list, ",", &saveptr); name && count < MAX_WORKERS;
+         name = strtok_r(NULL, ",", &saveptr)) {
+        workers[count++] = name;
+    }
+
+    for (int tries = 0; tries < count; tries++) {
+        int i = next_worker++ % count;
+        if (worker_down[i]) {
+            continue;
+        }
+        snprintf(cmd, sizeof(cmd), "%s %s true", WORKER_SSH, workers[i]);
+        if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+            snprintf(msg, sizeof(msg), "Build worker %s is unreachable, not using it", workers[i]);
+            LOG_WARNING(msg);
+            worker_down[i] = 1;
+            continue;
+        }
+        snprintf(host, size, "%s", workers[i]);
+        return 0;
+    }
+    return -1;
+}
+
+// First line a command prints, without the newline; empty if it prints nothing
+static void read_first_line(const char *cmd, char *line, size_t size) {
+    line[0] = '\0';
+    FILE *fp = popen(cmd, "r");
+    if (fp) {
+        if (fgets(line, (int)size, fp)) {
+            line[strcspn(line, "\n")] = '\0';
+        }
+        pclose(fp);
+    }
+}
+
+// Build Image, dtbs and modules on a worker and bring the outputs back
+// through the artifact store under key
+int remote_build_kernel(build_config_t *config, const char *kernel_dir, const char *key) {
+    char host[256];
+    char local_name[64] = "builder";
+    char remote_dir[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+
+    if (!config->build_workers[0] || remote_worker_pick(config, host, sizeof(host)) != 0) {
+        return ERROR_UNKNOWN;
+    }
+
+    // One tree per builder host, so its objects survive for the next build
+    gethostname(local_name, sizeof(local_name) - 1);
+    snprintf(remote_dir, sizeof(remote_dir), "%s/%s-linux", WORKER_DIR, local_name);
+
+    // The outputs are stored under a key naming the local compiler, so the worker
+    // must run the same gcc release (the program name differs between cross and native)
+    char local_cc[256];
+    char remote_cc[256];
+    snprintf(cmd, sizeof(cmd), "%sgcc --version 2>/dev/null", config->cross_compile);
+    read_first_line(cmd, local_cc, sizeof(local_cc));
+    snprintf(cmd, sizeof(cmd), "%s %s 'aarch64-linux-gnu-gcc --version 2>/dev/null'", WORKER_SSH, host);
+    read_first_line(cmd, remote_cc, sizeof(remote_cc));
+    const char *local_release = strchr(local_cc, ' ');
+    const char *remote_release = strchr(remote_cc, ' ');
+    if (!local_release || !remote_release || strcmp(local_release, remote_release) != 0) {
+        snprintf(msg, sizeof(msg), "Worker %s compiler (%s) differs from the local one (%s), building locally",
+                 host, remote_cc[0] ? remote_cc : "none", local_cc[0] ? local_cc : "none");
+        LOG_WARNING(msg);
+        return ERROR_DEPENDENCY_MISSING;
+    }
+
+    // Reproducible builds stamp the kernel with these instead of the worker's clock and name
+    char kbuild_env[256] = "";
+    const char *timestamp = getenv("KBUILD_BUILD_TIMESTAMP");
+    if (timestamp) {
+        snprintf(kbuild_env, sizeof(kbuild_env),
+                 "env KBUILD_BUILD_TIMESTAMP=\"%s\" KBUILD_BUILD_USER=%s KBUILD_BUILD_HOST=%s SOURCE_DATE_EPOCH=%s ",
+                 timestamp, getenv("KBUILD_BUILD_USER") ? getenv("KBUILD_BUILD_USER") : "builder",
+                 getenv("KBUILD_BUILD_HOST") ? getenv("KBUILD_BUILD_HOST") : "builder",
+                 getenv("SOURCE_DATE_EPOCH") ? getenv("SOURCE_DATE_EPOCH") : "0");
+    }
+
+    snprintf(msg, sizeof(msg), "Building kernel on worker %s...", host);
+    LOG_INFO(msg);
+    stage_timer_remote("ssh");
+
+    // Sources only; the worker's objects are left alone for an incremental build
+    snprintf(cmd, sizeof(cmd),
+             "rsync -a --delete --exclude=.git --exclude='*.o' --exclude='.*.cmd' --exclude='*.ko' "
+             "-e '%s' --rsync-path='mkdir -p %s && rsync' %s/ %s:%s/",
+             WORKER_SSH, remote_dir, kernel_dir, host, remote_dir);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_WARNING("Failed to sync the kernel tree to the worker");
+        return ERROR_NETWORK_FAILURE;
+    }
+
+    // The target triple names gcc on both x86 workers (cross) and aarch64 ones (native)
+    snprintf(cmd, sizeof(cmd),
+             "%s %s 'cd %s && %smake ARCH=%s CROSS_COMPILE=aarch64-linux-gnu- -j$(nproc) Image dtbs modules'",
+             WORKER_SSH, host, remote_dir, kbuild_env, config->arch);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_WARNING("Kernel build failed on the worker");
+        return ERROR_COMPILATION_FAILED;
+    }
+
+    snprintf(cmd, sizeof(cmd), "%s %s 'cd %s && %s | tar -cf - -T -'",
+             WORKER_SSH, host, remote_dir, KERNEL_OUTPUT_LIST);
+    if (artifact_store_put(config, "kernel", key, cmd) != ERROR_SUCCESS) {
+        return ERROR_NETWORK_FAILURE;
+    }
+    return artifact_store_extract(config, "kernel", key, kernel_dir);
+}
+
+// A stdin-to-stdout filter (xz, zstd) run on a worker when one is up
+void remote_filter_command(build_config_t *config, const char *filter, char *cmd, size_t size) {
+    char host[256];
+
+    if (config->build_workers[0] && remote_worker_pick(config, host, sizeof(host)) == 0) {
+        snprintf(cmd, size, "%s %s %s", WORKER_SSH, host, filter);
+    } else {
+        snprintf(cmd, size, "%s", filter);
+    }
+}
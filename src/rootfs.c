@@ -2,6 +2,7 @@
 #include "logging.h"
 #include "system_utils.h"
 #include "config.h"
+#include "package_profiles.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -130,61 +131,13 @@ int install_orangepi_packages(const char* rootfs_path) {
         "chroot %s /bin/bash -c 'apt update'", rootfs_path);
     execute_command(command, 1);
     
-    // Install hardware support packages
-    snprintf(command, sizeof(command),
-        "chroot %s /bin/bash -c '"
-        "apt install -y "
-        "linux-firmware-raspi2 "
-        "wireless-regdb "
-        "wpasupplicant "
-        "bluetooth "
-        "bluez "
-        "bluez-tools "
-        "network-manager "
-        "avahi-daemon "
-        "i2c-tools "
-        "spi-tools "
-        "gpio-utils "
-        "python3-rpi.gpio "
-        "device-tree-compiler'", rootfs_path);
-    execute_command(command, 1);
-    
-    // Install multimedia packages
-    snprintf(command, sizeof(command),
-        "chroot %s /bin/bash -c '"
-        "apt install -y "
-        "alsa-utils "
-        "pulseaudio "
-        "pulseaudio-utils "
-        "pavucontrol "
-        "gstreamer1.0-tools "
-        "gstreamer1.0-plugins-base "
-        "gstreamer1.0-plugins-good "
-        "gstreamer1.0-plugins-bad "
-        "gstreamer1.0-plugins-ugly "
-        "gstreamer1.0-vaapi "
-        "ffmpeg "
-        "v4l-utils'", rootfs_path);
-    execute_command(command, 1);
-    
-    // Install development tools
-    snprintf(command, sizeof(command),
-        "chroot %s /bin/bash -c '"
-        "apt install -y "
-        "gcc-aarch64-linux-gnu "
-        "g++-aarch64-linux-gnu "
-        "cmake "
-        "ninja-build "
-        "pkg-config "
-        "autotools-dev "
-        "autoconf "
-        "automake "
-        "libtool "
-        "python3-dev "
-        "python3-pip "
-        "nodejs "
-        "npm'", rootfs_path);
-    execute_command(command, 1);
+    // Hardware support, multimedia and development tools
+    const char *groups[] = {"orangepi-hardware", "orangepi-multimedia", "orangepi-devel", NULL};
+    for (int i = 0; groups[i]; i++) {
+        snprintf(command, sizeof(command),
+            "chroot %s /bin/bash -c 'apt install -y %s'", rootfs_path, get_package_group(groups[i]));
+        execute_command(command, 1);
+    }
     
     log_info("Orange Pi packages installed successfully");
     return 0;
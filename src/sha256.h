@@ -0,0 +1,30 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE 65
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t bit_count;
+    uint8_t buffer[64];
+    size_t buffer_len;
+} sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// One-shot digest of a memory buffer
+void sha256_buffer(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// Lowercase hex encoding of a digest
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[SHA256_HEX_SIZE]);
+
+// Hash a file's contents; returns 0 on success, -1 if it cannot be read
+int sha256_file(const char *path, char hex[SHA256_HEX_SIZE]);
+
+#endif // SHA256_H
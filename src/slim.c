@@ -0,0 +1,305 @@
+/*
+ * slim.c - Rootfs slimming for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the slimming stage that runs on the staged rootfs
+ * before the image is assembled. It drops documentation, man pages,
+ * unused translations, apt caches and lists, Python bytecode caches and
+ * optionally packages that were only needed to build software, then
+ * prints where the space went by directory and by package. The dpkg
+ * path excludes it installs keep packages installed later on the board
+ * just as small.
+ */
+
+#include "../builder.h"
+#include <dirent.h>
+
+#define SLIM_REPORT_ROWS 15
+
+typedef struct {
+    char name[192];
+    unsigned long long before_kb;
+    unsigned long long after_kb;
+} slim_entry_t;
+
+typedef struct {
+    slim_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} slim_table_t;
+
+static slim_entry_t* table_get(slim_table_t *table, const char *name) {
+    for (size_t i = 0; i < table->count; i++) {
+        if (strcmp(table->entries[i].name, name) == 0) {
+            return &table->entries[i];
+        }
+    }
+
+    if (table->count == table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : 256;
+        slim_entry_t *entries = realloc(table->entries, capacity * sizeof(*entries));
+        if (!entries) {
+            return NULL;
+        }
+        table->entries = entries;
+        table->capacity = capacity;
+    }
+
+    slim_entry_t *entry = &table->entries[table->count++];
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    return entry;
+}
+
+static void table_set(slim_table_t *table, const char *name, unsigned long long kb, int after) {
+    slim_entry_t *entry = table_get(table, name);
+    if (entry) {
+        if (after) {
+            entry->after_kb = kb;
+        } else {
+            entry->before_kb = kb;
+        }
+    }
+}
+
+// Disk usage three levels deep (/usr/share/doc); returns the total in KB
+static unsigned long long measure_directories(const char *rootfs_dir, slim_table_t *table, int after) {
+    char cmd[MAX_CMD_LEN];
+    char line[MAX_PATH_LEN + 32];
+    unsigned long long total = 0;
+    size_t prefix = strlen(rootfs_dir);
+
+    snprintf(cmd, sizeof(cmd), "du -xk -d 3 %s 2>/dev/null", rootfs_dir);
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long kb;
+        char *path = strchr(line, '\t');
+        if (!path || sscanf(line, "%llu", &kb) != 1) {
+            continue;
+        }
+        path++;
+        path[strcspn(path, "\n")] = '\0';
+        if (strncmp(path, rootfs_dir, prefix) != 0) {
+            continue;
+        }
+        path += prefix;
+        if (*path == '\0') {
+            total = kb;
+        } else {
+            table_set(table, path, kb, after);
+        }
+    }
+
+    pclose(fp);
+    return total;
+}
+
+// Space each package really occupies, from the file lists dpkg keeps
+static void measure_packages(const char *rootfs_dir, slim_table_t *table, int after) {
+    char info_dir[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN * 2];
+    char line[MAX_PATH_LEN];
+    struct dirent *ent;
+
+    snprintf(info_dir, sizeof(info_dir), "%s/var/lib/dpkg/info", rootfs_dir);
+    DIR *dir = opendir(info_dir);
+    if (!dir) {
+        return;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        char name[192];
+        size_t len = strlen(ent->d_name);
+        if (len <= 5 || strcmp(ent->d_name + len - 5, ".list") != 0) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "%.*s", (int)(len - 5), ent->d_name);
+        name[strcspn(name, ":")] = '\0';
+
+        snprintf(path, sizeof(path), "%s/%s", info_dir, ent->d_name);
+        FILE *list = fopen(path, "r");
+        if (!list) {
+            continue;
+        }
+
+        unsigned long long bytes = 0;
+        while (fgets(line, sizeof(line), list)) {
+            struct stat st;
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(path, sizeof(path), "%s%s", rootfs_dir, line);
+            // Directories are shared between packages; only files and links are owned
+            if (lstat(path, &st) == 0 && (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))) {
+                bytes += (unsigned long long)st.st_blocks * 512;
+            }
+        }
+        fclose(list);
+
+        table_set(table, name, bytes / 1024, after);
+    }
+
+    closedir(dir);
+}
+
+static int compare_before(const void *a, const void *b) {
+    const slim_entry_t *x = a, *y = b;
+    return x->before_kb < y->before_kb ? 1 : x->before_kb > y->before_kb ? -1 : 0;
+}
+
+static void print_table(const char *title, slim_table_t *table) {
+    qsort(table->entries, table->count, sizeof(slim_entry_t), compare_before);
+
+    printf("\n%-44s %10s %10s %10s\n", title, "Before", "After", "Saved");
+    for (size_t i = 0; i < table->count && i < SLIM_REPORT_ROWS; i++) {
+        const slim_entry_t *e = &table->entries[i];
+        printf("%-44.44s %7.1f MB %7.1f MB %7.1f MB\n", e->name,
+               e->before_kb / 1024.0, e->after_kb / 1024.0,
+               ((double)e->before_kb - (double)e->after_kb) / 1024.0);
+    }
+}
+
+// dpkg path excludes, so packages installed later skip the same content
+static int write_dpkg_excludes(build_config_t *config, const char *rootfs_dir) {
+    char path[MAX_PATH_LEN];
+    char locales[sizeof(config->slim_locales)];
+    char *saveptr = NULL;
+
+    snprintf(path, sizeof(path), "%s/etc/dpkg/dpkg.cfg.d", rootfs_dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/etc/dpkg/dpkg.cfg.d/01-orangepi-slim", rootfs_dir);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    fprintf(fp, "# Written by the Orange Pi 5 Plus builder\n");
+    fprintf(fp, "path-exclude=/usr/share/doc/*\n");
+    // Licences must ship with the binaries
+    fprintf(fp, "path-include=/usr/share/doc/*/copyright\n");
+    fprintf(fp, "path-exclude=/usr/share/man/*\n");
+    fprintf(fp, "path-exclude=/usr/share/info/*\n");
+    fprintf(fp, "path-exclude=/usr/share/groff/*\n");
+    fprintf(fp, "path-exclude=/usr/share/lintian/*\n");
+    fprintf(fp, "path-exclude=/usr/share/linda/*\n");
+    fprintf(fp, "path-exclude=/usr/share/locale/*\n");
+    fprintf(fp, "path-include=/usr/share/locale/locale.alias\n");
+
+    snprintf(locales, sizeof(locales), "%s", config->slim_locales);
+    for (char *l = strtok_r(locales, ",", &saveptr); l; l = strtok_r(NULL, ",", &saveptr)) {
+        fprintf(fp, "path-include=/usr/share/locale/%s/*\n", l);
+    }
+
+    fclose(fp);
+    return ERROR_SUCCESS;
+}
+
+// Build-only packages: headers and debug symbols left behind by source builds
+static int purge_build_packages(build_config_t *config, const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+    int result = ERROR_SUCCESS;
+
+    LOG_INFO("Purging development packages...");
+
+    chroot_exec_prepare(config, rootfs_dir);
+    snprintf(cmd, sizeof(cmd), "mountpoint -q %s/proc || mount -t proc /proc %s/proc", rootfs_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    // No autoremove: runtime libraries pulled in by -dev packages are still used by
+    // software built from source, which apt knows nothing about
+    snprintf(cmd, sizeof(cmd),
+             "chroot %s /bin/sh -c 'p=$(dpkg-query -W -f=\"${binary:Package}\\n\" | "
+             "grep -E -- \"-(dev|dbg)(:[a-z0-9]+)?$\"); "
+             "[ -z \"$p\" ] || DEBIAN_FRONTEND=noninteractive apt-get purge -y $p'",
+             rootfs_dir);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to purge development packages");
+        result = ERROR_INSTALLATION_FAILED;
+    }
+
+    snprintf(cmd, sizeof(cmd), "umount %s/proc || true", rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+    chroot_exec_release(config, rootfs_dir);
+
+    return result;
+}
+
+// Slim the staged rootfs and print a before/after breakdown
+int slim_rootfs(build_config_t *config, const char *rootfs_dir) {
+    char cmd[MAX_CMD_LEN];
+    char keep[sizeof(config->slim_locales) + 2];
+    slim_table_t dirs = {0};
+    slim_table_t packages = {0};
+    error_context_t error_ctx = {0};
+    int result = ERROR_SUCCESS;
+
+    LOG_INFO("Slimming root filesystem...");
+
+    unsigned long long before_kb = measure_directories(rootfs_dir, &dirs, 0);
+    measure_packages(rootfs_dir, &packages, 0);
+
+    if (config->slim_purge_dev && purge_build_packages(config, rootfs_dir) != ERROR_SUCCESS) {
+        result = ERROR_INSTALLATION_FAILED;
+    }
+
+    if (write_dpkg_excludes(config, rootfs_dir) != ERROR_SUCCESS) {
+        LOG_WARNING("dpkg path excludes were not written");
+    }
+
+    // What the excludes would have kept out, removed from packages already installed
+    snprintf(cmd, sizeof(cmd),
+             "cd %s && (find usr/share/doc ! -type d ! -name copyright -delete; "
+             "find usr/share/doc -depth -type d -empty -delete; "
+             "rm -rf usr/share/man/* usr/share/info/* usr/share/groff/* usr/share/lintian/* usr/share/linda/*) 2>/dev/null; true",
+             rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    // Translations for locales nobody selected; language packs hold more of them
+    snprintf(keep, sizeof(keep), " %s ", config->slim_locales);
+    for (char *c = keep; *c; c++) {
+        if (*c == ',') {
+            *c = ' ';
+        }
+    }
+    snprintf(cmd, sizeof(cmd),
+             "cd %s && for d in usr/share/locale/*/ usr/share/locale-langpack/*/; do "
+             "[ -d \"$d\" ] || continue; case \"%s\" in *\" $(basename $d) \"*) ;; *) rm -rf \"$d\";; esac; "
+             "done; true",
+             rootfs_dir, keep);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    // The board runs apt-get update before installing anything
+    snprintf(cmd, sizeof(cmd),
+             "rm -rf %s/var/lib/apt/lists/* %s/var/cache/apt/archives/*.deb %s/var/cache/apt/*.bin",
+             rootfs_dir, rootfs_dir, rootfs_dir);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    // A read-only root cannot cache bytecode again, so every run would recompile
+    if (!rootfs_format_is_readonly(config)) {
+        snprintf(cmd, sizeof(cmd),
+                 "find %s/usr -name __pycache__ -type d -prune -exec rm -rf {} + 2>/dev/null; true",
+                 rootfs_dir);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+
+    unsigned long long after_kb = measure_directories(rootfs_dir, &dirs, 1);
+    measure_packages(rootfs_dir, &packages, 1);
+
+    printf("\nRootfs slimming: %.1f MB -> %.1f MB (saved %.1f MB)\n",
+           before_kb / 1024.0, after_kb / 1024.0, ((double)before_kb - (double)after_kb) / 1024.0);
+    print_table("Directory", &dirs);
+    print_table("Package", &packages);
+    printf("\n");
+
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Rootfs slimmed from %llu MB to %llu MB", before_kb / 1024, after_kb / 1024);
+    LOG_INFO(msg);
+
+    free(dirs.entries);
+    free(packages.entries);
+    return result;
+}
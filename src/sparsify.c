@@ -0,0 +1,381 @@
+/*
+ * sparsify.c - Free space release for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the pass that runs over a finished image before it is
+ * hashed and compressed. Files deleted while the rootfs was built (the qemu
+ * binary, apt caches, wrapper scripts) leave their old contents in blocks
+ * the filesystem no longer uses, and xz or zstd would otherwise have to
+ * compress that garbage. Free blocks are found from the filesystems' own
+ * allocation bitmaps and punched out of the image file, so they read back
+ * as zeros, cost nothing to compress and stay holes in every sparse copy.
+ */
+
+#define _GNU_SOURCE
+#include "sparsify.h"
+#include "gpt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Holes are punched in whole 4 KiB blocks, the page size of every host filesystem
+#define SPARSIFY_BLOCK 4096ULL
+#define SPARSIFY_CHUNK (1024 * 1024)
+
+static uint16_t le16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t le64(const uint8_t *p) {
+    return (uint64_t)le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+static int read_at(int fd, uint64_t offset, void *buffer, size_t size) {
+    return pread(fd, buffer, size, (off_t)offset) == (ssize_t)size ? 0 : -1;
+}
+
+// Punch [offset, offset + length) shrunk to whole blocks; partial blocks keep their data
+static int punch(int fd, uint64_t offset, uint64_t length, uint64_t *counter) {
+    uint64_t start = (offset + SPARSIFY_BLOCK - 1) & ~(SPARSIFY_BLOCK - 1);
+    uint64_t end = (offset + length) & ~(SPARSIFY_BLOCK - 1);
+
+    if (end <= start) {
+        return 0;
+    }
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)start, (off_t)(end - start)) != 0) {
+        return -1;
+    }
+    *counter += end - start;
+    return 0;
+}
+
+// Free blocks from the block bitmaps; returns 1 if done, 0 if not understood, -1 on error
+static int sparsify_ext4(int fd, uint64_t offset, uint64_t size, uint64_t *freed) {
+    uint8_t sb[1024];
+
+    if (read_at(fd, offset + 1024, sb, sizeof(sb)) != 0 || le16(sb + 56) != 0xEF53) {
+        return 0;
+    }
+
+    uint32_t incompat = le32(sb + 96);
+    // A journal still to be replayed may hold blocks the bitmaps call free; meta_bg moves the descriptors
+    if (incompat & (0x4 | 0x10)) {
+        return 0;
+    }
+
+    uint64_t block_size = 1024ULL << le32(sb + 24);
+    uint64_t blocks = le32(sb + 4);
+    uint32_t first_data_block = le32(sb + 20);
+    uint32_t per_group = le32(sb + 32);
+    uint32_t desc_size = 32;
+    if (incompat & 0x80) {   // INCOMPAT_64BIT
+        blocks |= (uint64_t)le32(sb + 0x150) << 32;
+        desc_size = le16(sb + 0xFE);
+    }
+    if (block_size > 65536 || per_group == 0 || per_group > block_size * 8 || desc_size < 32 ||
+        blocks <= first_data_block || blocks * block_size > size) {
+        return 0;
+    }
+
+    uint64_t groups = (blocks - first_data_block + per_group - 1) / per_group;
+    uint8_t *table = malloc(groups * desc_size);
+    uint8_t *bitmap = malloc(block_size);
+    int result = 1;
+
+    if (!table || !bitmap ||
+        read_at(fd, offset + (first_data_block + 1) * block_size, table, groups * desc_size) != 0) {
+        result = 0;
+    }
+
+    for (uint64_t g = 0; result == 1 && g < groups; g++) {
+        const uint8_t *desc = table + g * desc_size;
+
+        // BLOCK_UNINIT: the bitmap was never written, and neither was any block of the group
+        if (le16(desc + 0x12) & 0x2) {
+            continue;
+        }
+
+        uint64_t bitmap_block = le32(desc);
+        if ((incompat & 0x80) && desc_size >= 64) {
+            bitmap_block |= (uint64_t)le32(desc + 0x20) << 32;
+        }
+        if (bitmap_block >= blocks || read_at(fd, offset + bitmap_block * block_size, bitmap, block_size) != 0) {
+            result = 0;
+            break;
+        }
+
+        uint64_t base = first_data_block + g * per_group;
+        uint64_t count = blocks - base < per_group ? blocks - base : per_group;
+        uint64_t run = 0;
+        int in_run = 0;
+
+        for (uint64_t i = 0; i <= count; i++) {
+            int used = i == count || (bitmap[i >> 3] & (1 << (i & 7)));
+            if (!used && !in_run) {
+                run = i;
+                in_run = 1;
+            } else if (used && in_run) {
+                in_run = 0;
+                if (punch(fd, offset + (base + run) * block_size, (i - run) * block_size, freed) != 0) {
+                    result = -1;
+                    break;
+                }
+            }
+        }
+    }
+
+    free(table);
+    free(bitmap);
+    return result;
+}
+
+// Free clusters are the zero entries of the first allocation table
+static int sparsify_fat(int fd, uint64_t offset, uint64_t size, uint64_t *freed) {
+    uint8_t bs[512];
+
+    if (read_at(fd, offset, bs, sizeof(bs)) != 0 || bs[510] != 0x55 || bs[511] != 0xAA ||
+        (memcmp(bs + 54, "FAT", 3) != 0 && memcmp(bs + 82, "FAT", 3) != 0)) {
+        return 0;
+    }
+
+    uint32_t bytes_per_sector = le16(bs + 11);
+    uint32_t sectors_per_cluster = bs[13];
+    uint32_t reserved = le16(bs + 14);
+    uint32_t fats = bs[16];
+    uint32_t root_entries = le16(bs + 17);
+    uint32_t sectors = le16(bs + 19) ? le16(bs + 19) : le32(bs + 32);
+    uint32_t fat_sectors = le16(bs + 22) ? le16(bs + 22) : le32(bs + 36);
+    if (!bytes_per_sector || !sectors_per_cluster || (uint64_t)sectors * bytes_per_sector > size) {
+        return 0;
+    }
+
+    uint32_t root_sectors = (root_entries * 32 + bytes_per_sector - 1) / bytes_per_sector;
+    uint32_t data_start = reserved + fats * fat_sectors + root_sectors;
+    if (sectors <= data_start) {
+        return 0;
+    }
+    uint32_t clusters = (sectors - data_start) / sectors_per_cluster;
+    int bits = clusters < 4085 ? 12 : clusters < 65525 ? 16 : 32;
+
+    size_t fat_bytes = (size_t)fat_sectors * bytes_per_sector;
+    uint8_t *fat = malloc(fat_bytes);
+    if (!fat || read_at(fd, offset + (uint64_t)reserved * bytes_per_sector, fat, fat_bytes) != 0) {
+        free(fat);
+        return 0;
+    }
+
+    uint64_t cluster_bytes = (uint64_t)sectors_per_cluster * bytes_per_sector;
+    uint64_t data = offset + (uint64_t)data_start * bytes_per_sector;
+    uint32_t run = 0;
+    int in_run = 0;
+    int result = 1;
+
+    for (uint32_t c = 2; c <= clusters + 2; c++) {
+        uint32_t entry = 1;
+        if (c < clusters + 2) {
+            if (bits == 12 && (size_t)c + c / 2 + 1 < fat_bytes) {
+                entry = le16(fat + c + c / 2);
+                entry = (c & 1) ? entry >> 4 : entry & 0xFFF;
+            } else if (bits == 16 && (size_t)c * 2 + 1 < fat_bytes) {
+                entry = le16(fat + (size_t)c * 2);
+            } else if (bits == 32 && (size_t)c * 4 + 3 < fat_bytes) {
+                entry = le32(fat + (size_t)c * 4) & 0x0FFFFFFF;
+            }
+        }
+
+        if (entry == 0 && !in_run) {
+            run = c;
+            in_run = 1;
+        } else if (entry != 0 && in_run) {
+            in_run = 0;
+            if (punch(fd, data + (uint64_t)(run - 2) * cluster_bytes, (uint64_t)(c - run) * cluster_bytes, freed) != 0) {
+                result = -1;
+                break;
+            }
+        }
+    }
+
+    free(fat);
+    return result;
+}
+
+// End of a dm-verity hash tree whose superblock sits at hash_offset; 0 if there is
+// none, UINT64_MAX if the tree size cannot be worked out. Mirrors veritysetup's layout:
+// the tree starts one hash block after the superblock, levels shrink by hashes per block.
+static uint64_t verity_tree_end(int fd, uint64_t hash_offset) {
+    uint8_t sb[512];
+
+    if (read_at(fd, hash_offset, sb, sizeof(sb)) != 0 || memcmp(sb, "verity\0\0", 8) != 0) {
+        return 0;
+    }
+
+    const char *algorithm = (const char *)sb + 32;
+    uint32_t hash_block_size = le32(sb + 68);
+    uint64_t data_blocks = le64(sb + 72);
+    uint32_t digest;
+    if (strncmp(algorithm, "sha256", 32) == 0 || strncmp(algorithm, "sha1", 32) == 0) {
+        digest = 32;   // sha1 digests are padded to 32 bytes
+    } else if (strncmp(algorithm, "sha512", 32) == 0) {
+        digest = 64;
+    } else {
+        return UINT64_MAX;
+    }
+    if (hash_block_size < digest || (hash_block_size & (hash_block_size - 1)) != 0) {
+        return UINT64_MAX;
+    }
+
+    uint64_t per_block = hash_block_size / digest;
+    uint64_t blocks = 0;
+    uint64_t level = data_blocks;
+    do {
+        level = (level + per_block - 1) / per_block;
+        blocks += level;
+    } while (level > 1);
+
+    uint64_t start = (hash_offset + sizeof(sb) + hash_block_size - 1) / hash_block_size * hash_block_size;
+    return start + blocks * hash_block_size;
+}
+
+// Read-only filesystems are packed full; only the partition tail past them (and past
+// the dm-verity hash tree appended to them) is free
+static int sparsify_readonly(int fd, uint64_t offset, uint64_t size, uint64_t *freed) {
+    uint8_t sb[2048];
+    uint64_t used;
+
+    if (read_at(fd, offset, sb, sizeof(sb)) != 0) {
+        return 0;
+    }
+    if (memcmp(sb, "hsqs", 4) == 0) {
+        used = le64(sb + 40);
+    } else if (le32(sb + 1024) == 0xE0F5E1E2) {
+        used = (uint64_t)le32(sb + 1024 + 36) << sb[1024 + 12];
+    } else {
+        return 0;
+    }
+
+    // build_readonly_root_image() puts the tree at the data size rounded to 4 KiB
+    used = (used + SPARSIFY_BLOCK - 1) & ~(SPARSIFY_BLOCK - 1);
+    if (used < size) {
+        uint64_t tree_end = verity_tree_end(fd, offset + used);
+        if (tree_end == UINT64_MAX) {
+            return 1;   // Keep the whole tail rather than guess
+        }
+        if (tree_end) {
+            used = tree_end - offset;
+        }
+    }
+    if (used >= size) {
+        return 1;
+    }
+    return punch(fd, offset + used, size - used, freed) == 0 ? 1 : -1;
+}
+
+// Punch out allocated blocks that hold nothing but zeros: the loader gap, unused
+// partition space never written, and whatever the bitmaps could not vouch for
+static int punch_zero_runs(int fd, uint64_t file_size, uint64_t *zeroed) {
+    static const uint8_t zeros[SPARSIFY_BLOCK];
+    uint8_t *buffer = malloc(SPARSIFY_CHUNK);
+    off_t pos = 0;
+    int result = 0;
+
+    if (!buffer) {
+        return -1;
+    }
+
+    while (result == 0 && (uint64_t)pos < file_size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0) {
+            break;   // Only a hole is left
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            hole = (off_t)file_size;
+        }
+
+        for (uint64_t at = (uint64_t)data & ~(SPARSIFY_BLOCK - 1); result == 0 && at < (uint64_t)hole; ) {
+            size_t length = (uint64_t)hole - at < SPARSIFY_CHUNK ? (size_t)((uint64_t)hole - at) : SPARSIFY_CHUNK;
+            ssize_t got = pread(fd, buffer, length, (off_t)at);
+            if (got <= 0) {
+                result = -1;
+                break;
+            }
+
+            uint64_t run = 0;
+            int in_run = 0;
+            for (size_t i = 0; i <= (size_t)got; i += SPARSIFY_BLOCK) {
+                int zero = i + SPARSIFY_BLOCK <= (size_t)got && memcmp(buffer + i, zeros, SPARSIFY_BLOCK) == 0;
+                if (zero && !in_run) {
+                    run = i;
+                    in_run = 1;
+                } else if (!zero && in_run) {
+                    in_run = 0;
+                    if (punch(fd, at + run, i - run, zeroed) != 0) {
+                        result = -1;
+                        break;
+                    }
+                }
+            }
+            at += (uint64_t)got;
+        }
+        pos = hole;
+    }
+
+    free(buffer);
+    return result;
+}
+
+int sparsify_image(const char *path, sparsify_stats_t *stats) {
+    gpt_table_t table;
+    struct stat st;
+
+    memset(stats, 0, sizeof(*stats));
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    int result = 0;
+    if (gpt_read(path, &table) == 0) {
+        for (int i = 0; i < table.count && result >= 0; i++) {
+            uint64_t offset = gpt_partition_offset(&table.partitions[i]);
+            uint64_t size = gpt_partition_size(&table.partitions[i]);
+            if (offset + size > (uint64_t)st.st_size) {
+                continue;
+            }
+
+            result = sparsify_ext4(fd, offset, size, &stats->free_bytes);
+            if (result == 0) {
+                result = sparsify_fat(fd, offset, size, &stats->free_bytes);
+            }
+            if (result == 0) {
+                result = sparsify_readonly(fd, offset, size, &stats->free_bytes);
+            }
+            if (result > 0) {
+                stats->partitions++;
+            }
+        }
+    }
+
+    if (result >= 0) {
+        result = punch_zero_runs(fd, (uint64_t)st.st_size, &stats->zero_bytes);
+    }
+
+    fsync(fd);
+    if (fstat(fd, &st) == 0) {
+        stats->allocated_bytes = (uint64_t)st.st_blocks * 512;
+    }
+    close(fd);
+    return result < 0 ? -1 : 0;
+}
@@ -0,0 +1,20 @@
+#ifndef SPARSIFY_H
+#define SPARSIFY_H
+
+#include <stdint.h>
+
+// What a sparsify pass released
+typedef struct {
+    int partitions;             // Partitions whose free space was understood
+    uint64_t free_bytes;        // Unused filesystem blocks punched out
+    uint64_t zero_bytes;        // Allocated runs of zeros punched out
+    uint64_t allocated_bytes;   // Space the image file occupies afterwards
+} sparsify_stats_t;
+
+// Punch holes over every unused block of every partition of a GPT image file
+// (ext4 and FAT from their allocation bitmaps, the unused tail of read-only
+// roots past any dm-verity hash tree), then over any remaining all-zero blocks. Filesystems must not be
+// mounted. Returns 0 on success, -1 if the file cannot hold holes.
+int sparsify_image(const char *path, sparsify_stats_t *stats);
+
+#endif // SPARSIFY_H
@@ -168,8 +168,9 @@ char* add_github_token_to_url(const char* url) {
     static char auth_url[MAX_CMD_LEN] = {0};
     char* token = get_github_token();
     
-    // If no token or not a GitHub URL, return original URL
-    if (token == NULL || strlen(token) == 0 || strstr(url, "github.com") == NULL) {
+    // If no token or not a GitHub URL, return original URL; offline clones are
+    // redirected to the bundle by URL, which must not carry a token
+    if ((global_config && global_config->offline_bundle[0]) || token == NULL || strlen(token) == 0 || strstr(url, "github.com") == NULL) {
         strncpy(auth_url, url, sizeof(auth_url) - 1);
         auth_url[sizeof(auth_url) - 1] = '\0';
         return auth_url;
@@ -237,6 +238,7 @@ void cleanup_on_signal(int sig) {
     printf(SHOW_CURSOR); // Make sure cursor is visible
     
     if (global_config) {
+        tmpfs_stage_release(global_config);
         cleanup_build(global_config);
     }
     
@@ -255,6 +257,11 @@ int execute_command_with_retry(const char *cmd, int show_output, int max_retries
     error_context_t error_ctx = {0};
     int attempt;
     
+    // Offline, a failure is final: nothing changes between attempts
+    if (global_config && global_config->offline_bundle[0]) {
+        max_retries = 1;
+    }
+    
     for (attempt = 1; attempt <= max_retries; attempt++) {
         if (interrupted) {
             LOG_WARNING("Build interrupted, stopping command execution");
@@ -488,11 +495,105 @@ int validate_config(build_config_t *config) {
         if (config->jobs <= 0) config->jobs = 4;
     }
     
-    // Validate image size
-    int image_size = atoi(config->image_size);
-    if (image_size < 4096) {
-        LOG_WARNING("Image size too small, setting to 8192 MB");
-        strcpy(config->image_size, "8192");
+    // Validate image size ("auto" is resolved against the staged rootfs later)
+    if (image_size_is_auto(config)) {
+        if (config->image_headroom_percent < 0 || config->image_headroom_percent > 500) {
+            LOG_WARNING("Invalid image headroom, resetting to 20%");
+            config->image_headroom_percent = 20;
+        }
+    } else {
+        int image_size = atoi(config->image_size);
+        if (image_size < 4096) {
+            LOG_WARNING("Image size too small, setting to 8192 MB");
+            strcpy(config->image_size, "8192");
+        }
+    }
+    
+    // Partition layout for the target medium
+    partition_layout_t layout;
+    if (config->erase_block_kb < 0 ||
+        layout_init(&layout, config->target_medium, (uint64_t)config->erase_block_kb) != 0) {
+        LOG_WARNING("Invalid target medium or erase block size, using SD card defaults");
+        strcpy(config->target_medium, "sd");
+        config->erase_block_kb = 0;
+    }
+    
+    if (config->fs_profile[0] && !fs_tuning_profile_exists(config->fs_profile)) {
+        LOG_WARNING("Unknown filesystem tuning profile, using the target medium's profile");
+        config->fs_profile[0] = '\0';
+    }
+    
+    // Read-only root options
+    if (rootfs_format_is_readonly(config)) {
+        if (strcmp(config->rootfs_compression, "lz4") != 0 &&
+            strcmp(config->rootfs_compression, "zstd") != 0) {
+            LOG_WARNING("Unsupported root image compression, using lz4");
+            strcpy(config->rootfs_compression, "lz4");
+        }
+        if (config->overlay_size_mb < 64) {
+            LOG_WARNING("Overlay partition too small, setting to 512 MB");
+            config->overlay_size_mb = 512;
+        }
+    } else if (config->dm_verity) {
+        LOG_WARNING("dm-verity needs a read-only root format, disabling");
+        config->dm_verity = 0;
+    }
+    
+    // Delta packages are diffed against the previous build
+    if (config->delta_from[0] && access(config->delta_from, R_OK) != 0) {
+        LOG_ERROR("Delta base image or manifest not found");
+        return ERROR_FILE_NOT_FOUND;
+    }
+    
+    if (config->output_targets[0] && validate_output_targets(config->output_targets) != 0) {
+        return ERROR_UNKNOWN;
+    }
+    
+    // Locale names end up in shell commands and dpkg patterns
+    for (const char *c = config->slim_locales; *c; c++) {
+        if (!isalnum((unsigned char)*c) && !strchr("_@.,-", *c)) {
+            LOG_ERROR("Invalid locale list for rootfs slimming");
+            return ERROR_UNKNOWN;
+        }
+    }
+    
+    if (config->tmpfs_build_mb < -1) {
+        LOG_ERROR("Invalid tmpfs stage size");
+        return ERROR_UNKNOWN;
+    }
+    
+    if (validate_build_workers(config->build_workers) != 0) {
+        LOG_ERROR("Invalid build worker list");
+        return ERROR_UNKNOWN;
+    }
+    
+    if (validate_remote_cache_url(config->remote_cache_url) != 0) {
+        LOG_ERROR("Remote cache URL must be http:// or https:// without shell metacharacters");
+        return ERROR_UNKNOWN;
+    }
+    
+    if (config->offline_bundle[0] && strpbrk(config->offline_bundle, " '\"$`\\;&|")) {
+        LOG_ERROR("Offline bundle path must not contain spaces or shell metacharacters");
+        return ERROR_UNKNOWN;
+    }
+    
+    if (validate_cache_quotas(config->cache_quotas) != 0) {
+        LOG_ERROR("Cache quotas must be NAME=MB with NAME one of artifacts, sources, apt-indexes, ccache");
+        return ERROR_UNKNOWN;
+    }
+    
+    if (config->reproducible) {
+        if (resolve_reproducible_build(config) != ERROR_SUCCESS) {
+            return ERROR_UNKNOWN;
+        }
+        // An image patched in place keeps the previous build's layout and free space
+        if (config->incremental_image) {
+            LOG_WARNING("Incremental image refresh disabled for a reproducible build");
+            config->incremental_image = 0;
+        }
+        if (config->rootfs_format == ROOTFS_FORMAT_BTRFS || config->rootfs_format == ROOTFS_FORMAT_F2FS) {
+            LOG_WARNING("btrfs and f2fs roots are normalized but not bit-identical between builds");
+        }
     }
     
     // GPU options validation
@@ -644,9 +745,11 @@ int setup_build_environment(void) {
         LOG_DEBUG("Error log file opened successfully");
     }
     
-    // Update package lists
+    // Update package lists (an offline build uses what the host has)
     LOG_INFO("Updating package lists...");
-    if (execute_command_with_retry("apt update", 1, 3) != 0) {
+    if (global_config && global_config->offline_bundle[0]) {
+        LOG_INFO("Offline build, not updating host package lists");
+    } else if (execute_command_with_retry("apt update", 1, 3) != 0) {
         error_ctx.code = ERROR_NETWORK_FAILURE;
         strncpy(error_ctx.message, "Failed to update package lists after retries", MAX_ERROR_MSG - 1);
         error_ctx.message[MAX_ERROR_MSG - 1] = '\0';
@@ -723,20 +826,48 @@ int install_prerequisites(void) {
         "debootstrap",
         "qemu-user-static",
         "parted",
+        "fdisk",
         "dosfstools",
+        "mtools",
+        "bmap-tools",
         "e2fsprogs",
+        "erofs-utils",
+        "squashfs-tools",
+        "btrfs-progs",
+        "f2fs-tools",
         NULL
     };
     
     char cmd[MAX_CMD_LEN * 2];
     int i;
     
-    // Install all packages at once
-    strcpy(cmd, "DEBIAN_FRONTEND=noninteractive apt install -y");
+    // Install all packages at once; offline, they can only be checked for
+    int offline = global_config && global_config->offline_bundle[0];
+    strcpy(cmd, offline ? "dpkg -s" : "DEBIAN_FRONTEND=noninteractive apt install -y");
     for (i = 0; packages[i] != NULL; i++) {
+        // An aarch64 host builds with its own compiler and runs the rootfs natively
+        if (global_config && global_config->host_exec == HOST_EXEC_NATIVE &&
+            (strstr(packages[i], "-aarch64-linux-gnu") || strcmp(packages[i], "qemu-user-static") == 0)) {
+            continue;
+        }
         strcat(cmd, " ");
         strcat(cmd, packages[i]);
     }
+    if (global_config && global_config->distcc_hosts[0]) {
+        strcat(cmd, " distcc distcc-pump");
+    }
+    if (global_config && global_config->remote_cache_url[0]) {
+        strcat(cmd, " ccache");
+    }
+    if (offline) {
+        strcat(cmd, " >/dev/null");
+        if (execute_command_safe(cmd, 0, NULL) != 0) {
+            LOG_ERROR("Prerequisites are missing and cannot be installed offline (see 'dpkg -s' above)");
+            return ERROR_DEPENDENCY_MISSING;
+        }
+        LOG_INFO("Prerequisites are installed");
+        return ERROR_SUCCESS;
+    }
     
     if (execute_command_with_retry(cmd, 1, 2) != 0) {
         error_context_t error_ctx = {0};
@@ -759,12 +890,15 @@ int cleanup_build(build_config_t *config) {
     
     LOG_INFO("Cleaning up build artifacts...");
     
+    // Scratch space goes; caches are only trimmed to their quotas
     char cmd[MAX_CMD_LEN];
-    snprintf(cmd, sizeof(cmd), "rm -rf %s/* 2>/dev/null || true", config->build_dir);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s/linux_temp 2>/dev/null || true", config->build_dir);
     execute_command_safe(cmd, 0, NULL);
     
     execute_command_safe("rm -rf /tmp/mali_install 2>/dev/null || true", 0, NULL);
     
+    cache_gc(config, NULL);
+    
     LOG_INFO("Cleanup completed");
     return ERROR_SUCCESS;
 }
@@ -0,0 +1,248 @@
+/*
+ * tmpfs_stage.c - RAM-backed build staging for Orange Pi 5 Plus Ultimate Interactive Builder
+ * Version: 0.1.0a
+ *
+ * This file contains the tmpfs build mode. The rootfs and every image
+ * built from it are staged in a sized tmpfs mounted over a stage directory
+ * that stands in for the output directory, so dpkg's small-file metadata
+ * I/O and fsyncs never reach a disk. The incremental base and chunk store
+ * stay on disk through bind mounts. Between phases the stage is grown while
+ * memory allows and spilled to disk when it does not; finished artifacts
+ * and the rootfs are copied to the real output directory once, at the end,
+ * so later runs that reuse the rootfs find it there either way.
+ */
+
+#include "../builder.h"
+
+// Memory left to the host, compilers and qemu while staging
+#define TMPFS_RESERVE_MB 4096
+// Below this a tmpfs stage is not worth setting up
+#define TMPFS_MIN_MB 8192
+
+// Persistent state that must never live only in RAM
+static const char *stage_bind_dirs[] = {"incremental", "chunks", "artifacts", NULL};
+// Working trees dropped instead of persisted; the rootfs is not one of them,
+// build_rootfs=0 runs and incremental refreshes start from it
+static const char *stage_scratch_entries[] = {"bootfiles", "delta", NULL};
+
+static long mem_available_mb(void) {
+    char line[256];
+    long kb = 0;
+
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "MemAvailable: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return kb / 1024;
+}
+
+static void stage_usage_mb(const char *stage, long *size_mb, long *free_mb) {
+    struct statvfs st;
+
+    *size_mb = *free_mb = 0;
+    if (statvfs(stage, &st) == 0) {
+        *size_mb = (long)((st.f_blocks * st.f_frsize) / (1024 * 1024));
+        *free_mb = (long)((st.f_bavail * st.f_frsize) / (1024 * 1024));
+    }
+}
+
+// Undo every mount under the stage, chroot mounts and bind mounts included
+static void unmount_stage(const char *stage) {
+    char cmd[MAX_CMD_LEN];
+    error_context_t error_ctx = {0};
+
+    snprintf(cmd, sizeof(cmd), "umount -R %s 2>/dev/null || umount -R -l %s 2>/dev/null; rmdir %s 2>/dev/null; true",
+             stage, stage, stage);
+    execute_command_safe(cmd, 0, &error_ctx);
+}
+
+// Mount a tmpfs stage and point the build at it; stays on disk if memory is short
+int tmpfs_stage_begin(build_config_t *config) {
+    char stage[MAX_PATH_LEN];
+    char cmd[MAX_CMD_LEN];
+    char msg[512];
+    error_context_t error_ctx = {0};
+
+    if (!config->tmpfs_build_mb || config->persist_dir[0]) {
+        return ERROR_SUCCESS;
+    }
+
+    long available_mb = mem_available_mb();
+    long size_mb = config->tmpfs_build_mb;
+    if (size_mb < 0) {
+        size_mb = (available_mb - TMPFS_RESERVE_MB) * 3 / 4;
+    }
+    if (size_mb < TMPFS_MIN_MB || size_mb > available_mb - TMPFS_RESERVE_MB) {
+        snprintf(msg, sizeof(msg), "Not enough memory for a %ld MB tmpfs stage (%ld MB available), building on disk",
+                 size_mb, available_mb);
+        LOG_WARNING(msg);
+        return ERROR_INSUFFICIENT_SPACE;
+    }
+
+    snprintf(stage, sizeof(stage), "%s/.tmpfs-stage", config->output_dir);
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s && mount -t tmpfs -o size=%ldM,mode=0755 opi5plus-stage %s",
+             stage, size_mb, stage);
+    if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+        LOG_WARNING("Failed to mount tmpfs stage, building on disk");
+        rmdir(stage);
+        return ERROR_UNKNOWN;
+    }
+
+    for (int i = 0; stage_bind_dirs[i]; i++) {
+        snprintf(cmd, sizeof(cmd), "mkdir -p %s/%s %s/%s && mount --bind %s/%s %s/%s",
+                 config->output_dir, stage_bind_dirs[i], stage, stage_bind_dirs[i],
+                 config->output_dir, stage_bind_dirs[i], stage, stage_bind_dirs[i]);
+        if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+            LOG_WARNING("Failed to keep build state on disk, building on disk");
+            unmount_stage(stage);
+            return ERROR_UNKNOWN;
+        }
+    }
+
+    // A build that reuses the previous rootfs starts from a copy of it
+    if (!config->build_rootfs) {
+        snprintf(cmd, sizeof(cmd), "[ ! -d %s/rootfs ] || cp -a %s/rootfs %s/", config->output_dir, config->output_dir, stage);
+        if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+            LOG_WARNING("Previous rootfs does not fit the tmpfs stage, building on disk");
+            unmount_stage(stage);
+            return ERROR_INSUFFICIENT_SPACE;
+        }
+    }
+
+    snprintf(config->persist_dir, sizeof(config->persist_dir), "%s", config->output_dir);
+    snprintf(config->output_dir, sizeof(config->output_dir), "%s", stage);
+
+    snprintf(msg, sizeof(msg), "Staging rootfs and images in a %ld MB tmpfs (%ld MB available)",
+             size_mb, available_mb);
+    LOG_INFO(msg);
+    return ERROR_SUCCESS;
+}
+
+// Move everything staged so far to disk and continue the build there
+static int spill_stage(build_config_t *config) {
+    char cmd[MAX_CMD_LEN];
+    char stage[MAX_PATH_LEN];
+    error_context_t error_ctx = {0};
+
+    LOG_WARNING("Memory is running short, moving the build stage to disk...");
+    snprintf(stage, sizeof(stage), "%s", config->output_dir);
+
+    // Chroot mounts and the bind-mounted state must not be copied
+    snprintf(cmd, sizeof(cmd),
+             "for m in dev/pts dev sys proc; do umount %s/rootfs/$m 2>/dev/null; done; true",
+             stage);
+    execute_command_safe(cmd, 0, &error_ctx);
+    for (int i = 0; stage_bind_dirs[i]; i++) {
+        snprintf(cmd, sizeof(cmd), "umount %s/%s && rmdir %s/%s", stage, stage_bind_dirs[i], stage, stage_bind_dirs[i]);
+        execute_command_safe(cmd, 0, &error_ctx);
+    }
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s/rootfs && cp -a --sparse=always %s/. %s/",
+             config->persist_dir, stage, config->persist_dir);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to move the build stage to disk");
+        return ERROR_INSUFFICIENT_SPACE;
+    }
+
+    snprintf(config->output_dir, sizeof(config->output_dir), "%s", config->persist_dir);
+    config->persist_dir[0] = '\0';
+    unmount_stage(stage);
+
+    LOG_INFO("Build continues on disk");
+    return ERROR_SUCCESS;
+}
+
+// Before a phase that writes need_mb more (negative: another copy of what is
+// staged): grow the stage if memory allows, else spill it to disk
+int tmpfs_stage_check(build_config_t *config, long need_mb) {
+    char cmd[MAX_CMD_LEN];
+    char msg[256];
+    error_context_t error_ctx = {0};
+    long size_mb, free_mb;
+
+    if (!config->persist_dir[0]) {
+        return ERROR_SUCCESS;
+    }
+
+    stage_usage_mb(config->output_dir, &size_mb, &free_mb);
+    if (need_mb < 0) {
+        need_mb = size_mb - free_mb + 1024;
+    }
+
+    // tmpfs pages are only allocated when written, so what the phase writes
+    // must fit in memory; the size limit itself can simply be raised
+    if (mem_available_mb() - TMPFS_RESERVE_MB < need_mb) {
+        return spill_stage(config);
+    }
+    if (free_mb < need_mb) {
+        long grown_mb = size_mb + need_mb - free_mb;
+        snprintf(cmd, sizeof(cmd), "mount -o remount,size=%ldM %s", grown_mb, config->output_dir);
+        if (execute_command_safe(cmd, 0, &error_ctx) != 0) {
+            return spill_stage(config);
+        }
+        snprintf(msg, sizeof(msg), "Grew tmpfs stage to %ld MB", grown_mb);
+        LOG_INFO(msg);
+    }
+    return ERROR_SUCCESS;
+}
+
+// Copy finished artifacts to the output directory once and release the stage
+int tmpfs_stage_end(build_config_t *config) {
+    char cmd[MAX_CMD_LEN];
+    char stage[MAX_PATH_LEN];
+    char skip[256] = "";
+    error_context_t error_ctx = {0};
+    int result = ERROR_SUCCESS;
+
+    if (!config->persist_dir[0]) {
+        return ERROR_SUCCESS;
+    }
+
+    snprintf(stage, sizeof(stage), "%s", config->output_dir);
+    for (int i = 0; stage_bind_dirs[i]; i++) {
+        size_t len = strlen(skip);
+        snprintf(skip + len, sizeof(skip) - len, "%s|", stage_bind_dirs[i]);
+    }
+    for (int i = 0; stage_scratch_entries[i]; i++) {
+        size_t len = strlen(skip);
+        snprintf(skip + len, sizeof(skip) - len, "%s%s", stage_scratch_entries[i],
+                 stage_scratch_entries[i + 1] ? "|" : "");
+    }
+
+    // Chroot mounts left by a failed build must not be copied
+    snprintf(cmd, sizeof(cmd),
+             "for m in dev/pts dev sys proc; do umount %s/rootfs/$m 2>/dev/null; done; true",
+             stage);
+    execute_command_safe(cmd, 0, &error_ctx);
+
+    // Each staged entry replaces the one on disk, so no stale rootfs files survive
+    LOG_INFO("Writing build artifacts and the rootfs to the output directory...");
+    snprintf(cmd, sizeof(cmd),
+             "cd %s && for f in * .[!.]*; do [ -e \"$f\" ] || continue; case \"$f\" in %s) ;; "
+             "*) rm -rf --one-file-system %s/\"$f\" && cp -a -x --sparse=always \"$f\" %s/ || exit 1;; esac; done",
+             stage, skip, config->persist_dir, config->persist_dir);
+    if (execute_command_safe(cmd, 1, &error_ctx) != 0) {
+        LOG_ERROR("Failed to copy artifacts out of the tmpfs stage");
+        result = ERROR_INSUFFICIENT_SPACE;
+    }
+
+    snprintf(config->output_dir, sizeof(config->output_dir), "%s", config->persist_dir);
+    config->persist_dir[0] = '\0';
+    unmount_stage(stage);
+    return result;
+}
+
+// Drop the stage without persisting anything (interrupted builds)
+void tmpfs_stage_release(build_config_t *config) {
+    if (config->persist_dir[0]) {
+        unmount_stage(config->output_dir);
+        snprintf(config->output_dir, sizeof(config->output_dir), "%s", config->persist_dir);
+        config->persist_dir[0] = '\0';
+    }
+}
@@ -406,7 +406,48 @@ void show_image_settings_menu(build_config_t *config) {
         printf("\n");
         printf("Current settings:\n");
         printf("• Output directory: %s\n", config->output_dir);
-        printf("• Image size: %s MB\n", config->image_size);
+        if (image_size_is_auto(config)) {
+            printf("• Image size: auto (rootfs + %d%% headroom)\n", config->image_headroom_percent);
+        } else {
+            printf("• Image size: %s MB\n", config->image_size);
+        }
+        printf("• Expand rootfs on first boot: %s\n", config->expand_rootfs_on_boot ? "Yes" : "No");
+        if (rootfs_format_is_readonly(config)) {
+            printf("• Root filesystem: %s (%s, read-only) with %s overlay\n",
+                   rootfs_format_name(config->rootfs_format), config->rootfs_compression,
+                   config->overlay_type == OVERLAY_TMPFS ? "tmpfs" : "partition");
+        } else {
+            printf("• Root filesystem: %s\n", rootfs_format_name(config->rootfs_format));
+        }
+        if (config->erase_block_kb > 0) {
+            printf("• Target medium: %s (%d KB erase block)\n", config->target_medium, config->erase_block_kb);
+        } else {
+            printf("• Target medium: %s (default erase block)\n", config->target_medium);
+        }
+        printf("• Filesystem tuning profile: %s\n", get_fs_tuning_profile(config)->name);
+        printf("• Incremental image refresh: %s\n", config->incremental_image ? "Yes" : "No");
+        printf("• Chunk store for delta downloads: %s\n", config->chunk_store ? "Yes" : "No");
+        printf("• Delta package base: %s\n", config->delta_from[0] ? config->delta_from : "None");
+        printf("• dm-verity read-only root: %s\n", config->dm_verity ? "Yes" : "No");
+        printf("• Extra output targets: %s\n", config->output_targets[0] ? config->output_targets : "None");
+        printf("• Slim rootfs: %s (locales %s%s)\n", config->slim_rootfs ? "Yes" : "No",
+               config->slim_locales, config->slim_purge_dev ? ", purge -dev" : "");
+        printf("• Reproducible build: %s (apt snapshot %s)\n", config->reproducible ? "Yes" : "No",
+               config->apt_snapshot[0] ? config->apt_snapshot : "from SOURCE_DATE_EPOCH");
+        printf("• Build first-boot caches: %s\n", config->finalize_rootfs ? "Yes" : "No");
+        if (config->tmpfs_build_mb > 0) {
+            printf("• tmpfs build stage: %ld MB\n", config->tmpfs_build_mb);
+        } else {
+            printf("• tmpfs build stage: %s\n", config->tmpfs_build_mb < 0 ? "auto" : "No");
+        }
+        printf("• Force qemu-user emulation: %s\n", config->force_emulation ? "Yes" : "No");
+        printf("• Build workers: %s\n", config->build_workers[0] ? config->build_workers : "None");
+        printf("• distcc hosts: %s\n", config->distcc_hosts[0] ? config->distcc_hosts : "None");
+        printf("• Remote cache: %s%s\n", config->remote_cache_url[0] ? config->remote_cache_url : "None",
+               config->remote_cache_url[0] && config->remote_cache_readonly ? " (read-only)" : "");
+        printf("• Cache quotas: %s%s\n", config->cache_quotas[0] ? config->cache_quotas : "Defaults",
+               config->pin_artifacts ? " (artifacts pinned)" : "");
+        printf("• Offline bundle: %s\n", config->offline_bundle[0] ? config->offline_bundle : "None (online)");
         printf("• Hostname: %s\n", config->hostname);
         printf("• Username: %s\n", config->username);
         printf("• Password: %s\n", config->password);
@@ -416,10 +457,38 @@ void show_image_settings_menu(build_config_t *config) {
         printf("3. Change hostname\n");
         printf("4. Change username\n");
         printf("5. Change password\n");
+        printf("6. Change auto size headroom\n");
+        printf("7. Toggle first-boot rootfs expansion\n");
+        printf("8. Change root filesystem format\n");
+        printf("9. Toggle read-only root compression (lz4/zstd)\n");
+        printf("10. Toggle overlay type (partition/tmpfs)\n");
+        printf("11. Change target medium\n");
+        printf("12. Change erase block size\n");
+        printf("13. Change filesystem tuning profile\n");
+        printf("14. Toggle incremental image refresh\n");
+        printf("15. Toggle chunk store for delta downloads\n");
+        printf("16. Set delta package base image\n");
+        printf("17. Toggle dm-verity for read-only roots\n");
+        printf("18. Set extra output targets\n");
+        printf("19. Toggle rootfs slimming\n");
+        printf("20. Toggle purging -dev packages\n");
+        printf("21. Set locales kept by slimming\n");
+        printf("22. Toggle reproducible build\n");
+        printf("23. Set apt snapshot timestamp\n");
+        printf("24. Toggle building first-boot caches\n");
+        printf("25. Set tmpfs build stage size\n");
+        printf("26. Toggle forced qemu-user emulation\n");
+        printf("27. Set SSH build workers\n");
+        printf("28. Set distcc hosts\n");
+        printf("29. Set remote cache URL\n");
+        printf("30. Toggle remote cache read-only\n");
+        printf("31. Set cache quotas\n");
+        printf("32. Toggle pinning artifacts (release build)\n");
+        printf("33. Set offline bundle directory\n");
         printf("0. Back\n");
         printf("\n");
         
-        choice = get_user_choice("Select option", 0, 5);
+        choice = get_user_choice("Select option", 0, 33);
         
         char buffer[MAX_PATH_LEN];
         switch (choice) {
@@ -449,8 +518,8 @@ void show_image_settings_menu(build_config_t *config) {
                 }
                 break;
             case 2:
-                get_user_input("Enter image size in MB (min 4096): ", buffer, sizeof(buffer));
-                if (strlen(buffer) > 0 && atoi(buffer) >= 4096) {
+                get_user_input("Enter image size in MB (min 4096) or 'auto': ", buffer, sizeof(buffer));
+                if (strcmp(buffer, "auto") == 0 || (strlen(buffer) > 0 && atoi(buffer) >= 4096)) {
                     strncpy(config->image_size, buffer, sizeof(config->image_size) - 1);
                     config->image_size[sizeof(config->image_size) - 1] = '\0';
                 }
@@ -476,6 +545,155 @@ void show_image_settings_menu(build_config_t *config) {
                     config->password[sizeof(config->password) - 1] = '\0';
                 }
                 break;
+            case 6:
+                get_user_input("Enter headroom in percent of the rootfs size: ", buffer, sizeof(buffer));
+                if (strlen(buffer) > 0 && atoi(buffer) >= 0 && atoi(buffer) <= 500) {
+                    config->image_headroom_percent = atoi(buffer);
+                }
+                break;
+            case 7:
+                config->expand_rootfs_on_boot = !config->expand_rootfs_on_boot;
+                break;
+            case 8:
+                get_user_input("Enter root filesystem format (ext4/btrfs/f2fs/erofs/squashfs): ", buffer, sizeof(buffer));
+                if (strlen(buffer) > 0 && parse_rootfs_format(buffer, &config->rootfs_format) != 0) {
+                    printf("Unknown root filesystem format: %s\n", buffer);
+                }
+                break;
+            case 9:
+                strcpy(config->rootfs_compression,
+                       strcmp(config->rootfs_compression, "lz4") == 0 ? "zstd" : "lz4");
+                break;
+            case 10:
+                config->overlay_type = config->overlay_type == OVERLAY_TMPFS ? OVERLAY_PARTITION : OVERLAY_TMPFS;
+                break;
+            case 11:
+                get_user_input("Enter target medium (sd/emmc/nvme): ", buffer, sizeof(buffer));
+                if (strcmp(buffer, "sd") == 0 || strcmp(buffer, "emmc") == 0 || strcmp(buffer, "nvme") == 0) {
+                    strcpy(config->target_medium, buffer);
+                }
+                break;
+            case 12:
+                get_user_input("Enter erase block size in KB (0 for the medium default): ", buffer, sizeof(buffer));
+                if (strlen(buffer) > 0 && atoi(buffer) >= 0) {
+                    config->erase_block_kb = atoi(buffer);
+                }
+                break;
+            case 13:
+                get_user_input("Enter tuning profile (sd/emmc/nvme/kiosk, empty for medium default): ", buffer, sizeof(buffer));
+                if (strlen(buffer) == 0 || fs_tuning_profile_exists(buffer)) {
+                    strncpy(config->fs_profile, buffer, sizeof(config->fs_profile) - 1);
+                    config->fs_profile[sizeof(config->fs_profile) - 1] = '\0';
+                }
+                break;
+            case 14:
+                config->incremental_image = !config->incremental_image;
+                break;
+            case 15:
+                config->chunk_store = !config->chunk_store;
+                break;
+            case 16:
+                get_user_input("Enter previous image or manifest (empty for none): ", buffer, sizeof(buffer));
+                if (strlen(buffer) == 0 || access(buffer, R_OK) == 0) {
+                    strncpy(config->delta_from, buffer, sizeof(config->delta_from) - 1);
+                    config->delta_from[sizeof(config->delta_from) - 1] = '\0';
+                } else {
+                    printf("File not found: %s\n", buffer);
+                }
+                break;
+            case 17:
+                config->dm_verity = !config->dm_verity;
+                break;
+            case 18:
+                get_user_input("Enter targets (sd,emmc,nvme,compressed,tarball,bootfiles,spi; empty for none): ",
+                               buffer, sizeof(buffer));
+                if (buffer[0] == '\0' || validate_output_targets(buffer) == 0) {
+                    strncpy(config->output_targets, buffer, sizeof(config->output_targets) - 1);
+                    config->output_targets[sizeof(config->output_targets) - 1] = '\0';
+                }
+                break;
+            case 19:
+                config->slim_rootfs = !config->slim_rootfs;
+                break;
+            case 20:
+                config->slim_purge_dev = !config->slim_purge_dev;
+                break;
+            case 21:
+                get_user_input("Enter locales to keep (e.g. en,en_US,de): ", buffer, sizeof(buffer));
+                if (strlen(buffer) > 0) {
+                    strncpy(config->slim_locales, buffer, sizeof(config->slim_locales) - 1);
+                    config->slim_locales[sizeof(config->slim_locales) - 1] = '\0';
+                }
+                break;
+            case 22:
+                config->reproducible = !config->reproducible;
+                break;
+            case 23:
+                get_user_input("Enter snapshot (YYYYMMDDTHHMMSSZ, empty for SOURCE_DATE_EPOCH): ",
+                               buffer, sizeof(buffer));
+                strncpy(config->apt_snapshot, buffer, sizeof(config->apt_snapshot) - 1);
+                config->apt_snapshot[sizeof(config->apt_snapshot) - 1] = '\0';
+                if (config->apt_snapshot[0]) {
+                    config->reproducible = 1;
+                }
+                break;
+            case 24:
+                config->finalize_rootfs = !config->finalize_rootfs;
+                break;
+            case 25:
+                get_user_input("Enter tmpfs size in MB, 'auto' or 0 to build on disk: ", buffer, sizeof(buffer));
+                if (strlen(buffer) > 0) {
+                    config->tmpfs_build_mb = strcmp(buffer, "auto") == 0 ? -1 : atol(buffer);
+                }
+                break;
+            case 26:
+                config->force_emulation = !config->force_emulation;
+                break;
+            case 27:
+                get_user_input("Enter workers as [user@]host,[user@]host (empty for none): ", buffer, sizeof(buffer));
+                if (validate_build_workers(buffer) == 0) {
+                    snprintf(config->build_workers, sizeof(config->build_workers), "%s", buffer);
+                } else {
+                    printf("Invalid worker list\n");
+                }
+                break;
+            case 28:
+                get_user_input("Enter DISTCC_HOSTS (e.g. 'a/16,cpp,lzo b/32,cpp,lzo', empty for none): ",
+                               buffer, sizeof(buffer));
+                snprintf(config->distcc_hosts, sizeof(config->distcc_hosts), "%s", buffer);
+                break;
+            case 29:
+                get_user_input("Enter cache URL (http://host/path, empty for none): ", buffer, sizeof(buffer));
+                if (validate_remote_cache_url(buffer) == 0) {
+                    snprintf(config->remote_cache_url, sizeof(config->remote_cache_url), "%s", buffer);
+                } else {
+                    printf("Invalid cache URL\n");
+                }
+                break;
+            case 30:
+                config->remote_cache_readonly = !config->remote_cache_readonly;
+                break;
+            case 31:
+                get_user_input("Enter quotas as name=MB,... (artifacts, sources, apt-indexes, ccache; empty for defaults): ",
+                               buffer, sizeof(buffer));
+                if (validate_cache_quotas(buffer) == 0) {
+                    snprintf(config->cache_quotas, sizeof(config->cache_quotas), "%s", buffer);
+                } else {
+                    printf("Invalid cache quotas\n");
+                }
+                break;
+            case 32:
+                config->pin_artifacts = !config->pin_artifacts;
+                break;
+            case 33:
+                get_user_input("Enter bundle directory from 'export-bundle' (empty to build online): ",
+                               buffer, sizeof(buffer));
+                if (strpbrk(buffer, " '\"$`\\;&|")) {
+                    printf("Invalid bundle directory\n");
+                } else {
+                    snprintf(config->offline_bundle, sizeof(config->offline_bundle), "%s", buffer);
+                }
+                break;
             case 0:
                 return;
             default:
@@ -627,7 +845,14 @@ void show_build_summary(build_config_t *config) {
         printf("  - OpenCL: %s\n", config->enable_opencl ? "Yes" : "No");
         printf("  - Vulkan: %s\n", config->enable_vulkan ? "Yes" : "No");
     }
-    printf("Image Size: %s MB\n", config->image_size);
+    if (image_size_is_auto(config)) {
+        printf("Image Size: auto (rootfs + %d%% headroom)\n", config->image_headroom_percent);
+    } else {
+        printf("Image Size: %s MB\n", config->image_size);
+    }
+    printf("Root Filesystem: %s%s\n", rootfs_format_name(config->rootfs_format),
+           rootfs_format_is_readonly(config) ? " (read-only, overlay)" : "");
+    printf("Target Medium: %s (%s tuning)\n", config->target_medium, get_fs_tuning_profile(config)->name);
     printf("Build Directory: %s\n", config->build_dir);
     printf("Output Directory: %s\n", config->output_dir);
     printf("\n");